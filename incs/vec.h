@@ -0,0 +1 @@
+../srcs/common/vec.h
\ No newline at end of file
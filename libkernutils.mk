@@ -1,9 +1,13 @@
 NAME       := libkernutils.a
+BATCH      := macho-batch
+BENCH      := spawn-bench
+TEST       := dyld-cache-slide-test
 CC         := clang
 SRCS_DIR   := srcs
 OBJS_DIR   := .objs
 BUILD_DIR  := build
 INCS_DIR   := incs
+LDLIBS     := -lpthread
 CFLAGS     := \
 	-Wall \
 	-Wextra \
@@ -23,11 +27,51 @@ SRCS := \
 	common/hexdump.c \
 	common/fs.c \
 	common/vec.c \
+	common/leb128.c \
 	common/spawn.c \
 	common/strpcmp.c \
 	common/path-attach.c \
 	common/str-to-print.c \
 	common/logger.c \
+	common/parallel.c \
+	common/arena.c \
+	common/bufwriter.c \
+	common/sha.c \
+	common/strpool.c \
+	common/strmap.c \
 	image.c \
+	macho.c \
+	chained-fixups.c \
+	dyld-info.c \
+	function-starts.c \
+	codesign.c \
+	strings.c \
+	xrefs.c \
+	callgraph.c \
+	insn-match.c \
+	signature.c \
+	bindiff.c \
+	objc.c \
+	swift.c \
+	patch.c \
+	macho-edit.c \
+	dyld-cache.c \
+	dyld-cache-extract.c \
+	fileset.c \
+	unwind.c \
+	profile.c \
+	symbolicate.c \
+	image-cache.c \
+	process-table.c \
+	session.c \
 	memory.c \
 	task.c 
+
+BATCH_SRCS := \
+	utils/macho-batch.c
+
+BENCH_SRCS := \
+	utils/spawn-bench.c
+
+TEST_SRCS  := \
+	tests/dyld-cache-slide.c
@@ -0,0 +1,174 @@
+#ifndef __ARM64_H__
+#define __ARM64_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* A64 decoding helpers shared by the code scanners, 'insn' is the
+ * instruction word and 'pc' its unslid address.
+ */
+
+static inline int64_t arm64_sext(uint64_t value, unsigned bits)
+{
+	return ((int64_t)(value << (64 - bits)) >> (64 - bits));
+}
+
+static inline uint32_t arm64_rd(uint32_t insn)
+{
+	return (insn & 0x1f);
+}
+
+static inline uint32_t arm64_rn(uint32_t insn)
+{
+	return ((insn >> 5) & 0x1f);
+}
+
+static inline uint32_t arm64_rs(uint32_t insn)
+{
+	return ((insn >> 16) & 0x1f);
+}
+
+/* ADR and ADRP */
+static inline bool arm64_is_adrp(uint32_t insn)
+{
+	return ((insn & 0x9f000000) == 0x90000000);
+}
+
+static inline bool arm64_is_adr(uint32_t insn)
+{
+	return ((insn & 0x9f000000) == 0x10000000);
+}
+
+static inline uint64_t arm64_adr_target(uint32_t insn, uint64_t pc)
+{
+	uint64_t imm = (((insn >> 5) & 0x7ffff) << 2) | ((insn >> 29) & 3);
+
+	if (arm64_is_adrp(insn))
+		return ((pc & ~0xfffULL) + (arm64_sext(imm, 21) << 12));
+	return (pc + arm64_sext(imm, 21));
+}
+
+/* ADD Xd, Xn, #imm{, LSL #12} */
+static inline bool arm64_is_add_imm64(uint32_t insn)
+{
+	return ((insn & 0xff800000) == 0x91000000);
+}
+
+static inline uint64_t arm64_add_imm(uint32_t insn)
+{
+	return (((insn >> 10) & 0xfff) << (((insn >> 22) & 1) * 12));
+}
+
+/* Every load and store encoding */
+static inline bool arm64_is_ldst(uint32_t insn)
+{
+	return ((insn & 0x0a000000) == 0x08000000);
+}
+
+/* Load/store exclusive, load-acquire/store-release and CAS */
+static inline bool arm64_is_ldst_excl(uint32_t insn)
+{
+	return ((insn & 0x3f000000) == 0x08000000);
+}
+
+/* LSE atomic memory operations (LDADD and co, SWP) and LDAPR */
+static inline bool arm64_is_atomic(uint32_t insn)
+{
+	return ((insn & 0x3f200c00) == 0x38200000);
+}
+
+/* LDR/STR (unsigned immediate), general and SIMD registers */
+static inline bool arm64_is_ldst_uimm(uint32_t insn)
+{
+	return ((insn & 0x3b000000) == 0x39000000);
+}
+
+static inline uint64_t arm64_ldst_uimm_offset(uint32_t insn)
+{
+	unsigned scale = insn >> 30;
+
+	if ((insn & (1u << 26)) && (insn & (1u << 23)))
+		scale = 4; /* 128-bit Q register */
+	return ((uint64_t)((insn >> 10) & 0xfff) << scale);
+}
+
+/* LDR (literal), LDRSW (literal) and PRFM (literal) */
+static inline bool arm64_is_ldr_literal(uint32_t insn)
+{
+	return ((insn & 0x3b000000) == 0x18000000);
+}
+
+static inline uint64_t arm64_ldr_literal_target(uint32_t insn, uint64_t pc)
+{
+	return (pc + arm64_sext(((insn >> 5) & 0x7ffff) << 2, 21));
+}
+
+/* B and BL */
+static inline bool arm64_is_b(uint32_t insn)
+{
+	return ((insn & 0xfc000000) == 0x14000000);
+}
+
+static inline bool arm64_is_bl(uint32_t insn)
+{
+	return ((insn & 0xfc000000) == 0x94000000);
+}
+
+static inline uint64_t arm64_b_target(uint32_t insn, uint64_t pc)
+{
+	return (pc + arm64_sext((insn & 0x3ffffff) << 2, 28));
+}
+
+/* B.cond, CBZ/CBNZ and TBZ/TBNZ */
+static inline bool arm64_is_bcond(uint32_t insn)
+{
+	return ((insn & 0xff000010) == 0x54000000);
+}
+
+static inline bool arm64_is_cbz(uint32_t insn)
+{
+	return ((insn & 0x7e000000) == 0x34000000);
+}
+
+static inline bool arm64_is_tbz(uint32_t insn)
+{
+	return ((insn & 0x7e000000) == 0x36000000);
+}
+
+static inline uint64_t arm64_cond_branch_target(uint32_t insn, uint64_t pc)
+{
+	if (arm64_is_tbz(insn))
+		return (pc + arm64_sext(((insn >> 5) & 0x3fff) << 2, 16));
+	return (pc + arm64_sext(((insn >> 5) & 0x7ffff) << 2, 21));
+}
+
+/* BR, BLR, RET and their authenticated forms */
+static inline bool arm64_is_branch_reg(uint32_t insn)
+{
+	return ((insn & 0xfe000000) == 0xd6000000);
+}
+
+static inline bool arm64_is_blr(uint32_t insn)
+{
+	return ((insn & 0xfffffc1f) == 0xd63f0000 ||
+		(insn & 0xfefff800) == 0xd63f0800);
+}
+
+/* Bits of 'insn' that do not depend on where it or its pc-relative target
+ * sits: the immediates of ADR/ADRP, branches and literal loads are cleared.
+ */
+static inline uint32_t arm64_pcrel_mask(uint32_t insn)
+{
+	if (arm64_is_adrp(insn) || arm64_is_adr(insn))
+		return (0x9f00001f);
+	if (arm64_is_b(insn) || arm64_is_bl(insn))
+		return (0xfc000000);
+	if (arm64_is_tbz(insn))
+		return (0xfff8001f);
+	if (arm64_is_bcond(insn) || arm64_is_cbz(insn) ||
+	    arm64_is_ldr_literal(insn))
+		return (0xff00001f);
+	return (0xffffffff);
+}
+
+#endif /* __ARM64_H__ */
@@ -0,0 +1,530 @@
+#include "arm64.h"
+#include "common.h"
+#include "ios-macos-utils.h"
+#include <mach-o/loader.h>
+#include <mach-o/nlist.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#define BINDIFF_NONE	      UINT32_MAX
+#define BINDIFF_FUNCS_PER_JOB 256
+#define BINDIFF_ROUNDS	      8 /* of call graph matching */
+
+typedef struct bindiff_func_s {
+	uint64_t    addr;
+	uint64_t    size;
+	uint64_t    hash; /* of the code, immediates masked */
+	const char *name;
+	uint32_t    match; /* function of the other image, or BINDIFF_NONE */
+	uint8_t	    how;   /* BINDIFF_BY_* */
+} bindiff_func_t;
+
+typedef struct bindiff_image_s {
+	const macho_t	 *macho;
+	function_starts_t fs;
+	callgraph_t	  cg;
+	bindiff_func_t	 *funcs; /* the call graph's functions */
+	size_t		  nfuncs;
+	uint64_t	 *keys; /* join keys of the current pass, 0 to skip */
+} bindiff_image_t;
+
+typedef struct bindiff_ctx_s {
+	bindiff_image_t img[2]; /* old, new */
+	size_t		njobs;	/* hashing jobs of the old image */
+} bindiff_ctx_t;
+
+typedef struct bindiff_slot_s {
+	uint64_t key; /* 0 for an empty slot */
+	uint32_t head; /* first old function left with this key */
+	uint32_t nold;
+	uint32_t nnew;
+} bindiff_slot_t;
+
+typedef struct bindiff_sym_s {
+	uint64_t    addr;
+	const char *name;
+} bindiff_sym_t;
+
+/* Final step of splitmix64, keys of 0 are reserved for empty slots.
+ */
+static uint64_t bindiff_mix(uint64_t x)
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return (x ? x : 1);
+}
+
+/* Drops what changes when code or data moves: branch and literal offsets,
+ * ADRP pages, and the page offsets added to or loaded from a register an
+ * ADRP set ('pages' tracks those registers).
+ */
+static uint32_t bindiff_mask(uint32_t insn, uint32_t *pages)
+{
+	if (arm64_is_adrp(insn) || arm64_is_adr(insn)) {
+		if (arm64_is_adrp(insn))
+			*pages |= 1u << arm64_rd(insn);
+		else
+			*pages &= ~(1u << arm64_rd(insn));
+		return (insn & 0x9f00001f);
+	}
+
+	if (arm64_is_b(insn) || arm64_is_bl(insn)) {
+		if (arm64_is_bl(insn))
+			*pages &= ~0x7ffffu; /* x0-x18 do not survive a call */
+		return (insn & 0xfc000000);
+	}
+
+	if (arm64_is_bcond(insn) || arm64_is_cbz(insn) ||
+	    arm64_is_ldr_literal(insn))
+		return (insn & 0xff00001f);
+	if (arm64_is_tbz(insn))
+		return (insn & 0xfff8001f);
+
+	if ((arm64_is_add_imm64(insn) || arm64_is_ldst_uimm(insn)) &&
+	    (*pages & (1u << arm64_rn(insn)))) {
+		if (arm64_is_add_imm64(insn) || (insn & (3u << 22)))
+			*pages &= ~(1u << arm64_rd(insn));
+		return (insn & ~(0xfffu << 10));
+	}
+
+	return (insn);
+}
+
+static uint64_t bindiff_hash_code(const uint8_t *code, uint64_t size)
+{
+	uint64_t h     = 0xcbf29ce484222325ULL ^ size;
+	uint32_t pages = 0;
+
+	for (uint64_t i = 0; i + 4 <= size; i += 4) {
+		uint32_t insn;
+
+		(void)memcpy(&insn, code + i, sizeof(insn));
+		h ^= bindiff_mask(insn, &pages);
+		h *= 0x100000001b3ULL;
+	}
+
+	return (bindiff_mix(h));
+}
+
+static void bindiff_hash(void *arg, size_t worker, size_t job)
+{
+	bindiff_ctx_t	*ctx = arg;
+	bindiff_image_t *img = &ctx->img[job >= ctx->njobs];
+	size_t		 first;
+	size_t		 last;
+
+	(void)worker;
+
+	if (job >= ctx->njobs)
+		job -= ctx->njobs;
+	first = job * BINDIFF_FUNCS_PER_JOB;
+	last  = MIN(first + BINDIFF_FUNCS_PER_JOB, img->nfuncs);
+
+	for (size_t i = first; i < last; i++) {
+		bindiff_func_t *f    = &img->funcs[i];
+		const uint8_t  *code = macho_at_vmaddr(img->macho, f->addr,
+						       f->size);
+
+		f->hash = code ? bindiff_hash_code(code, f->size) :
+				 bindiff_mix(f->addr);
+	}
+}
+
+static int bindiff_sym_cmp(const void *a, const void *b)
+{
+	const bindiff_sym_t *x = a;
+	const bindiff_sym_t *y = b;
+
+	return ((x->addr > y->addr) - (x->addr < y->addr));
+}
+
+/* Names the functions starting at a symbol of the symbol table.
+ */
+static bool bindiff_names(bindiff_image_t *img)
+{
+	const struct symtab_command *symtab;
+	const struct nlist_64	    *syms;
+	const char		    *strtab;
+	bindiff_sym_t		    *named;
+	size_t			     n = 0;
+
+	symtab = macho_find_command(img->macho, LC_SYMTAB, NULL);
+	if (!symtab)
+		return (true);
+
+	syms   = (const struct nlist_64 *)macho_at_offset(
+		  img->macho, symtab->symoff,
+		  (uint64_t)symtab->nsyms * sizeof(*syms));
+	strtab = (const char *)macho_at_offset(img->macho, symtab->stroff,
+					       symtab->strsize);
+	if (!syms || !strtab)
+		return (true);
+
+	named = malloc((symtab->nsyms + 1) * sizeof(*named));
+	if (!named) {
+		__logger(error, "malloc: out of memory");
+		return (false);
+	}
+
+	for (uint32_t i = 0; i < symtab->nsyms; i++) {
+		uint32_t strx = syms[i].n_un.n_strx;
+
+		if ((syms[i].n_type & N_STAB) ||
+		    (syms[i].n_type & N_TYPE) != N_SECT || !strx ||
+		    strx >= symtab->strsize ||
+		    !memchr(strtab + strx, '\0', symtab->strsize - strx))
+			continue;
+
+		named[n].addr	= syms[i].n_value;
+		named[n++].name = strtab + strx;
+	}
+
+	qsort(named, n, sizeof(*named), bindiff_sym_cmp);
+
+	for (size_t i = 0, s = 0; i < img->nfuncs; i++) {
+		while (s < n && named[s].addr < img->funcs[i].addr)
+			s++;
+		if (s < n && named[s].addr == img->funcs[i].addr)
+			img->funcs[i].name = named[s].name;
+	}
+
+	free(named);
+	return (true);
+}
+
+static bool bindiff_image_init(bindiff_image_t *img, const macho_t *macho)
+{
+	const callgraph_node_t *nodes;
+	bool			has_fs;
+
+	img->macho = macho;
+	has_fs = macho_find_command(macho, LC_FUNCTION_STARTS, NULL) &&
+		 function_starts_parse(macho, &img->fs);
+
+	if (!callgraph_build(macho, has_fs ? &img->fs : NULL, &img->cg))
+		return (false);
+
+	nodes	    = vec_unsafe_access(img->cg.nodes, 0);
+	img->nfuncs = img->cg.nfunctions;
+	img->funcs  = calloc(img->nfuncs + 1, sizeof(*img->funcs));
+	img->keys   = calloc(img->nfuncs + 1, sizeof(*img->keys));
+	if (!img->funcs || !img->keys) {
+		__logger(error, "calloc: out of memory");
+		return (false);
+	}
+
+	for (size_t i = 0; i < img->nfuncs; i++) {
+		img->funcs[i].addr  = nodes[i].addr;
+		img->funcs[i].size  = nodes[i].size;
+		img->funcs[i].match = BINDIFF_NONE;
+	}
+
+	return (bindiff_names(img));
+}
+
+static void bindiff_image_free(bindiff_image_t *img)
+{
+	function_starts_free(&img->fs);
+	callgraph_free(&img->cg);
+	free(img->funcs);
+	free(img->keys);
+}
+
+static bindiff_slot_t *bindiff_slot(bindiff_slot_t *slots, size_t mask,
+				    uint64_t key)
+{
+	size_t i = key & mask;
+
+	while (slots[i].key && slots[i].key != key)
+		i = (i + 1) & mask;
+	return (&slots[i]);
+}
+
+/* Identical bodies under different names are not paired on their hash,
+ * the call graph pass may still pair them.
+ */
+static bool bindiff_same(uint8_t how, const bindiff_func_t *a,
+			 const bindiff_func_t *b)
+{
+	if (how == BINDIFF_BY_HASH && a->hash != b->hash)
+		return (false);
+	if (how == BINDIFF_BY_NAME ||
+	    (how == BINDIFF_BY_HASH && a->name && b->name))
+		return (a->name && b->name && !strcmp(a->name, b->name));
+	return (true);
+}
+
+/* Hash join of the unmatched functions of both images on their 'keys',
+ * equal keys pair up in address order. With 'unique' only keys that no
+ * other function of either image has are paired.
+ */
+static bool bindiff_join(bindiff_ctx_t *ctx, uint8_t how, bool unique,
+			 size_t *matched)
+{
+	bindiff_image_t *old = &ctx->img[0];
+	bindiff_image_t *new = &ctx->img[1];
+	bindiff_slot_t	*slots;
+	uint32_t	*next;
+	size_t		 nslots = 16;
+
+	*matched = 0;
+	while (nslots < old->nfuncs * 2)
+		nslots <<= 1;
+
+	slots = calloc(nslots, sizeof(*slots));
+	next  = malloc((old->nfuncs + 1) * sizeof(*next));
+	if (!slots || !next) {
+		__logger(error, "bindiff: out of memory");
+		free(slots);
+		free(next);
+		return (false);
+	}
+
+	for (size_t i = old->nfuncs; i--;) {
+		bindiff_slot_t *slot;
+
+		if (!old->keys[i])
+			continue;
+
+		slot = bindiff_slot(slots, nslots - 1, old->keys[i]);
+		next[i]	   = slot->key ? slot->head : BINDIFF_NONE;
+		slot->key  = old->keys[i];
+		slot->head = (uint32_t)i;
+		slot->nold++;
+	}
+
+	for (size_t i = 0; unique && i < new->nfuncs; i++) {
+		bindiff_slot_t *slot;
+
+		if (!new->keys[i])
+			continue;
+		slot = bindiff_slot(slots, nslots - 1, new->keys[i]);
+		if (slot->key)
+			slot->nnew++;
+	}
+
+	for (size_t i = 0; i < new->nfuncs; i++) {
+		bindiff_slot_t *slot;
+		uint32_t	o;
+
+		if (!new->keys[i])
+			continue;
+
+		slot = bindiff_slot(slots, nslots - 1, new->keys[i]);
+		if (!slot->key || slot->head == BINDIFF_NONE ||
+		    (unique && (slot->nold != 1 || slot->nnew != 1)))
+			continue;
+
+		o = slot->head;
+		if (!bindiff_same(how, &old->funcs[o], &new->funcs[i]))
+			continue;
+
+		slot->head	     = next[o];
+		old->funcs[o].match = (uint32_t)i;
+		old->funcs[o].how   = how;
+		new->funcs[i].match = o;
+		new->funcs[i].how   = how;
+		(*matched)++;
+	}
+
+	free(slots);
+	free(next);
+	return (true);
+}
+
+/* Keys the unmatched functions of 'img' on their matched neighbours: the
+ * pairs they call or are called by, and the imports their stubs stand for.
+ */
+static void bindiff_call_keys(bindiff_image_t *img, bool is_new)
+{
+	const callgraph_node_t *nodes = vec_unsafe_access(img->cg.nodes, 0);
+
+	for (size_t i = 0; i < img->nfuncs; i++) {
+		uint64_t key = 0;
+
+		img->keys[i] = 0;
+		if (img->funcs[i].match != BINDIFF_NONE)
+			continue;
+
+		for (int dir = 0; dir < 2; dir++) {
+			const uint32_t *edges;
+			size_t		count;
+
+			edges = dir ? callgraph_callers(&img->cg, i, &count) :
+				      callgraph_callees(&img->cg, i, &count);
+			for (size_t e = 0; e < count; e++) {
+				uint32_t n = edges[e];
+				uint64_t label;
+
+				if (n >= img->nfuncs && nodes[n].name)
+					label = fnv1a_str(nodes[n].name);
+				else if (n < img->nfuncs &&
+					 img->funcs[n].match != BINDIFF_NONE)
+					label = is_new ? img->funcs[n].match
+						       : n;
+				else
+					continue;
+				key += bindiff_mix(label * 2 + dir);
+			}
+		}
+
+		img->keys[i] = key ? bindiff_mix(key) : 0;
+	}
+}
+
+static void bindiff_keys(bindiff_image_t *img, uint8_t how)
+{
+	for (size_t i = 0; i < img->nfuncs; i++) {
+		const bindiff_func_t *f = &img->funcs[i];
+
+		if (f->match != BINDIFF_NONE || (how == BINDIFF_BY_NAME &&
+						 !f->name))
+			img->keys[i] = 0;
+		else if (how == BINDIFF_BY_NAME)
+			img->keys[i] = bindiff_mix(fnv1a_str(f->name));
+		else
+			img->keys[i] = f->hash;
+	}
+}
+
+static bool bindiff_match(bindiff_ctx_t *ctx)
+{
+	size_t matched;
+
+	/* Identical code first, then the same name, then the same place in
+	 * the call graph, a round at a time as pairs give new neighbours.
+	 */
+	bindiff_keys(&ctx->img[0], BINDIFF_BY_HASH);
+	bindiff_keys(&ctx->img[1], BINDIFF_BY_HASH);
+	if (!bindiff_join(ctx, BINDIFF_BY_HASH, false, &matched))
+		return (false);
+
+	bindiff_keys(&ctx->img[0], BINDIFF_BY_NAME);
+	bindiff_keys(&ctx->img[1], BINDIFF_BY_NAME);
+	if (!bindiff_join(ctx, BINDIFF_BY_NAME, false, &matched))
+		return (false);
+
+	for (int round = 0; round < BINDIFF_ROUNDS; round++) {
+		bindiff_call_keys(&ctx->img[0], false);
+		bindiff_call_keys(&ctx->img[1], true);
+		if (!bindiff_join(ctx, BINDIFF_BY_CALLS, true, &matched))
+			return (false);
+		if (!matched)
+			break;
+	}
+
+	return (true);
+}
+
+static bool bindiff_report(const bindiff_ctx_t *ctx, bindiff_t *diff)
+{
+	const bindiff_image_t *old = &ctx->img[0];
+	const bindiff_image_t *new = &ctx->img[1];
+	bindiff_entry_t	       entry;
+
+	for (size_t i = 0; i < new->nfuncs; i++) {
+		const bindiff_func_t *f = &new->funcs[i];
+
+		if (f->match != BINDIFF_NONE)
+			continue;
+		entry = (bindiff_entry_t){ .new_addr = f->addr,
+					   .name     = f->name,
+					   .status   = BINDIFF_ADDED };
+		if (!vec_push(diff->entries, &entry))
+			return (false);
+		diff->nadded++;
+	}
+
+	for (size_t i = 0; i < old->nfuncs; i++) {
+		const bindiff_func_t *f = &old->funcs[i];
+
+		if (f->match != BINDIFF_NONE)
+			continue;
+		entry = (bindiff_entry_t){ .old_addr = f->addr,
+					   .name     = f->name,
+					   .status   = BINDIFF_REMOVED };
+		if (!vec_push(diff->entries, &entry))
+			return (false);
+		diff->nremoved++;
+	}
+
+	for (size_t i = 0; i < new->nfuncs; i++) {
+		const bindiff_func_t *f = &new->funcs[i];
+		const bindiff_func_t *o;
+
+		if (f->match == BINDIFF_NONE)
+			continue;
+
+		o = &old->funcs[f->match];
+		if (o->hash == f->hash) {
+			diff->nunchanged++;
+			continue;
+		}
+
+		entry = (bindiff_entry_t){ .old_addr = o->addr,
+					   .new_addr = f->addr,
+					   .name     = f->name,
+					   .status   = BINDIFF_MODIFIED,
+					   .how	     = f->how };
+		if (!entry.name)
+			entry.name = o->name;
+		if (!vec_push(diff->entries, &entry))
+			return (false);
+		diff->nmodified++;
+	}
+
+	return (true);
+}
+
+bool bindiff_build(const macho_t *old_image, const macho_t *new_image,
+		   bindiff_t *diff)
+{
+	bindiff_ctx_t ctx = { 0 };
+	size_t	      njobs;
+	bool	      ret = false;
+
+	(void)memset(diff, 0, sizeof(*diff));
+
+	diff->entries = vec_create(sizeof(bindiff_entry_t), 0, NULL);
+	if (!diff->entries) {
+		__logger(error, "vec_create: out of memory");
+		return (false);
+	}
+
+	if (!bindiff_image_init(&ctx.img[0], old_image) ||
+	    !bindiff_image_init(&ctx.img[1], new_image))
+		goto out;
+
+	ctx.njobs = (ctx.img[0].nfuncs + BINDIFF_FUNCS_PER_JOB - 1) /
+		    BINDIFF_FUNCS_PER_JOB;
+	njobs	  = (ctx.img[1].nfuncs + BINDIFF_FUNCS_PER_JOB - 1) /
+		BINDIFF_FUNCS_PER_JOB + ctx.njobs;
+	if (!parallel_for(njobs, 0, bindiff_hash, &ctx) ||
+	    !bindiff_match(&ctx))
+		goto out;
+
+	if (!bindiff_report(&ctx, diff)) {
+		__logger(error, "vec_push: out of memory");
+		goto out;
+	}
+	ret = true;
+
+out:
+	bindiff_image_free(&ctx.img[0]);
+	bindiff_image_free(&ctx.img[1]);
+	if (!ret)
+		bindiff_free(diff);
+	return (ret);
+}
+
+void bindiff_free(bindiff_t *diff)
+{
+	if (diff->entries)
+		vec_kill(diff->entries);
+	(void)memset(diff, 0, sizeof(*diff));
+}
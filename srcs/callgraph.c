@@ -0,0 +1,594 @@
+#include "arm64.h"
+#include "common.h"
+#include "ios-macos-utils.h"
+#include <mach-o/loader.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#define CALLGRAPH_CHUNK	       (64 * 1024)
+#define CALLGRAPH_BUCKET_SHIFT 10
+
+typedef struct callgraph_edge_s {
+	uint32_t caller;
+	uint32_t callee;
+} callgraph_edge_t;
+
+typedef struct callgraph_job_s {
+	uint64_t start; /* byte range, when discovering functions */
+	uint64_t end;
+	uint32_t first; /* function range, when scanning */
+	uint32_t last;
+	vec_t	*out;
+} callgraph_job_t;
+
+typedef struct callgraph_ctx_s {
+	const callgraph_node_t *nodes;
+	size_t			nfunctions;
+	size_t			nnodes;
+	const uint8_t	       *text; /* bytes of __TEXT,__text */
+	uint64_t		text_start;
+	uint64_t		text_end;
+	uint64_t		stubs_start; /* hull of the stub sections */
+	uint64_t		stubs_end;
+	uint32_t	       *buckets; /* function at every 1 KB of text */
+	callgraph_job_t	       *jobs;
+	atomic_bool		failed;
+} callgraph_ctx_t;
+
+static inline uint32_t callgraph_insn(const callgraph_ctx_t *ctx, uint64_t pc)
+{
+	uint32_t insn;
+
+	(void)memcpy(&insn, ctx->text + (pc - ctx->text_start), sizeof(insn));
+	return (insn);
+}
+
+/* Index of the node in [lo, hi) containing 'addr', or CALLGRAPH_NONE.
+ */
+static uint32_t callgraph_find(const callgraph_node_t *nodes, size_t lo,
+			       size_t hi, uint64_t addr)
+{
+	size_t first = lo;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (nodes[mid].addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo == first || addr - nodes[lo - 1].addr >= nodes[lo - 1].size)
+		return (CALLGRAPH_NONE);
+	return ((uint32_t)(lo - 1));
+}
+
+static uint32_t callgraph_ctx_lookup(const callgraph_ctx_t *ctx,
+				     uint64_t addr)
+{
+	if (addr >= ctx->text_start && addr < ctx->text_end) {
+		size_t b = (addr - ctx->text_start) >> CALLGRAPH_BUCKET_SHIFT;
+
+		return (callgraph_find(ctx->nodes, ctx->buckets[b],
+				       ctx->buckets[b + 1] + 1, addr));
+	}
+	if (addr >= ctx->stubs_start && addr < ctx->stubs_end)
+		return (callgraph_find(ctx->nodes, ctx->nfunctions,
+				       ctx->nnodes, addr));
+	return (CALLGRAPH_NONE);
+}
+
+/* First pass without LC_FUNCTION_STARTS, every BL target in __text is
+ * taken as the start of a function.
+ */
+static void callgraph_discover(void *arg, size_t worker, size_t index)
+{
+	callgraph_ctx_t *ctx = arg;
+	callgraph_job_t *job = &ctx->jobs[index];
+
+	(void)worker;
+
+	job->out = vec_create(sizeof(uint64_t), 0, NULL);
+	if (!job->out) {
+		atomic_store(&ctx->failed, true);
+		return;
+	}
+
+	for (uint64_t pc = job->start; pc + 4 <= job->end; pc += 4) {
+		uint32_t insn = callgraph_insn(ctx, pc);
+		uint64_t target;
+
+		if (!arm64_is_bl(insn))
+			continue;
+
+		target = arm64_b_target(insn, pc);
+		if (target >= ctx->text_start && target < ctx->text_end &&
+		    !(target & 3) && !vec_push(job->out, &target)) {
+			atomic_store(&ctx->failed, true);
+			return;
+		}
+	}
+}
+
+static int callgraph_addr_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return ((x > y) - (x < y));
+}
+
+static int callgraph_u32_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a;
+	uint32_t y = *(const uint32_t *)b;
+
+	return ((x > y) - (x < y));
+}
+
+/* Appends one edge per distinct callee of function 'caller'.
+ */
+static bool callgraph_flush(vec_t *out, uint32_t caller, vec_t *callees)
+{
+	uint32_t *c = vec_unsafe_access(callees, 0);
+	size_t	  n = vec_size(callees);
+
+	if (n > 1)
+		qsort(c, n, sizeof(*c), callgraph_u32_cmp);
+
+	for (size_t i = 0; i < n; i++) {
+		callgraph_edge_t edge = { caller, c[i] };
+
+		if (i && c[i] == c[i - 1])
+			continue;
+		if (!vec_push(out, &edge))
+			return (false);
+	}
+
+	vec_clear(callees);
+	return (true);
+}
+
+/* Branches leaving the function are calls (BL) or tail calls (B, B.cond,
+ * CBZ and TBZ), targets that are not a known node are dropped.
+ */
+static void callgraph_scan(void *arg, size_t worker, size_t index)
+{
+	callgraph_ctx_t *ctx = arg;
+	callgraph_job_t *job = &ctx->jobs[index];
+	vec_t		*callees;
+
+	(void)worker;
+
+	job->out = vec_create(sizeof(callgraph_edge_t), 0, NULL);
+	callees	 = vec_create(sizeof(uint32_t), 0, NULL);
+	if (!job->out || !callees) {
+		atomic_store(&ctx->failed, true);
+		if (callees)
+			vec_kill(callees);
+		return;
+	}
+
+	for (uint32_t f = job->first; f < job->last; f++) {
+		uint64_t start = ctx->nodes[f].addr;
+		uint64_t end   = start + ctx->nodes[f].size;
+
+		for (uint64_t pc = start; pc + 4 <= end; pc += 4) {
+			uint32_t insn = callgraph_insn(ctx, pc);
+			uint64_t target;
+			uint32_t callee;
+
+			if (arm64_is_bl(insn) || arm64_is_b(insn))
+				target = arm64_b_target(insn, pc);
+			else if (arm64_is_bcond(insn) || arm64_is_cbz(insn) ||
+				 arm64_is_tbz(insn))
+				target = arm64_cond_branch_target(insn, pc);
+			else
+				continue;
+
+			if (!arm64_is_bl(insn) && target >= start &&
+			    target < end)
+				continue;
+
+			callee = callgraph_ctx_lookup(ctx, target);
+			if (callee != CALLGRAPH_NONE &&
+			    !vec_push(callees, &callee))
+				goto fail;
+		}
+
+		if (!callgraph_flush(job->out, f, callees))
+			goto fail;
+	}
+
+	vec_kill(callees);
+	return;
+
+fail:
+	atomic_store(&ctx->failed, true);
+	vec_kill(callees);
+}
+
+static bool callgraph_parallel(callgraph_ctx_t *ctx, vec_t *jobs,
+			       void (*fn)(void *, size_t, size_t))
+{
+	ctx->jobs = vec_unsafe_access(jobs, 0);
+	atomic_init(&ctx->failed, false);
+
+	return (parallel_for(vec_size(jobs), 0, fn, ctx) &&
+		!atomic_load(&ctx->failed));
+}
+
+static void callgraph_jobs_kill(vec_t *jobs)
+{
+	for (size_t i = 0; i < vec_size(jobs); i++) {
+		callgraph_job_t *job = vec_access(jobs, i);
+
+		if (job->out)
+			vec_kill(job->out);
+	}
+	vec_kill(jobs);
+}
+
+/* Adds every BL target found in the text to 'starts'.
+ */
+static bool callgraph_bl_targets(callgraph_ctx_t *ctx, vec_t *starts)
+{
+	callgraph_job_t job  = { 0 };
+	vec_t	       *jobs = vec_create(sizeof(callgraph_job_t), 0, NULL);
+	bool		ret  = false;
+
+	if (!jobs)
+		return (false);
+
+	for (uint64_t at = ctx->text_start; at < ctx->text_end;
+	     at += CALLGRAPH_CHUNK) {
+		job.start = at;
+		job.end	  = MIN(at + CALLGRAPH_CHUNK, ctx->text_end);
+		if (!vec_push(jobs, &job))
+			goto out;
+	}
+
+	if (!callgraph_parallel(ctx, jobs, callgraph_discover))
+		goto out;
+
+	for (size_t i = 0; i < vec_size(jobs); i++) {
+		const callgraph_job_t *done = vec_at(jobs, i);
+
+		if (!vec_concat(starts, done->out))
+			goto out;
+	}
+	ret = true;
+
+out:
+	callgraph_jobs_kill(jobs);
+	return (ret);
+}
+
+/* Collects the function starts in __TEXT,__text, from 'fs' when given or
+ * from the BL targets otherwise. The text start is always one.
+ */
+static bool callgraph_functions(callgraph_ctx_t *ctx,
+				const function_starts_t *fs, vec_t *starts)
+{
+	function_range_t range;
+	uint64_t	*addrs;
+	size_t		 iter = 0;
+	size_t		 n;
+
+	if (!vec_push(starts, &ctx->text_start))
+		return (false);
+
+	if (fs && vec_size(fs->starts)) {
+		while (function_starts_next(fs, &iter, &range)) {
+			if (range.start >= ctx->text_start &&
+			    range.start < ctx->text_end &&
+			    !vec_push(starts, &range.start))
+				return (false);
+		}
+	} else if (!callgraph_bl_targets(ctx, starts)) {
+		return (false);
+	}
+
+	addrs = vec_unsafe_access(starts, 0);
+	qsort(addrs, vec_size(starts), sizeof(*addrs), callgraph_addr_cmp);
+
+	n = 0;
+	for (size_t i = 0; i < vec_size(starts); i++) {
+		if (!n || addrs[i] != addrs[n - 1])
+			addrs[n++] = addrs[i];
+	}
+	vec_wipe(starts, n, vec_size(starts));
+	return (true);
+}
+
+static int callgraph_node_cmp(const void *a, const void *b)
+{
+	return (callgraph_addr_cmp(&((const callgraph_node_t *)a)->addr,
+				   &((const callgraph_node_t *)b)->addr));
+}
+
+/* Appends a node for every entry of the S_SYMBOL_STUBS sections, named
+ * after the indirect symbol it jumps to.
+ */
+static bool callgraph_stubs(const macho_t *macho, callgraph_ctx_t *ctx,
+			    vec_t *nodes)
+{
+	size_t first = vec_size(nodes);
+
+	ctx->stubs_start = UINT64_MAX;
+	ctx->stubs_end	 = 0;
+
+	for (uint32_t i = 0; i < macho->nsegments; i++) {
+		const struct segment_command_64 *seg  = macho->segments[i];
+		const struct section_64		*sect = (const void *)(seg + 1);
+
+		for (uint32_t j = 0; j < seg->nsects; j++) {
+			uint32_t stride = sect[j].reserved2;
+
+			if ((sect[j].flags & SECTION_TYPE) != S_SYMBOL_STUBS ||
+			    !stride)
+				continue;
+
+			for (uint64_t k = 0; k < sect[j].size / stride; k++) {
+				callgraph_node_t node;
+
+				node.addr = sect[j].addr + k * stride;
+				node.size = stride;
+				node.name = macho_indirect_symbol(
+					macho, sect[j].reserved1 + (uint32_t)k);
+				if (!vec_push(nodes, &node))
+					return (false);
+			}
+
+			ctx->stubs_start = MIN(ctx->stubs_start, sect[j].addr);
+			ctx->stubs_end	 = MAX(ctx->stubs_end,
+					       sect[j].addr + sect[j].size);
+		}
+	}
+
+	if (vec_size(nodes) - first > 1)
+		qsort(vec_access(nodes, first), vec_size(nodes) - first,
+		      sizeof(callgraph_node_t), callgraph_node_cmp);
+	return (true);
+}
+
+/* Maps every 1 KB block of the text to the function containing its first
+ * byte, which narrows a lookup down to a few nodes. The text always starts
+ * a function.
+ */
+static bool callgraph_buckets(callgraph_ctx_t *ctx)
+{
+	size_t nbuckets = ((ctx->text_end - ctx->text_start) >>
+			   CALLGRAPH_BUCKET_SHIFT) + 2;
+	size_t f	= 0;
+
+	ctx->buckets = malloc(sizeof(*ctx->buckets) * nbuckets);
+	if (!ctx->buckets) {
+		__logger(error, "malloc: out of memory");
+		return (false);
+	}
+
+	for (size_t b = 0; b < nbuckets; b++) {
+		uint64_t addr = ctx->text_start +
+				((uint64_t)b << CALLGRAPH_BUCKET_SHIFT);
+
+		while (f + 1 < ctx->nfunctions &&
+		       ctx->nodes[f + 1].addr <= addr)
+			f++;
+		ctx->buckets[b] = (uint32_t)f;
+	}
+
+	return (true);
+}
+
+/* Builds both CSR directions from the caller-ordered edges.
+ */
+static bool callgraph_compact(callgraph_t *cg, const callgraph_job_t *jobs,
+			      size_t njobs)
+{
+	size_t nnodes = vec_size(cg->nodes);
+	size_t nedges = 0;
+	size_t e      = 0;
+
+	for (size_t i = 0; i < njobs; i++)
+		nedges += vec_size(jobs[i].out);
+
+	if (nedges >= UINT32_MAX) {
+		__logger(error, "callgraph: too many edges");
+		return (false);
+	}
+
+	cg->callees	   = malloc(sizeof(*cg->callees) * (nedges + 1));
+	cg->callers	   = malloc(sizeof(*cg->callers) * (nedges + 1));
+	cg->callee_offsets = calloc(nnodes + 1, sizeof(uint32_t));
+	cg->caller_offsets = calloc(nnodes + 2, sizeof(uint32_t));
+	if (!cg->callees || !cg->callers || !cg->callee_offsets ||
+	    !cg->caller_offsets) {
+		__logger(error, "malloc: out of memory");
+		return (false);
+	}
+
+	for (size_t i = 0; i < njobs; i++) {
+		const callgraph_edge_t *edges;
+
+		edges = vec_unsafe_access(jobs[i].out, 0);
+
+		for (size_t j = 0; j < vec_size(jobs[i].out); j++) {
+			cg->callee_offsets[edges[j].caller + 1]++;
+			cg->caller_offsets[edges[j].callee + 2]++;
+			cg->callees[e++] = edges[j].callee;
+		}
+	}
+
+	for (size_t i = 0; i < nnodes; i++) {
+		cg->callee_offsets[i + 1] += cg->callee_offsets[i];
+		cg->caller_offsets[i + 2] += cg->caller_offsets[i + 1];
+	}
+
+	/* Counting sort on the callee, the callers of a node stay sorted
+	 * since the edges come in caller order.
+	 */
+	for (size_t i = 0; i < njobs; i++) {
+		const callgraph_edge_t *edges;
+
+		edges = vec_unsafe_access(jobs[i].out, 0);
+
+		for (size_t j = 0; j < vec_size(jobs[i].out); j++)
+			cg->callers[cg->caller_offsets[edges[j].callee + 1]++] =
+				edges[j].caller;
+	}
+
+	cg->nedges = nedges;
+	return (true);
+}
+
+/* Turns the sorted starts into function nodes, each ending where the next
+ * one starts.
+ */
+static bool callgraph_nodes(const callgraph_ctx_t *ctx, const vec_t *starts,
+			    vec_t *nodes)
+{
+	const uint64_t *addrs = vec_unsafe_access(starts, 0);
+	size_t		n     = vec_size(starts);
+
+	for (size_t i = 0; i < n; i++) {
+		callgraph_node_t node;
+		uint64_t	 end = i + 1 < n ? addrs[i + 1] : ctx->text_end;
+
+		node.addr = addrs[i];
+		node.size = end - addrs[i];
+		node.name = NULL;
+		if (!vec_push(nodes, &node))
+			return (false);
+	}
+
+	return (true);
+}
+
+bool callgraph_build(const macho_t *macho, const function_starts_t *fs,
+		     callgraph_t *cg)
+{
+	const struct section_64 *text;
+	callgraph_ctx_t		 ctx;
+	callgraph_job_t		 job	= { 0 };
+	vec_t			*starts = NULL;
+	vec_t			*jobs	= NULL;
+	bool			 ret	= false;
+
+	(void)memset(cg, 0, sizeof(*cg));
+
+	if (macho->header->cputype != CPU_TYPE_ARM64) {
+		__logger(error, "callgraph: %s is not supported",
+			 cputype_to_cstr(macho->header->cputype));
+		return (false);
+	}
+
+	text = macho_find_section(macho, SEG_TEXT, SECT_TEXT);
+	if (!text) {
+		__logger(error, "callgraph: no __TEXT,__text");
+		return (false);
+	}
+
+	ctx.buckets    = NULL;
+	ctx.text_start = text->addr;
+	ctx.text_end   = text->addr + (text->size & ~3ULL);
+	ctx.text       = macho_at_offset(macho, text->offset, text->size);
+	if (!ctx.text) {
+		__logger(error, "callgraph: __TEXT,__text out of bounds");
+		return (false);
+	}
+
+	starts	  = vec_create(sizeof(uint64_t), 0, NULL);
+	cg->nodes = vec_create(sizeof(callgraph_node_t), 0, NULL);
+	jobs	  = vec_create(sizeof(callgraph_job_t), 0, NULL);
+	if (!starts || !cg->nodes || !jobs ||
+	    !callgraph_functions(&ctx, fs, starts) ||
+	    !callgraph_nodes(&ctx, starts, cg->nodes))
+		goto out;
+
+	cg->nfunctions = vec_size(cg->nodes);
+	if (!callgraph_stubs(macho, &ctx, cg->nodes))
+		goto out;
+
+	if (vec_size(cg->nodes) >= UINT32_MAX) {
+		__logger(error, "callgraph: too many nodes");
+		goto out;
+	}
+
+	ctx.nodes      = vec_unsafe_access(cg->nodes, 0);
+	ctx.nfunctions = cg->nfunctions;
+	ctx.nnodes     = vec_size(cg->nodes);
+	if (!callgraph_buckets(&ctx))
+		goto out;
+
+	/* Groups the functions in jobs of about CALLGRAPH_CHUNK bytes.
+	 */
+	for (uint32_t f = 0; f < ctx.nfunctions; f++) {
+		if (ctx.nodes[f].addr + ctx.nodes[f].size -
+				    ctx.nodes[job.first].addr >=
+			    CALLGRAPH_CHUNK ||
+		    f + 1 == ctx.nfunctions) {
+			job.last = f + 1;
+			if (!vec_push(jobs, &job))
+				goto out;
+			job.first = f + 1;
+		}
+	}
+
+	if (callgraph_parallel(&ctx, jobs, callgraph_scan))
+		ret = callgraph_compact(cg, vec_unsafe_access(jobs, 0),
+					vec_size(jobs));
+
+out:
+	if (!ret)
+		__logger(error, "callgraph: failed to build the graph");
+	if (jobs)
+		callgraph_jobs_kill(jobs);
+	if (starts)
+		vec_kill(starts);
+	free(ctx.buckets);
+	if (!ret)
+		callgraph_free(cg);
+	return (ret);
+}
+
+void callgraph_free(callgraph_t *cg)
+{
+	if (cg->nodes)
+		vec_kill(cg->nodes);
+	free(cg->callees);
+	free(cg->callee_offsets);
+	free(cg->callers);
+	free(cg->caller_offsets);
+	(void)memset(cg, 0, sizeof(*cg));
+}
+
+uint32_t callgraph_lookup(const callgraph_t *cg, uint64_t addr)
+{
+	const callgraph_node_t *nodes = vec_unsafe_access(cg->nodes, 0);
+	uint32_t		node;
+
+	node = callgraph_find(nodes, 0, cg->nfunctions, addr);
+	if (node == CALLGRAPH_NONE)
+		node = callgraph_find(nodes, cg->nfunctions,
+				      vec_size(cg->nodes), addr);
+	return (node);
+}
+
+const uint32_t *callgraph_callees(const callgraph_t *cg, uint32_t node,
+				  size_t *count)
+{
+	*count = cg->callee_offsets[node + 1] - cg->callee_offsets[node];
+	return (&cg->callees[cg->callee_offsets[node]]);
+}
+
+const uint32_t *callgraph_callers(const callgraph_t *cg, uint32_t node,
+				  size_t *count)
+{
+	*count = cg->caller_offsets[node + 1] - cg->caller_offsets[node];
+	return (&cg->callers[cg->caller_offsets[node]]);
+}
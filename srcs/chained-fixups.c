@@ -0,0 +1,477 @@
+#include "common.h"
+#include "ios-macos-utils.h"
+#include <mach-o/fixup-chains.h>
+#include <mach-o/loader.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Distance in bytes between two links of a chain.
+ */
+static uint32_t chained_stride(uint16_t format)
+{
+	switch (format) {
+	case DYLD_CHAINED_PTR_ARM64E:
+	case DYLD_CHAINED_PTR_ARM64E_USERLAND:
+	case DYLD_CHAINED_PTR_ARM64E_USERLAND24:
+		return (8);
+	case DYLD_CHAINED_PTR_ARM64E_KERNEL:
+	case DYLD_CHAINED_PTR_ARM64E_FIRMWARE:
+	case DYLD_CHAINED_PTR_64:
+	case DYLD_CHAINED_PTR_64_OFFSET:
+	case DYLD_CHAINED_PTR_64_KERNEL_CACHE:
+		return (4);
+	case DYLD_CHAINED_PTR_X86_64_KERNEL_CACHE:
+		return (1);
+	default:
+		return (0);
+	}
+}
+
+static inline int64_t sign_extend(uint64_t v, unsigned bits)
+{
+	return ((int64_t)(v << (64 - bits)) >> (64 - bits));
+}
+
+/* Decodes one raw chained pointer into 'fixup' and returns the distance to
+ * the next link, in strides (0 ends the chain).
+ */
+static uint32_t chained_decode(uint16_t format, uint64_t raw, uint64_t vmbase,
+			       chained_fixup_t *fixup)
+{
+	fixup->flags	 = 0;
+	fixup->key	 = 0;
+	fixup->diversity = 0;
+
+	switch (format) {
+	case DYLD_CHAINED_PTR_ARM64E:
+	case DYLD_CHAINED_PTR_ARM64E_KERNEL:
+	case DYLD_CHAINED_PTR_ARM64E_USERLAND:
+	case DYLD_CHAINED_PTR_ARM64E_USERLAND24:
+	case DYLD_CHAINED_PTR_ARM64E_FIRMWARE: {
+		bool auth = (raw >> 63) & 1;
+		bool bind = (raw >> 62) & 1;
+
+		if (auth) {
+			fixup->flags |= CHAINED_FIXUP_AUTH;
+			fixup->diversity = (raw >> 32) & 0xffff;
+			fixup->key	 = (raw >> 49) & 0x3;
+			if ((raw >> 48) & 1)
+				fixup->flags |= CHAINED_FIXUP_ADDR_DIV;
+		}
+
+		if (bind) {
+			fixup->ordinal =
+				(format == DYLD_CHAINED_PTR_ARM64E_USERLAND24) ?
+					(raw & 0xffffff) :
+					(raw & 0xffff);
+			fixup->target =
+				auth ? 0 :
+				       (uint64_t)sign_extend((raw >> 32) & 0x7ffff,
+							     19);
+		} else if (auth) {
+			fixup->ordinal = CHAINED_FIXUP_REBASE;
+			fixup->target  = vmbase + (raw & 0xffffffff);
+		} else {
+			uint64_t target = raw & 0x7ffffffffffULL;
+			uint64_t high8	= (raw >> 43) & 0xff;
+
+			if (format != DYLD_CHAINED_PTR_ARM64E &&
+			    format != DYLD_CHAINED_PTR_ARM64E_FIRMWARE)
+				target += vmbase;
+
+			fixup->ordinal = CHAINED_FIXUP_REBASE;
+			fixup->target  = target | (high8 << 56);
+		}
+
+		return ((raw >> 51) & 0x7ff);
+	}
+	case DYLD_CHAINED_PTR_64:
+	case DYLD_CHAINED_PTR_64_OFFSET:
+		if ((raw >> 63) & 1) {
+			fixup->ordinal = raw & 0xffffff;
+			fixup->target  = (raw >> 24) & 0xff;
+		} else {
+			uint64_t target = raw & 0xfffffffffULL;
+			uint64_t high8	= (raw >> 36) & 0xff;
+
+			if (format == DYLD_CHAINED_PTR_64_OFFSET)
+				target += vmbase;
+
+			fixup->ordinal = CHAINED_FIXUP_REBASE;
+			fixup->target  = target | (high8 << 56);
+		}
+
+		return ((raw >> 51) & 0xfff);
+	case DYLD_CHAINED_PTR_64_KERNEL_CACHE:
+	case DYLD_CHAINED_PTR_X86_64_KERNEL_CACHE:
+		if ((raw >> 63) & 1) {
+			fixup->flags |= CHAINED_FIXUP_AUTH;
+			fixup->diversity = (raw >> 32) & 0xffff;
+			fixup->key	 = (raw >> 49) & 0x3;
+			if ((raw >> 48) & 1)
+				fixup->flags |= CHAINED_FIXUP_ADDR_DIV;
+		}
+
+		fixup->ordinal = CHAINED_FIXUP_REBASE;
+		fixup->target  = vmbase + (raw & 0x3fffffff);
+
+		return ((raw >> 51) & 0xfff);
+	default:
+		return (0);
+	}
+}
+
+static bool chained_imports_parse(chained_fixups_t *cf, const uint8_t *data,
+				  uint32_t datasize)
+{
+	const struct dyld_chained_fixups_header *hdr = (const void *)data;
+	const char *symbols = (const char *)data + hdr->symbols_offset;
+	size_t	    symbols_size;
+	size_t	    entsize;
+
+	switch (hdr->imports_format) {
+	case DYLD_CHAINED_IMPORT:
+		entsize = sizeof(struct dyld_chained_import);
+		break;
+	case DYLD_CHAINED_IMPORT_ADDEND:
+		entsize = sizeof(struct dyld_chained_import_addend);
+		break;
+	case DYLD_CHAINED_IMPORT_ADDEND64:
+		entsize = sizeof(struct dyld_chained_import_addend64);
+		break;
+	default:
+		__logger(error, "chained_fixups: unknown imports format %u",
+			 hdr->imports_format);
+		return (false);
+	}
+
+	if (hdr->symbols_offset > datasize || hdr->imports_offset > datasize ||
+	    (datasize - hdr->imports_offset) / entsize < hdr->imports_count) {
+		__logger(error, "chained_fixups: imports out of bounds");
+		return (false);
+	}
+
+	symbols_size = datasize - hdr->symbols_offset;
+	cf->nimports = hdr->imports_count;
+	if (!cf->nimports)
+		return (true);
+
+	cf->imports = malloc(sizeof(*cf->imports) * cf->nimports);
+	if (!cf->imports) {
+		__logger(error, "malloc: out of memory");
+		return (false);
+	}
+
+	for (uint32_t i = 0; i < cf->nimports; i++) {
+		const uint8_t	 *ent = data + hdr->imports_offset + i * entsize;
+		chained_import_t *imp = &cf->imports[i];
+		uint64_t	  name_offset;
+
+		switch (hdr->imports_format) {
+		case DYLD_CHAINED_IMPORT: {
+			const struct dyld_chained_import *e = (const void *)ent;
+
+			imp->lib_ordinal = (int8_t)e->lib_ordinal;
+			imp->weak	 = e->weak_import;
+			imp->addend	 = 0;
+			name_offset	 = e->name_offset;
+			break;
+		}
+		case DYLD_CHAINED_IMPORT_ADDEND: {
+			const struct dyld_chained_import_addend *e =
+				(const void *)ent;
+
+			imp->lib_ordinal = (int8_t)e->lib_ordinal;
+			imp->weak	 = e->weak_import;
+			imp->addend	 = e->addend;
+			name_offset	 = e->name_offset;
+			break;
+		}
+		default: {
+			const struct dyld_chained_import_addend64 *e =
+				(const void *)ent;
+
+			imp->lib_ordinal = (int16_t)e->lib_ordinal;
+			imp->weak	 = e->weak_import;
+			imp->addend	 = (int64_t)e->addend;
+			name_offset	 = e->name_offset;
+			break;
+		}
+		}
+
+		if (name_offset >= symbols_size ||
+		    !memchr(symbols + name_offset, '\0',
+			    symbols_size - name_offset)) {
+			__logger(error, "chained_fixups: bad import name %u", i);
+			return (false);
+		}
+
+		imp->name = symbols + name_offset;
+	}
+
+	return (true);
+}
+
+static int chained_fixup_cmp(const void *a, const void *b)
+{
+	const chained_fixup_t *fa = a;
+	const chained_fixup_t *fb = b;
+
+	return ((fa->vmaddr > fb->vmaddr) - (fa->vmaddr < fb->vmaddr));
+}
+
+static bool chained_walk_page(chained_fixups_t *cf, uint16_t format,
+			      const uint8_t *page, size_t page_avail,
+			      uint64_t page_vmaddr, uint32_t offset)
+{
+	uint32_t	stride = chained_stride(format);
+	uint64_t	vmbase = cf->macho->vmbase;
+	chained_fixup_t fixup;
+	uint32_t	next;
+
+	do {
+		uint64_t raw;
+
+		if (offset > page_avail || page_avail - offset < sizeof(raw)) {
+			__logger(error, "chained_fixups: chain runs off %#llx",
+				 (unsigned long long)page_vmaddr);
+			return (false);
+		}
+
+		(void)memcpy(&raw, page + offset, sizeof(raw));
+		next = chained_decode(format, raw, vmbase, &fixup);
+
+		if (fixup.ordinal != CHAINED_FIXUP_REBASE &&
+		    fixup.ordinal >= cf->nimports) {
+			__logger(error, "chained_fixups: bad ordinal %u at %#llx",
+				 fixup.ordinal,
+				 (unsigned long long)(page_vmaddr + offset));
+			return (false);
+		}
+
+		fixup.vmaddr = page_vmaddr + offset;
+		if (!vec_push(cf->fixups, &fixup)) {
+			__logger(error, "vec_push: out of memory");
+			return (false);
+		}
+
+		offset += next * stride;
+	} while (next);
+
+	return (true);
+}
+
+static bool chained_walk_segment(chained_fixups_t		       *cf,
+				 const struct dyld_chained_starts_in_segment *starts,
+				 const struct segment_command_64	    *seg,
+				 const uint8_t *data, uint32_t datasize)
+{
+	const uint8_t *end   = data + datasize;
+	uint16_t       format = starts->pointer_format;
+
+	if (!chained_stride(format)) {
+		__logger(error, "chained_fixups: unsupported pointer format %u",
+			 format);
+		return (false);
+	}
+
+	if ((const uint8_t *)&starts->page_start[starts->page_count] > end) {
+		__logger(error, "chained_fixups: page starts out of bounds");
+		return (false);
+	}
+
+	for (uint16_t i = 0; i < starts->page_count; i++) {
+		uint64_t       segoff = (uint64_t)i * starts->page_size;
+		uint16_t       start  = starts->page_start[i];
+		const uint8_t *page;
+		size_t	       avail;
+
+		if (start == DYLD_CHAINED_PTR_START_NONE)
+			continue;
+
+		if (segoff >= seg->filesize) {
+			__logger(error, "chained_fixups: page %u past %.16s", i,
+				 seg->segname);
+			return (false);
+		}
+
+		avail = seg->filesize - segoff;
+		page  = macho_at_offset(cf->macho, seg->fileoff + segoff, avail);
+		if (!page) {
+			__logger(error, "chained_fixups: %.16s out of bounds",
+				 seg->segname);
+			return (false);
+		}
+
+		if (!(start & DYLD_CHAINED_PTR_START_MULTI)) {
+			if (!chained_walk_page(cf, format, page, avail,
+					       seg->vmaddr + segoff, start))
+				return (false);
+			continue;
+		}
+
+		/* Pages holding several chains list their starts in an
+		 * overflow area, terminated by DYLD_CHAINED_PTR_START_LAST.
+		 */
+		const uint16_t *multi =
+			&starts->page_start[start & ~DYLD_CHAINED_PTR_START_MULTI];
+		uint16_t	chain;
+
+		do {
+			if ((const uint8_t *)(multi + 1) > end) {
+				__logger(error,
+					 "chained_fixups: chain starts out of bounds");
+				return (false);
+			}
+
+			chain = *multi++;
+			if (!chained_walk_page(
+				    cf, format, page, avail, seg->vmaddr + segoff,
+				    chain & ~DYLD_CHAINED_PTR_START_LAST))
+				return (false);
+		} while (!(chain & DYLD_CHAINED_PTR_START_LAST));
+	}
+
+	return (true);
+}
+
+bool chained_fixups_parse(const macho_t *macho, chained_fixups_t *cf)
+{
+	const struct dyld_chained_fixups_header *hdr;
+	const struct dyld_chained_starts_in_image *image;
+	const uint8_t				    *data;
+	uint32_t				     datasize;
+
+	(void)memset(cf, 0, sizeof(*cf));
+	cf->macho = macho;
+
+	data = macho_linkedit_data(macho, LC_DYLD_CHAINED_FIXUPS, &datasize);
+	if (!data) {
+		__logger(error, "chained_fixups: no LC_DYLD_CHAINED_FIXUPS");
+		return (false);
+	}
+
+	hdr = (const void *)data;
+	if (datasize < sizeof(*hdr) || hdr->fixups_version != 0 ||
+	    hdr->starts_offset > datasize - sizeof(image->seg_count)) {
+		__logger(error, "chained_fixups: malformed header");
+		return (false);
+	}
+
+	cf->fixups = vec_create(sizeof(chained_fixup_t), 0, NULL);
+	if (!cf->fixups) {
+		__logger(error, "vec_create: out of memory");
+		return (false);
+	}
+
+	if (!chained_imports_parse(cf, data, datasize))
+		goto fail;
+
+	image = (const void *)(data + hdr->starts_offset);
+	if ((const uint8_t *)&image->seg_info_offset[image->seg_count] >
+	    data + datasize) {
+		__logger(error, "chained_fixups: segment starts out of bounds");
+		goto fail;
+	}
+
+	for (uint32_t i = 0; i < image->seg_count; i++) {
+		const struct dyld_chained_starts_in_segment *starts;
+		uint32_t off = image->seg_info_offset[i];
+
+		if (!off)
+			continue;
+
+		if (i >= macho->nsegments ||
+		    hdr->starts_offset + (uint64_t)off + sizeof(*starts) >
+			    datasize) {
+			__logger(error, "chained_fixups: bad segment %u", i);
+			goto fail;
+		}
+
+		starts = (const void *)((const uint8_t *)image + off);
+		if (!chained_walk_segment(cf, starts, macho->segments[i], data,
+					  datasize))
+			goto fail;
+	}
+
+	/* Chains are emitted in address order except when several chains
+	 * share a page, so a single pass usually proves the table sorted.
+	 */
+	const chained_fixup_t *fixups = vec_unsafe_access(cf->fixups, 0);
+
+	for (size_t i = 1; i < vec_size(cf->fixups); i++) {
+		if (fixups[i - 1].vmaddr > fixups[i].vmaddr) {
+			qsort(vec_unsafe_access(cf->fixups, 0),
+			      vec_size(cf->fixups), sizeof(chained_fixup_t),
+			      chained_fixup_cmp);
+			break;
+		}
+	}
+
+	return (true);
+
+fail:
+	chained_fixups_free(cf);
+	return (false);
+}
+
+void chained_fixups_free(chained_fixups_t *cf)
+{
+	if (cf->fixups)
+		vec_kill(cf->fixups);
+	free(cf->imports);
+	(void)memset(cf, 0, sizeof(*cf));
+}
+
+const chained_fixup_t *chained_fixups_at(const chained_fixups_t *cf,
+					 uint64_t		 vmaddr)
+{
+	const chained_fixup_t *fixups = vec_unsafe_access(cf->fixups, 0);
+	size_t		       lo     = 0;
+	size_t		       hi     = vec_size(cf->fixups);
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (fixups[mid].vmaddr < vmaddr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo < vec_size(cf->fixups) && fixups[lo].vmaddr == vmaddr)
+		return (&fixups[lo]);
+
+	return (NULL);
+}
+
+bool chained_fixups_resolve(const chained_fixups_t *cf, uint64_t vmaddr,
+			    uint64_t *value, const chained_import_t **import)
+{
+	const chained_fixup_t *fixup = chained_fixups_at(cf, vmaddr);
+	const uint8_t	      *raw;
+
+	*import = NULL;
+
+	if (fixup && fixup->ordinal == CHAINED_FIXUP_REBASE) {
+		*value = fixup->target;
+		return (true);
+	}
+
+	if (fixup) {
+		*import = &cf->imports[fixup->ordinal];
+		*value	= (*import)->addend + fixup->target;
+		return (true);
+	}
+
+	raw = macho_at_vmaddr(cf->macho, vmaddr, sizeof(*value));
+	if (!raw) {
+		__logger(error, "chained_fixups: %#llx is not mapped",
+			 (unsigned long long)vmaddr);
+		return (false);
+	}
+
+	(void)memcpy(value, raw, sizeof(*value));
+	return (true);
+}
@@ -0,0 +1,375 @@
+#include "common.h"
+#include "ios-macos-utils.h"
+#include <mach-o/loader.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+/* Blobs are big-endian and only 4-byte aligned within __LINKEDIT, see xnu's
+ * osfmk/kern/cs_blobs.h.
+ */
+#define CSMAGIC_EMBEDDED_SIGNATURE	   0xfade0cc0
+#define CSMAGIC_CODEDIRECTORY		   0xfade0c02
+#define CSSLOT_CODEDIRECTORY		   0
+#define CSSLOT_ALTERNATE_CODEDIRECTORIES   0x1000
+#define CSSLOT_ALTERNATE_CODEDIRECTORY_MAX 5
+
+#define CS_SUPPORTSSCATTER     0x20100
+#define CS_SUPPORTSCODELIMIT64 0x20300
+
+#define CODESIGN_PAGES_PER_JOB 32
+#define CODESIGN_TASK_WINDOW   (4 << 20)
+
+typedef struct cs_blob_index_s {
+	uint32_t type;
+	uint32_t offset;
+} __attribute__((packed)) cs_blob_index_t;
+
+typedef struct cs_superblob_s {
+	uint32_t	magic;
+	uint32_t	length;
+	uint32_t	count;
+	cs_blob_index_t index[];
+} __attribute__((packed)) cs_superblob_t;
+
+typedef struct cs_code_directory_s {
+	uint32_t magic;
+	uint32_t length;
+	uint32_t version;
+	uint32_t flags;
+	uint32_t hashOffset;
+	uint32_t identOffset;
+	uint32_t nSpecialSlots;
+	uint32_t nCodeSlots;
+	uint32_t codeLimit;
+	uint8_t	 hashSize;
+	uint8_t	 hashType;
+	uint8_t	 platform;
+	uint8_t	 pageSize;
+	uint32_t spare2;
+	uint32_t scatterOffset; /* version >= CS_SUPPORTSSCATTER */
+	uint32_t teamOffset;
+	uint32_t spare3; /* version >= CS_SUPPORTSCODELIMIT64 */
+	uint64_t codeLimit64;
+} __attribute__((packed)) cs_code_directory_t;
+
+typedef struct codesign_job_s {
+	const codesign_t *cs;
+	const uint8_t	 *data;	 /* bytes of page 'first' onwards */
+	uint32_t	  first;
+	uint32_t	  npages;
+	uint8_t		 *bad;	 /* one flag per page, from 'first' */
+} codesign_job_t;
+
+static int codesign_hash_rank(uint8_t type)
+{
+	switch (type) {
+	case CODESIGN_HASH_SHA256:
+		return (3);
+	case CODESIGN_HASH_SHA256_TRUNCATED:
+		return (2);
+	case CODESIGN_HASH_SHA1:
+		return (1);
+	default:
+		return (0);
+	}
+}
+
+static bool codesign_directory(const uint8_t *blob, uint32_t size,
+			       codesign_t *cs)
+{
+	const cs_code_directory_t *cd = (const cs_code_directory_t *)blob;
+	uint32_t		   length;
+	uint32_t		   version;
+	uint32_t		   hash_offset;
+	uint32_t		   ident_offset;
+	uint64_t		   page_size;
+
+	if (size < offsetof(cs_code_directory_t, scatterOffset) ||
+	    __builtin_bswap32(cd->magic) != CSMAGIC_CODEDIRECTORY)
+		return (false);
+
+	length	     = __builtin_bswap32(cd->length);
+	version	     = __builtin_bswap32(cd->version);
+	hash_offset  = __builtin_bswap32(cd->hashOffset);
+	ident_offset = __builtin_bswap32(cd->identOffset);
+	if (length > size ||
+	    length < offsetof(cs_code_directory_t, scatterOffset))
+		return (false);
+
+	/* Alternate CodeDirectories with a hash not computed here, such as
+	 * SHA-384, are passed over rather than reported as malformed.
+	 */
+	if (!codesign_hash_rank(cd->hashType))
+		return (false);
+
+	if (version >= CS_SUPPORTSSCATTER &&
+	    length >= offsetof(cs_code_directory_t, teamOffset) &&
+	    cd->scatterOffset) {
+		__logger(error, "codesign: scatter vectors are not supported");
+		return (false);
+	}
+
+	cs->hash_type  = cd->hashType;
+	cs->hash_size  = cd->hashSize;
+	cs->nslots     = __builtin_bswap32(cd->nCodeSlots);
+	cs->code_limit = __builtin_bswap32(cd->codeLimit);
+	if (version >= CS_SUPPORTSCODELIMIT64 && length >= sizeof(*cd) &&
+	    cd->codeLimit64)
+		cs->code_limit = __builtin_bswap64(cd->codeLimit64);
+
+	if (cd->pageSize > 30) {
+		__logger(error, "codesign: bad page size 2^%u", cd->pageSize);
+		return (false);
+	}
+
+	/* A zero page size means a single page spanning the whole code.
+	 */
+	page_size = cd->pageSize ? (1ULL << cd->pageSize) : cs->code_limit;
+	if (!page_size || page_size > UINT32_MAX ||
+	    cs->nslots != (cs->code_limit + page_size - 1) / page_size) {
+		__logger(error, "codesign: %u slots for %#llx bytes",
+			 cs->nslots, (unsigned long long)cs->code_limit);
+		return (false);
+	}
+	cs->page_size = (uint32_t)page_size;
+
+	if (cs->hash_size !=
+	    (cs->hash_type == CODESIGN_HASH_SHA256 ? 32 : 20)) {
+		__logger(error, "codesign: bad hash size %u", cs->hash_size);
+		return (false);
+	}
+
+	if (hash_offset > length ||
+	    (uint64_t)cs->nslots * cs->hash_size > length - hash_offset) {
+		__logger(error, "codesign: code slots out of bounds");
+		return (false);
+	}
+	cs->hashes = blob + hash_offset;
+
+	cs->identifier = NULL;
+	if (ident_offset < length &&
+	    memchr(blob + ident_offset, '\0', length - ident_offset))
+		cs->identifier = (const char *)blob + ident_offset;
+
+	return (true);
+}
+
+bool codesign_parse(const macho_t *macho, codesign_t *cs)
+{
+	const cs_superblob_t *sb;
+	const uint8_t	     *data;
+	uint32_t	      datasize;
+	uint32_t	      count;
+	int		      best = 0;
+
+	(void)memset(cs, 0, sizeof(*cs));
+
+	data = macho_linkedit_data(macho, LC_CODE_SIGNATURE, &datasize);
+	if (!data) {
+		__logger(error, "codesign: no LC_CODE_SIGNATURE");
+		return (false);
+	}
+
+	sb = (const cs_superblob_t *)data;
+	if (datasize < sizeof(*sb) ||
+	    __builtin_bswap32(sb->magic) != CSMAGIC_EMBEDDED_SIGNATURE) {
+		__logger(error, "codesign: not an embedded signature");
+		return (false);
+	}
+
+	datasize = MIN(datasize, __builtin_bswap32(sb->length));
+	count	 = __builtin_bswap32(sb->count);
+	if (count > (datasize - sizeof(*sb)) / sizeof(*sb->index)) {
+		__logger(error, "codesign: blob index out of bounds");
+		return (false);
+	}
+
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t   type	  = __builtin_bswap32(sb->index[i].type);
+		uint32_t   offset = __builtin_bswap32(sb->index[i].offset);
+		codesign_t cd;
+
+		if (type != CSSLOT_CODEDIRECTORY &&
+		    (type < CSSLOT_ALTERNATE_CODEDIRECTORIES ||
+		     type >= CSSLOT_ALTERNATE_CODEDIRECTORIES +
+				     CSSLOT_ALTERNATE_CODEDIRECTORY_MAX))
+			continue;
+
+		if (offset > datasize ||
+		    !codesign_directory(data + offset, datasize - offset, &cd))
+			continue;
+
+		if (codesign_hash_rank(cd.hash_type) > best) {
+			best = codesign_hash_rank(cd.hash_type);
+			*cs  = cd;
+		}
+	}
+
+	if (!best) {
+		__logger(error, "codesign: no usable CodeDirectory");
+		return (false);
+	}
+
+	return (true);
+}
+
+static void codesign_job(void *ctx, size_t worker, size_t job)
+{
+	const codesign_job_t *cj    = ctx;
+	const codesign_t     *cs    = cj->cs;
+	uint32_t	      start = job * CODESIGN_PAGES_PER_JOB;
+	uint32_t	      end   = start + CODESIGN_PAGES_PER_JOB;
+	uint8_t		      digest[32];
+
+	(void)worker;
+
+	for (uint32_t i = start; i < MIN(end, cj->npages); i++) {
+		uint64_t       index = cj->first + i;
+		uint64_t       off   = index * cs->page_size;
+		uint64_t       len   = MIN(cs->page_size, cs->code_limit - off);
+		const uint8_t *page  = cj->data + (uint64_t)i * cs->page_size;
+
+		if (cs->hash_type == CODESIGN_HASH_SHA1)
+			sha1(page, len, digest);
+		else
+			sha256(page, len, digest);
+
+		cj->bad[i] = memcmp(digest, cs->hashes + index * cs->hash_size,
+				    cs->hash_size) != 0;
+	}
+}
+
+/* Checks 'npages' pages starting at page 'first', whose bytes are at
+ * 'data', and appends the failing indices to 'mismatches'.
+ */
+static bool codesign_check_pages(const codesign_t *cs, const uint8_t *data,
+				 uint32_t first, uint32_t npages,
+				 vec_t *mismatches)
+{
+	codesign_job_t cj;
+	bool	       ret = true;
+
+	if (!npages)
+		return (true);
+
+	cj.cs	  = cs;
+	cj.data	  = data;
+	cj.first  = first;
+	cj.npages = npages;
+	cj.bad	  = malloc(npages);
+	if (!cj.bad) {
+		__logger(error, "malloc: out of memory");
+		return (false);
+	}
+
+	if (!parallel_for((npages + CODESIGN_PAGES_PER_JOB - 1) /
+				  CODESIGN_PAGES_PER_JOB,
+			  0, codesign_job, &cj)) {
+		free(cj.bad);
+		return (false);
+	}
+
+	for (uint32_t i = 0; ret && i < npages; i++) {
+		uint32_t index = first + i;
+
+		if (cj.bad[i] && !vec_push(mismatches, &index)) {
+			__logger(error, "vec_push: out of memory");
+			ret = false;
+		}
+	}
+
+	free(cj.bad);
+	return (ret);
+}
+
+bool codesign_verify(const macho_t *macho, vec_t **mismatches)
+{
+	codesign_t cs;
+
+	if (!codesign_parse(macho, &cs))
+		return (false);
+
+	if (cs.code_limit > macho->size) {
+		__logger(error, "codesign: code limit past the image end");
+		return (false);
+	}
+
+	*mismatches = vec_create(sizeof(uint32_t), 0, NULL);
+	if (!*mismatches) {
+		__logger(error, "vec_create: out of memory");
+		return (false);
+	}
+
+	if (!codesign_check_pages(&cs, macho->base, 0, cs.nslots,
+				  *mismatches)) {
+		vec_kill(*mismatches);
+		*mismatches = NULL;
+		return (false);
+	}
+
+	return (true);
+}
+
+bool codesign_verify_task(task_t task, vm_address_t address,
+			  const macho_t *macho, vec_t **mismatches)
+{
+	const struct segment_command_64 *text;
+	codesign_t			 cs;
+	uint8_t				*window;
+	uint64_t			 limit;
+	uint32_t			 npages;
+	uint32_t			 step;
+
+	if (!codesign_parse(macho, &cs))
+		return (false);
+
+	/* Only __TEXT is expected to match the file once loaded, the pages
+	 * past it are rewritten by the fixups.
+	 */
+	text = macho_find_segment(macho, SEG_TEXT);
+	if (!text || text->fileoff != 0) {
+		__logger(error, "codesign: no __TEXT at file offset 0");
+		return (false);
+	}
+
+	limit  = MIN(cs.code_limit, text->filesize);
+	npages = (uint32_t)(limit / cs.page_size);
+	if (limit == cs.code_limit)
+		npages = cs.nslots;
+
+	step   = MAX(1, CODESIGN_TASK_WINDOW / cs.page_size);
+	window = malloc((size_t)step * cs.page_size);
+	if (!window) {
+		__logger(error, "malloc: out of memory");
+		return (false);
+	}
+
+	*mismatches = vec_create(sizeof(uint32_t), 0, NULL);
+	if (!*mismatches) {
+		__logger(error, "vec_create: out of memory");
+		free(window);
+		return (false);
+	}
+
+	/* Reads a window of pages at a time and hashes it on every CPU.
+	 */
+	for (uint32_t first = 0; first < npages; first += step) {
+		uint32_t n     = MIN(step, npages - first);
+		uint64_t off   = (uint64_t)first * cs.page_size;
+		uint64_t bytes = MIN((uint64_t)n * cs.page_size, limit - off);
+
+		if (!memory_r(task, address + off, window, bytes) ||
+		    !codesign_check_pages(&cs, window, first, n, *mismatches)) {
+			vec_kill(*mismatches);
+			*mismatches = NULL;
+			free(window);
+			return (false);
+		}
+	}
+
+	free(window);
+	return (true);
+}
@@ -0,0 +1,128 @@
+#include "common.h"
+#include "compile_time.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN 16
+
+typedef struct arena_chunk_s {
+	struct arena_chunk_s *next;
+	size_t		      size;
+	size_t		      used;
+	uint8_t		      data[];
+} arena_chunk_t;
+
+struct arena_s {
+	arena_chunk_t *head;
+	size_t	       chunk_size;
+};
+
+static arena_chunk_t *arena_chunk_new(size_t size)
+{
+	arena_chunk_t *chunk = malloc(sizeof(*chunk) + size);
+
+	if (!chunk) {
+		__logger(error, "malloc: out of memory");
+		return (NULL);
+	}
+
+	chunk->next = NULL;
+	chunk->size = size;
+	chunk->used = 0;
+	return (chunk);
+}
+
+arena_t *arena_create(size_t chunk_size)
+{
+	arena_t *arena = malloc(sizeof(*arena));
+
+	if (!arena) {
+		__logger(error, "malloc: out of memory");
+		return (NULL);
+	}
+
+	arena->chunk_size = chunk_size ? chunk_size : 64 * 1024;
+	arena->head	  = arena_chunk_new(arena->chunk_size);
+	if (!arena->head) {
+		free(arena);
+		return (NULL);
+	}
+
+	return (arena);
+}
+
+void *arena_alloc(arena_t *arena, size_t size)
+{
+	arena_chunk_t *chunk = arena->head;
+	size_t	       off   = (chunk->used + ARENA_ALIGN - 1) &
+		      ~(size_t)(ARENA_ALIGN - 1);
+
+	if (off > chunk->size || size > chunk->size - off) {
+		size_t want = size > arena->chunk_size ? size :
+							 arena->chunk_size;
+
+		chunk = arena_chunk_new(want);
+		if (!chunk)
+			return (NULL);
+
+		chunk->next = arena->head;
+		arena->head = chunk;
+		off	    = 0;
+	}
+
+	chunk->used = off + size;
+	return (chunk->data + off);
+}
+
+void *arena_calloc(arena_t *arena, size_t n, size_t size)
+{
+	void *ptr;
+
+	if (unsigned_mult_overflows(n, size))
+		return (NULL);
+
+	ptr = arena_alloc(arena, n * size);
+	if (ptr)
+		(void)memset(ptr, 0, n * size);
+
+	return (ptr);
+}
+
+char *arena_strndup(arena_t *arena, const char *s, size_t n)
+{
+	size_t len = strnlen(s, n);
+	char  *dst = arena_alloc(arena, len + 1);
+
+	if (dst) {
+		(void)memcpy(dst, s, len);
+		dst[len] = '\0';
+	}
+
+	return (dst);
+}
+
+/* Keeps the most recent chunk so steady-state use does not touch malloc.
+ */
+void arena_reset(arena_t *arena)
+{
+	arena_chunk_t *chunk = arena->head->next;
+
+	while (chunk) {
+		arena_chunk_t *next = chunk->next;
+
+		free(chunk);
+		chunk = next;
+	}
+
+	arena->head->next = NULL;
+	arena->head->used = 0;
+}
+
+void arena_kill(arena_t *arena)
+{
+	arena_reset(arena);
+	free(arena->head);
+	free(arena);
+}
@@ -0,0 +1,169 @@
+#include "common.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+bool bufwriter_init(bufwriter_t *w, int fd, size_t cap, pthread_mutex_t *lock)
+{
+	w->buf = malloc(cap);
+	if (!w->buf) {
+		__logger(error, "malloc: out of memory");
+		return (false);
+	}
+
+	w->fd	= fd;
+	w->len	= 0;
+	w->cap	= cap;
+	w->lock = lock;
+	w->err	= false;
+	return (true);
+}
+
+bool bufwriter_flush(bufwriter_t *w)
+{
+	const char *p = w->buf;
+	size_t	    n = w->len;
+
+	if (!n)
+		return (!w->err);
+
+	if (w->lock)
+		(void)pthread_mutex_lock(w->lock);
+
+	while (n) {
+		ssize_t ret = write(w->fd, p, n);
+
+		if (ret == -1 && errno == EINTR)
+			continue;
+		if (ret <= 0) {
+			__logger(error, "bufwriter_flush: %s", strerror(errno));
+			w->err = true;
+			break;
+		}
+
+		p += ret;
+		n -= ret;
+	}
+
+	if (w->lock)
+		(void)pthread_mutex_unlock(w->lock);
+
+	w->len = 0;
+	return (!w->err);
+}
+
+/* A shared writer grows its buffer rather than flushing in the middle of a
+ * record, so output from other threads never lands inside one.
+ */
+static bool bufwriter_grow(bufwriter_t *w, size_t n)
+{
+	size_t cap = w->cap;
+	char  *buf;
+
+	if (n <= w->cap - w->len)
+		return (true);
+
+	while (cap - w->len < n)
+		cap *= 2;
+
+	buf = realloc(w->buf, cap);
+	if (!buf) {
+		__logger(error, "realloc: out of memory");
+		w->err = true;
+		return (false);
+	}
+
+	w->buf = buf;
+	w->cap = cap;
+	return (true);
+}
+
+void bufwriter_write(bufwriter_t *w, const void *data, size_t n)
+{
+	if (w->lock) {
+		if (!bufwriter_grow(w, n))
+			return;
+	} else if (n > w->cap - w->len) {
+		(void)bufwriter_flush(w);
+
+		if (n > w->cap) {
+			const char *p = data;
+
+			(void)memcpy(w->buf, p, w->cap);
+			w->len = w->cap;
+			bufwriter_write(w, p + w->cap, n - w->cap);
+			return;
+		}
+	}
+
+	(void)memcpy(w->buf + w->len, data, n);
+	w->len += n;
+}
+
+void bufwriter_puts(bufwriter_t *w, const char *s)
+{
+	bufwriter_write(w, s, strlen(s));
+}
+
+void bufwriter_printf(bufwriter_t *w, const char *format, ...)
+{
+	va_list args;
+	int	ret;
+
+	va_start(args, format);
+	ret = vsnprintf(w->buf + w->len, w->cap - w->len, format, args);
+	va_end(args);
+
+	if (ret < 0)
+		return;
+
+	if ((size_t)ret < w->cap - w->len) {
+		w->len += ret;
+		return;
+	}
+
+	if (w->lock) {
+		if (!bufwriter_grow(w, (size_t)ret + 1))
+			return;
+
+		va_start(args, format);
+		ret = vsnprintf(w->buf + w->len, w->cap - w->len, format, args);
+		va_end(args);
+
+		if (ret > 0)
+			w->len += ret;
+		return;
+	}
+
+	(void)bufwriter_flush(w);
+
+	va_start(args, format);
+	ret = vsnprintf(w->buf, w->cap, format, args);
+	va_end(args);
+
+	if (ret > 0)
+		w->len = ((size_t)ret < w->cap) ? (size_t)ret : w->cap - 1;
+}
+
+/* Flushes once the buffer is past 'threshold', so callers can batch a whole
+ * record before handing it to the shared descriptor.
+ */
+bool bufwriter_commit(bufwriter_t *w, size_t threshold)
+{
+	if (w->len >= threshold)
+		return (bufwriter_flush(w));
+
+	return (!w->err);
+}
+
+void bufwriter_destroy(bufwriter_t *w)
+{
+	(void)bufwriter_flush(w);
+	free(w->buf);
+	w->buf = NULL;
+}
@@ -1,6 +1,7 @@
 #ifndef __COMMON_H__
 #define __COMMON_H__
 
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <sys/types.h>
@@ -36,6 +37,7 @@ extern t_log_level __log_level__;
 
 void logger(t_log_level level, const char *filename, const char *func,
 	    uint32_t lineno, const char *format, ...);
+void log_set_level(t_log_level level);
 
 size_t	ascii_16_bytes(uint8_t *dst, const uint8_t *src, size_t n);
 size_t	data_16_bytes_color(uint8_t *buffer, const uint8_t *addr, size_t n);
@@ -54,6 +56,85 @@ bool fd_read_at(int fd, void *dest, size_t n, off_t offset);
 bool fd_sneek_read(int fd, void *dest, size_t n);
 bool fd_read(int fd, void *dest, size_t n);
 
+bool leb128_read_u(const uint8_t **p, const uint8_t *end, uint64_t *value);
+bool leb128_read_s(const uint8_t **p, const uint8_t *end, int64_t *value);
+
+/* One-shot digests. SHA-256 uses the SHA extensions (SHA-NI, ARMv8 crypto)
+ * when the CPU has them.
+ */
+void sha1(const void *data, size_t len, uint8_t digest[20]);
+void sha256(const void *data, size_t len, uint8_t digest[32]);
+bool sha256_is_accelerated(void);
+
+/* Runs fn(ctx, worker, job) for every job in [0, njobs) on 'nworkers'
+ * threads (0 for one per online CPU). Workers pull jobs from a shared
+ * counter and 'worker' is a stable index in [0, nworkers).
+ */
+bool   parallel_for(size_t njobs, size_t nworkers,
+		    void (*fn)(void *ctx, size_t worker, size_t job), void *ctx);
+size_t parallel_ncpus(void);
+
+/* Bump allocator, everything is released at once by arena_reset/kill.
+ */
+typedef struct arena_s arena_t;
+
+arena_t *arena_create(size_t chunk_size);
+void	*arena_alloc(arena_t *arena, size_t size);
+void	*arena_calloc(arena_t *arena, size_t n, size_t size);
+char	*arena_strndup(arena_t *arena, const char *s, size_t n);
+void	 arena_reset(arena_t *arena);
+void	 arena_kill(arena_t *arena);
+
+/* Set of unique byte strings. The copies are NUL-terminated and live until
+ * strpool_kill.
+ */
+typedef struct strpool_s strpool_t;
+
+strpool_t  *strpool_create(void);
+const char *strpool_intern(strpool_t *pool, const void *s, size_t len);
+size_t	    strpool_count(const strpool_t *pool);
+void	    strpool_kill(strpool_t *pool);
+
+/* FNV-1a, the hash behind every table keyed by names or bytes. */
+uint64_t fnv1a(const void *data, size_t len);
+uint64_t fnv1a_str(const char *s);
+
+/* Table from C strings to 32-bit values, sized for 'n' keys up front and
+ * grown past that. Keys are not copied and must outlive the table, the
+ * first value added for a key is the one kept.
+ */
+typedef struct strmap_s strmap_t;
+
+strmap_t *strmap_create(size_t n);
+bool	  strmap_add(strmap_t *map, const char *key, uint32_t value);
+bool	  strmap_get(const strmap_t *map, const char *key, uint32_t *value);
+void	  strmap_kill(strmap_t *map);
+
+/* Output buffer in front of a descriptor that may be shared between
+ * threads, in which case 'lock' serializes the flushes. A shared writer only
+ * writes on bufwriter_commit/flush, its buffer grows to hold what is pending.
+ */
+typedef struct bufwriter_s {
+	char		*buf;
+	size_t		 len;
+	size_t		 cap;
+	int		 fd;
+	bool		 err;
+	pthread_mutex_t *lock;
+} bufwriter_t;
+
+bool bufwriter_init(bufwriter_t *w, int fd, size_t cap, pthread_mutex_t *lock);
+void bufwriter_write(bufwriter_t *w, const void *data, size_t n);
+void bufwriter_puts(bufwriter_t *w, const char *s);
+void bufwriter_printf(bufwriter_t *w, const char *format, ...)
+	__attribute__((format(printf, 2, 3)));
+bool bufwriter_commit(bufwriter_t *w, size_t threshold);
+bool bufwriter_flush(bufwriter_t *w);
+void bufwriter_destroy(bufwriter_t *w);
+
+/* Shell-style glob match of 'str' against 'pat' ('*', '?' and [classes]).
+ */
+bool	    strpcmp(const char *str, const char *pat);
 const char *str_to_print(char *buf, size_t bufsiz, const char *str);
 char	   *path_attach(const char *dirname, const char *name);
 
@@ -0,0 +1,48 @@
+#include <stdbool.h>
+#include <stdint.h>
+
+bool leb128_read_u(const uint8_t **p, const uint8_t *end, uint64_t *value)
+{
+	const uint8_t *s     = *p;
+	uint64_t       v     = 0;
+	unsigned       shift = 0;
+
+	do {
+		if (s == end || shift > 63) {
+			return (false);
+		}
+
+		v |= (uint64_t)(*s & 0x7f) << shift;
+		shift += 7;
+	} while (*s++ & 0x80);
+
+	*p     = s;
+	*value = v;
+	return (true);
+}
+
+bool leb128_read_s(const uint8_t **p, const uint8_t *end, int64_t *value)
+{
+	const uint8_t *s     = *p;
+	uint64_t       v     = 0;
+	unsigned       shift = 0;
+	uint8_t	       byte;
+
+	do {
+		if (s == end || shift > 63) {
+			return (false);
+		}
+
+		byte = *s++;
+		v |= (uint64_t)(byte & 0x7f) << shift;
+		shift += 7;
+	} while (byte & 0x80);
+
+	if (shift < 64 && (byte & 0x40)) {
+		v |= ~(uint64_t)0 << shift;
+	}
+
+	*p     = s;
+	*value = (int64_t)v;
+	return (true);
+}
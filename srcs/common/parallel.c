@@ -0,0 +1,104 @@
+#include "common.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct parallel_ctx_s {
+	void (*fn)(void *ctx, size_t worker, size_t job);
+	void	      *ctx;
+	size_t	       njobs;
+	atomic_size_t  next;
+} parallel_ctx_t;
+
+typedef struct parallel_worker_s {
+	parallel_ctx_t *shared;
+	size_t		id;
+} parallel_worker_t;
+
+static void *parallel_worker(void *arg)
+{
+	parallel_worker_t *w = arg;
+	parallel_ctx_t	  *p = w->shared;
+	size_t		   job;
+
+	while ((job = atomic_fetch_add_explicit(&p->next, 1,
+						memory_order_relaxed)) <
+	       p->njobs) {
+		p->fn(p->ctx, w->id, job);
+	}
+
+	return (NULL);
+}
+
+size_t parallel_ncpus(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return (n > 0 ? (size_t)n : 1);
+}
+
+bool parallel_for(size_t njobs, size_t nworkers,
+		  void (*fn)(void *ctx, size_t worker, size_t job), void *ctx)
+{
+	parallel_worker_t *workers;
+	pthread_t	  *threads;
+	parallel_ctx_t	   shared;
+	size_t		   started;
+
+	if (!nworkers)
+		nworkers = parallel_ncpus();
+	if (nworkers > njobs)
+		nworkers = njobs;
+	if (!njobs)
+		return (true);
+
+	shared.fn    = fn;
+	shared.ctx   = ctx;
+	shared.njobs = njobs;
+	atomic_init(&shared.next, 0);
+
+	if (nworkers == 1) {
+		for (size_t i = 0; i < njobs; i++)
+			fn(ctx, 0, i);
+		return (true);
+	}
+
+	workers = malloc(sizeof(*workers) * nworkers);
+	threads = malloc(sizeof(*threads) * nworkers);
+	if (!workers || !threads) {
+		__logger(error, "malloc: out of memory");
+		free(workers);
+		free(threads);
+		return (false);
+	}
+
+	/* The calling thread is worker 0, so a failed pthread_create only
+	 * costs parallelism, every job still runs.
+	 */
+	for (started = 1; started < nworkers; started++) {
+		int ret;
+
+		workers[started].shared = &shared;
+		workers[started].id	= started;
+		ret = pthread_create(&threads[started], NULL, parallel_worker,
+				     &workers[started]);
+		if (ret != 0) {
+			__logger(warning, "pthread_create: %s", strerror(ret));
+			break;
+		}
+	}
+
+	workers[0].shared = &shared;
+	workers[0].id	  = 0;
+	(void)parallel_worker(&workers[0]);
+
+	for (size_t i = 1; i < started; i++)
+		(void)pthread_join(threads[i], NULL);
+
+	free(workers);
+	free(threads);
+	return (true);
+}
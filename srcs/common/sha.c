@@ -0,0 +1,354 @@
+#include "common.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <cpuid.h>
+#include <immintrin.h>
+#define HAVE_SHA_NI 1
+#elif defined(__aarch64__) && \
+	(defined(__ARM_FEATURE_SHA2) || defined(__ARM_FEATURE_CRYPTO))
+#include <arm_neon.h>
+#define HAVE_ARM_SHA2 1
+#endif
+
+typedef void (*sha256_blocks_fn)(uint32_t state[8], const uint8_t *data,
+				 size_t nblocks);
+
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+	0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+	0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+	0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+	0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+	0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+	0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+	0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+	0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotr32(uint32_t v, unsigned n)
+{
+	return ((v >> n) | (v << (32 - n)));
+}
+
+static inline uint32_t rotl32(uint32_t v, unsigned n)
+{
+	return ((v << n) | (v >> (32 - n)));
+}
+
+static inline uint32_t load_be32(const uint8_t *p)
+{
+	return (((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+		((uint32_t)p[2] << 8) | p[3]);
+}
+
+static inline void store_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+#define SHA256_BSIG0(x) (rotr32(x, 2) ^ rotr32(x, 13) ^ rotr32(x, 22))
+#define SHA256_BSIG1(x) (rotr32(x, 6) ^ rotr32(x, 11) ^ rotr32(x, 25))
+#define SHA256_SSIG0(x) (rotr32(x, 7) ^ rotr32(x, 18) ^ ((x) >> 3))
+#define SHA256_SSIG1(x) (rotr32(x, 17) ^ rotr32(x, 19) ^ ((x) >> 10))
+
+static void sha256_blocks_generic(uint32_t state[8], const uint8_t *data,
+				  size_t nblocks)
+{
+	uint32_t w[64];
+
+	while (nblocks--) {
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+		uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+
+		for (int i = 0; i < 16; i++)
+			w[i] = load_be32(data + 4 * i);
+
+		for (int i = 16; i < 64; i++) {
+			w[i] = w[i - 16] + SHA256_SSIG0(w[i - 15]) + w[i - 7] +
+			       SHA256_SSIG1(w[i - 2]);
+		}
+
+		for (int i = 0; i < 64; i++) {
+			uint32_t ch = (e & f) ^ (~e & g);
+			uint32_t mj = (a & b) ^ (a & c) ^ (b & c);
+			uint32_t t1 = h + SHA256_BSIG1(e) + ch + sha256_k[i];
+			uint32_t t2 = SHA256_BSIG0(a) + mj;
+
+			t1 += w[i];
+
+			h = g;
+			g = f;
+			f = e;
+			e = d + t1;
+			d = c;
+			c = b;
+			b = a;
+			a = t1 + t2;
+		}
+
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+		state[5] += f;
+		state[6] += g;
+		state[7] += h;
+		data += 64;
+	}
+}
+
+#ifdef HAVE_SHA_NI
+/* Four rounds on w0, then w0 is replaced by the message words needed four
+ * groups later. The callers rotate the four message registers.
+ */
+#define SHANI_QROUND(i, w0, w1, w2, w3)                                       \
+	do {                                                                  \
+		__m128i msg = _mm_loadu_si128(                                \
+			(const __m128i *)&sha256_k[4 * i]);                   \
+                                                                              \
+		msg = _mm_add_epi32(msg, w0);                                 \
+                                                                              \
+		st1 = _mm_sha256rnds2_epu32(st1, st0, msg);                   \
+		st0 = _mm_sha256rnds2_epu32(st0, st1,                         \
+					    _mm_shuffle_epi32(msg, 0x0E));    \
+		if (i < 12) {                                                 \
+			w0 = _mm_add_epi32(_mm_sha256msg1_epu32(w0, w1),      \
+					   _mm_alignr_epi8(w3, w2, 4));       \
+			w0 = _mm_sha256msg2_epu32(w0, w3);                    \
+		}                                                             \
+	} while (0)
+
+__attribute__((target("sha,sse4.1"))) static void
+sha256_blocks_shani(uint32_t state[8], const uint8_t *data, size_t nblocks)
+{
+	const __m128i mask =
+		_mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i st0, st1, tmp;
+
+	tmp = _mm_loadu_si128((const __m128i *)&state[0]);
+	st1 = _mm_loadu_si128((const __m128i *)&state[4]);
+	tmp = _mm_shuffle_epi32(tmp, 0xB1);    /* CDAB */
+	st1 = _mm_shuffle_epi32(st1, 0x1B);    /* EFGH */
+	st0 = _mm_alignr_epi8(tmp, st1, 8);    /* ABEF */
+	st1 = _mm_blend_epi16(st1, tmp, 0xF0); /* CDGH */
+
+	while (nblocks--) {
+		__m128i abef = st0;
+		__m128i cdgh = st1;
+		__m128i m0   = _mm_shuffle_epi8(
+			  _mm_loadu_si128((const __m128i *)(data + 0)), mask);
+		__m128i m1 = _mm_shuffle_epi8(
+			_mm_loadu_si128((const __m128i *)(data + 16)), mask);
+		__m128i m2 = _mm_shuffle_epi8(
+			_mm_loadu_si128((const __m128i *)(data + 32)), mask);
+		__m128i m3 = _mm_shuffle_epi8(
+			_mm_loadu_si128((const __m128i *)(data + 48)), mask);
+
+		SHANI_QROUND(0, m0, m1, m2, m3);
+		SHANI_QROUND(1, m1, m2, m3, m0);
+		SHANI_QROUND(2, m2, m3, m0, m1);
+		SHANI_QROUND(3, m3, m0, m1, m2);
+		SHANI_QROUND(4, m0, m1, m2, m3);
+		SHANI_QROUND(5, m1, m2, m3, m0);
+		SHANI_QROUND(6, m2, m3, m0, m1);
+		SHANI_QROUND(7, m3, m0, m1, m2);
+		SHANI_QROUND(8, m0, m1, m2, m3);
+		SHANI_QROUND(9, m1, m2, m3, m0);
+		SHANI_QROUND(10, m2, m3, m0, m1);
+		SHANI_QROUND(11, m3, m0, m1, m2);
+		SHANI_QROUND(12, m0, m1, m2, m3);
+		SHANI_QROUND(13, m1, m2, m3, m0);
+		SHANI_QROUND(14, m2, m3, m0, m1);
+		SHANI_QROUND(15, m3, m0, m1, m2);
+
+		st0 = _mm_add_epi32(st0, abef);
+		st1 = _mm_add_epi32(st1, cdgh);
+		data += 64;
+	}
+
+	tmp = _mm_shuffle_epi32(st0, 0x1B);    /* FEBA */
+	st1 = _mm_shuffle_epi32(st1, 0xB1);    /* DCHG */
+	st0 = _mm_blend_epi16(tmp, st1, 0xF0); /* DCBA */
+	st1 = _mm_alignr_epi8(st1, tmp, 8);    /* ABEF */
+
+	_mm_storeu_si128((__m128i *)&state[0], st0);
+	_mm_storeu_si128((__m128i *)&state[4], st1);
+}
+#endif
+
+#ifdef HAVE_ARM_SHA2
+static void sha256_blocks_arm(uint32_t state[8], const uint8_t *data,
+			      size_t nblocks)
+{
+	uint32x4_t st0 = vld1q_u32(&state[0]);
+	uint32x4_t st1 = vld1q_u32(&state[4]);
+
+	while (nblocks--) {
+		uint32x4_t abcd = st0;
+		uint32x4_t efgh = st1;
+		uint32x4_t w[4];
+
+		for (int i = 0; i < 4; i++) {
+			w[i] = vreinterpretq_u32_u8(
+				vrev32q_u8(vld1q_u8(data + 16 * i)));
+		}
+
+		for (int i = 0; i < 16; i++) {
+			uint32x4_t wk  = vaddq_u32(w[i & 3],
+						   vld1q_u32(&sha256_k[4 * i]));
+			uint32x4_t tmp = st0;
+
+			st0 = vsha256hq_u32(st0, st1, wk);
+			st1 = vsha256h2q_u32(st1, tmp, wk);
+
+			if (i < 12) {
+				uint32_t j = i & 3;
+
+				w[j] = vsha256su0q_u32(w[j], w[(j + 1) & 3]);
+				w[j] = vsha256su1q_u32(w[j], w[(j + 2) & 3],
+						       w[(j + 3) & 3]);
+			}
+		}
+
+		st0 = vaddq_u32(st0, abcd);
+		st1 = vaddq_u32(st1, efgh);
+		data += 64;
+	}
+
+	vst1q_u32(&state[0], st0);
+	vst1q_u32(&state[4], st1);
+}
+#endif
+
+static sha256_blocks_fn sha256_blocks = sha256_blocks_generic;
+static pthread_once_t	sha256_once   = PTHREAD_ONCE_INIT;
+
+static void sha256_select(void)
+{
+#if defined(HAVE_SHA_NI)
+	unsigned int eax, ebx, ecx, edx;
+
+	if (__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) &&
+	    (ebx & (1u << 29)) && __get_cpuid(1, &eax, &ebx, &ecx, &edx) &&
+	    (ecx & (1u << 19)) && (ecx & (1u << 9)))
+		sha256_blocks = sha256_blocks_shani;
+#elif defined(HAVE_ARM_SHA2)
+	sha256_blocks = sha256_blocks_arm;
+#endif
+}
+
+bool sha256_is_accelerated(void)
+{
+	(void)pthread_once(&sha256_once, sha256_select);
+	return (sha256_blocks != sha256_blocks_generic);
+}
+
+/* Pads the trailing bytes and appends the message length in bits, producing
+ * one or two final blocks.
+ */
+static size_t md_final_blocks(uint8_t out[128], const uint8_t *tail,
+			      size_t tail_len, uint64_t total_len)
+{
+	size_t nblocks = (tail_len < 56) ? 1 : 2;
+	size_t end     = nblocks * 64;
+
+	(void)memset(out, 0, end);
+	(void)memcpy(out, tail, tail_len);
+	out[tail_len] = 0x80;
+	store_be32(out + end - 8, (uint32_t)((total_len * 8) >> 32));
+	store_be32(out + end - 4, (uint32_t)(total_len * 8));
+	return (nblocks);
+}
+
+void sha256(const void *data, size_t len, uint8_t digest[32])
+{
+	uint32_t state[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+			      0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+	uint8_t	 last[128];
+	size_t	 full = len / 64;
+
+	(void)pthread_once(&sha256_once, sha256_select);
+
+	sha256_blocks(state, data, full);
+	sha256_blocks(state, last,
+		      md_final_blocks(last, (const uint8_t *)data + full * 64,
+				      len % 64, len));
+
+	for (int i = 0; i < 8; i++)
+		store_be32(digest + 4 * i, state[i]);
+}
+
+static void sha1_blocks(uint32_t state[5], const uint8_t *data, size_t nblocks)
+{
+	uint32_t w[80];
+
+	while (nblocks--) {
+		uint32_t a = state[0], b = state[1], c = state[2];
+		uint32_t d = state[3], e = state[4];
+
+		for (int i = 0; i < 16; i++)
+			w[i] = load_be32(data + 4 * i);
+		for (int i = 16; i < 80; i++) {
+			w[i] = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+			w[i] = rotl32(w[i], 1);
+		}
+
+		for (int i = 0; i < 80; i++) {
+			uint32_t f, k, t;
+
+			if (i < 20) {
+				f = (b & c) | (~b & d);
+				k = 0x5a827999;
+			} else if (i < 40) {
+				f = b ^ c ^ d;
+				k = 0x6ed9eba1;
+			} else if (i < 60) {
+				f = (b & c) | (b & d) | (c & d);
+				k = 0x8f1bbcdc;
+			} else {
+				f = b ^ c ^ d;
+				k = 0xca62c1d6;
+			}
+
+			t = rotl32(a, 5) + f + e + k + w[i];
+			e = d;
+			d = c;
+			c = rotl32(b, 30);
+			b = a;
+			a = t;
+		}
+
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+		data += 64;
+	}
+}
+
+void sha1(const void *data, size_t len, uint8_t digest[20])
+{
+	uint32_t state[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+			      0xc3d2e1f0 };
+	uint8_t	 last[128];
+	size_t	 full = len / 64;
+
+	sha1_blocks(state, data, full);
+	sha1_blocks(state, last,
+		    md_final_blocks(last, (const uint8_t *)data + full * 64,
+				    len % 64, len));
+
+	for (int i = 0; i < 5; i++)
+		store_be32(digest + 4 * i, state[i]);
+}
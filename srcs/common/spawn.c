@@ -1,39 +1,560 @@
 #include "common.h"
-#include <string.h>
+#include "ios-macos-utils.h"
 #include <errno.h>
-#include <stdbool.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <spawn.h>
+#include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SPAWN_SERVER_LAUNCH	 1
+#define SPAWN_SERVER_WAIT	 2
+#define SPAWN_SERVER_MAX_STRINGS (4 * 1024 * 1024)
+#define SPAWN_SERVER_POLL_MIN	 (50 * 1000)	    /* ns */
+#define SPAWN_SERVER_POLL_MAX	 (10 * 1000 * 1000) /* ns */
+
+/* Followed by 'size' bytes of NUL-terminated strings: the path, then 'argc'
+ * arguments and 'envc' environment variables. A count of -1 stands for a NULL
+ * vector. The stdio descriptors flagged in 'fds' travel as SCM_RIGHTS.
+ */
+typedef struct spawn_request_s {
+	uint32_t op;
+	uint32_t flags;
+	uint32_t fds; /* bit i for stdio descriptor i */
+	int32_t	 argc;
+	int32_t	 envc;
+	int32_t	 pid; /* to wait for */
+	uint32_t size;
+} spawn_request_t;
+
+typedef struct spawn_reply_s {
+	int32_t err; /* errno value */
+	int32_t pid;
+	int32_t status;
+} spawn_reply_t;
+
+void spawn_opts_init(spawn_opts_t *opts)
+{
+	(void)memset(opts, 0, sizeof(*opts));
+	opts->stdin_fd	= -1;
+	opts->stdout_fd = -1;
+	opts->stderr_fd = -1;
+}
+
+/* Returns an errno value, posix_spawn() does not set errno. */
+static int spawn_posix(pid_t *pid, const char *path, const spawn_opts_t *opts)
+{
+	char *const		   argv[2] = { (char *)path, NULL };
+	char *const		   envp[1] = { NULL };
+	const int		   fds[3]  = { opts->stdin_fd, opts->stdout_fd,
+					       opts->stderr_fd };
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t	   attr;
+	int			   err;
+
+	err = posix_spawnattr_init(&attr);
+	if (err)
+		return (err);
+
+	err = posix_spawn_file_actions_init(&actions);
+	if (err) {
+		(void)posix_spawnattr_destroy(&attr);
+		return (err);
+	}
+
+	if (opts->flags & SPAWN_SUSPENDED)
+		err = posix_spawnattr_setflags(&attr,
+					       POSIX_SPAWN_START_SUSPENDED);
+
+	for (int i = 0; !err && i < 3; i++) {
+		if (fds[i] >= 0)
+			err = posix_spawn_file_actions_adddup2(&actions,
+							       fds[i], i);
+	}
+
+	if (!err)
+		err = posix_spawn(pid, path, &actions, &attr,
+				  opts->argv ? opts->argv : argv,
+				  opts->envp ? opts->envp : envp);
+
+	(void)posix_spawn_file_actions_destroy(&actions);
+	(void)posix_spawnattr_destroy(&attr);
+	return (err);
+}
+
+bool spawn(pid_t *pid, const char *path, const spawn_opts_t *opts)
+{
+	spawn_opts_t defaults;
+	int	     err;
+
+	if (!opts) {
+		spawn_opts_init(&defaults);
+		opts = &defaults;
+	}
+
+	err = spawn_posix(pid, path, opts);
+	if (err) {
+		__logger(error, "posix_spawn: %s: %s", path, strerror(err));
+		return (false);
+	}
+
+	return (true);
+}
 
 bool spawn_program(pid_t *pid, const char *binpath)
 {
-	posix_spawnattr_t attr;
+	spawn_opts_t opts;
+
+	spawn_opts_init(&opts);
+	opts.flags = SPAWN_SUSPENDED;
+	return (spawn(pid, binpath, &opts));
+}
+
+/* Reads or writes all of 'size' bytes, false when the peer is gone. */
+static bool spawn_io(int fd, void *buf, size_t size, bool out)
+{
+	uint8_t *p = buf;
+
+	while (size) {
+		ssize_t n = out ? write(fd, p, size) : read(fd, p, size);
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return (false);
+		p += n;
+		size -= (size_t)n;
+	}
+
+	return (true);
+}
+
+static bool spawn_send(int sock, const spawn_request_t *req, const int *fds,
+		       size_t nfds, const char *strings)
+{
+	union {
+		struct cmsghdr hdr;
+		char	       buf[CMSG_SPACE(3 * sizeof(int))];
+	} control;
+	struct msghdr	msg;
+	struct iovec	iov;
+	struct cmsghdr *cmsg;
+	ssize_t		n;
+
+	(void)memset(&msg, 0, sizeof(msg));
+	(void)memset(&control, 0, sizeof(control));
+	iov.iov_base   = (void *)req;
+	iov.iov_len    = sizeof(*req);
+	msg.msg_iov    = &iov;
+	msg.msg_iovlen = 1;
+
+	if (nfds) {
+		msg.msg_control	   = control.buf;
+		msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+		cmsg		   = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level   = SOL_SOCKET;
+		cmsg->cmsg_type	   = SCM_RIGHTS;
+		cmsg->cmsg_len	   = CMSG_LEN(nfds * sizeof(int));
+		(void)memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+	}
+
+	do {
+		n = sendmsg(sock, &msg, 0);
+	} while (n < 0 && errno == EINTR);
+	if (n <= 0)
+		return (false);
+
+	return (spawn_io(sock, (uint8_t *)req + n, sizeof(*req) - (size_t)n,
+			 true) &&
+		spawn_io(sock, (void *)strings, req->size, true));
+}
+
+/* Descriptors that came with the request are stored in 'fds' by stdio slot,
+ * the others are left at -1.
+ */
+static bool spawn_recv(int sock, spawn_request_t *req, int fds[3])
+{
+	union {
+		struct cmsghdr hdr;
+		char	       buf[CMSG_SPACE(3 * sizeof(int))];
+	} control;
+	struct msghdr	msg;
+	struct iovec	iov;
+	struct cmsghdr *cmsg;
+	int		recvd[3];
+	size_t		nrecvd = 0;
+	size_t		k      = 0;
+	ssize_t		n;
+
+	(void)memset(&msg, 0, sizeof(msg));
+	iov.iov_base	   = req;
+	iov.iov_len	   = sizeof(*req);
+	msg.msg_iov	   = &iov;
+	msg.msg_iovlen	   = 1;
+	msg.msg_control	   = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+
+	do {
+		n = recvmsg(sock, &msg, 0);
+	} while (n < 0 && errno == EINTR);
+	if (n <= 0)
+		return (false);
+
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		size_t count;
+
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (size_t i = 0; i < count && nrecvd < 3; i++)
+			(void)memcpy(&recvd[nrecvd++],
+				     CMSG_DATA(cmsg) + i * sizeof(int),
+				     sizeof(int));
+	}
+
+	if (!spawn_io(sock, (uint8_t *)req + n, sizeof(*req) - (size_t)n,
+		      false))
+		goto fail;
+
+	for (int i = 0; i < 3; i++) {
+		fds[i] = -1;
+		if (!(req->fds & (1U << i)))
+			continue;
+		if (k == nrecvd)
+			goto fail;
+		fds[i] = recvd[k++];
+	}
+
+	if (k == nrecvd)
+		return (true);
+
+fail:
+	for (size_t i = 0; i < nrecvd; i++)
+		(void)close(recvd[i]);
+	return (false);
+}
+
+/* Splits 'count' strings off 'p', NULL for a count of -1. */
+static char **spawn_split(char **p, const char *end, int32_t count)
+{
+	char **v;
+
+	if (count < 0)
+		return (NULL);
+
+	v = calloc((size_t)count + 1, sizeof(*v));
+	if (!v)
+		return (NULL);
+
+	for (int32_t i = 0; i < count && *p < end; i++) {
+		v[i] = *p;
+		*p += strlen(*p) + 1;
+	}
+
+	return (v);
+}
+
+/* False when the request cannot be read, the stream is then out of sync. */
+static bool spawn_server_launch_one(int sock, const spawn_request_t *req,
+				    const int fds[3], spawn_reply_t *reply)
+{
+	spawn_opts_t opts;
+	char	    *strings;
+	char	    *p;
+	pid_t	     pid = 0;
+
+	if (req->size == 0 || req->size > SPAWN_SERVER_MAX_STRINGS)
+		return (false);
+
+	strings = malloc(req->size + 1);
+	if (!strings || !spawn_io(sock, strings, req->size, false)) {
+		free(strings);
+		return (false);
+	}
+	strings[req->size] = '\0';
+
+	spawn_opts_init(&opts);
+	opts.flags     = req->flags;
+	opts.stdin_fd  = fds[0];
+	opts.stdout_fd = fds[1];
+	opts.stderr_fd = fds[2];
+
+	p	  = strings + strlen(strings) + 1;
+	opts.argv = spawn_split(&p, strings + req->size, req->argc);
+	opts.envp = spawn_split(&p, strings + req->size, req->envc);
+
+	if ((req->argc >= 0 && !opts.argv) || (req->envc >= 0 && !opts.envp))
+		reply->err = ENOMEM;
+	else
+		reply->err = spawn_posix(&pid, strings, &opts);
+	reply->pid = pid;
+
+	free((void *)opts.argv);
+	free((void *)opts.envp);
+	free(strings);
+	return (true);
+}
+
+/* Runs in the forked helper until the other end of the socket is closed. */
+static void spawn_server_main(int sock)
+{
+	for (;;) {
+		spawn_request_t req;
+		spawn_reply_t	reply;
+		int		fds[3];
+
+		if (!spawn_recv(sock, &req, fds))
+			_exit(0);
+
+		(void)memset(&reply, 0, sizeof(reply));
+		if (req.op == SPAWN_SERVER_LAUNCH) {
+			if (!spawn_server_launch_one(sock, &req, fds, &reply))
+				_exit(1);
+		} else if (req.op == SPAWN_SERVER_WAIT) {
+			int   status = 0;
+			pid_t pid;
+
+			/* Never blocks, the caller polls a running program */
+			while ((pid = waitpid(req.pid, &status, WNOHANG)) < 0 &&
+			       errno == EINTR)
+				;
+			if (pid < 0)
+				reply.err = errno;
+			reply.pid    = pid > 0 ? pid : 0;
+			reply.status = status;
+		} else {
+			reply.err = EINVAL;
+		}
+
+		for (int i = 0; i < 3; i++) {
+			if (fds[i] >= 0)
+				(void)close(fds[i]);
+		}
+
+		if (!spawn_io(sock, &reply, sizeof(reply), true))
+			_exit(0);
+	}
+}
+
+bool spawn_server_start(spawn_server_t *srv)
+{
+	int sv[2];
+
+	(void)memset(srv, 0, sizeof(*srv));
+	srv->sock = -1;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+		__logger(error, "socketpair: %s", strerror(errno));
+		return (false);
+	}
+
+	/* Neither end is passed on to the launched programs */
+	(void)fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+	(void)fcntl(sv[1], F_SETFD, FD_CLOEXEC);
+#ifdef SO_NOSIGPIPE
+	(void)setsockopt(sv[0], SOL_SOCKET, SO_NOSIGPIPE, &(int){ 1 },
+			 sizeof(int));
+#endif
+
+	srv->pid = fork();
+	if (srv->pid < 0) {
+		__logger(error, "fork: %s", strerror(errno));
+		(void)close(sv[0]);
+		(void)close(sv[1]);
+		return (false);
+	}
+
+	/* The helper outlives whatever the caller opens or closes later, so it
+	 * only keeps stdio and its end of the socket.
+	 */
+	if (srv->pid == 0) {
+		for (int fd = getdtablesize() - 1; fd > 2; fd--) {
+			if (fd != sv[1])
+				(void)close(fd);
+		}
+		spawn_server_main(sv[1]);
+	}
+
+	(void)close(sv[1]);
+	srv->sock = sv[0];
+	(void)pthread_mutex_init(&srv->lock, NULL);
+	return (true);
+}
+
+void spawn_server_stop(spawn_server_t *srv)
+{
+	if (srv->sock < 0)
+		return;
+
+	/* The helper exits once it reads the end of the stream */
+	(void)close(srv->sock);
+	while (waitpid(srv->pid, NULL, 0) < 0 && errno == EINTR)
+		;
+	(void)pthread_mutex_destroy(&srv->lock);
+	(void)memset(srv, 0, sizeof(*srv));
+	srv->sock = -1;
+}
+
+static bool spawn_server_call(spawn_server_t *srv, const spawn_request_t *req,
+			      const int *fds, size_t nfds, const char *strings,
+			      spawn_reply_t *reply)
+{
+	bool ok;
+
+	if (srv->sock < 0) {
+		__logger(error, "spawn_server: not started");
+		return (false);
+	}
+
+	(void)pthread_mutex_lock(&srv->lock);
+	ok = spawn_send(srv->sock, req, fds, nfds, strings) &&
+	     spawn_io(srv->sock, reply, sizeof(*reply), false);
+	(void)pthread_mutex_unlock(&srv->lock);
+
+	if (!ok)
+		__logger(error, "spawn_server: the helper is gone");
+	return (ok);
+}
+
+/* Appends the strings of a vector to 'buf', or only counts their bytes when
+ * 'buf' is NULL. Returns the number of strings or -1 for a NULL vector.
+ */
+static int32_t spawn_pack(char *const *v, char *buf, size_t *size)
+{
+	int32_t n = 0;
+
+	if (!v)
+		return (-1);
+
+	for (; v[n]; n++) {
+		size_t len = strlen(v[n]) + 1;
+
+		if (buf)
+			(void)memcpy(buf + *size, v[n], len);
+		*size += len;
+	}
+
+	return (n);
+}
+
+bool spawn_server_launch(spawn_server_t *srv, pid_t *pid, const char *path,
+			 const spawn_opts_t *opts)
+{
+	spawn_opts_t	defaults;
+	spawn_request_t req;
+	spawn_reply_t	reply;
+	int		fds[3];
+	size_t		nfds = 0;
+	size_t		len  = strlen(path) + 1;
+	size_t		size = len;
+	char	       *strings;
+
+	if (!opts) {
+		spawn_opts_init(&defaults);
+		opts = &defaults;
+	}
+
+	(void)spawn_pack(opts->argv, NULL, &size);
+	(void)spawn_pack(opts->envp, NULL, &size);
+	if (size > SPAWN_SERVER_MAX_STRINGS) {
+		__logger(error, "spawn_server: %s: %s", path, strerror(E2BIG));
+		return (false);
+	}
+
+	strings = malloc(size);
+	if (!strings) {
+		__logger(error, "malloc: out of memory");
+		return (false);
+	}
 
-	static struct {
-		char *const *argv[4];
-		const char  *envp[1];
-	} arguments;
+	(void)memset(&req, 0, sizeof(req));
+	(void)memcpy(strings, path, len);
+	size	  = len;
+	req.op	  = SPAWN_SERVER_LAUNCH;
+	req.flags = opts->flags;
+	req.argc  = spawn_pack(opts->argv, strings, &size);
+	req.envc  = spawn_pack(opts->envp, strings, &size);
+	req.size  = (uint32_t)size;
 
-	arguments.argv[0] = (char *const *)binpath;
-	arguments.argv[1] = NULL;
-	arguments.envp[0] = NULL;
+	if (opts->stdin_fd >= 0) {
+		req.fds |= 1U << 0;
+		fds[nfds++] = opts->stdin_fd;
+	}
+	if (opts->stdout_fd >= 0) {
+		req.fds |= 1U << 1;
+		fds[nfds++] = opts->stdout_fd;
+	}
+	if (opts->stderr_fd >= 0) {
+		req.fds |= 1U << 2;
+		fds[nfds++] = opts->stderr_fd;
+	}
 
-	if (posix_spawnattr_init(&attr) != 0) {
-		__logger(error, "posix_spawnattr_init %s", strerror(errno));
+	if (!spawn_server_call(srv, &req, fds, nfds, strings, &reply)) {
+		free(strings);
 		return (false);
 	}
+	free(strings);
 
-	if (posix_spawnattr_setflags(&attr, POSIX_SPAWN_START_SUSPENDED) != 0) {
-		__logger(error, "posix_spawnattr_setflags %s", strerror(errno));
+	if (reply.err) {
+		__logger(error, "posix_spawn: %s: %s", path,
+			 strerror(reply.err));
 		return (false);
 	}
 
-	if (posix_spawn(pid, (const char *)arguments.argv[0], NULL, &attr,
-			(char *const *)arguments.argv,
-			(char *const *)arguments.envp) != 0) {
-		__logger(error, "posix_spawn %s", strerror(errno));
+	*pid = reply.pid;
+	return (true);
+}
+
+bool spawn_server_poll(spawn_server_t *srv, pid_t pid, int *status,
+		       bool *exited)
+{
+	spawn_request_t req;
+	spawn_reply_t	reply;
+
+	(void)memset(&req, 0, sizeof(req));
+	req.op	= SPAWN_SERVER_WAIT;
+	req.pid = pid;
+
+	if (!spawn_server_call(srv, &req, NULL, 0, NULL, &reply))
+		return (false);
+
+	if (reply.err) {
+		__logger(error, "waitpid: %d: %s", pid, strerror(reply.err));
 		return (false);
 	}
 
+	*exited = reply.pid != 0;
+	if (*exited && status)
+		*status = reply.status;
+	return (true);
+}
+
+/* The lock is only held for one round-trip, other threads launch and wait
+ * between the polls of a program still running.
+ */
+bool spawn_server_wait(spawn_server_t *srv, pid_t pid, int *status)
+{
+	struct timespec delay  = { 0, SPAWN_SERVER_POLL_MIN };
+	bool		exited = false;
+
+	for (;;) {
+		if (!spawn_server_poll(srv, pid, status, &exited))
+			return (false);
+
+		if (exited)
+			break;
+
+		(void)nanosleep(&delay, NULL);
+		if (delay.tv_nsec < SPAWN_SERVER_POLL_MAX)
+			delay.tv_nsec *= 2;
+	}
+
 	return (true);
 }
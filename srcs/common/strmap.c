@@ -0,0 +1,149 @@
+#include "common.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FNV1A_OFFSET 0xcbf29ce484222325ULL
+#define FNV1A_PRIME  0x100000001b3ULL
+
+typedef struct strmap_slot_s {
+	const char *key; /* NULL for an empty slot */
+	uint64_t    hash;
+	uint32_t    value;
+} strmap_slot_t;
+
+struct strmap_s {
+	strmap_slot_t *slots;
+	size_t	       nslots; /* power of two */
+	size_t	       count;
+};
+
+uint64_t fnv1a(const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	uint64_t       h = FNV1A_OFFSET;
+
+	for (size_t i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= FNV1A_PRIME;
+	}
+
+	return (h);
+}
+
+uint64_t fnv1a_str(const char *s)
+{
+	uint64_t h = FNV1A_OFFSET;
+
+	while (*s) {
+		h ^= (uint8_t)*s++;
+		h *= FNV1A_PRIME;
+	}
+
+	return (h);
+}
+
+strmap_t *strmap_create(size_t n)
+{
+	strmap_t *map = malloc(sizeof(*map));
+
+	if (!map) {
+		__logger(error, "malloc: out of memory");
+		return (NULL);
+	}
+
+	map->count  = 0;
+	map->nslots = 16;
+	while (map->nslots < n * 2)
+		map->nslots <<= 1;
+
+	map->slots = calloc(map->nslots, sizeof(*map->slots));
+	if (!map->slots) {
+		__logger(error, "calloc: out of memory");
+		free(map);
+		return (NULL);
+	}
+
+	return (map);
+}
+
+void strmap_kill(strmap_t *map)
+{
+	if (!map)
+		return;
+
+	free(map->slots);
+	free(map);
+}
+
+static bool strmap_grow(strmap_t *map)
+{
+	size_t	       nslots = map->nslots * 2;
+	strmap_slot_t *slots  = calloc(nslots, sizeof(*slots));
+
+	if (!slots) {
+		__logger(error, "calloc: out of memory");
+		return (false);
+	}
+
+	for (size_t i = 0; i < map->nslots; i++) {
+		size_t j;
+
+		if (!map->slots[i].key)
+			continue;
+
+		j = map->slots[i].hash & (nslots - 1);
+		while (slots[j].key)
+			j = (j + 1) & (nslots - 1);
+		slots[j] = map->slots[i];
+	}
+
+	free(map->slots);
+	map->slots  = slots;
+	map->nslots = nslots;
+	return (true);
+}
+
+/* Slot holding 'key', or the empty one it would go in. */
+static strmap_slot_t *strmap_slot(const strmap_t *map, const char *key,
+				  uint64_t hash)
+{
+	size_t i = hash & (map->nslots - 1);
+
+	while (map->slots[i].key &&
+	       (map->slots[i].hash != hash || strcmp(map->slots[i].key, key)))
+		i = (i + 1) & (map->nslots - 1);
+
+	return (&map->slots[i]);
+}
+
+bool strmap_add(strmap_t *map, const char *key, uint32_t value)
+{
+	uint64_t       hash = fnv1a_str(key);
+	strmap_slot_t *slot;
+
+	if ((map->count + 1) * 2 > map->nslots && !strmap_grow(map))
+		return (false);
+
+	slot = strmap_slot(map, key, hash);
+	if (!slot->key) {
+		slot->key   = key;
+		slot->hash  = hash;
+		slot->value = value;
+		map->count++;
+	}
+
+	return (true);
+}
+
+bool strmap_get(const strmap_t *map, const char *key, uint32_t *value)
+{
+	const strmap_slot_t *slot = strmap_slot(map, key, fnv1a_str(key));
+
+	if (!slot->key)
+		return (false);
+
+	*value = slot->value;
+	return (true);
+}
@@ -0,0 +1,119 @@
+#include "common.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STRPOOL_MIN_SLOTS 1024
+
+typedef struct strpool_slot_s {
+	uint64_t    hash;
+	const char *str; /* NULL for an empty slot */
+	size_t	    len;
+} strpool_slot_t;
+
+struct strpool_s {
+	arena_t	       *arena;
+	strpool_slot_t *slots;
+	size_t		nslots; /* power of two */
+	size_t		count;
+};
+
+strpool_t *strpool_create(void)
+{
+	strpool_t *pool = malloc(sizeof(*pool));
+
+	if (!pool) {
+		__logger(error, "malloc: out of memory");
+		return (NULL);
+	}
+
+	pool->count  = 0;
+	pool->nslots = STRPOOL_MIN_SLOTS;
+	pool->slots  = calloc(pool->nslots, sizeof(*pool->slots));
+	pool->arena  = arena_create(0);
+	if (!pool->slots || !pool->arena) {
+		__logger(error, "malloc: out of memory");
+		strpool_kill(pool);
+		return (NULL);
+	}
+
+	return (pool);
+}
+
+static bool strpool_grow(strpool_t *pool)
+{
+	size_t		nslots = pool->nslots * 2;
+	strpool_slot_t *slots  = calloc(nslots, sizeof(*slots));
+
+	if (!slots) {
+		__logger(error, "calloc: out of memory");
+		return (false);
+	}
+
+	for (size_t i = 0; i < pool->nslots; i++) {
+		const strpool_slot_t *old = &pool->slots[i];
+		size_t		      j;
+
+		if (!old->str)
+			continue;
+
+		j = old->hash & (nslots - 1);
+		while (slots[j].str)
+			j = (j + 1) & (nslots - 1);
+		slots[j] = *old;
+	}
+
+	free(pool->slots);
+	pool->slots  = slots;
+	pool->nslots = nslots;
+	return (true);
+}
+
+const char *strpool_intern(strpool_t *pool, const void *s, size_t len)
+{
+	uint64_t	hash = fnv1a(s, len);
+	strpool_slot_t *slot;
+	char	       *copy;
+	size_t		i;
+
+	if (pool->count * 4 >= pool->nslots * 3 && !strpool_grow(pool))
+		return (NULL);
+
+	i = hash & (pool->nslots - 1);
+	for (;;) {
+		slot = &pool->slots[i];
+		if (!slot->str)
+			break;
+		if (slot->hash == hash && slot->len == len &&
+		    !memcmp(slot->str, s, len))
+			return (slot->str);
+		i = (i + 1) & (pool->nslots - 1);
+	}
+
+	copy = arena_alloc(pool->arena, len + 1);
+	if (!copy)
+		return (NULL);
+
+	(void)memcpy(copy, s, len);
+	copy[len] = '\0';
+
+	slot->hash = hash;
+	slot->str  = copy;
+	slot->len  = len;
+	pool->count++;
+	return (copy);
+}
+
+size_t strpool_count(const strpool_t *pool)
+{
+	return (pool->count);
+}
+
+void strpool_kill(strpool_t *pool)
+{
+	if (pool->arena)
+		arena_kill(pool->arena);
+	free(pool->slots);
+	free(pool);
+}
@@ -0,0 +1,717 @@
+#include "common.h"
+#include "ios-macos-utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <mach-o/loader.h>
+#include <mach-o/nlist.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define EXTRACT_ALIGN	  0x4000
+#define EXTRACT_WRITE_BUF (8 << 20)
+
+#define SLIDE_V2_PAGE_ATTR_EXTRA     0x8000
+#define SLIDE_V2_PAGE_ATTR_NO_REBASE 0x4000
+#define SLIDE_V2_PAGE_ATTR_END	     0x8000
+#define SLIDE_V3_PAGE_NO_REBASE	     0xffff
+
+typedef struct slide_info_v2_s {
+	uint32_t version;
+	uint32_t page_size;
+	uint32_t page_starts_offset;
+	uint32_t page_starts_count;
+	uint32_t page_extras_offset;
+	uint32_t page_extras_count;
+	uint64_t delta_mask;
+	uint64_t value_add;
+} slide_info_v2_t;
+
+/* Versions 3 and 5 share this layout, 'value_add' only applies to the
+ * authenticated pointers of version 3.
+ */
+typedef struct slide_info_v3_s {
+	uint32_t version;
+	uint32_t page_size;
+	uint32_t page_starts_count;
+	uint32_t pad;
+	uint64_t value_add;
+	uint16_t page_starts[];
+} slide_info_v3_t;
+
+/* A segment being rebased, the locations outside of it are skipped.
+ */
+typedef struct extract_rebase_s {
+	const dyld_cache_t *cache;
+	uint64_t	    vmaddr;
+	uint64_t	    size;
+	uint8_t		   *buf;
+} extract_rebase_t;
+
+typedef struct extract_strx_s {
+	uint32_t key; /* original n_strx + 1, 0 for an empty slot */
+	uint32_t offset;
+} extract_strx_t;
+
+typedef struct extract_bulk_s {
+	const dyld_cache_t	  *cache;
+	const dyld_cache_image_t *const *images;
+	const char		  *dir;
+	atomic_size_t		   failed;
+} extract_bulk_t;
+
+static const uint8_t *extract_slide_info(const dyld_cache_t	    *cache,
+					 const dyld_cache_mapping_t *m,
+					 uint32_t		    *version)
+{
+	const uint8_t *info = cache->files[m->file].map + m->slide_info_offset;
+
+	if (!m->slide_info_offset || m->slide_info_size < sizeof(uint32_t) * 3)
+		return (NULL);
+
+	(void)memcpy(version, info, sizeof(*version));
+	return (info);
+}
+
+static void extract_store(const extract_rebase_t *rb, uint64_t vmaddr,
+			  uint64_t value)
+{
+	if (vmaddr >= rb->vmaddr && rb->size >= 8 &&
+	    vmaddr - rb->vmaddr <= rb->size - 8)
+		(void)memcpy(rb->buf + (vmaddr - rb->vmaddr), &value,
+			     sizeof(value));
+}
+
+static bool extract_raw(const extract_rebase_t *rb, uint64_t vmaddr,
+			uint64_t *raw)
+{
+	const uint8_t *p = dyld_cache_at_address(rb->cache, vmaddr, 8);
+
+	if (!p)
+		return (false);
+	(void)memcpy(raw, p, sizeof(*raw));
+	return (true);
+}
+
+static void extract_chain_v2(const extract_rebase_t *rb,
+			     const slide_info_v2_t *si, uint64_t page,
+			     uint32_t offset)
+{
+	unsigned shift = __builtin_ctzll(si->delta_mask) - 2;
+	uint64_t delta = 1;
+
+	while (delta && offset <= si->page_size - 8) {
+		uint64_t raw;
+		uint64_t value;
+
+		if (!extract_raw(rb, page + offset, &raw))
+			return;
+
+		delta = (raw & si->delta_mask) >> shift;
+		value = raw & ~si->delta_mask;
+		if (value)
+			value += si->value_add;
+		extract_store(rb, page + offset, value);
+		offset += delta;
+	}
+}
+
+static bool extract_rebase_v2(const extract_rebase_t	 *rb,
+			      const dyld_cache_mapping_t *m,
+			      const uint8_t *info, uint32_t first,
+			      uint32_t last)
+{
+	const slide_info_v2_t *si = (const void *)info;
+	const uint16_t	      *starts;
+	const uint16_t	      *extras;
+
+	if (m->slide_info_size < sizeof(*si) || !si->delta_mask ||
+	    (si->delta_mask & 3) ||
+	    si->page_starts_offset > m->slide_info_size ||
+	    si->page_starts_count > (m->slide_info_size -
+				     si->page_starts_offset) / 2 ||
+	    si->page_extras_offset > m->slide_info_size ||
+	    si->page_extras_count > (m->slide_info_size -
+				     si->page_extras_offset) / 2 ||
+	    last >= si->page_starts_count) {
+		__logger(error, "dyld_cache: malformed slide info");
+		return (false);
+	}
+	starts = (const uint16_t *)(info + si->page_starts_offset);
+	extras = (const uint16_t *)(info + si->page_extras_offset);
+
+	for (uint32_t p = first; p <= last; p++) {
+		uint64_t page  = m->address + (uint64_t)p * si->page_size;
+		uint16_t start = starts[p];
+
+		if (start == SLIDE_V2_PAGE_ATTR_NO_REBASE)
+			continue;
+
+		if (!(start & SLIDE_V2_PAGE_ATTR_EXTRA)) {
+			extract_chain_v2(rb, si, page, start * 4u);
+			continue;
+		}
+
+		for (uint32_t j = start & 0x3fff; j < si->page_extras_count;
+		     j++) {
+			extract_chain_v2(rb, si, page,
+					 (extras[j] & 0x3fff) * 4u);
+			if (extras[j] & SLIDE_V2_PAGE_ATTR_END)
+				break;
+		}
+	}
+
+	return (true);
+}
+
+/* Pointers of versions 3 and 5 chain in steps of 8 bytes, with 11 bits of
+ * delta. Authenticated pointers are stored stripped.
+ */
+static uint64_t extract_value_v3(const slide_info_v3_t *si, uint64_t raw)
+{
+	uint64_t value = raw & 0x7ffffffffffffULL;
+
+	if (raw >> 63)
+		return ((raw & 0xffffffff) + si->value_add);
+	return (((value & 0x0007f80000000000ULL) << 13) |
+		(value & 0x000007ffffffffffULL));
+}
+
+static uint64_t extract_value_v5(const slide_info_v3_t *si, uint64_t raw)
+{
+	uint64_t offset = raw & 0x3ffffffffULL;
+
+	if (raw >> 63)
+		return (offset + si->value_add);
+	return ((((raw >> 34) & 0xff) << 56) | (offset + si->value_add));
+}
+
+static bool extract_rebase_v3(const extract_rebase_t	 *rb,
+			      const dyld_cache_mapping_t *m,
+			      const uint8_t *info, uint32_t first,
+			      uint32_t last)
+{
+	const slide_info_v3_t *si = (const void *)info;
+
+	if (m->slide_info_size < sizeof(*si) ||
+	    si->page_starts_count > (m->slide_info_size - sizeof(*si)) / 2 ||
+	    last >= si->page_starts_count) {
+		__logger(error, "dyld_cache: malformed slide info");
+		return (false);
+	}
+
+	for (uint32_t p = first; p <= last; p++) {
+		uint64_t page	= m->address + (uint64_t)p * si->page_size;
+		uint32_t offset = si->page_starts[p];
+		uint64_t delta	= 1;
+
+		if (offset == SLIDE_V3_PAGE_NO_REBASE)
+			continue;
+
+		while (delta && offset <= si->page_size - 8) {
+			uint64_t raw;
+
+			if (!extract_raw(rb, page + offset, &raw))
+				break;
+
+			if (si->version == 3) {
+				delta = (raw >> 51) & 0x7ff;
+				extract_store(rb, page + offset,
+					      extract_value_v3(si, raw));
+			} else {
+				delta = (raw >> 52) & 0x7ff;
+				extract_store(rb, page + offset,
+					      extract_value_v5(si, raw));
+			}
+			offset += delta * 8;
+		}
+	}
+
+	return (true);
+}
+
+bool dyld_cache_unslide(const dyld_cache_t *cache, uint64_t vmaddr,
+			uint8_t *buf, uint64_t size)
+{
+	extract_rebase_t rb = { cache, vmaddr, size, buf };
+	uint64_t	 at = vmaddr;
+
+	while (at < vmaddr + size) {
+		const dyld_cache_mapping_t *m;
+		const uint8_t		   *info;
+		uint32_t		    version;
+		uint32_t		    page_size;
+		uint64_t		    end;
+		bool			    ok;
+
+		m = dyld_cache_mapping_for_address(cache, at);
+		if (!m)
+			return (false);
+		end = MIN(vmaddr + size, m->address + m->size);
+
+		info = extract_slide_info(cache, m, &version);
+		if (!info) {
+			at = end;
+			continue;
+		}
+
+		(void)memcpy(&page_size, info + sizeof(uint32_t),
+			     sizeof(page_size));
+		if (page_size < 8) {
+			__logger(error, "dyld_cache: malformed slide info");
+			return (false);
+		}
+
+		switch (version) {
+		case 2:
+			ok = extract_rebase_v2(&rb, m, info,
+					       (at - m->address) / page_size,
+					       (end - 1 - m->address) /
+						       page_size);
+			break;
+		case 3:
+		case 5:
+			ok = extract_rebase_v3(&rb, m, info,
+					       (at - m->address) / page_size,
+					       (end - 1 - m->address) /
+						       page_size);
+			break;
+		default:
+			__logger(error, "dyld_cache: slide info version %u is "
+					"not supported",
+				 version);
+			ok = false;
+			break;
+		}
+
+		if (!ok)
+			return (false);
+		at = end;
+	}
+
+	return (true);
+}
+
+/* Appends 'size' bytes of the cached linkedit at 'fileoff' to the new one
+ * and points 'offset' at them.
+ */
+static bool extract_blob(const macho_t *macho, vec_t *linkedit,
+			 uint64_t linkedit_off, uint32_t *offset,
+			 uint32_t size)
+{
+	static const uint8_t zeros[8] = { 0 };
+	const uint8_t	    *data;
+
+	if (!size) {
+		*offset = 0;
+		return (true);
+	}
+
+	data = macho_at_offset(macho, *offset, size);
+	if (!data) {
+		__logger(error, "dyld_cache: linkedit data out of bounds");
+		return (false);
+	}
+
+	*offset = (uint32_t)(linkedit_off + vec_size(linkedit));
+	return (vec_append(linkedit, data, size) &&
+		vec_append(linkedit, zeros, -size & 7));
+}
+
+/* Copies the image's symbols with a string table of their own names, the
+ * cached one being shared by every image.
+ */
+static bool extract_symtab(const macho_t *macho, struct symtab_command *st,
+			   vec_t *linkedit, uint64_t linkedit_off)
+{
+	const struct nlist_64 *syms;
+	const char	      *strs;
+	struct nlist_64	      *copy;
+	extract_strx_t	      *slots;
+	size_t		       nslots = 16;
+	vec_t		      *pool;
+	bool		       ret = false;
+
+	syms = (const void *)macho_at_offset(macho, st->symoff,
+					     (uint64_t)st->nsyms *
+						     sizeof(*syms));
+	strs = (const char *)macho_at_offset(macho, st->stroff, st->strsize);
+	if ((!syms && st->nsyms) || (!strs && st->strsize)) {
+		__logger(error, "dyld_cache: symbol table out of bounds");
+		return (false);
+	}
+
+	while (nslots < (size_t)st->nsyms * 2)
+		nslots <<= 1;
+
+	copy  = malloc(((size_t)st->nsyms + 1) * sizeof(*copy));
+	slots = calloc(nslots, sizeof(*slots));
+	pool  = vec_create(1, (size_t)st->nsyms * 16 + 1, NULL);
+	if (!copy || !slots || !pool || !vec_append(pool, "", 1)) {
+		__logger(error, "dyld_cache: out of memory");
+		goto out;
+	}
+
+	for (uint32_t i = 0; i < st->nsyms; i++) {
+		uint32_t strx = syms[i].n_un.n_strx;
+		size_t	 j    = (strx * 0x9e3779b1u) & (nslots - 1);
+		size_t	 len;
+
+		copy[i] = syms[i];
+		if (!strx || strx >= st->strsize) {
+			copy[i].n_un.n_strx = 0;
+			continue;
+		}
+
+		while (slots[j].key && slots[j].key != strx + 1)
+			j = (j + 1) & (nslots - 1);
+
+		if (!slots[j].key) {
+			len = strnlen(strs + strx, st->strsize - strx);
+			slots[j].key	= strx + 1;
+			slots[j].offset = (uint32_t)vec_size(pool);
+			if (!vec_append(pool, strs + strx, len) ||
+			    !vec_append(pool, "", 1)) {
+				__logger(error, "dyld_cache: out of memory");
+				goto out;
+			}
+		}
+		copy[i].n_un.n_strx = slots[j].offset;
+	}
+
+	st->symoff = (uint32_t)(linkedit_off + vec_size(linkedit));
+	if (!vec_append(linkedit, copy, (size_t)st->nsyms * sizeof(*copy)))
+		goto out;
+
+	st->stroff  = (uint32_t)(linkedit_off + vec_size(linkedit));
+	st->strsize = (uint32_t)((vec_size(pool) + 7) & ~(size_t)7);
+	ret	    = vec_append(linkedit, vec_data(pool), vec_size(pool)) &&
+	      vec_append(linkedit, "\0\0\0\0\0\0\0", st->strsize -
+							    vec_size(pool));
+
+out:
+	free(copy);
+	free(slots);
+	if (pool)
+		vec_kill(pool);
+	return (ret);
+}
+
+/* Rebuilds __LINKEDIT with the data of this image only and points the
+ * load commands in 'cmds' at it.
+ */
+static bool extract_linkedit(const macho_t *macho, uint8_t *cmds,
+			     uint64_t linkedit_off, vec_t *linkedit)
+{
+	struct symtab_command *symtab = NULL;
+	uint8_t		      *p      = cmds + sizeof(struct mach_header_64);
+
+	for (uint32_t i = 0; i < macho->header->ncmds; i++) {
+		struct load_command *lc = (struct load_command *)p;
+		bool		     ok = true;
+
+		p += lc->cmdsize;
+		switch (lc->cmd) {
+		case LC_SYMTAB:
+			symtab = (struct symtab_command *)lc;
+			break;
+		case LC_DYSYMTAB: {
+			struct dysymtab_command *ds = (void *)lc;
+
+			ok = extract_blob(macho, linkedit, linkedit_off,
+					  &ds->indirectsymoff,
+					  ds->nindirectsyms * 4);
+			ds->tocoff	 = ds->ntoc	   = 0;
+			ds->modtaboff	 = ds->nmodtab	   = 0;
+			ds->extrefsymoff = ds->nextrefsyms = 0;
+			ds->extreloff	 = ds->nextrel	   = 0;
+			ds->locreloff	 = ds->nlocrel	   = 0;
+			break;
+		}
+		case LC_DYLD_INFO:
+		case LC_DYLD_INFO_ONLY: {
+			struct dyld_info_command *di = (void *)lc;
+
+			ok = extract_blob(macho, linkedit, linkedit_off,
+					  &di->rebase_off, di->rebase_size) &&
+			     extract_blob(macho, linkedit, linkedit_off,
+					  &di->bind_off, di->bind_size) &&
+			     extract_blob(macho, linkedit, linkedit_off,
+					  &di->weak_bind_off,
+					  di->weak_bind_size) &&
+			     extract_blob(macho, linkedit, linkedit_off,
+					  &di->lazy_bind_off,
+					  di->lazy_bind_size) &&
+			     extract_blob(macho, linkedit, linkedit_off,
+					  &di->export_off, di->export_size);
+			break;
+		}
+		case LC_CODE_SIGNATURE:
+		case LC_SEGMENT_SPLIT_INFO:
+		case LC_FUNCTION_STARTS:
+		case LC_DATA_IN_CODE:
+		case LC_DYLIB_CODE_SIGN_DRS:
+		case LC_LINKER_OPTIMIZATION_HINT:
+		case LC_DYLD_EXPORTS_TRIE:
+		case LC_DYLD_CHAINED_FIXUPS: {
+			struct linkedit_data_command *ld = (void *)lc;
+
+			ok = extract_blob(macho, linkedit, linkedit_off,
+					  &ld->dataoff, ld->datasize);
+			break;
+		}
+		default:
+			break;
+		}
+
+		if (!ok)
+			return (false);
+	}
+
+	/* Last, the string table is the only part that is not aligned. */
+	return (!symtab ||
+		extract_symtab(macho, symtab, linkedit, linkedit_off));
+}
+
+/* Gives the segments contiguous file offsets, in load command order with
+ * __LINKEDIT last, and moves their sections along.
+ */
+static uint64_t extract_layout(uint8_t *cmds, uint32_t ncmds,
+			       struct segment_command_64 **linkedit)
+{
+	uint8_t *p   = cmds + sizeof(struct mach_header_64);
+	uint64_t off = 0;
+
+	*linkedit = NULL;
+	for (uint32_t i = 0; i < ncmds; i++) {
+		struct segment_command_64 *seg = (void *)p;
+		struct section_64	  *sect;
+
+		p += seg->cmdsize;
+		if (seg->cmd != LC_SEGMENT_64)
+			continue;
+
+		if (!strncmp(seg->segname, SEG_LINKEDIT, 16)) {
+			*linkedit = seg;
+			continue;
+		}
+
+		off	     = (off + EXTRACT_ALIGN - 1) & ~(EXTRACT_ALIGN - 1);
+		seg->fileoff = seg->filesize ? off : 0;
+		sect	     = (struct section_64 *)(seg + 1);
+		for (uint32_t j = 0; j < seg->nsects; j++) {
+			if (sect[j].offset)
+				sect[j].offset = (uint32_t)(off + sect[j].addr -
+							    seg->vmaddr);
+		}
+		off += seg->filesize;
+	}
+
+	return ((off + EXTRACT_ALIGN - 1) & ~(EXTRACT_ALIGN - 1));
+}
+
+static void extract_pad(bufwriter_t *w, uint64_t *pos, uint64_t to)
+{
+	static const uint8_t zeros[EXTRACT_ALIGN] = { 0 };
+
+	while (*pos < to) {
+		size_t n = MIN(sizeof(zeros), to - *pos);
+
+		bufwriter_write(w, zeros, n);
+		*pos += n;
+	}
+}
+
+/* Writes the segments in file order from one buffer, the rebased copy of
+ * a segment being the only one made.
+ */
+static bool extract_write(const dyld_cache_t *cache, const macho_t *macho,
+			  const uint8_t *cmds, const vec_t *linkedit,
+			  const struct segment_command_64 *linkedit_seg,
+			  const char *path)
+{
+	const uint8_t *p   = cmds + sizeof(struct mach_header_64);
+	size_t	       len = sizeof(struct mach_header_64) +
+		       macho->header->sizeofcmds;
+	uint64_t       pos = 0;
+	bufwriter_t    w;
+	bool	       ok = true;
+	int	       fd;
+
+	if (!file_open_write(path, &fd))
+		return (false);
+
+	if (!bufwriter_init(&w, fd, EXTRACT_WRITE_BUF, NULL)) {
+		(void)close(fd);
+		(void)unlink(path);
+		return (false);
+	}
+
+	for (uint32_t i = 0; ok && i < macho->header->ncmds; i++) {
+		const struct segment_command_64 *seg = (const void *)p;
+		const uint8_t			*data;
+		uint8_t				*copy;
+
+		p += seg->cmdsize;
+		if (seg->cmd != LC_SEGMENT_64 || !seg->filesize ||
+		    seg == linkedit_seg)
+			continue;
+
+		data = macho_at_vmaddr(macho, seg->vmaddr, seg->filesize);
+		copy = data ? malloc(seg->filesize) : NULL;
+		if (!copy) {
+			__logger(error, "dyld_cache: %.16s: cannot be copied",
+				 seg->segname);
+			ok = false;
+			break;
+		}
+
+		(void)memcpy(copy, data, seg->filesize);
+		if (seg->vmaddr == macho->vmbase)
+			(void)memcpy(copy, cmds, MIN(len, seg->filesize));
+
+		ok = dyld_cache_unslide(cache, seg->vmaddr, copy,
+					seg->filesize);
+		if (ok) {
+			extract_pad(&w, &pos, seg->fileoff);
+			bufwriter_write(&w, copy, seg->filesize);
+			pos += seg->filesize;
+		}
+		free(copy);
+	}
+
+	if (ok && linkedit_seg) {
+		extract_pad(&w, &pos, linkedit_seg->fileoff);
+		bufwriter_write(&w, vec_unsafe_access(linkedit, 0),
+				vec_size(linkedit));
+	}
+
+	ok = bufwriter_flush(&w) && ok;
+	bufwriter_destroy(&w);
+	if (close(fd) || !ok) {
+		(void)unlink(path);
+		return (false);
+	}
+
+	return (true);
+}
+
+bool dyld_cache_extract(const dyld_cache_t *cache,
+			const dyld_cache_image_t *image, const char *path)
+{
+	struct segment_command_64 *linkedit_seg;
+	struct mach_header_64	  *header;
+	macho_t			   macho;
+	uint8_t			  *cmds;
+	vec_t			  *linkedit = NULL;
+	uint64_t		   linkedit_off;
+	bool			   ret = false;
+
+	if (!dyld_cache_image_macho(cache, image, &macho))
+		return (false);
+
+	cmds = malloc(sizeof(*header) + macho.header->sizeofcmds);
+	if (!cmds) {
+		__logger(error, "malloc: out of memory");
+		macho_close(&macho);
+		return (false);
+	}
+	(void)memcpy(cmds, macho.header,
+		     sizeof(*header) + macho.header->sizeofcmds);
+
+	/* The image no longer is part of a cache. */
+	header = (struct mach_header_64 *)cmds;
+	header->flags &= ~MH_DYLIB_IN_CACHE;
+
+	linkedit_off = extract_layout(cmds, header->ncmds, &linkedit_seg);
+	linkedit     = vec_create(1, 1 << 16, NULL);
+	if (!linkedit) {
+		__logger(error, "vec_create: out of memory");
+		goto out;
+	}
+
+	if (linkedit_seg) {
+		if (!extract_linkedit(&macho, cmds, linkedit_off, linkedit)) {
+			__logger(error, "dyld_cache: %s: cannot rebuild "
+					"__LINKEDIT",
+				 image->path);
+			goto out;
+		}
+		linkedit_seg->fileoff  = linkedit_off;
+		linkedit_seg->filesize = vec_size(linkedit);
+		linkedit_seg->vmsize   = (vec_size(linkedit) + EXTRACT_ALIGN -
+					  1) & ~(uint64_t)(EXTRACT_ALIGN - 1);
+	}
+
+	ret = extract_write(cache, &macho, cmds, linkedit, linkedit_seg, path);
+
+out:
+	if (linkedit)
+		vec_kill(linkedit);
+	free(cmds);
+	macho_close(&macho);
+	return (ret);
+}
+
+/* Creates the parents of 'path', which is left as it was.
+ */
+static bool extract_mkdirs(char *path)
+{
+	for (char *p = strchr(path + 1, '/'); p; p = strchr(p + 1, '/')) {
+		if (p[-1] == '/')
+			continue;
+
+		*p = '\0';
+		if (mkdir(path, 0755) && errno != EEXIST) {
+			__logger(error, "mkdir: %s: %s", path, strerror(errno));
+			*p = '/';
+			return (false);
+		}
+		*p = '/';
+	}
+
+	return (true);
+}
+
+static void extract_bulk_image(void *arg, size_t worker, size_t job)
+{
+	extract_bulk_t		 *bulk = arg;
+	const dyld_cache_image_t *image;
+	char			 *path;
+
+	(void)worker;
+
+	if (bulk->images) {
+		image = bulk->images[job];
+	} else {
+		/* Aliases share the address, and the output, of an image. */
+		image = &bulk->cache->images[job];
+		if (dyld_cache_image_for_address(bulk->cache, image->address) !=
+		    image)
+			return;
+	}
+
+	path = path_attach(bulk->dir, image->path);
+	if (!path || !extract_mkdirs(path) ||
+	    !dyld_cache_extract(bulk->cache, image, path))
+		atomic_fetch_add(&bulk->failed, 1);
+	free(path);
+}
+
+size_t dyld_cache_extract_images(const dyld_cache_t		 *cache,
+				 const dyld_cache_image_t *const *images,
+				 size_t count, const char *dir)
+{
+	extract_bulk_t bulk = { cache, images, dir, 0 };
+
+	if (!images)
+		count = cache->nimages;
+
+	if (!parallel_for(count, 0, extract_bulk_image, &bulk))
+		return (count);
+	return (atomic_load(&bulk.failed));
+}
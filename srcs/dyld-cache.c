@@ -0,0 +1,656 @@
+#include "common.h"
+#include "ios-macos-utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <mach-o/loader.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <unistd.h>
+
+/* The layout of dyld_cache_format.h, which is not part of the SDK, up to
+ * the last field read here. Fields are only valid when the header is long
+ * enough to hold them, see DYLD_CACHE_HAS().
+ */
+typedef struct dyld_cache_header_s {
+	char	 magic[16];
+	uint32_t mapping_offset;
+	uint32_t mapping_count;
+	uint32_t images_offset_old;
+	uint32_t images_count_old;
+	uint64_t dyld_base_address;
+	uint64_t code_signature_offset;
+	uint64_t code_signature_size;
+	uint64_t slide_info_offset_unused;
+	uint64_t slide_info_size_unused;
+	uint64_t local_symbols_offset;
+	uint64_t local_symbols_size;
+	uint8_t	 uuid[16];
+	uint64_t cache_type;
+	uint32_t branch_pools_offset;
+	uint32_t branch_pools_count;
+	uint64_t dyld_in_cache_mh;
+	uint64_t dyld_in_cache_entry;
+	uint64_t images_text_offset;
+	uint64_t images_text_count;
+	uint64_t patch_info_addr;
+	uint64_t patch_info_size;
+	uint64_t unused0[6];
+	uint32_t platform;
+	uint32_t format_flags;
+	uint64_t shared_region_start;
+	uint64_t shared_region_size;
+	uint64_t max_slide;
+	uint64_t unused1[8];
+	uint32_t mapping_with_slide_offset;
+	uint32_t mapping_with_slide_count;
+	uint64_t unused2[5];
+	uint32_t program_trie_size;
+	uint32_t os_version;
+	uint32_t alt_platform;
+	uint32_t alt_os_version;
+	uint64_t swift_opts_offset;
+	uint64_t swift_opts_size;
+	uint32_t subcache_array_offset;
+	uint32_t subcache_array_count;
+	uint8_t	 symbol_file_uuid[16];
+	uint64_t rosetta[4];
+	uint32_t images_offset;
+	uint32_t images_count;
+	uint32_t cache_sub_type;
+} dyld_cache_header_t;
+
+typedef struct dyld_cache_mapping_info_s {
+	uint64_t address;
+	uint64_t size;
+	uint64_t file_offset;
+	uint32_t max_prot;
+	uint32_t init_prot;
+} dyld_cache_mapping_info_t;
+
+typedef struct dyld_cache_mapping_slide_s {
+	uint64_t address;
+	uint64_t size;
+	uint64_t file_offset;
+	uint64_t slide_info_file_offset;
+	uint64_t slide_info_file_size;
+	uint64_t flags;
+	uint32_t max_prot;
+	uint32_t init_prot;
+} dyld_cache_mapping_slide_t;
+
+typedef struct dyld_cache_image_info_s {
+	uint64_t address;
+	uint64_t mod_time;
+	uint64_t inode;
+	uint32_t path_file_offset;
+	uint32_t pad;
+} dyld_cache_image_info_t;
+
+typedef struct dyld_subcache_entry_s {
+	uint8_t	 uuid[16];
+	uint64_t cache_vm_offset;
+	char	 file_suffix[32]; /* not in the first version of the entry */
+} dyld_subcache_entry_t;
+
+#define DYLD_CACHE_SUBCACHE_V1_SIZE \
+	offsetof(dyld_subcache_entry_t, file_suffix)
+
+#define DYLD_CACHE_HAS(header, field) \
+	((header)->mapping_offset >= \
+	 offsetof(dyld_cache_header_t, field) + sizeof((header)->field))
+
+static int dyld_cache_mapping_cmp(const void *a, const void *b)
+{
+	const dyld_cache_mapping_t *x = a;
+	const dyld_cache_mapping_t *y = b;
+
+	return ((x->address > y->address) - (x->address < y->address));
+}
+
+static int dyld_cache_range_cmp(const void *a, const void *b)
+{
+	const dyld_cache_range_t *x = a;
+	const dyld_cache_range_t *y = b;
+
+	if (x->start != y->start)
+		return ((x->start > y->start) - (x->start < y->start));
+	return ((x->image > y->image) - (x->image < y->image));
+}
+
+/* Validated header of the (sub)cache file at 'index'.
+ */
+static const dyld_cache_header_t *dyld_cache_header(const dyld_cache_t *cache,
+						    uint32_t index)
+{
+	const dyld_cache_header_t *header;
+
+	header = (const dyld_cache_header_t *)cache->files[index].map;
+	if (cache->files[index].size < offsetof(dyld_cache_header_t, uuid) ||
+	    strncmp(header->magic, "dyld_v1", 7) ||
+	    header->mapping_offset > cache->files[index].size ||
+	    header->mapping_offset < offsetof(dyld_cache_header_t, uuid)) {
+		__logger(error, "dyld_cache: %s: not a shared cache",
+			 cache->files[index].path);
+		return (NULL);
+	}
+
+	return (header);
+}
+
+static bool dyld_cache_map_file(dyld_cache_t *cache, const char *path)
+{
+	dyld_cache_file_t *file;
+	int		   fd;
+
+	if (cache->nfiles == DYLD_CACHE_MAX_FILES) {
+		__logger(error, "dyld_cache: more than %d files",
+			 DYLD_CACHE_MAX_FILES);
+		return (false);
+	}
+
+	file = &cache->files[cache->nfiles];
+	if (!file_open_read(path, &fd))
+		return (false);
+
+	if (!file_get_size(path, &file->size) ||
+	    file->size < sizeof(dyld_cache_header_t)) {
+		__logger(error, "dyld_cache: %s: file too small", path);
+		(void)close(fd);
+		return (false);
+	}
+
+	file->map = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	file->fd  = fd;
+	if (file->map == MAP_FAILED) {
+		__logger(error, "mmap: %s", strerror(errno));
+		file->map = NULL;
+		(void)close(fd);
+		return (false);
+	}
+
+	file->path = strdup(path);
+	cache->nfiles++;
+	if (!file->path) {
+		__logger(error, "strdup: out of memory");
+		return (false);
+	}
+
+	return (true);
+}
+
+/* Appends the mappings of the file at 'index', with their slide info when
+ * the header describes it.
+ */
+static bool dyld_cache_add_mappings(dyld_cache_t *cache, uint32_t index)
+{
+	const dyld_cache_file_t		 *file	= &cache->files[index];
+	const dyld_cache_header_t	 *header;
+	const dyld_cache_mapping_info_t	 *info;
+	const dyld_cache_mapping_slide_t *slide = NULL;
+	dyld_cache_mapping_t		 *mappings;
+	uint32_t			  count;
+
+	header = dyld_cache_header(cache, index);
+	if (!header)
+		return (false);
+
+	count = header->mapping_count;
+	if (count > (file->size - header->mapping_offset) / sizeof(*info)) {
+		__logger(error, "dyld_cache: %s: mappings out of bounds",
+			 file->path);
+		return (false);
+	}
+	info = (const void *)(file->map + header->mapping_offset);
+
+	if (DYLD_CACHE_HAS(header, mapping_with_slide_count) &&
+	    header->mapping_with_slide_count == count &&
+	    header->mapping_with_slide_offset <= file->size &&
+	    count <= (file->size - header->mapping_with_slide_offset) /
+			     sizeof(*slide))
+		slide = (const void *)(file->map +
+				       header->mapping_with_slide_offset);
+
+	mappings = realloc(cache->mappings,
+			   (cache->nmappings + count) * sizeof(*mappings));
+	if (!mappings) {
+		__logger(error, "realloc: out of memory");
+		return (false);
+	}
+	cache->mappings = mappings;
+
+	for (uint32_t i = 0; i < count; i++) {
+		dyld_cache_mapping_t *m = &mappings[cache->nmappings];
+
+		if (info[i].file_offset > file->size ||
+		    info[i].size > file->size - info[i].file_offset ||
+		    info[i].address + info[i].size < info[i].address) {
+			__logger(error, "dyld_cache: %s: mapping %u out of "
+					"bounds",
+				 file->path, i);
+			return (false);
+		}
+
+		(void)memset(m, 0, sizeof(*m));
+		m->address     = info[i].address;
+		m->size	       = info[i].size;
+		m->file_offset = info[i].file_offset;
+		m->file	       = index;
+		m->prot	       = info[i].init_prot;
+		if (slide && slide[i].slide_info_file_offset &&
+		    slide[i].slide_info_file_offset <= file->size &&
+		    slide[i].slide_info_file_size <=
+			    file->size - slide[i].slide_info_file_offset) {
+			m->slide_info_offset = slide[i].slide_info_file_offset;
+			m->slide_info_size   = slide[i].slide_info_file_size;
+		}
+		cache->nmappings++;
+	}
+
+	return (true);
+}
+
+/* Opens the subcaches listed by the main header, '<path>.01' and so on for
+ * the first version of the entries, '<path><suffix>' after that.
+ */
+static bool dyld_cache_open_subcaches(dyld_cache_t *cache, const char *path)
+{
+	const dyld_cache_header_t *header = dyld_cache_header(cache, 0);
+	const uint8_t		  *entries;
+	size_t			   entry_size;
+	char			   sub[PATH_MAX];
+
+	if (!DYLD_CACHE_HAS(header, subcache_array_count))
+		return (true);
+
+	entry_size = DYLD_CACHE_HAS(header, cache_sub_type) ?
+			     sizeof(dyld_subcache_entry_t) :
+			     DYLD_CACHE_SUBCACHE_V1_SIZE;
+	if (header->subcache_array_offset > cache->files[0].size ||
+	    header->subcache_array_count >
+		    (cache->files[0].size - header->subcache_array_offset) /
+			    entry_size) {
+		__logger(error, "dyld_cache: %s: subcaches out of bounds",
+			 path);
+		return (false);
+	}
+	entries = cache->files[0].map + header->subcache_array_offset;
+
+	for (uint32_t i = 0; i < header->subcache_array_count; i++) {
+		const dyld_subcache_entry_t *entry =
+			(const void *)(entries + i * entry_size);
+		const dyld_cache_header_t *subheader;
+		int			   len;
+
+		if (entry_size == DYLD_CACHE_SUBCACHE_V1_SIZE)
+			len = snprintf(sub, sizeof(sub), "%s.%u", path, i + 1);
+		else
+			len = snprintf(sub, sizeof(sub), "%s%.*s", path,
+				       (int)sizeof(entry->file_suffix),
+				       entry->file_suffix);
+		if (len < 0 || (size_t)len >= sizeof(sub)) {
+			__logger(error, "dyld_cache: %s: path too long", path);
+			return (false);
+		}
+
+		if (!dyld_cache_map_file(cache, sub))
+			return (false);
+
+		subheader = dyld_cache_header(cache, cache->nfiles - 1);
+		if (!subheader)
+			return (false);
+		if (memcmp(subheader->uuid, entry->uuid, sizeof(entry->uuid))) {
+			__logger(error, "dyld_cache: %s does not belong to %s",
+				 sub, path);
+			return (false);
+		}
+	}
+
+	return (true);
+}
+
+/* Lays every mapping out at its address in one reservation, the way the
+ * shared region is, so that an image's segments are where its load
+ * commands say whichever file they come from.
+ */
+static bool dyld_cache_map_region(dyld_cache_t *cache)
+{
+	uint64_t page = (uint64_t)getpagesize();
+	uint64_t lo   = UINT64_MAX;
+	uint64_t hi   = 0;
+
+	for (size_t i = 0; i < cache->nmappings; i++) {
+		lo = MIN(lo, cache->mappings[i].address);
+		hi = MAX(hi, cache->mappings[i].address +
+				     cache->mappings[i].size);
+	}
+
+	if (lo >= hi) {
+		__logger(error, "dyld_cache: no mappings");
+		return (false);
+	}
+
+	lo	      = lo & ~(page - 1);
+	hi	      = (hi + page - 1) & ~(page - 1);
+	cache->vmbase = lo;
+	cache->size   = hi - lo;
+	cache->base   = mmap(NULL, cache->size, PROT_NONE,
+			     MAP_PRIVATE | MAP_ANON, -1, 0);
+	if (cache->base == MAP_FAILED) {
+		__logger(error, "mmap: %s", strerror(errno));
+		cache->base = NULL;
+		return (false);
+	}
+
+	for (size_t i = 0; i < cache->nmappings; i++) {
+		const dyld_cache_mapping_t *m	  = &cache->mappings[i];
+		uint64_t		    delta = m->file_offset & (page - 1);
+		uint8_t			   *at	  = cache->base +
+					 (m->address - lo) - delta;
+
+		if (!m->size)
+			continue;
+
+		if (((m->address - lo) & (page - 1)) != delta) {
+			__logger(error, "dyld_cache: mapping at %#llx is not "
+					"page aligned",
+				 (unsigned long long)m->address);
+			return (false);
+		}
+
+		if (mmap(at, m->size + delta, PROT_READ,
+			 MAP_PRIVATE | MAP_FIXED, cache->files[m->file].fd,
+			 (off_t)(m->file_offset - delta)) == MAP_FAILED) {
+			__logger(error, "mmap: %s", strerror(errno));
+			return (false);
+		}
+	}
+
+	return (true);
+}
+
+static bool dyld_cache_read_images(dyld_cache_t *cache)
+{
+	const dyld_cache_header_t     *header = dyld_cache_header(cache, 0);
+	const dyld_cache_file_t	      *file   = &cache->files[0];
+	const dyld_cache_image_info_t *info;
+	uint32_t		       offset = header->images_offset_old;
+	uint32_t		       count  = header->images_count_old;
+
+	if (DYLD_CACHE_HAS(header, images_count) && header->images_count) {
+		offset = header->images_offset;
+		count  = header->images_count;
+	}
+
+	if (offset > file->size ||
+	    count > (file->size - offset) / sizeof(*info)) {
+		__logger(error, "dyld_cache: %s: images out of bounds",
+			 file->path);
+		return (false);
+	}
+	info = (const void *)(file->map + offset);
+
+	cache->images = calloc(count + 1, sizeof(*cache->images));
+	if (!cache->images) {
+		__logger(error, "calloc: out of memory");
+		return (false);
+	}
+
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t path = info[i].path_file_offset;
+
+		if (path >= file->size ||
+		    !memchr(file->map + path, '\0', file->size - path)) {
+			__logger(error, "dyld_cache: image %u: bad path", i);
+			return (false);
+		}
+
+		cache->images[i].path	 = (const char *)file->map + path;
+		cache->images[i].address = info[i].address;
+	}
+	cache->nimages = count;
+
+	return (true);
+}
+
+static bool dyld_cache_index_paths(dyld_cache_t *cache)
+{
+	cache->by_path = strmap_create(cache->nimages);
+	if (!cache->by_path)
+		return (false);
+
+	for (size_t i = 0; i < cache->nimages; i++) {
+		if (!strmap_add(cache->by_path, cache->images[i].path,
+				(uint32_t)i))
+			return (false);
+	}
+
+	return (true);
+}
+
+/* Address ranges of the segments of every image, sorted. __LINKEDIT is
+ * shared by all images and left out, and aliases of an image, which share
+ * its address, keep the first entry.
+ */
+static bool dyld_cache_index_addresses(dyld_cache_t *cache)
+{
+	size_t cap = 0;
+	size_t n;
+
+	for (size_t i = 0; i < cache->nimages; i++) {
+		macho_t macho;
+
+		if (!dyld_cache_image_macho(cache, &cache->images[i], &macho))
+			return (false);
+
+		if (cache->nranges + macho.nsegments > cap) {
+			dyld_cache_range_t *ranges;
+
+			cap    = MAX(cap * 2, cache->nranges + macho.nsegments);
+			ranges = realloc(cache->ranges, cap * sizeof(*ranges));
+			if (!ranges) {
+				__logger(error, "realloc: out of memory");
+				macho_close(&macho);
+				return (false);
+			}
+			cache->ranges = ranges;
+		}
+
+		for (uint32_t s = 0; s < macho.nsegments; s++) {
+			const struct segment_command_64 *seg =
+				macho.segments[s];
+			dyld_cache_range_t *r = &cache->ranges[cache->nranges];
+
+			if (!seg->vmsize || seg == macho.linkedit)
+				continue;
+
+			r->start = seg->vmaddr;
+			r->end	 = seg->vmaddr + seg->vmsize;
+			r->image = (uint32_t)i;
+			cache->nranges++;
+		}
+		macho_close(&macho);
+	}
+
+	qsort(cache->ranges, cache->nranges, sizeof(*cache->ranges),
+	      dyld_cache_range_cmp);
+
+	n = 0;
+	for (size_t i = 0; i < cache->nranges; i++) {
+		if (n && cache->ranges[n - 1].start == cache->ranges[i].start)
+			continue;
+		cache->ranges[n++] = cache->ranges[i];
+	}
+	cache->nranges = n;
+
+	return (true);
+}
+
+bool dyld_cache_open(dyld_cache_t *cache, const char *path)
+{
+	(void)memset(cache, 0, sizeof(*cache));
+
+	if (!dyld_cache_map_file(cache, path) ||
+	    !dyld_cache_header(cache, 0) ||
+	    !dyld_cache_open_subcaches(cache, path)) {
+		dyld_cache_close(cache);
+		return (false);
+	}
+
+	(void)memcpy(cache->uuid, dyld_cache_header(cache, 0)->uuid,
+		     sizeof(cache->uuid));
+
+	for (uint32_t i = 0; i < cache->nfiles; i++) {
+		if (!dyld_cache_add_mappings(cache, i)) {
+			dyld_cache_close(cache);
+			return (false);
+		}
+	}
+
+	qsort(cache->mappings, cache->nmappings, sizeof(*cache->mappings),
+	      dyld_cache_mapping_cmp);
+
+	for (size_t i = 1; i < cache->nmappings; i++) {
+		const dyld_cache_mapping_t *prev = &cache->mappings[i - 1];
+
+		if (cache->mappings[i].address < prev->address + prev->size) {
+			__logger(error, "dyld_cache: %s: mappings overlap",
+				 path);
+			dyld_cache_close(cache);
+			return (false);
+		}
+	}
+
+	if (!dyld_cache_map_region(cache) || !dyld_cache_read_images(cache) ||
+	    !dyld_cache_index_paths(cache) ||
+	    !dyld_cache_index_addresses(cache)) {
+		dyld_cache_close(cache);
+		return (false);
+	}
+
+	return (true);
+}
+
+void dyld_cache_close(dyld_cache_t *cache)
+{
+	if (cache->base)
+		(void)munmap(cache->base, cache->size);
+
+	for (uint32_t i = 0; i < cache->nfiles; i++) {
+		(void)munmap((void *)cache->files[i].map, cache->files[i].size);
+		(void)close(cache->files[i].fd);
+		free(cache->files[i].path);
+	}
+
+	strmap_kill(cache->by_path);
+	free(cache->mappings);
+	free(cache->images);
+	free(cache->ranges);
+	(void)memset(cache, 0, sizeof(*cache));
+}
+
+const dyld_cache_mapping_t *dyld_cache_mapping_for_address(
+	const dyld_cache_t *cache, uint64_t address)
+{
+	size_t lo = 0;
+	size_t hi = cache->nmappings;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (cache->mappings[mid].address <= address)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (!lo || address - cache->mappings[lo - 1].address >=
+			   cache->mappings[lo - 1].size)
+		return (NULL);
+	return (&cache->mappings[lo - 1]);
+}
+
+const uint8_t *dyld_cache_at_address(const dyld_cache_t *cache,
+				     uint64_t address, uint64_t size)
+{
+	const dyld_cache_mapping_t *m;
+
+	m = dyld_cache_mapping_for_address(cache, address);
+	if (!m || size > m->size - (address - m->address))
+		return (NULL);
+
+	return (cache->base + (address - cache->vmbase));
+}
+
+const dyld_cache_image_t *dyld_cache_image_find(const dyld_cache_t *cache,
+						const char	   *path)
+{
+	uint32_t image;
+
+	if (strmap_get(cache->by_path, path, &image))
+		return (&cache->images[image]);
+	return (NULL);
+}
+
+const dyld_cache_image_t *dyld_cache_image_for_address(
+	const dyld_cache_t *cache, uint64_t address)
+{
+	size_t lo = 0;
+	size_t hi = cache->nranges;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (cache->ranges[mid].start <= address)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (!lo || address >= cache->ranges[lo - 1].end)
+		return (NULL);
+	return (&cache->images[cache->ranges[lo - 1].image]);
+}
+
+bool dyld_cache_image_macho(const dyld_cache_t *cache,
+			    const dyld_cache_image_t *image, macho_t *macho)
+{
+	const struct mach_header_64 *header;
+
+	header = (const void *)dyld_cache_at_address(cache, image->address,
+						     sizeof(*header));
+	if (header &&
+	    !dyld_cache_at_address(cache, image->address,
+				   sizeof(*header) + header->sizeofcmds))
+		header = NULL;
+	if (!header) {
+		__logger(error, "dyld_cache: %s: header is not mapped",
+			 image->path);
+		return (false);
+	}
+
+	if (!macho_init_vm(macho, cache->base, cache->size, cache->vmbase,
+			   image->address))
+		return (false);
+
+	/* The view reads through segments, which must all be mapped. */
+	for (uint32_t i = 0; i < macho->nsegments; i++) {
+		const struct segment_command_64 *seg = macho->segments[i];
+
+		if (seg->filesize &&
+		    (seg->filesize > seg->vmsize ||
+		     !dyld_cache_at_address(cache, seg->vmaddr,
+					    seg->filesize))) {
+			__logger(error, "dyld_cache: %s: %.16s is not mapped",
+				 image->path, seg->segname);
+			macho_close(macho);
+			return (false);
+		}
+	}
+
+	return (true);
+}
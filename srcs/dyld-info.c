@@ -0,0 +1,303 @@
+#include "common.h"
+#include "ios-macos-utils.h"
+#include <mach-o/loader.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define PTR_SIZE sizeof(uint64_t)
+
+typedef struct dyld_info_state_s {
+	const macho_t *macho;
+	vec_t	      *records;
+	const uint8_t *p;
+	const uint8_t *end;
+	uint64_t       offset;
+	int64_t	       addend;
+	const char    *symbol;
+	int32_t	       ordinal;
+	uint8_t	       segment;
+	uint8_t	       type;
+	uint8_t	       kind;
+	uint8_t	       flags;
+} dyld_info_state_t;
+
+/* Emits 'count' records spaced by 'stride' bytes in one reservation, then
+ * leaves the cursor one stride past the last of them.
+ */
+static bool dyld_info_emit(dyld_info_state_t *st, uint64_t count,
+			   uint64_t stride)
+{
+	const struct segment_command_64 *seg;
+	dyld_info_record_t		*rec;
+
+	if (!count)
+		return (true);
+
+	if (st->segment >= st->macho->nsegments) {
+		__logger(error, "dyld_info: bad segment index %u", st->segment);
+		return (false);
+	}
+
+	/* The whole of the last pointer must be within the segment */
+	seg = st->macho->segments[st->segment];
+	if (st->offset > seg->vmsize || PTR_SIZE > seg->vmsize - st->offset ||
+	    stride < PTR_SIZE ||
+	    (count - 1) > (seg->vmsize - st->offset - PTR_SIZE) / stride) {
+		__logger(error, "dyld_info: %.16s+%#llx runs past the segment",
+			 seg->segname, (unsigned long long)st->offset);
+		return (false);
+	}
+
+	if (!vec_adjust(st->records, count)) {
+		__logger(error, "vec_adjust: out of memory");
+		return (false);
+	}
+
+	rec = vec_uninitialized_data(st->records);
+	for (uint64_t i = 0; i < count; i++) {
+		rec[i].offset  = st->offset;
+		rec[i].addend  = st->addend;
+		rec[i].symbol  = st->symbol;
+		rec[i].ordinal = st->ordinal;
+		rec[i].segment = st->segment;
+		rec[i].type    = st->type;
+		rec[i].kind    = st->kind;
+		rec[i].flags   = st->flags;
+		st->offset += stride;
+	}
+
+	return (vec_append_from_capacity(st->records, count));
+}
+
+static bool dyld_info_uleb(dyld_info_state_t *st, uint64_t *value)
+{
+	if (!leb128_read_u(&st->p, st->end, value)) {
+		__logger(error, "dyld_info: truncated uleb128");
+		return (false);
+	}
+
+	return (true);
+}
+
+static bool dyld_info_rebase(dyld_info_state_t *st)
+{
+	uint64_t count;
+	uint64_t skip;
+
+	while (st->p < st->end) {
+		uint8_t opcode = *st->p & REBASE_OPCODE_MASK;
+		uint8_t imm    = *st->p & REBASE_IMMEDIATE_MASK;
+
+		st->p++;
+		switch (opcode) {
+		case REBASE_OPCODE_DONE:
+			return (true);
+		case REBASE_OPCODE_SET_TYPE_IMM:
+			st->type = imm;
+			break;
+		case REBASE_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB:
+			st->segment = imm;
+			if (!dyld_info_uleb(st, &st->offset))
+				return (false);
+			break;
+		case REBASE_OPCODE_ADD_ADDR_ULEB:
+			if (!dyld_info_uleb(st, &skip))
+				return (false);
+			st->offset += skip;
+			break;
+		case REBASE_OPCODE_ADD_ADDR_IMM_SCALED:
+			st->offset += imm * PTR_SIZE;
+			break;
+		case REBASE_OPCODE_DO_REBASE_IMM_TIMES:
+			if (!dyld_info_emit(st, imm, PTR_SIZE))
+				return (false);
+			break;
+		case REBASE_OPCODE_DO_REBASE_ULEB_TIMES:
+			if (!dyld_info_uleb(st, &count) ||
+			    !dyld_info_emit(st, count, PTR_SIZE))
+				return (false);
+			break;
+		case REBASE_OPCODE_DO_REBASE_ADD_ADDR_ULEB:
+			if (!dyld_info_uleb(st, &skip) ||
+			    !dyld_info_emit(st, 1, PTR_SIZE))
+				return (false);
+			st->offset += skip;
+			break;
+		case REBASE_OPCODE_DO_REBASE_ULEB_TIMES_SKIPPING_ULEB:
+			if (!dyld_info_uleb(st, &count) ||
+			    !dyld_info_uleb(st, &skip) ||
+			    !dyld_info_emit(st, count, skip + PTR_SIZE))
+				return (false);
+			break;
+		default:
+			__logger(error, "dyld_info: bad rebase opcode %#x",
+				 opcode);
+			return (false);
+		}
+	}
+
+	return (true);
+}
+
+static bool dyld_info_bind(dyld_info_state_t *st)
+{
+	const char *nul;
+	uint64_t    count;
+	uint64_t    skip;
+
+	while (st->p < st->end) {
+		uint8_t opcode = *st->p & BIND_OPCODE_MASK;
+		uint8_t imm    = *st->p & BIND_IMMEDIATE_MASK;
+
+		st->p++;
+		switch (opcode) {
+		case BIND_OPCODE_DONE:
+			/* Lazy binds are separate entries, each one ending with
+			 * DONE, so keep going until the end of the stream.
+			 */
+			if (st->kind != DYLD_INFO_LAZY_BIND)
+				return (true);
+			break;
+		case BIND_OPCODE_SET_DYLIB_ORDINAL_IMM:
+			st->ordinal = imm;
+			break;
+		case BIND_OPCODE_SET_DYLIB_ORDINAL_ULEB:
+			if (!dyld_info_uleb(st, &count))
+				return (false);
+			st->ordinal = (int32_t)count;
+			break;
+		case BIND_OPCODE_SET_DYLIB_SPECIAL_IMM:
+			st->ordinal = imm ? (int8_t)(BIND_OPCODE_MASK | imm) : 0;
+			break;
+		case BIND_OPCODE_SET_SYMBOL_TRAILING_FLAGS_IMM:
+			nul = memchr(st->p, '\0', st->end - st->p);
+			if (!nul) {
+				__logger(error, "dyld_info: unterminated symbol");
+				return (false);
+			}
+			st->symbol = (const char *)st->p;
+			st->flags  = imm;
+			st->p	   = (const uint8_t *)nul + 1;
+			break;
+		case BIND_OPCODE_SET_TYPE_IMM:
+			st->type = imm;
+			break;
+		case BIND_OPCODE_SET_ADDEND_SLEB:
+			if (!leb128_read_s(&st->p, st->end, &st->addend)) {
+				__logger(error, "dyld_info: truncated sleb128");
+				return (false);
+			}
+			break;
+		case BIND_OPCODE_SET_SEGMENT_AND_OFFSET_ULEB:
+			st->segment = imm;
+			if (!dyld_info_uleb(st, &st->offset))
+				return (false);
+			break;
+		case BIND_OPCODE_ADD_ADDR_ULEB:
+			if (!dyld_info_uleb(st, &skip))
+				return (false);
+			st->offset += skip;
+			break;
+		case BIND_OPCODE_DO_BIND:
+			if (!dyld_info_emit(st, 1, PTR_SIZE))
+				return (false);
+			break;
+		case BIND_OPCODE_DO_BIND_ADD_ADDR_ULEB:
+			if (!dyld_info_uleb(st, &skip) ||
+			    !dyld_info_emit(st, 1, PTR_SIZE))
+				return (false);
+			st->offset += skip;
+			break;
+		case BIND_OPCODE_DO_BIND_ADD_ADDR_IMM_SCALED:
+			if (!dyld_info_emit(st, 1, PTR_SIZE))
+				return (false);
+			st->offset += imm * PTR_SIZE;
+			break;
+		case BIND_OPCODE_DO_BIND_ULEB_TIMES_SKIPPING_ULEB:
+			if (!dyld_info_uleb(st, &count) ||
+			    !dyld_info_uleb(st, &skip) ||
+			    !dyld_info_emit(st, count, skip + PTR_SIZE))
+				return (false);
+			break;
+		default:
+			__logger(error, "dyld_info: unsupported bind opcode %#x",
+				 opcode);
+			return (false);
+		}
+	}
+
+	return (true);
+}
+
+static bool dyld_info_stream(dyld_info_state_t *st, uint8_t kind,
+			     uint32_t off, uint32_t size)
+{
+	const uint8_t *data;
+
+	if (!size)
+		return (true);
+
+	data = macho_at_offset(st->macho, off, size);
+	if (!data) {
+		__logger(error, "dyld_info: opcodes out of bounds");
+		return (false);
+	}
+
+	st->p	    = data;
+	st->end	    = data + size;
+	st->offset  = 0;
+	st->addend  = 0;
+	st->symbol  = NULL;
+	st->ordinal = 0;
+	st->segment = 0;
+	st->kind    = kind;
+	st->flags   = 0;
+	st->type    = (kind == DYLD_INFO_REBASE) ? REBASE_TYPE_POINTER :
+						   BIND_TYPE_POINTER;
+
+	if (kind == DYLD_INFO_REBASE)
+		return (dyld_info_rebase(st));
+	return (dyld_info_bind(st));
+}
+
+bool dyld_info_parse(const macho_t *macho, uint32_t kinds, vec_t **records)
+{
+	const struct dyld_info_command *info;
+	dyld_info_state_t		st = { 0 };
+
+	info = macho_find_command(macho, LC_DYLD_INFO_ONLY, NULL);
+	if (!info)
+		info = macho_find_command(macho, LC_DYLD_INFO, NULL);
+	if (!info) {
+		__logger(error, "dyld_info: no LC_DYLD_INFO");
+		return (false);
+	}
+
+	*records = vec_create(sizeof(dyld_info_record_t), 0, NULL);
+	if (!*records) {
+		__logger(error, "vec_create: out of memory");
+		return (false);
+	}
+
+	st.macho   = macho;
+	st.records = *records;
+
+	if (((kinds & DYLD_INFO_REBASE) &&
+	     !dyld_info_stream(&st, DYLD_INFO_REBASE, info->rebase_off,
+			       info->rebase_size)) ||
+	    ((kinds & DYLD_INFO_BIND) &&
+	     !dyld_info_stream(&st, DYLD_INFO_BIND, info->bind_off,
+			       info->bind_size)) ||
+	    ((kinds & DYLD_INFO_WEAK_BIND) &&
+	     !dyld_info_stream(&st, DYLD_INFO_WEAK_BIND, info->weak_bind_off,
+			       info->weak_bind_size)) ||
+	    ((kinds & DYLD_INFO_LAZY_BIND) &&
+	     !dyld_info_stream(&st, DYLD_INFO_LAZY_BIND, info->lazy_bind_off,
+			       info->lazy_bind_size))) {
+		vec_kill(*records);
+		*records = NULL;
+		return (false);
+	}
+
+	return (true);
+}
@@ -0,0 +1,297 @@
+#include "common.h"
+#include "ios-macos-utils.h"
+#include <mach-o/loader.h>
+#include <mach-o/nlist.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct fileset_job_s {
+	const fileset_t	 *fs;
+	fileset_entry_t **entries; /* NULL for all of them */
+	atomic_bool	  failed;
+} fileset_job_t;
+
+static int fileset_symbol_cmp(const void *a, const void *b)
+{
+	const fileset_symbol_t *x = a;
+	const fileset_symbol_t *y = b;
+
+	return ((x->addr > y->addr) - (x->addr < y->addr));
+}
+
+static int fileset_section_cmp(const void *a, const void *b)
+{
+	const struct section_64 *x = *(const struct section_64 *const *)a;
+	const struct section_64 *y = *(const struct section_64 *const *)b;
+
+	return ((x->addr > y->addr) - (x->addr < y->addr));
+}
+
+static bool fileset_index_ids(fileset_t *fs)
+{
+	fs->by_id = strmap_create(fs->nentries);
+	if (!fs->by_id)
+		return (false);
+
+	for (size_t i = 0; i < fs->nentries; i++) {
+		if (!strmap_add(fs->by_id, fs->entries[i].id, (uint32_t)i))
+			return (false);
+	}
+
+	return (true);
+}
+
+bool fileset_init(fileset_t *fs, const macho_t *macho)
+{
+	const struct fileset_entry_command *fe = NULL;
+	size_t				    n  = 0;
+
+	(void)memset(fs, 0, sizeof(*fs));
+	fs->macho = macho;
+
+	if (macho->header->filetype != MH_FILESET) {
+		__logger(error, "fileset: not a fileset but %s",
+			 filetype_to_cstr(macho->header->filetype));
+		return (false);
+	}
+
+	while ((fe = macho_find_command(macho, LC_FILESET_ENTRY, fe)))
+		n++;
+
+	fs->entries = calloc(n + 1, sizeof(*fs->entries));
+	if (!fs->entries) {
+		__logger(error, "calloc: out of memory");
+		return (false);
+	}
+
+	/* Only the top level commands are read, the entries are opened when
+	 * they are first used.
+	 */
+	while ((fe = macho_find_command(macho, LC_FILESET_ENTRY, fe))) {
+		fileset_entry_t *e = &fs->entries[fs->nentries];
+		uint32_t	 off = fe->entry_id.offset;
+
+		if (fe->cmdsize < sizeof(*fe) || off >= fe->cmdsize ||
+		    !memchr((const char *)fe + off, '\0', fe->cmdsize - off)) {
+			__logger(error, "fileset: malformed entry %zu",
+				 fs->nentries);
+			fileset_free(fs);
+			return (false);
+		}
+
+		e->id	   = (const char *)fe + off;
+		e->vmaddr  = fe->vmaddr;
+		e->fileoff = fe->fileoff;
+		fs->nentries++;
+	}
+
+	if (!fileset_index_ids(fs)) {
+		fileset_free(fs);
+		return (false);
+	}
+
+	return (true);
+}
+
+void fileset_free(fileset_t *fs)
+{
+	for (size_t i = 0; i < fs->nentries; i++) {
+		fileset_entry_t *e = &fs->entries[i];
+
+		if (e->opened)
+			macho_close(&e->macho);
+		free(e->symbols);
+		free(e->sections);
+	}
+
+	strmap_kill(fs->by_id);
+	free(fs->entries);
+	(void)memset(fs, 0, sizeof(*fs));
+}
+
+fileset_entry_t *fileset_find(const fileset_t *fs, const char *id)
+{
+	uint32_t entry;
+
+	if (strmap_get(fs->by_id, id, &entry))
+		return (&fs->entries[entry]);
+	return (NULL);
+}
+
+const macho_t *fileset_entry_open(const fileset_t *fs, fileset_entry_t *entry)
+{
+	if (entry->opened)
+		return (&entry->macho);
+
+	/* Entries are laid out within the collection, whose file offsets
+	 * their load commands use, so the view shares its buffer.
+	 */
+	if (!macho_init(&entry->macho, fs->macho->base, fs->macho->size,
+			entry->fileoff)) {
+		__logger(error, "fileset: %s: cannot be opened", entry->id);
+		return (NULL);
+	}
+
+	entry->opened = true;
+	return (&entry->macho);
+}
+
+static bool fileset_index_symbols(fileset_entry_t *e)
+{
+	const struct symtab_command *symtab;
+	const struct nlist_64	    *syms;
+	const char		    *strtab;
+
+	symtab = macho_find_command(&e->macho, LC_SYMTAB, NULL);
+	if (!symtab)
+		return (true);
+
+	syms   = (const struct nlist_64 *)macho_at_offset(
+		  &e->macho, symtab->symoff,
+		  (uint64_t)symtab->nsyms * sizeof(*syms));
+	strtab = (const char *)macho_at_offset(&e->macho, symtab->stroff,
+					       symtab->strsize);
+	if (!syms || !strtab) {
+		__logger(error, "fileset: %s: symbol table out of bounds",
+			 e->id);
+		return (false);
+	}
+
+	e->symbols = malloc((symtab->nsyms + 1) * sizeof(*e->symbols));
+	if (!e->symbols) {
+		__logger(error, "malloc: out of memory");
+		return (false);
+	}
+
+	for (uint32_t i = 0; i < symtab->nsyms; i++) {
+		uint32_t strx = syms[i].n_un.n_strx;
+
+		if ((syms[i].n_type & N_STAB) ||
+		    (syms[i].n_type & N_TYPE) != N_SECT || !strx ||
+		    strx >= symtab->strsize ||
+		    !memchr(strtab + strx, '\0', symtab->strsize - strx))
+			continue;
+
+		e->symbols[e->nsymbols].addr	   = syms[i].n_value;
+		e->symbols[e->nsymbols++].name = strtab + strx;
+	}
+
+	qsort(e->symbols, e->nsymbols, sizeof(*e->symbols),
+	      fileset_symbol_cmp);
+	return (true);
+}
+
+static bool fileset_index_sections(fileset_entry_t *e)
+{
+	size_t n = 0;
+
+	for (uint32_t i = 0; i < e->macho.nsegments; i++)
+		n += e->macho.segments[i]->nsects;
+
+	e->sections = malloc((n + 1) * sizeof(*e->sections));
+	if (!e->sections) {
+		__logger(error, "malloc: out of memory");
+		return (false);
+	}
+
+	for (uint32_t i = 0; i < e->macho.nsegments; i++) {
+		const struct segment_command_64 *seg  = e->macho.segments[i];
+		const struct section_64		*sect = (const void *)(seg + 1);
+
+		for (uint32_t j = 0; j < seg->nsects; j++) {
+			if (sect[j].size)
+				e->sections[e->nsections++] = &sect[j];
+		}
+	}
+
+	qsort(e->sections, e->nsections, sizeof(*e->sections),
+	      fileset_section_cmp);
+	return (true);
+}
+
+bool fileset_entry_index(const fileset_t *fs, fileset_entry_t *entry)
+{
+	if (entry->indexed)
+		return (true);
+
+	if (!fileset_entry_open(fs, entry))
+		return (false);
+
+	if (!fileset_index_sections(entry) || !fileset_index_symbols(entry)) {
+		free(entry->symbols);
+		free(entry->sections);
+		entry->symbols	 = NULL;
+		entry->sections	 = NULL;
+		entry->nsymbols	 = 0;
+		entry->nsections = 0;
+		return (false);
+	}
+
+	entry->indexed = true;
+	return (true);
+}
+
+static void fileset_index_job(void *arg, size_t worker, size_t job)
+{
+	fileset_job_t	*ctx = arg;
+	fileset_entry_t *e;
+
+	(void)worker;
+
+	e = ctx->entries ? ctx->entries[job] : &ctx->fs->entries[job];
+	if (!fileset_entry_index(ctx->fs, e))
+		atomic_store(&ctx->failed, true);
+}
+
+bool fileset_index(const fileset_t *fs, fileset_entry_t **entries,
+		   size_t count)
+{
+	fileset_job_t ctx = { fs, entries, false };
+
+	if (!entries)
+		count = fs->nentries;
+
+	return (parallel_for(count, 0, fileset_index_job, &ctx) &&
+		!atomic_load(&ctx.failed));
+}
+
+const fileset_symbol_t *fileset_symbol_at(const fileset_entry_t *entry,
+					  uint64_t		 addr)
+{
+	size_t lo = 0;
+	size_t hi = entry->nsymbols;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (entry->symbols[mid].addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (lo ? &entry->symbols[lo - 1] : NULL);
+}
+
+const struct section_64 *fileset_section_at(const fileset_entry_t *entry,
+					    uint64_t		   addr)
+{
+	size_t lo = 0;
+	size_t hi = entry->nsections;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (entry->sections[mid]->addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (!lo || addr - entry->sections[lo - 1]->addr >=
+			   entry->sections[lo - 1]->size)
+		return (NULL);
+	return (entry->sections[lo - 1]);
+}
@@ -0,0 +1,227 @@
+#include "common.h"
+#include "ios-macos-utils.h"
+#include <mach-o/loader.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAVE_SIMD_MASK 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define HAVE_SIMD_MASK 1
+#endif
+
+#ifdef HAVE_SIMD_MASK
+/* Loads 16 bytes and returns one bit per byte: continuation bits in the low
+ * half, zero bytes in the high half.
+ */
+static inline uint32_t uleb_masks_16(const uint8_t *p)
+{
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+	static const uint8_t weights[16] = { 1, 2, 4, 8, 16, 32, 64, 128,
+					     1, 2, 4, 8, 16, 32, 64, 128 };
+	uint8x16_t	     w		 = vld1q_u8(weights);
+	uint8x16_t	     v		 = vld1q_u8(p);
+	uint8x16_t	     cont =
+		vandq_u8(vcltq_s8(vreinterpretq_s8_u8(v), vdupq_n_s8(0)), w);
+	uint8x16_t zero = vandq_u8(vceqq_u8(v, vdupq_n_u8(0)), w);
+	uint32_t   c	= vaddv_u8(vget_low_u8(cont)) |
+		     (vaddv_u8(vget_high_u8(cont)) << 8);
+	uint32_t z = vaddv_u8(vget_low_u8(zero)) |
+		     (vaddv_u8(vget_high_u8(zero)) << 8);
+
+	return (c | (z << 16));
+#else
+	__m128i v = _mm_loadu_si128((const __m128i *)p);
+	uint32_t c = (uint32_t)_mm_movemask_epi8(v);
+	uint32_t z = (uint32_t)_mm_movemask_epi8(
+		_mm_cmpeq_epi8(v, _mm_setzero_si128()));
+
+	return (c | (z << 16));
+#endif
+}
+#endif
+
+/* Decodes the zero-terminated delta stream into absolute addresses and
+ * returns how many were written to 'out'.
+ */
+static size_t function_starts_decode(const uint8_t *p, const uint8_t *end,
+				     uint64_t addr, uint64_t *out)
+{
+	size_t n = 0;
+
+#ifdef HAVE_SIMD_MASK
+	/* Nearly every delta fits in one or two bytes, so classify 16 bytes
+	 * at a time and only fall back to the generic reader for longer
+	 * values or the terminator.
+	 */
+	while (end - p >= 16) {
+		uint32_t masks = uleb_masks_16(p);
+		uint32_t cont  = masks & 0xffff;
+		uint32_t stops = ~cont & 0xffff;
+		unsigned pos   = 0;
+
+		if (masks == 0) {
+			for (unsigned i = 0; i < 16; i++) {
+				addr += p[i];
+				out[n++] = addr;
+			}
+			p += 16;
+			continue;
+		}
+
+		if (masks >> 16)
+			break;
+
+		while (stops) {
+			unsigned stop = __builtin_ctz(stops);
+			uint64_t delta;
+
+			if (stop == pos)
+				delta = p[pos];
+			else if (stop == pos + 1)
+				delta = (p[pos] & 0x7f) | ((uint64_t)p[pos + 1] << 7);
+			else
+				break;
+
+			addr += delta;
+			out[n++] = addr;
+			pos	 = stop + 1;
+			stops &= stops - 1;
+		}
+
+		p += pos;
+		if (pos == 0) {
+			uint64_t delta;
+
+			if (!leb128_read_u(&p, end, &delta) || delta == 0)
+				return (n);
+			addr += delta;
+			out[n++] = addr;
+		}
+	}
+#endif
+
+	while (p < end) {
+		uint64_t delta;
+
+		if (!leb128_read_u(&p, end, &delta) || delta == 0)
+			break;
+
+		addr += delta;
+		out[n++] = addr;
+	}
+
+	return (n);
+}
+
+bool function_starts_parse(const macho_t *macho, function_starts_t *fs)
+{
+	const struct section_64 *text;
+	const uint8_t		*data;
+	uint32_t		 datasize;
+	size_t			 n;
+
+	(void)memset(fs, 0, sizeof(*fs));
+
+	text = macho_find_section(macho, SEG_TEXT, SECT_TEXT);
+	if (text) {
+		fs->text_start = text->addr;
+		fs->text_end   = text->addr + text->size;
+	}
+
+	data = macho_linkedit_data(macho, LC_FUNCTION_STARTS, &datasize);
+	if (!data) {
+		__logger(error, "function_starts: no LC_FUNCTION_STARTS");
+		return (false);
+	}
+
+	/* Every delta takes at least one byte, which bounds the count.
+	 */
+	fs->starts = vec_create(sizeof(uint64_t), datasize + 1, NULL);
+	if (!fs->starts) {
+		__logger(error, "vec_create: out of memory");
+		return (false);
+	}
+
+	n = function_starts_decode(data, data + datasize, macho->vmbase,
+				   vec_uninitialized_data(fs->starts));
+	(void)vec_append_from_capacity(fs->starts, n);
+
+	if (!text && n) {
+		fs->text_start = *(uint64_t *)vec_head(fs->starts);
+		fs->text_end   = UINT64_MAX;
+	}
+
+	return (true);
+}
+
+void function_starts_free(function_starts_t *fs)
+{
+	if (fs->starts)
+		vec_kill(fs->starts);
+	(void)memset(fs, 0, sizeof(*fs));
+}
+
+/* Index of the first start strictly above 'vmaddr'.
+ */
+static size_t function_starts_upper(const function_starts_t *fs,
+				    uint64_t		     vmaddr)
+{
+	const uint64_t *starts = vec_unsafe_access(fs->starts, 0);
+	size_t		lo     = 0;
+	size_t		hi     = vec_size(fs->starts);
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (starts[mid] <= vmaddr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (lo);
+}
+
+bool function_starts_lookup(const function_starts_t *fs, uint64_t vmaddr,
+			    function_range_t *range)
+{
+	const uint64_t *starts = vec_unsafe_access(fs->starts, 0);
+	size_t		i;
+
+	if (vmaddr < fs->text_start || vmaddr >= fs->text_end)
+		return (false);
+
+	i = function_starts_upper(fs, vmaddr);
+	if (i == 0 || starts[i - 1] < fs->text_start)
+		return (false);
+
+	range->start = starts[i - 1];
+	range->end   = (i < vec_size(fs->starts) && starts[i] < fs->text_end) ?
+			       starts[i] :
+			       fs->text_end;
+	return (true);
+}
+
+bool function_starts_next(const function_starts_t *fs, size_t *iter,
+			  function_range_t *range)
+{
+	const uint64_t *starts = vec_unsafe_access(fs->starts, 0);
+	size_t		count  = vec_size(fs->starts);
+	size_t		i      = *iter;
+
+	if (i == 0 && count && starts[0] < fs->text_start)
+		i = function_starts_upper(fs, fs->text_start - 1);
+
+	if (i >= count || starts[i] >= fs->text_end)
+		return (false);
+
+	range->start = starts[i];
+	range->end   = (i + 1 < count && starts[i + 1] < fs->text_end) ?
+			       starts[i + 1] :
+			       fs->text_end;
+	*iter	     = i + 1;
+	return (true);
+}
@@ -0,0 +1,841 @@
+#include "common.h"
+#include "ios-macos-utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <mach-o/loader.h>
+#include <mach-o/nlist.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define IMAGE_CACHE_PATH_MAX  1024
+#define IMAGE_CACHE_NAME_MAX  4096 /* of an exported symbol */
+#define IMAGE_CACHE_WRITE_BUF 0x100000
+
+/* Strings are stored once, 'slots' holds their offsets (0 is the empty
+ * string, which is never looked up).
+ */
+typedef struct image_cache_strtab_s {
+	vec_t	 *bytes;
+	uint32_t *slots;
+	size_t	  nslots; /* power of two */
+	size_t	  count;
+} image_cache_strtab_t;
+
+typedef struct image_cache_build_s {
+	const macho_t	    *macho;
+	image_cache_strtab_t strtab;
+	vec_t		    *symbols; /* image_cache_symbol_t */
+	vec_t		    *exports; /* image_cache_export_t */
+	function_starts_t    fs;
+	size_t		     visited; /* trie nodes, bounds a malformed trie */
+} image_cache_build_t;
+
+typedef struct image_cache_trie_s {
+	const uint8_t *start;
+	const uint8_t *end;
+	char	       name[IMAGE_CACHE_NAME_MAX];
+} image_cache_trie_t;
+
+typedef struct image_cache_named_s {
+	const char	    *name;
+	image_cache_export_t export;
+} image_cache_named_t;
+
+static bool image_cache_path(char *buf, size_t size, const char *dir,
+			     const uint8_t uuid[16], int32_t cputype,
+			     int32_t cpusubtype, bool dir_only)
+{
+	char u[37];
+	int  n;
+
+	(void)snprintf(u, sizeof(u),
+		       "%02X%02X%02X%02X-%02X%02X-%02X%02X-%02X%02X-"
+		       "%02X%02X%02X%02X%02X%02X",
+		       uuid[0], uuid[1], uuid[2], uuid[3], uuid[4], uuid[5],
+		       uuid[6], uuid[7], uuid[8], uuid[9], uuid[10], uuid[11],
+		       uuid[12], uuid[13], uuid[14], uuid[15]);
+
+	if (dir_only)
+		n = snprintf(buf, size, "%s/%s", dir, u);
+	else
+		n = snprintf(buf, size, "%s/%s/%d.%d", dir, u, cputype,
+			     cpusubtype);
+	if (n < 0 || (size_t)n >= size) {
+		__logger(error, "image_cache: path too long under %s", dir);
+		return (false);
+	}
+
+	return (true);
+}
+
+static bool image_cache_strtab_init(image_cache_strtab_t *st)
+{
+	st->count  = 0;
+	st->nslots = 1024;
+	st->bytes  = vec_create(1, 0x10000, NULL);
+	st->slots  = calloc(st->nslots, sizeof(*st->slots));
+	if (!st->bytes || !st->slots || !vec_push(st->bytes, "")) {
+		__logger(error, "image_cache: out of memory");
+		return (false);
+	}
+
+	return (true);
+}
+
+static void image_cache_strtab_free(image_cache_strtab_t *st)
+{
+	if (st->bytes)
+		vec_kill(st->bytes);
+	free(st->slots);
+}
+
+static bool image_cache_strtab_grow(image_cache_strtab_t *st)
+{
+	const char *bytes  = vec_data(st->bytes);
+	size_t	    nslots = st->nslots * 2;
+	uint32_t   *slots;
+
+	slots = calloc(nslots, sizeof(*slots));
+	if (!slots) {
+		__logger(error, "calloc: out of memory");
+		return (false);
+	}
+
+	for (size_t i = 0; i < st->nslots; i++) {
+		const char *s = bytes + st->slots[i];
+		size_t	    j;
+
+		if (!st->slots[i])
+			continue;
+
+		j = fnv1a_str(s) & (nslots - 1);
+		while (slots[j])
+			j = (j + 1) & (nslots - 1);
+		slots[j] = st->slots[i];
+	}
+
+	free(st->slots);
+	st->slots  = slots;
+	st->nslots = nslots;
+	return (true);
+}
+
+/* Offset of 's' in the strings, UINT32_MAX on failure. */
+static uint32_t image_cache_strtab_add(image_cache_strtab_t *st,
+				       const char *s, size_t len)
+{
+	size_t	 i = fnv1a(s, len) & (st->nslots - 1);
+	uint32_t off;
+
+	if (!len)
+		return (0);
+
+	while (st->slots[i]) {
+		const char *t = (const char *)vec_data(st->bytes) +
+				st->slots[i];
+
+		if (!strncmp(t, s, len) && !t[len])
+			return (st->slots[i]);
+		i = (i + 1) & (st->nslots - 1);
+	}
+
+	if (vec_size(st->bytes) + len + 1 > UINT32_MAX) {
+		__logger(error, "image_cache: strings over 4GB");
+		return (UINT32_MAX);
+	}
+
+	off = (uint32_t)vec_size(st->bytes);
+	if (!vec_append(st->bytes, s, len) || !vec_push(st->bytes, "")) {
+		__logger(error, "vec_append: out of memory");
+		return (UINT32_MAX);
+	}
+	st->slots[i] = off;
+
+	if (++st->count * 2 > st->nslots && !image_cache_strtab_grow(st))
+		return (UINT32_MAX);
+	return (off);
+}
+
+static int image_cache_symbol_cmp(const void *a, const void *b)
+{
+	const image_cache_symbol_t *x = a;
+	const image_cache_symbol_t *y = b;
+
+	if (x->addr != y->addr)
+		return ((x->addr > y->addr) - (x->addr < y->addr));
+	return ((x->name > y->name) - (x->name < y->name));
+}
+
+static int image_cache_named_cmp(const void *a, const void *b)
+{
+	const image_cache_named_t *x = a;
+	const image_cache_named_t *y = b;
+
+	return (strcmp(x->name, y->name));
+}
+
+static bool image_cache_collect_symbols(image_cache_build_t *b)
+{
+	const struct symtab_command *symtab;
+	const struct nlist_64	    *nl;
+	const char		    *strtab;
+
+	symtab = macho_find_command(b->macho, LC_SYMTAB, NULL);
+	if (!symtab)
+		return (true);
+
+	nl     = (const struct nlist_64 *)macho_at_offset(
+		  b->macho, symtab->symoff,
+		  (uint64_t)symtab->nsyms * sizeof(*nl));
+	strtab = (const char *)macho_at_offset(b->macho, symtab->stroff,
+					       symtab->strsize);
+	if (!nl || !strtab) {
+		__logger(error, "image_cache: symbol table out of bounds");
+		return (false);
+	}
+
+	for (uint32_t i = 0; i < symtab->nsyms; i++) {
+		image_cache_symbol_t sym;
+		uint32_t	     strx = nl[i].n_un.n_strx;
+		const char	    *end;
+
+		if ((nl[i].n_type & N_STAB) ||
+		    (nl[i].n_type & N_TYPE) != N_SECT || !strx ||
+		    strx >= symtab->strsize)
+			continue;
+
+		end = memchr(strtab + strx, '\0', symtab->strsize - strx);
+		if (!end || end == strtab + strx)
+			continue;
+
+		sym.addr = nl[i].n_value;
+		sym.type = nl[i].n_type;
+		sym.name = image_cache_strtab_add(&b->strtab, strtab + strx,
+						  end - (strtab + strx));
+		if (sym.name == UINT32_MAX)
+			return (false);
+
+		if (!vec_push(b->symbols, &sym)) {
+			__logger(error, "vec_push: out of memory");
+			return (false);
+		}
+	}
+
+	qsort(vec_unsafe_access(b->symbols, 0), vec_size(b->symbols),
+	      sizeof(image_cache_symbol_t), image_cache_symbol_cmp);
+	return (true);
+}
+
+static bool image_cache_trie_terminal(image_cache_build_t *b,
+				      const image_cache_trie_t *t,
+				      const uint8_t *p, const uint8_t *end,
+				      size_t len)
+{
+	image_cache_export_t e = { 0 };
+	uint64_t	     flags;
+	uint64_t	     v;
+
+	if (!leb128_read_u(&p, end, &flags))
+		return (false);
+	e.flags = (uint32_t)flags;
+
+	if (flags & EXPORT_SYMBOL_FLAGS_REEXPORT) {
+		const uint8_t *nul;
+
+		if (!leb128_read_u(&p, end, &e.other))
+			return (false);
+		nul = memchr(p, '\0', end - p);
+		if (!nul)
+			return (false);
+		e.import = image_cache_strtab_add(&b->strtab, (const char *)p,
+						  nul - p);
+		if (e.import == UINT32_MAX)
+			return (false);
+	} else {
+		uint64_t base = b->macho->vmbase;
+
+		if ((flags & EXPORT_SYMBOL_FLAGS_KIND_MASK) ==
+		    EXPORT_SYMBOL_FLAGS_KIND_ABSOLUTE)
+			base = 0;
+		if (!leb128_read_u(&p, end, &v))
+			return (false);
+		e.addr = base + v;
+
+		if (flags & EXPORT_SYMBOL_FLAGS_STUB_AND_RESOLVER) {
+			if (!leb128_read_u(&p, end, &v))
+				return (false);
+			e.other = base + v;
+		}
+	}
+
+	e.name = image_cache_strtab_add(&b->strtab, t->name, len);
+	if (e.name == UINT32_MAX)
+		return (false);
+
+	if (!vec_push(b->exports, &e)) {
+		__logger(error, "vec_push: out of memory");
+		return (false);
+	}
+	return (true);
+}
+
+/* Walks the node at 'off' whose edges so far spell the first 'len' bytes of
+ * 't->name'.
+ */
+static bool image_cache_trie_node(image_cache_build_t *b,
+				  image_cache_trie_t *t, uint64_t off,
+				  size_t len)
+{
+	const uint8_t *p;
+	uint64_t       terminal;
+	uint8_t	       nchildren;
+
+	if (off >= (uint64_t)(t->end - t->start) ||
+	    ++b->visited > (size_t)(t->end - t->start))
+		return (false);
+
+	p = t->start + off;
+	if (!leb128_read_u(&p, t->end, &terminal) ||
+	    terminal > (uint64_t)(t->end - p))
+		return (false);
+
+	if (terminal &&
+	    !image_cache_trie_terminal(b, t, p, p + terminal, len))
+		return (false);
+
+	p += terminal;
+	if (p >= t->end)
+		return (false);
+
+	nchildren = *p++;
+	for (uint8_t i = 0; i < nchildren; i++) {
+		const uint8_t *nul = memchr(p, '\0', t->end - p);
+		uint64_t       child;
+		size_t	       elen;
+
+		if (!nul)
+			return (false);
+
+		elen = nul - p;
+		if (len + elen >= sizeof(t->name))
+			return (false);
+		(void)memcpy(t->name + len, p, elen);
+
+		p = nul + 1;
+		if (!leb128_read_u(&p, t->end, &child) ||
+		    !image_cache_trie_node(b, t, child, len + elen))
+			return (false);
+	}
+
+	return (true);
+}
+
+static bool image_cache_collect_exports(image_cache_build_t *b)
+{
+	const struct dyld_info_command *di;
+	image_cache_trie_t	       *t;
+	uint32_t			size = 0;
+	bool				ok;
+
+	t = malloc(sizeof(*t));
+	if (!t) {
+		__logger(error, "malloc: out of memory");
+		return (false);
+	}
+
+	t->start = macho_linkedit_data(b->macho, LC_DYLD_EXPORTS_TRIE, &size);
+	if (!t->start) {
+		di = macho_find_command(b->macho, LC_DYLD_INFO_ONLY, NULL);
+		if (!di)
+			di = macho_find_command(b->macho, LC_DYLD_INFO, NULL);
+		if (di && di->export_size) {
+			size	 = di->export_size;
+			t->start = macho_at_offset(b->macho, di->export_off,
+						   size);
+		}
+	}
+
+	if (!t->start || !size) {
+		free(t);
+		return (true);
+	}
+
+	t->end = t->start + size;
+	ok     = image_cache_trie_node(b, t, 0, 0);
+	if (!ok)
+		__logger(error, "image_cache: malformed export trie");
+
+	free(t);
+	return (ok);
+}
+
+static uint64_t image_cache_align(uint64_t off)
+{
+	return ((off + 7) & ~(uint64_t)7);
+}
+
+/* Lays the collected tables out after the header and fills them in. */
+static uint8_t *image_cache_serialize(image_cache_build_t	 *b,
+				      const image_cache_header_t *id,
+				      size_t			 *size)
+{
+	const char	      *strings = vec_data(b->strtab.bytes);
+	size_t		       nsyms   = vec_size(b->symbols);
+	size_t		       nexp    = vec_size(b->exports);
+	size_t		       nfuncs  = 0;
+	size_t		       nslots  = 0;
+	image_cache_header_t   hdr     = *id;
+	image_cache_segment_t *segs;
+	image_cache_export_t  *exps;
+	image_cache_named_t   *named;
+	uint32_t	      *slots;
+	uint64_t	       off = image_cache_align(sizeof(hdr));
+	uint8_t		      *buf;
+
+	if (b->fs.starts)
+		nfuncs = vec_size(b->fs.starts);
+
+	if (nsyms) {
+		nslots = 16;
+		while (nslots < nsyms * 2)
+			nslots <<= 1;
+	}
+
+#define IMAGE_CACHE_TABLE(tbl, n, elt)                                \
+	do {                                                          \
+		hdr.tbl.offset = off;                                 \
+		hdr.tbl.count  = (n);                                 \
+		off = image_cache_align(off + (uint64_t)(n) * (elt)); \
+	} while (0)
+
+	IMAGE_CACHE_TABLE(segments, b->macho->nsegments, sizeof(*segs));
+	IMAGE_CACHE_TABLE(symbols, nsyms, sizeof(image_cache_symbol_t));
+	IMAGE_CACHE_TABLE(symbol_hash, nslots, sizeof(*slots));
+	IMAGE_CACHE_TABLE(function_starts, nfuncs, sizeof(uint64_t));
+	IMAGE_CACHE_TABLE(exports, nexp, sizeof(*exps));
+	IMAGE_CACHE_TABLE(strings, vec_size(b->strtab.bytes), 1);
+#undef IMAGE_CACHE_TABLE
+
+	buf   = calloc(1, off);
+	named = malloc((nexp + 1) * sizeof(*named));
+	if (!buf || !named) {
+		__logger(error, "malloc: out of memory");
+		free(buf);
+		free(named);
+		return (NULL);
+	}
+
+	segs  = (image_cache_segment_t *)(buf + hdr.segments.offset);
+	slots = (uint32_t *)(buf + hdr.symbol_hash.offset);
+	exps  = (image_cache_export_t *)(buf + hdr.exports.offset);
+
+	for (uint32_t i = 0; i < b->macho->nsegments; i++) {
+		const struct segment_command_64 *seg = b->macho->segments[i];
+
+		(void)memcpy(segs[i].name, seg->segname, sizeof(segs[i].name));
+		segs[i].vmaddr	 = seg->vmaddr;
+		segs[i].vmsize	 = seg->vmsize;
+		segs[i].fileoff	 = seg->fileoff;
+		segs[i].filesize = seg->filesize;
+		segs[i].maxprot	 = (uint32_t)seg->maxprot;
+		segs[i].initprot = (uint32_t)seg->initprot;
+	}
+
+	(void)memcpy(buf + hdr.symbols.offset, vec_unsafe_access(b->symbols, 0),
+		     nsyms * sizeof(image_cache_symbol_t));
+
+	for (size_t i = 0; i < nsyms; i++) {
+		const image_cache_symbol_t *sym = vec_unsafe_access(b->symbols,
+								    i);
+		const char		   *name = strings + sym->name;
+		size_t j = fnv1a_str(name) & (nslots - 1);
+
+		while (slots[j])
+			j = (j + 1) & (nslots - 1);
+		slots[j] = (uint32_t)i + 1;
+	}
+
+	if (nfuncs)
+		(void)memcpy(buf + hdr.function_starts.offset,
+			     vec_data(b->fs.starts), nfuncs * sizeof(uint64_t));
+
+	/* Exports are looked up by name with a binary search */
+	for (size_t i = 0; i < nexp; i++) {
+		named[i].export = *(const image_cache_export_t *)
+			vec_unsafe_access(b->exports, i);
+		named[i].name = strings + named[i].export.name;
+	}
+	qsort(named, nexp, sizeof(*named), image_cache_named_cmp);
+	for (size_t i = 0; i < nexp; i++)
+		exps[i] = named[i].export;
+
+	(void)memcpy(buf + hdr.strings.offset, strings,
+		     vec_size(b->strtab.bytes));
+
+	hdr.magic      = IMAGE_CACHE_MAGIC;
+	hdr.version    = IMAGE_CACHE_VERSION;
+	hdr.size       = off;
+	hdr.vmbase     = b->macho->vmbase;
+	hdr.text_start = b->fs.text_start;
+	hdr.text_end   = b->fs.text_end;
+	(void)memcpy(buf, &hdr, sizeof(hdr));
+
+	free(named);
+	*size = off;
+	return (buf);
+}
+
+static void image_cache_build_free(image_cache_build_t *b)
+{
+	image_cache_strtab_free(&b->strtab);
+	if (b->symbols)
+		vec_kill(b->symbols);
+	if (b->exports)
+		vec_kill(b->exports);
+	function_starts_free(&b->fs);
+}
+
+static bool image_cache_identify(const macho_t *macho,
+				 image_cache_header_t *id)
+{
+	const struct uuid_command *uc;
+
+	uc = macho_find_command(macho, LC_UUID, NULL);
+	if (!uc || uc->cmdsize < sizeof(*uc)) {
+		__logger(error, "image_cache: image without LC_UUID");
+		return (false);
+	}
+
+	(void)memset(id, 0, sizeof(*id));
+	(void)memcpy(id->uuid, uc->uuid, sizeof(id->uuid));
+	id->cputype    = macho->header->cputype;
+	id->cpusubtype = macho->header->cpusubtype & ~CPU_SUBTYPE_MASK;
+	return (true);
+}
+
+static bool image_cache_mkdir(const char *path)
+{
+	if (mkdir(path, 0755) && errno != EEXIST) {
+		__logger(error, "mkdir: %s: %s", path, strerror(errno));
+		return (false);
+	}
+	return (true);
+}
+
+/* The index is written next to its final path and renamed over it, so
+ * readers never map a partial file.
+ */
+static bool image_cache_write(const char *path, const uint8_t *buf,
+			      size_t size)
+{
+	char	    tmp[IMAGE_CACHE_PATH_MAX];
+	bufwriter_t w;
+	int	    fd;
+	bool	    ok;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >=
+	    (int)sizeof(tmp)) {
+		__logger(error, "image_cache: path too long: %s", path);
+		return (false);
+	}
+
+	fd = mkstemp(tmp);
+	if (fd == -1) {
+		__logger(error, "mkstemp: %s: %s", tmp, strerror(errno));
+		return (false);
+	}
+
+	if (!bufwriter_init(&w, fd, IMAGE_CACHE_WRITE_BUF, NULL)) {
+		(void)close(fd);
+		(void)unlink(tmp);
+		return (false);
+	}
+
+	bufwriter_write(&w, buf, size);
+	ok = bufwriter_flush(&w);
+	bufwriter_destroy(&w);
+	(void)fchmod(fd, 0644);
+	if (close(fd) == -1)
+		ok = false;
+
+	if (ok && rename(tmp, path) == -1) {
+		__logger(error, "rename: %s: %s", path, strerror(errno));
+		ok = false;
+	}
+	if (!ok)
+		(void)unlink(tmp);
+
+	return (ok);
+}
+
+bool image_cache_store(const char *dir, const macho_t *macho)
+{
+	image_cache_build_t  b = { 0 };
+	image_cache_header_t id;
+	char		     path[IMAGE_CACHE_PATH_MAX];
+	uint8_t		    *buf = NULL;
+	size_t		     size;
+	bool		     ok;
+
+	if (!image_cache_identify(macho, &id))
+		return (false);
+
+	b.macho	  = macho;
+	b.symbols = vec_create(sizeof(image_cache_symbol_t), 1024, NULL);
+	b.exports = vec_create(sizeof(image_cache_export_t), 256, NULL);
+	ok	  = image_cache_strtab_init(&b.strtab) && b.symbols &&
+	     b.exports && image_cache_collect_symbols(&b) &&
+	     image_cache_collect_exports(&b);
+
+	/* Function starts are optional, but a present one must parse */
+	if (ok && macho_find_command(macho, LC_FUNCTION_STARTS, NULL))
+		ok = function_starts_parse(macho, &b.fs);
+
+	if (ok)
+		buf = image_cache_serialize(&b, &id, &size);
+	image_cache_build_free(&b);
+	if (!buf)
+		return (false);
+
+	ok = image_cache_mkdir(dir) &&
+	     image_cache_path(path, sizeof(path), dir, id.uuid, id.cputype,
+			      id.cpusubtype, true) &&
+	     image_cache_mkdir(path) &&
+	     image_cache_path(path, sizeof(path), dir, id.uuid, id.cputype,
+			      id.cpusubtype, false) &&
+	     image_cache_write(path, buf, size);
+
+	free(buf);
+	return (ok);
+}
+
+static bool image_cache_table_ok(const image_cache_header_t *hdr,
+				 const image_cache_table_t  *tbl,
+				 size_t			     elt)
+{
+	return (!(tbl->offset & 7) && tbl->offset <= hdr->size &&
+		tbl->count <= (hdr->size - tbl->offset) / elt);
+}
+
+static bool image_cache_validate(const image_cache_t *ic, const uint8_t *uuid,
+				 int32_t cputype, int32_t cpusubtype)
+{
+	const image_cache_header_t *hdr = ic->header;
+
+	if (ic->map_size < sizeof(*hdr) || hdr->magic != IMAGE_CACHE_MAGIC ||
+	    hdr->version != IMAGE_CACHE_VERSION ||
+	    hdr->size != ic->map_size || hdr->cputype != cputype ||
+	    hdr->cpusubtype != cpusubtype ||
+	    memcmp(hdr->uuid, uuid, sizeof(hdr->uuid)))
+		return (false);
+
+	if (!image_cache_table_ok(hdr, &hdr->segments,
+				  sizeof(image_cache_segment_t)) ||
+	    !image_cache_table_ok(hdr, &hdr->symbols,
+				  sizeof(image_cache_symbol_t)) ||
+	    !image_cache_table_ok(hdr, &hdr->symbol_hash, sizeof(uint32_t)) ||
+	    !image_cache_table_ok(hdr, &hdr->function_starts,
+				  sizeof(uint64_t)) ||
+	    !image_cache_table_ok(hdr, &hdr->exports,
+				  sizeof(image_cache_export_t)) ||
+	    !image_cache_table_ok(hdr, &hdr->strings, 1))
+		return (false);
+
+	/* Lookups rely on these, the entries themselves are checked as they
+	 * are read.
+	 */
+	return (hdr->strings.count &&
+		!((const char *)ic->map)[hdr->strings.offset +
+					 hdr->strings.count - 1] &&
+		!(hdr->symbol_hash.count & (hdr->symbol_hash.count - 1)) &&
+		hdr->symbol_hash.count >= hdr->symbols.count);
+}
+
+bool image_cache_load(image_cache_t *ic, const char *dir,
+		      const uint8_t uuid[16], int32_t cputype,
+		      int32_t cpusubtype)
+{
+	const image_cache_header_t *hdr;
+	char			    path[IMAGE_CACHE_PATH_MAX];
+	struct stat		    st;
+	int			    fd;
+
+	(void)memset(ic, 0, sizeof(*ic));
+	cpusubtype &= ~CPU_SUBTYPE_MASK;
+
+	if (!image_cache_path(path, sizeof(path), dir, uuid, cputype,
+			      cpusubtype, false))
+		return (false);
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		if (errno != ENOENT)
+			__logger(error, "open: %s: %s", path, strerror(errno));
+		return (false);
+	}
+
+	if (fstat(fd, &st) == -1 || st.st_size <= 0) {
+		(void)close(fd);
+		return (false);
+	}
+
+	ic->map_size = (size_t)st.st_size;
+	ic->map	     = mmap(NULL, ic->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	(void)close(fd);
+	if (ic->map == MAP_FAILED) {
+		__logger(error, "mmap: %s: %s", path, strerror(errno));
+		(void)memset(ic, 0, sizeof(*ic));
+		return (false);
+	}
+
+	ic->header = ic->map;
+	if (!image_cache_validate(ic, uuid, cputype, cpusubtype)) {
+		__logger(warning, "image_cache: %s: stale or corrupt", path);
+		image_cache_close(ic);
+		return (false);
+	}
+
+	hdr		    = ic->header;
+	ic->segments	    = (const void *)((const uint8_t *)ic->map +
+					     hdr->segments.offset);
+	ic->symbols	    = (const void *)((const uint8_t *)ic->map +
+					     hdr->symbols.offset);
+	ic->symbol_hash	    = (const void *)((const uint8_t *)ic->map +
+					     hdr->symbol_hash.offset);
+	ic->function_starts = (const void *)((const uint8_t *)ic->map +
+					     hdr->function_starts.offset);
+	ic->exports	    = (const void *)((const uint8_t *)ic->map +
+					     hdr->exports.offset);
+	ic->strings	    = (const char *)ic->map + hdr->strings.offset;
+	return (true);
+}
+
+bool image_cache_open(image_cache_t *ic, const char *dir,
+		      const macho_t *macho)
+{
+	image_cache_header_t id;
+
+	if (!image_cache_identify(macho, &id))
+		return (false);
+
+	if (image_cache_load(ic, dir, id.uuid, id.cputype, id.cpusubtype))
+		return (true);
+
+	return (image_cache_store(dir, macho) &&
+		image_cache_load(ic, dir, id.uuid, id.cputype, id.cpusubtype));
+}
+
+void image_cache_close(image_cache_t *ic)
+{
+	if (ic->map)
+		(void)munmap(ic->map, ic->map_size);
+	(void)memset(ic, 0, sizeof(*ic));
+}
+
+const char *image_cache_string(const image_cache_t *ic, uint32_t offset)
+{
+	if (offset >= ic->header->strings.count)
+		return (NULL);
+	return (ic->strings + offset);
+}
+
+const image_cache_symbol_t *image_cache_symbol_find(const image_cache_t *ic,
+						    const char *name)
+{
+	size_t nslots = ic->header->symbol_hash.count;
+	size_t i;
+
+	if (!nslots)
+		return (NULL);
+
+	i = fnv1a_str(name) & (nslots - 1);
+	for (size_t n = 0; n < nslots && ic->symbol_hash[i]; n++) {
+		uint32_t    sym = ic->symbol_hash[i] - 1;
+		const char *s;
+
+		if (sym < ic->header->symbols.count) {
+			s = image_cache_string(ic, ic->symbols[sym].name);
+			if (s && !strcmp(s, name))
+				return (&ic->symbols[sym]);
+		}
+		i = (i + 1) & (nslots - 1);
+	}
+
+	return (NULL);
+}
+
+const image_cache_symbol_t *image_cache_symbol_at(const image_cache_t *ic,
+						  uint64_t addr)
+{
+	size_t lo = 0;
+	size_t hi = ic->header->symbols.count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (ic->symbols[mid].addr <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (lo ? &ic->symbols[lo - 1] : NULL);
+}
+
+const image_cache_export_t *image_cache_export_find(const image_cache_t *ic,
+						    const char *name)
+{
+	size_t lo = 0;
+	size_t hi = ic->header->exports.count;
+
+	while (lo < hi) {
+		size_t	    mid = lo + (hi - lo) / 2;
+		const char *s	= image_cache_string(ic, ic->exports[mid].name);
+		int	    cmp = strcmp(s ? s : "", name);
+
+		if (!cmp)
+			return (&ic->exports[mid]);
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (NULL);
+}
+
+bool image_cache_function_at(const image_cache_t *ic, uint64_t addr,
+			     function_range_t *range)
+{
+	const image_cache_header_t *hdr = ic->header;
+	const uint64_t		   *starts = ic->function_starts;
+	size_t			    lo	   = 0;
+	size_t			    hi	   = hdr->function_starts.count;
+
+	if (addr < hdr->text_start || addr >= hdr->text_end)
+		return (false);
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (starts[mid] <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (!lo || starts[lo - 1] < hdr->text_start)
+		return (false);
+
+	range->start = starts[lo - 1];
+	range->end   = (lo < hdr->function_starts.count &&
+			starts[lo] < hdr->text_end) ?
+			       starts[lo] :
+			       hdr->text_end;
+	return (true);
+}
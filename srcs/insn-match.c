@@ -0,0 +1,259 @@
+#include "common.h"
+#include "ios-macos-utils.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#define INSN_MATCH_BLOCK       8 /* instructions compared per step */
+#define INSN_MATCH_MAX_SPAN    (64 * 1024)
+#define INSN_MATCH_TASK_WINDOW (1 << 20)
+
+static inline uint32_t insn_load(const uint8_t *buf, size_t word)
+{
+	uint32_t insn;
+
+	(void)memcpy(&insn, buf + word * 4, sizeof(insn));
+	return (insn);
+}
+
+/* One bit per instruction of the 8 at 'p' for which
+ * (insn & mask) == value.
+ */
+static inline uint32_t insn_match_block(const uint8_t *p, uint32_t value,
+					uint32_t mask)
+{
+#if defined(__AVX2__)
+	__m256i v = _mm256_loadu_si256((const __m256i *)p);
+
+	v = _mm256_cmpeq_epi32(_mm256_and_si256(v, _mm256_set1_epi32(mask)),
+			       _mm256_set1_epi32(value));
+	return ((uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(v)));
+#elif defined(__SSE2__)
+	const __m128i m = _mm_set1_epi32(mask);
+	const __m128i x = _mm_set1_epi32(value);
+	__m128i	      a = _mm_loadu_si128((const __m128i *)p);
+	__m128i	      b = _mm_loadu_si128((const __m128i *)(p + 16));
+
+	a = _mm_cmpeq_epi32(_mm_and_si128(a, m), x);
+	b = _mm_cmpeq_epi32(_mm_and_si128(b, m), x);
+	return ((uint32_t)_mm_movemask_ps(_mm_castsi128_ps(a)) |
+		((uint32_t)_mm_movemask_ps(_mm_castsi128_ps(b)) << 4));
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	static const uint32_t weights[4] = { 1, 2, 4, 8 };
+	const uint32x4_t      w		 = vld1q_u32(weights);
+	const uint32x4_t      m		 = vdupq_n_u32(mask);
+	const uint32x4_t      x		 = vdupq_n_u32(value);
+	uint32x4_t	      a = vld1q_u32((const uint32_t *)(const void *)p);
+	uint32x4_t	      b =
+		vld1q_u32((const uint32_t *)(const void *)(p + 16));
+
+	a = vandq_u32(vceqq_u32(vandq_u32(a, m), x), w);
+	b = vandq_u32(vceqq_u32(vandq_u32(b, m), x), w);
+	return (vaddvq_u32(a) | (vaddvq_u32(b) << 4));
+#else
+	uint32_t bits = 0;
+
+	for (size_t i = 0; i < INSN_MATCH_BLOCK; i++) {
+		if ((insn_load(p, i) & mask) == value)
+			bits |= 1u << i;
+	}
+
+	return (bits);
+#endif
+}
+
+bool insn_pattern_init(insn_pattern_t *pattern, const insn_mask_t *insns,
+		       size_t count)
+{
+	size_t fixed = count;
+	int    best  = -1;
+
+	(void)memset(pattern, 0, sizeof(*pattern));
+
+	if (!count) {
+		__logger(error, "insn_pattern: empty pattern");
+		return (false);
+	}
+
+	pattern->insns = insns;
+	pattern->count = count;
+
+	for (size_t i = 0; i < count; i++) {
+		int bits = __builtin_popcount(insns[i].mask);
+
+		if (insns[i].value & ~insns[i].mask) {
+			__logger(error, "insn_pattern: %#x is not within %#x",
+				 insns[i].value, insns[i].mask);
+			return (false);
+		}
+
+		/* The anchor needs a fixed distance from the first word.
+		 */
+		if (i < fixed && bits > best) {
+			best		= bits;
+			pattern->anchor = i;
+		}
+		if (insns[i].gap && i + 1 < count && fixed == count)
+			fixed = i + 1;
+
+		pattern->span += 4 * (1 + (i + 1 < count ? insns[i].gap : 0));
+	}
+
+	if (!best) {
+		__logger(error, "insn_pattern: no word to anchor on");
+		return (false);
+	}
+
+	if (pattern->span > INSN_MATCH_MAX_SPAN) {
+		__logger(error, "insn_pattern: spans more than %d bytes",
+			 INSN_MATCH_MAX_SPAN);
+		return (false);
+	}
+
+	return (true);
+}
+
+/* Matches the words of 'pattern' from 'i' on against the instructions from
+ * 'word' on, trying every length of the variable gaps.
+ */
+static bool insn_match_at(const insn_pattern_t *pattern, const uint8_t *buf,
+			  size_t nwords, size_t word, size_t i)
+{
+	for (; i < pattern->count; i++, word++) {
+		const insn_mask_t *m = &pattern->insns[i];
+
+		if (word >= nwords ||
+		    (insn_load(buf, word) & m->mask) != m->value)
+			return (false);
+
+		if (m->gap && i + 1 < pattern->count) {
+			for (size_t g = 0; g <= m->gap; g++) {
+				if (insn_match_at(pattern, buf, nwords,
+						  word + 1 + g, i + 1))
+					return (true);
+			}
+			return (false);
+		}
+	}
+
+	return (true);
+}
+
+/* Reports the matches starting in the first 'limit' bytes of the buffer.
+ */
+static bool insn_match_buffer(const insn_pattern_t *pattern,
+			      const uint8_t *buf, size_t size, uint64_t addr,
+			      size_t limit, vec_t *pcs)
+{
+	const insn_mask_t *anchor = &pattern->insns[pattern->anchor];
+	size_t		   nwords = size / 4;
+	size_t		   end	  = MIN(limit / 4 + pattern->anchor, nwords);
+	size_t		   word	  = pattern->anchor;
+
+	while (word < end) {
+		uint32_t hits;
+
+		if (end - word >= INSN_MATCH_BLOCK) {
+			hits = insn_match_block(buf + word * 4, anchor->value,
+						anchor->mask);
+		} else {
+			hits = 0;
+			for (size_t i = 0; i < end - word; i++) {
+				if ((insn_load(buf, word + i) & anchor->mask) ==
+				    anchor->value)
+					hits |= 1u << i;
+			}
+		}
+
+		while (hits) {
+			size_t	 start = word + __builtin_ctz(hits) -
+					 pattern->anchor;
+			uint64_t pc    = addr + start * 4;
+
+			if (insn_match_at(pattern, buf, nwords, start, 0) &&
+			    !vec_push(pcs, &pc)) {
+				__logger(error, "vec_push: out of memory");
+				return (false);
+			}
+			hits &= hits - 1;
+		}
+
+		word += INSN_MATCH_BLOCK;
+	}
+
+	return (true);
+}
+
+bool insn_match(const insn_pattern_t *pattern, const uint8_t *buf,
+		size_t size, uint64_t addr, vec_t *pcs)
+{
+	return (insn_match_buffer(pattern, buf, size, addr, size, pcs));
+}
+
+/* Reads the readable regions of [address, address + size) a window at a
+ * time, consecutive windows overlapping by the span of the pattern.
+ */
+bool insn_match_task(const insn_pattern_t *pattern, task_t task,
+		     mach_vm_address_t address, mach_vm_size_t size,
+		     vec_t *pcs)
+{
+	mach_vm_address_t end	  = address + size;
+	size_t		  overlap = pattern->span - 4;
+	uint8_t		 *window;
+	bool		  ret = true;
+
+	window = malloc(INSN_MATCH_TASK_WINDOW);
+	if (!window) {
+		__logger(error, "malloc: out of memory");
+		return (false);
+	}
+
+	address &= ~(mach_vm_address_t)3;
+	while (ret && address < end) {
+		mach_vm_address_t region = address;
+		mach_vm_size_t	  region_size;
+		mach_vm_address_t region_end;
+		vm_prot_t	  prot;
+
+		if (!memory_region_next(task, &region, &region_size, &prot) ||
+		    region >= end)
+			break;
+
+		region_end = MIN(region + region_size, end);
+		address	   = MAX(region, address);
+
+		while ((prot & VM_PROT_READ) && address < region_end) {
+			size_t n     = region_end - address;
+			size_t limit;
+
+			n = MIN(n, INSN_MATCH_TASK_WINDOW);
+			if (!memory_r(task, address, window, n))
+				break;
+
+			/* Matches starting in the overlap are left to the
+			 * next window, unless this is the last one.
+			 */
+			limit = (address + n == region_end) ? n : n - overlap;
+			if (!insn_match_buffer(pattern, window, n, address,
+					       limit, pcs)) {
+				ret = false;
+				break;
+			}
+			address += limit;
+		}
+
+		address = region_end;
+	}
+
+	free(window);
+	return (ret);
+}
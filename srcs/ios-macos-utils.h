@@ -1,8 +1,12 @@
 #ifndef __IOS_MACOS_UTILS_H__
 #define __IOS_MACOS_UTILS_H__
 
+#include "vec.h"
+#include <mach-o/loader.h>
 #include <mach/mach.h>
 #include <mach/mach_traps.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <sys/types.h>
 
@@ -13,7 +17,7 @@
 #define swap_32(v) v = __builtin_bswap32(v)
 
 typedef struct patch_s {
-	const uint64_t offset;
+	const uint64_t offset; /* from the image base */
 	const uint8_t *code;
 	size_t	       code_size;
 } patch_t;
@@ -27,9 +31,1119 @@ const char *__attribute__((const)) load_command_to_cstr(uint32_t command);
 const char *__attribute__((const)) sectype_to_cstr(uint32_t filetype);
 const char *__attribute__((const)) attr_type_to_cstr(uint32_t attr_type);
 
+/* MACH-O
+ */
+typedef struct macho_s {
+	const uint8_t			 *base;	  /* what file offsets are relative to */
+	size_t				  size;	  /* number of bytes readable at 'base' */
+	const struct mach_header_64	 *header; /* header, within 'base' */
+	const struct segment_command_64 **segments; /* in load command order */
+	uint32_t			  nsegments;
+	const struct segment_command_64	 *linkedit;
+	uint64_t			  vmbase; /* unslid address of the header */
+	void				 *map;	  /* owned mapping, or NULL */
+	size_t				  map_size;
+	size_t				  slice_offset; /* of the FAT slice */
+	uint64_t			  base_vmaddr; /* of 'base' */
+	bool				  in_memory; /* laid out by address */
+} macho_t;
+
+#define MACHO_MAX_SLICES 16
+
+typedef struct macho_slice_s {
+	int32_t	 cputype;
+	int32_t	 cpusubtype;
+	uint64_t offset;
+	uint64_t size;
+} macho_slice_t;
+
+/* Lists the slices of a mapped FAT file (or the file itself when it is a
+ * thin 64-bit image) and returns how many were stored in 'slices'.
+ */
+size_t macho_slices(const uint8_t *map, size_t map_size, macho_slice_t *slices,
+		    size_t max);
+
+/* Maps the file at 'path' read-only and opens the 64-bit image matching
+ * 'cputype' (CPU_TYPE_ANY picks the first FAT slice).
+ */
+bool macho_open(macho_t *macho, const char *path, int32_t cputype);
+
+/* Builds a view over an image whose header sits at 'hdroff' within a buffer
+ * that its file offsets are relative to. The buffer is not copied.
+ */
+bool macho_init(macho_t *macho, const uint8_t *base, size_t size,
+		size_t hdroff);
+
+/* Builds a view over an image laid out by address, as in the shared cache,
+ * in a buffer mapped at 'base_vmaddr'. File offsets are translated through
+ * the segment holding them, __LINKEDIT first.
+ */
+bool macho_init_vm(macho_t *macho, const uint8_t *base, size_t size,
+		   uint64_t base_vmaddr, uint64_t vmaddr);
+void macho_close(macho_t *macho);
+
+/* Returns the first load command of type 'command' found after 'after'
+ * (or from the start when 'after' is NULL).
+ */
+const void *macho_find_command(const macho_t *macho, uint32_t command,
+			       const void *after);
+const struct segment_command_64 *macho_find_segment(const macho_t *macho,
+						    const char	  *segname);
+const struct section_64		*macho_find_section(const macho_t *macho,
+						    const char	  *segname,
+						    const char	  *sectname);
+const struct segment_command_64 *macho_segment_for_vmaddr(const macho_t *macho,
+							  uint64_t vmaddr);
+
+/* Bounds-checked pointers into the image, NULL when the range is not
+ * backed by the buffer.
+ */
+const uint8_t *macho_at_offset(const macho_t *macho, uint64_t fileoff,
+			       uint64_t size);
+const uint8_t *macho_at_vmaddr(const macho_t *macho, uint64_t vmaddr,
+			       uint64_t size);
+
+/* Payload of the linkedit_data_command of type 'command'.
+ */
+const uint8_t *macho_linkedit_data(const macho_t *macho, uint32_t command,
+				   uint32_t *size);
+
+/* Name of the symbol at 'index' in the indirect symbol table, NULL for local
+ * and absolute entries.
+ */
+const char *macho_indirect_symbol(const macho_t *macho, uint32_t index);
+
+/* CHAINED FIXUPS
+ */
+#define CHAINED_FIXUP_REBASE   UINT32_MAX
+#define CHAINED_FIXUP_AUTH     0x1
+#define CHAINED_FIXUP_ADDR_DIV 0x2
+
+typedef struct chained_import_s {
+	const char *name; /* points into the image */
+	int64_t	    addend;
+	int32_t	    lib_ordinal;
+	bool	    weak;
+} chained_import_t;
+
+typedef struct chained_fixup_s {
+	uint64_t vmaddr;    /* unslid address of the fixed-up pointer */
+	uint64_t target;    /* rebase: unslid target, bind: inline addend */
+	uint32_t ordinal;   /* import index, or CHAINED_FIXUP_REBASE */
+	uint16_t diversity; /* arm64e authentication diversity */
+	uint8_t	 key;	    /* arm64e authentication key (IA, IB, DA, DB) */
+	uint8_t	 flags;
+} chained_fixup_t;
+
+typedef struct chained_fixups_s {
+	const macho_t	 *macho;
+	chained_import_t *imports;
+	uint32_t	  nimports;
+	vec_t		 *fixups; /* chained_fixup_t, sorted by vmaddr */
+} chained_fixups_t;
+
+/* Walks every chain described by LC_DYLD_CHAINED_FIXUPS into a table of
+ * rebases and binds.
+ */
+bool chained_fixups_parse(const macho_t *macho, chained_fixups_t *cf);
+void chained_fixups_free(chained_fixups_t *cf);
+
+/* Returns the fixup at 'vmaddr', or NULL if the location is not fixed up.
+ */
+const chained_fixup_t *chained_fixups_at(const chained_fixups_t *cf,
+					 uint64_t		 vmaddr);
+
+/* Reads the pointer at 'vmaddr' as dyld would see it: the unslid target of
+ * a rebase, the addend of a bind (with 'import' set), or the raw bytes.
+ */
+bool chained_fixups_resolve(const chained_fixups_t *cf, uint64_t vmaddr,
+			    uint64_t *value, const chained_import_t **import);
+
+/* DYLD INFO
+ */
+#define DYLD_INFO_REBASE    0x1
+#define DYLD_INFO_BIND	    0x2
+#define DYLD_INFO_WEAK_BIND 0x4
+#define DYLD_INFO_LAZY_BIND 0x8
+#define DYLD_INFO_ALL	    0xf
+
+typedef struct dyld_info_record_s {
+	uint64_t    offset;  /* from the start of the segment */
+	int64_t	    addend;
+	const char *symbol;  /* binds only, points into the image */
+	int32_t	    ordinal; /* library ordinal or BIND_SPECIAL_DYLIB_* */
+	uint8_t	    segment; /* index into macho_t.segments */
+	uint8_t	    type;    /* REBASE_TYPE_* or BIND_TYPE_* */
+	uint8_t	    kind;    /* DYLD_INFO_* */
+	uint8_t	    flags;   /* BIND_SYMBOL_FLAGS_* */
+} dyld_info_record_t;
+
+/* Runs the LC_DYLD_INFO(_ONLY) opcode streams selected by 'kinds' and
+ * returns the resulting rebases and binds, in stream order.
+ */
+bool dyld_info_parse(const macho_t *macho, uint32_t kinds, vec_t **records);
+
+/* FUNCTION STARTS
+ */
+typedef struct function_range_s {
+	uint64_t start;
+	uint64_t end; /* exclusive */
+} function_range_t;
+
+typedef struct function_starts_s {
+	vec_t	*starts;     /* uint64_t, sorted unslid vmaddrs */
+	uint64_t text_start; /* __TEXT,__text bounds, ranges are clipped to */
+	uint64_t text_end;
+} function_starts_t;
+
+/* Decodes LC_FUNCTION_STARTS into absolute addresses.
+ */
+bool function_starts_parse(const macho_t *macho, function_starts_t *fs);
+void function_starts_free(function_starts_t *fs);
+
+/* Finds the function containing 'vmaddr'.
+ */
+bool function_starts_lookup(const function_starts_t *fs, uint64_t vmaddr,
+			    function_range_t *range);
+
+/* Iterates over the functions in __TEXT,__text, '*iter' starts at 0.
+ */
+bool function_starts_next(const function_starts_t *fs, size_t *iter,
+			  function_range_t *range);
+
+/* CODE SIGNATURE
+ */
+#define CODESIGN_HASH_SHA1	       1
+#define CODESIGN_HASH_SHA256	       2
+#define CODESIGN_HASH_SHA256_TRUNCATED 3
+
+typedef struct codesign_s {
+	const uint8_t *hashes;	   /* code slot 0 of the CodeDirectory */
+	const char    *identifier;
+	uint64_t       code_limit; /* bytes covered, from the slice start */
+	uint32_t       nslots;
+	uint32_t       page_size;
+	uint8_t	       hash_type; /* CODESIGN_HASH_* */
+	uint8_t	       hash_size;
+} codesign_t;
+
+/* Picks the strongest supported CodeDirectory of the LC_CODE_SIGNATURE
+ * SuperBlob.
+ */
+bool codesign_parse(const macho_t *macho, codesign_t *cs);
+
+/* Hashes the code pages on every CPU and returns the indices of the pages
+ * whose hash does not match, as a sorted vec_t of uint32_t.
+ */
+bool codesign_verify(const macho_t *macho, vec_t **mismatches);
+
+/* Same as codesign_verify, but for the __TEXT pages of 'macho' loaded at
+ * 'address' in 'task'.
+ */
+bool codesign_verify_task(task_t task, vm_address_t address,
+			  const macho_t *macho, vec_t **mismatches);
+
+/* XREFS
+ */
+typedef struct xref_index_s {
+	uint64_t *targets; /* referenced addresses, sorted */
+	uint32_t *offsets; /* ntargets + 1 row bounds into 'pcs' */
+	uint64_t *pcs;	   /* referencing instructions, sorted per target */
+	uint32_t *buckets; /* open addressing hash of target indices */
+	size_t	  ntargets;
+	size_t	  npcs;
+	size_t	  nbuckets;
+} xref_index_t;
+
+/* Indexes the ADR, ADRP+ADD/LDR/STR and literal load references made by an
+ * arm64 __TEXT,__text, the pc being the instruction that completes them.
+ * 'fs' is optional and lets the scan split on function boundaries.
+ */
+bool xrefs_build(const macho_t *macho, const function_starts_t *fs,
+		 xref_index_t *xi);
+void xrefs_free(xref_index_t *xi);
+
+/* Returns the 'count' pcs referencing 'target', NULL if there is none.
+ */
+const uint64_t *xrefs_to(const xref_index_t *xi, uint64_t target,
+			 size_t *count);
+
+/* CALL GRAPH
+ */
+#define CALLGRAPH_NONE UINT32_MAX
+
+typedef struct callgraph_node_s {
+	uint64_t    addr;
+	uint64_t    size;
+	const char *name; /* imported symbol of a stub, points into the image */
+} callgraph_node_t;
+
+typedef struct callgraph_s {
+	vec_t	 *nodes;	  /* callgraph_node_t, functions then stubs */
+	size_t	  nfunctions;	  /* nodes below are functions, by address */
+	uint32_t *callees;	  /* node indices, sorted per caller */
+	uint32_t *callee_offsets; /* nodes + 1 row bounds into 'callees' */
+	uint32_t *callers;	  /* node indices, sorted per callee */
+	uint32_t *caller_offsets; /* nodes + 1 row bounds into 'callers' */
+	size_t	  nedges;
+} callgraph_t;
+
+/* Links the functions of an arm64 __TEXT,__text to the functions and
+ * __stubs entries they branch to with BL, or leave through B, B.cond, CBZ
+ * and TBZ. Without 'fs' the functions are the BL targets.
+ */
+bool callgraph_build(const macho_t *macho, const function_starts_t *fs,
+		     callgraph_t *cg);
+void callgraph_free(callgraph_t *cg);
+
+/* Returns the node containing 'addr', or CALLGRAPH_NONE.
+ */
+uint32_t callgraph_lookup(const callgraph_t *cg, uint64_t addr);
+const uint32_t *callgraph_callees(const callgraph_t *cg, uint32_t node,
+				  size_t *count);
+const uint32_t *callgraph_callers(const callgraph_t *cg, uint32_t node,
+				  size_t *count);
+
+/* INSTRUCTION PATTERNS
+ */
+typedef struct insn_mask_s {
+	uint32_t value;
+	uint32_t mask; /* 0 matches any instruction */
+	uint32_t gap;  /* up to that many instructions may follow this one */
+} insn_mask_t;
+
+typedef struct insn_pattern_s {
+	const insn_mask_t *insns;
+	size_t		   count;
+	size_t		   anchor; /* most selective word at a fixed position */
+	size_t		   span;   /* in bytes, gaps at their longest */
+} insn_pattern_t;
+
+/* Checks the masked words and picks the one candidates are looked for with.
+ * 'insns' is not copied.
+ */
+bool insn_pattern_init(insn_pattern_t *pattern, const insn_mask_t *insns,
+		       size_t count);
+
+/* Appends to 'pcs' (a vec_t of uint64_t) the address of the first
+ * instruction of every match, comparing eight words per step.
+ */
+bool insn_match(const insn_pattern_t *pattern, const uint8_t *buf,
+		size_t size, uint64_t addr, vec_t *pcs);
+bool insn_match_task(const insn_pattern_t *pattern, task_t task,
+		     mach_vm_address_t address, mach_vm_size_t size,
+		     vec_t *pcs);
+
+/* SIGNATURES
+ */
+#define SIGNATURE_GRAM 4 /* instructions per indexed n-gram */
+
+typedef struct signature_index_s {
+	const uint8_t *text;  /* __TEXT, in the image or 'owned' */
+	uint8_t	      *owned; /* copy read from a task */
+	uint64_t       base;  /* unslid address of 'text' */
+	size_t	       nwords;
+	uint64_t      *grams; /* key << 32 | word index, sorted by key */
+	size_t	       ngrams;
+} signature_index_t;
+
+/* Indexes every n-gram of instructions of an arm64 __TEXT, of a mapped
+ * image or of 'macho' loaded at 'address' in 'task', for the uniqueness
+ * checks of signature_generate.
+ */
+bool signature_index_build(signature_index_t *si, const macho_t *macho);
+bool signature_index_build_task(signature_index_t *si, task_t task,
+				vm_address_t address, const macho_t *macho);
+void signature_index_free(signature_index_t *si);
+
+/* Grows a signature from the instruction at 'addr' until no other place
+ * of __TEXT matches it, 'max' words at most. Relocated operands are
+ * wildcarded and '*count' words of 'sig' are set, ready for
+ * insn_pattern_init.
+ */
+bool signature_generate(const signature_index_t *si, uint64_t addr,
+			insn_mask_t *sig, size_t max, size_t *count);
+
+/* BINARY DIFF
+ */
+#define BINDIFF_ADDED	 0
+#define BINDIFF_REMOVED	 1
+#define BINDIFF_MODIFIED 2
+
+#define BINDIFF_BY_HASH	 0 /* same code */
+#define BINDIFF_BY_NAME	 1 /* same symbol */
+#define BINDIFF_BY_CALLS 2 /* same matched callers and callees */
+
+typedef struct bindiff_entry_s {
+	uint64_t    old_addr; /* 0 for an added function */
+	uint64_t    new_addr; /* 0 for a removed function */
+	const char *name;     /* points into an image, NULL when stripped */
+	uint8_t	    status;   /* BINDIFF_ADDED, _REMOVED or _MODIFIED */
+	uint8_t	    how;      /* BINDIFF_BY_*, how a modified one matched */
+} bindiff_entry_t;
+
+typedef struct bindiff_s {
+	vec_t *entries; /* bindiff_entry_t, by status then address */
+	size_t nadded;
+	size_t nremoved;
+	size_t nmodified;
+	size_t nunchanged;
+} bindiff_t;
+
+/* Compares the functions of two arm64 builds, split by the call graph.
+ * Each function is hashed with the branch offsets, ADRP pages and page
+ * offsets masked out, so code that only moved compares equal. Functions
+ * are paired on their hash, then on their name, then on their matched
+ * neighbours in the call graph, with hash joins. Both images must outlive
+ * the report.
+ */
+bool bindiff_build(const macho_t *old_image, const macho_t *new_image,
+		   bindiff_t *diff);
+void bindiff_free(bindiff_t *diff);
+
+/* OBJC
+ */
+#define OBJC_METHOD_CLASS 0x1 /* class (+) method */
+
+typedef struct objc_method_s {
+	const char *name;  /* selector */
+	const char *types; /* NULL when unreadable */
+	uint64_t    imp;   /* unslid */
+	uint32_t    flags; /* OBJC_METHOD_* */
+} objc_method_t;
+
+typedef struct objc_class_s {
+	uint64_t	     addr;	 /* unslid, of the class object */
+	uint64_t	     ro;	 /* unslid, of its class_ro_t */
+	uint64_t	     superclass; /* unslid, 0 when imported */
+	const char	    *name;
+	const char	    *super_name; /* imported superclass, or NULL */
+	const objc_method_t *methods;	 /* instance methods first */
+	uint32_t	     nmethods;
+	uint8_t		     state; /* how much of it was read */
+} objc_class_t;
+
+typedef struct objc_impl_s {
+	const objc_class_t  *cls;
+	const objc_method_t *method;
+} objc_impl_t;
+
+typedef struct objc_selref_s {
+	uint64_t    ref; /* unslid address of the reference */
+	const char *name;
+} objc_selref_t;
+
+typedef struct objc_s {
+	const macho_t	  *macho;
+	chained_fixups_t   fixups; /* of a file, when it has some */
+	task_t		   task;   /* MACH_PORT_NULL for a file */
+	uint64_t	   slide;
+	struct arena_s	  *arena;
+	struct strpool_s  *pool;    /* names read from the task */
+	objc_class_t	  *classes; /* in __objc_classlist order */
+	size_t		   nclasses;
+	objc_selref_t	  *selrefs;
+	size_t		   nselrefs;
+	struct strmap_s	  *by_name;
+	struct strmap_s	  *by_selector; /* first of a run in impls */
+	objc_impl_t	  *impls;	/* grouped by selector */
+	size_t		   nimpls;
+} objc_t;
+
+/* Reads the Objective-C metadata of a mapped image, or of 'macho' loaded
+ * at 'address' in 'task'. Only __objc_classlist is read upfront, classes
+ * are parsed on first use and the indices built by the first lookup.
+ * Nothing is thread-safe.
+ */
+bool objc_init(objc_t *objc, const macho_t *macho);
+bool objc_init_task(objc_t *objc, task_t task, vm_address_t address,
+		    const macho_t *macho);
+void objc_free(objc_t *objc);
+
+/* Classes with their name and superclass read, the methods are read by
+ * objc_methods (pointer and relative method lists).
+ */
+const objc_class_t  *objc_class_at(objc_t *objc, size_t index);
+const objc_class_t  *objc_class_find(objc_t *objc, const char *name);
+const objc_method_t *objc_methods(objc_t *objc, const objc_class_t *cls,
+				  size_t *count);
+
+/* Every class method and instance method named 'selector'.
+ */
+const objc_impl_t *objc_implementations(objc_t *objc, const char *selector,
+					size_t *count);
+const objc_selref_t *objc_selrefs(objc_t *objc, size_t *count);
+
+/* SWIFT
+ */
+#define SWIFT_TYPE_CLASS  16
+#define SWIFT_TYPE_STRUCT 17
+#define SWIFT_TYPE_ENUM	  18
+
+/* A mangled name left in the image: symbolic references embed offsets
+ * which only make sense at their address.
+ */
+typedef struct swift_span_s {
+	uint64_t addr; /* unslid */
+	uint32_t len;
+} swift_span_t;
+
+typedef struct swift_field_s {
+	const char  *name; /* NULL when unreadable */
+	swift_span_t type;
+	uint32_t     flags; /* 0x2 for a var */
+} swift_field_t;
+
+typedef struct swift_type_s {
+	const char	    *name; /* Module.Outer.Type */
+	uint64_t	     descriptor;       /* unslid */
+	uint64_t	     field_descriptor; /* unslid, 0 if none */
+	swift_span_t	     superclass;       /* of a class, len 0 if none */
+	const swift_field_t *fields;
+	uint32_t	     nfields;
+	uint8_t		     kind; /* SWIFT_TYPE_* */
+} swift_type_t;
+
+typedef struct swift_s {
+	const macho_t	   *macho;
+	chained_fixups_t    fixups; /* of a file, when it has some */
+	task_t		    task;   /* MACH_PORT_NULL for a file */
+	uint64_t	    slide;
+	uint8_t		   *text; /* data sections of __TEXT, for a task */
+	uint64_t	    text_addr;
+	uint64_t	    text_size;
+	struct arena_s	   *arena;
+	struct strpool_s   *pool;
+	vec_t		   *types; /* swift_type_t, in __swift5_types order */
+	struct strmap_s	   *by_name;
+} swift_t;
+
+/* Reads the nominal types listed in __swift5_types of a mapped image, or
+ * of 'macho' loaded at 'address' in 'task', with their fields. For a task,
+ * the data sections of __TEXT are copied in a few large reads.
+ */
+bool swift_init(swift_t *sw, const macho_t *macho);
+bool swift_init_task(swift_t *sw, task_t task, vm_address_t address,
+		     const macho_t *macho);
+void swift_free(swift_t *sw);
+
+const swift_type_t *swift_type_find(const swift_t *sw, const char *name);
+
+/* Writes a readable form of a mangled name to 'buf', see swift.c for how
+ * little of it is demangled.
+ */
+bool swift_demangle(swift_t *sw, const swift_span_t *span, char *buf,
+		    size_t size);
+
+/* OFFLINE PATCHING
+ */
+#define PATCH_FILE_SHARED 0x1 /* write through to the file */
+
+typedef struct patch_segment_s {
+	uint64_t			 vmaddr;
+	uint64_t			 fileoff; /* from the slice */
+	uint64_t			 filesize;
+	const struct segment_command_64 *seg;
+} patch_segment_t;
+
+typedef struct patch_file_s {
+	macho_t		 macho; /* over the mapping */
+	uint8_t		*map;
+	size_t		 map_size;
+	size_t		 slice_offset;
+	char		*path;
+	patch_segment_t *segments; /* with bytes in the file, by vmaddr */
+	size_t		 nsegments;
+	uint64_t	*dirty; /* bitmap of the modified pages of 'map' */
+	size_t		 npages;
+	size_t		 page_size;
+	uint32_t	 flags; /* PATCH_FILE_* */
+} patch_file_t;
+
+/* Maps the file at 'path' writable, and opens the image matching
+ * 'cputype' (CPU_TYPE_ANY picks the first FAT slice). The mapping is
+ * private unless PATCH_FILE_SHARED is given.
+ */
+bool patch_file_open(patch_file_t *pf, const char *path, int32_t cputype,
+		     uint32_t flags);
+void patch_file_close(patch_file_t *pf);
+
+/* Translations through the segments, file offsets are from the slice.
+ */
+bool patch_file_to_offset(const patch_file_t *pf, uint64_t vmaddr,
+			  uint64_t *fileoff);
+bool patch_file_to_vmaddr(const patch_file_t *pf, uint64_t fileoff,
+			  uint64_t *vmaddr);
+
+/* Copies every patch to the unslid vmbase + offset. Nothing is written
+ * unless all of them fit in a segment's file bytes, straddle no section
+ * boundary and do not overlap.
+ */
+bool patch_file_apply(patch_file_t *pf, const patch_t *patches,
+		      size_t count);
+
+/* Flushes the modified pages of a shared mapping ('path' is unused), or
+ * writes a private one to a new file renamed over 'path': a clone of the
+ * original with only the modified pages written when the filesystem can
+ * clone. 'path' cannot be the patched file itself.
+ */
+bool patch_file_save(patch_file_t *pf, const char *path);
+
+/* LOAD COMMAND EDITS
+ */
+#define MACHO_EDIT_ADD_DYLIB	  0
+#define MACHO_EDIT_ADD_WEAK_DYLIB 1
+#define MACHO_EDIT_REMOVE_DYLIB	  2
+#define MACHO_EDIT_ADD_RPATH	  3
+#define MACHO_EDIT_REMOVE_RPATH	  4
+
+typedef struct macho_edit_s {
+	uint32_t    op; /* MACHO_EDIT_* */
+	const char *path;
+} macho_edit_t;
+
+/* Applies 'edits' to the load commands of every slice of the file at
+ * 'path', in place and within the padding before the first section. New
+ * commands go last and existing ones are not added twice. The code
+ * signature is dropped when there is no room otherwise. Nothing is written
+ * unless every slice can be edited.
+ */
+bool macho_edit_file(const char *path, const macho_edit_t *edits,
+		     size_t count);
+
+/* macho_edit_file() on every path in parallel, returns how many failed.
+ */
+size_t macho_edit_files(const char *const *paths, size_t npaths,
+			const macho_edit_t *edits, size_t count);
+
+/* SHARED CACHE
+ */
+#define DYLD_CACHE_MAX_FILES 64
+
+typedef struct dyld_cache_file_s {
+	const uint8_t *map; /* the whole file */
+	size_t	       size;
+	char	      *path;
+	int	       fd;
+} dyld_cache_file_t;
+
+typedef struct dyld_cache_mapping_s {
+	uint64_t address;
+	uint64_t size;
+	uint64_t file_offset;
+	uint64_t slide_info_offset; /* in the same file, 0 when there is none */
+	uint64_t slide_info_size;
+	uint32_t file; /* index in 'files' */
+	uint32_t prot;
+} dyld_cache_mapping_t;
+
+typedef struct dyld_cache_image_s {
+	const char *path;    /* install name, in the main cache file */
+	uint64_t    address; /* of the mach header */
+} dyld_cache_image_t;
+
+typedef struct dyld_cache_range_s {
+	uint64_t start;
+	uint64_t end;
+	uint32_t image; /* index in 'images' */
+} dyld_cache_range_t;
+
+typedef struct dyld_cache_s {
+	uint8_t		     *base;   /* every mapping, laid out by address */
+	size_t		      size;
+	uint64_t	      vmbase; /* unslid address of 'base' */
+	uint8_t		      uuid[16];
+	dyld_cache_file_t     files[DYLD_CACHE_MAX_FILES]; /* main one first */
+	uint32_t	      nfiles;
+	dyld_cache_mapping_t *mappings; /* sorted by address */
+	size_t		      nmappings;
+	dyld_cache_image_t   *images; /* in cache order, aliases included */
+	size_t		      nimages;
+	dyld_cache_range_t   *ranges; /* image segments, sorted by address */
+	size_t		      nranges;
+	struct strmap_s	     *by_path;
+} dyld_cache_t;
+
+/* Maps the shared cache at 'path' and the subcaches next to it, laying
+ * their mappings out at their unslid addresses, and indexes the images by
+ * install name and by address.
+ */
+bool dyld_cache_open(dyld_cache_t *cache, const char *path);
+void dyld_cache_close(dyld_cache_t *cache);
+
+const dyld_cache_mapping_t *dyld_cache_mapping_for_address(
+	const dyld_cache_t *cache, uint64_t address);
+
+/* Bounds-checked pointer to 'size' bytes at an unslid address, NULL when
+ * they are not within one mapping.
+ */
+const uint8_t *dyld_cache_at_address(const dyld_cache_t *cache,
+				     uint64_t address, uint64_t size);
+
+const dyld_cache_image_t *dyld_cache_image_find(const dyld_cache_t *cache,
+						const char	   *path);
+
+/* Image whose segments hold 'address', __LINKEDIT excluded.
+ */
+const dyld_cache_image_t *dyld_cache_image_for_address(
+	const dyld_cache_t *cache, uint64_t address);
+
+/* Builds a view over a cached image, without copying it. Close it with
+ * macho_close(), the cache must outlive it.
+ */
+bool dyld_cache_image_macho(const dyld_cache_t *cache,
+			    const dyld_cache_image_t *image, macho_t *macho);
+
+/* Replaces the slid pointers of 'buf', a copy of the 'size' bytes at
+ * 'vmaddr', by their unslid targets, walking the slide info (versions 2, 3
+ * and 5) of every page that overlaps it.
+ */
+bool dyld_cache_unslide(const dyld_cache_t *cache, uint64_t vmaddr,
+			uint8_t *buf, uint64_t size);
+
+/* Writes a cached image to 'path' as a standalone Mach-O. Its segments get
+ * contiguous file offsets, its pointers are rebased from the slide info
+ * and __LINKEDIT is rebuilt with its own symbols, strings and linkedit
+ * data. Local symbols, which the cache keeps apart, are not restored.
+ */
+bool dyld_cache_extract(const dyld_cache_t *cache,
+			const dyld_cache_image_t *image, const char *path);
+
+/* Extracts 'images', or every image but the aliases when NULL, under 'dir'
+ * at their install names, in parallel. Returns how many failed.
+ */
+size_t dyld_cache_extract_images(const dyld_cache_t		 *cache,
+				 const dyld_cache_image_t *const *images,
+				 size_t count, const char *dir);
+
+/* FILESETS
+ */
+typedef struct fileset_symbol_s {
+	uint64_t    addr;
+	const char *name; /* points into the collection */
+} fileset_symbol_t;
+
+typedef struct fileset_entry_s {
+	const char		 *id; /* points into the collection */
+	uint64_t		  vmaddr;
+	uint64_t		  fileoff;
+	macho_t			  macho; /* once opened */
+	fileset_symbol_t	 *symbols; /* sorted by address, once indexed */
+	size_t			  nsymbols;
+	const struct section_64 **sections; /* sorted by address */
+	size_t			  nsections;
+	bool			  opened;
+	bool			  indexed;
+} fileset_entry_t;
+
+typedef struct fileset_s {
+	const macho_t	     *macho;
+	fileset_entry_t	     *entries; /* in load command order */
+	size_t		      nentries;
+	struct strmap_s	     *by_id;
+} fileset_t;
+
+/* Lists the LC_FILESET_ENTRY commands of an MH_FILESET image, such as a
+ * kernel collection, without opening any entry. 'macho' must outlive it.
+ */
+bool fileset_init(fileset_t *fs, const macho_t *macho);
+void fileset_free(fileset_t *fs);
+
+fileset_entry_t *fileset_find(const fileset_t *fs, const char *id);
+
+/* View over an entry, sharing the buffer of the collection, built the
+ * first time it is asked for.
+ */
+const macho_t *fileset_entry_open(const fileset_t *fs, fileset_entry_t *entry);
+
+/* Builds the symbol and section indices of an entry, once. fileset_index()
+ * does so for 'count' distinct 'entries', or all of them when NULL, in
+ * parallel. An entry must not be opened or indexed from two threads.
+ */
+bool fileset_entry_index(const fileset_t *fs, fileset_entry_t *entry);
+bool fileset_index(const fileset_t *fs, fileset_entry_t **entries,
+		   size_t count);
+
+/* Closest symbol at or before 'addr', and the section holding it, in an
+ * indexed entry.
+ */
+const fileset_symbol_t	*fileset_symbol_at(const fileset_entry_t *entry,
+					   uint64_t		  addr);
+const struct section_64 *fileset_section_at(const fileset_entry_t *entry,
+					    uint64_t		   addr);
+
+/* UNWINDING
+ */
+typedef struct unwind_info_s {
+	const uint8_t	      *section; /* __TEXT,__unwind_info */
+	uint64_t	       size;
+	uint64_t	       base;	/* function offsets are relative to */
+	const uint32_t	      *common;	/* encodings shared by every page */
+	uint32_t	       ncommon;
+	const void	      *index;	/* first level, ends with a sentinel */
+	uint32_t	       nindex;
+	struct unwind_page_s **pages;	/* second level, decoded on first use */
+} unwind_info_t;
+
+typedef struct unwind_image_s {
+	uint64_t      start; /* loaded __TEXT range */
+	uint64_t      end;
+	uint64_t      slide;
+	int32_t	      cputype; /* compact unwind is only read for arm64 */
+	unwind_info_t info;
+} unwind_image_t;
+
+/* The registers an arm64 stack walk needs, the callee-saved ones do not
+ * affect where frames return to.
+ */
+typedef struct unwind_regs_s {
+	uint64_t pc;
+	uint64_t lr;
+	uint64_t sp;
+	uint64_t fp;
+} unwind_regs_t;
+
+/* Reads the compact unwind info of an image, an image without any is not an
+ * error but never finds an encoding. 'macho' must outlive it.
+ */
+bool unwind_info_init(unwind_info_t *ui, const macho_t *macho);
+void unwind_info_free(unwind_info_t *ui);
+
+/* Finds the encoding of the function holding the unslid 'vmaddr' and where
+ * it starts. Second level pages are decoded and kept the first time they are
+ * looked into, so an unwind_info_t must not be used from two threads.
+ */
+bool unwind_info_lookup(unwind_info_t *ui, uint64_t vmaddr,
+			uint32_t *encoding, uint64_t *start);
+
+/* Image whose header is loaded at 'address' in the unwound task. */
+bool unwind_image_init(unwind_image_t *image, const macho_t *macho,
+		       uint64_t address);
+void unwind_image_free(unwind_image_t *image);
+
+/* Walks the stack of a suspended thread from 'regs', storing up to 'max'
+ * return addresses in 'pcs', the current pc first, and returns how many.
+ * 'images' are sorted by start. Frames are stepped with the compact unwind
+ * encodings, through the frame pointer chain where there are none, and stack
+ * words are read in windows of UNWIND_STACK_WINDOW bytes.
+ */
+#define UNWIND_STACK_WINDOW 0x4000
+
+size_t unwind_stack(task_t task, const unwind_regs_t *regs,
+		    unwind_image_t *images, size_t nimages, uint64_t *pcs,
+		    size_t max);
+
+/* PROFILING
+ */
+#define PROFILE_MAX_FRAMES 128
+
+typedef struct profile_config_s {
+	uint32_t frequency;  /* samples per second */
+	uint64_t duration;   /* in nanoseconds, 0 to run until profile_stop() */
+	uint64_t budget;     /* nanoseconds a sample may keep the task
+			      * suspended, 0 for no limit
+			      */
+	uint32_t max_frames; /* per stack, up to PROFILE_MAX_FRAMES */
+} profile_config_t;
+
+typedef struct profile_stack_s {
+	const uint64_t *frames; /* leaf first, in the arena */
+	uint32_t	nframes;
+	uint64_t	count; /* threads sampled there */
+	uint64_t	hash;
+} profile_stack_t;
+
+typedef struct profile_sample_s {
+	uint64_t time;	   /* nanoseconds since the start */
+	uint64_t pause;	   /* nanoseconds the task stayed suspended */
+	uint32_t nthreads; /* walked */
+	uint32_t skipped;  /* left out once the budget was spent */
+} profile_sample_t;
+
+typedef struct profile_s {
+	struct arena_s	     *arena;
+	vec_t		     *stacks;  /* profile_stack_t, each one once */
+	vec_t		     *samples; /* profile_sample_t */
+	struct profile_map_s *by_frames;
+	atomic_bool	      stop;
+} profile_t;
+
+bool profile_init(profile_t *prof);
+void profile_free(profile_t *prof);
+
+/* Suspends 'task' 'frequency' times a second and walks the stack of each of
+ * its threads against 'images', sorted by start, until the budget of the
+ * sample is spent. Identical stacks are stored once, with a count. Fails
+ * upfront when not built for arm64.
+ */
+bool profile_run(profile_t *prof, task_t task, unwind_image_t *images,
+		 size_t nimages, const profile_config_t *config);
+void profile_stop(profile_t *prof);
+
+/* Writes a line per stack, root first, in the folded format flame graph
+ * tools read. Each distinct pc is passed to 'symbolize' once, addresses are
+ * printed where it is NULL or fails.
+ */
+typedef bool (*profile_symbolize_t)(void *ctx, uint64_t pc, char *buf,
+				    size_t size);
+
+bool profile_write_folded(const profile_t *prof, int fd,
+			  profile_symbolize_t symbolize, void *ctx);
+
+/* Median, 99th percentile and longest pause of the samples taken. */
+void profile_pauses(const profile_t *prof, uint64_t *median, uint64_t *p99,
+		    uint64_t *max);
+
+/* SYMBOLICATION
+ */
+typedef struct symbolicate_image_s {
+	const macho_t *macho;
+	const char    *name;	/* reported along with its addresses */
+	uint64_t       address; /* of its header in the symbolicated task */
+} symbolicate_image_t;
+
+typedef struct symbolication_s {
+	const symbolicate_image_t *image;  /* NULL outside of every __TEXT */
+	const char		  *symbol; /* NULL before the first one */
+	uint64_t		   offset; /* from the symbol, else the image */
+} symbolication_t;
+
+typedef struct symbolicator_s {
+	struct arena_s		  *arena;
+	struct strpool_s	  *names;
+	struct symbolicator_map_s *by_key;
+} symbolicator_t;
+
+/* Keeps the symbols of every image it resolves against, by UUID (or name
+ * when there is none), so later batches do not parse them again. The names
+ * are copied and outlive the images.
+ */
+bool symbolicator_init(symbolicator_t *sym);
+void symbolicator_free(symbolicator_t *sym);
+
+/* Resolves 'count' addresses into 'out', in the same order. They are sorted,
+ * grouped by image with a binary search of the images' __TEXT ranges, and
+ * each group is merged against the sorted symbols of its image.
+ */
+bool symbolicate(symbolicator_t *sym, const symbolicate_image_t *images,
+		 size_t nimages, const uint64_t *addrs, size_t count,
+		 symbolication_t *out);
+
+/* IMAGE CACHE
+ */
+#define IMAGE_CACHE_MAGIC   0x4349554d /* "MUIC" */
+#define IMAGE_CACHE_VERSION 1
+
+/* Everything in an index file is found through offsets from its start, so
+ * it is used where it is mapped, as is.
+ */
+typedef struct image_cache_table_s {
+	uint64_t offset;
+	uint64_t count;
+} image_cache_table_t;
+
+typedef struct image_cache_header_s {
+	uint32_t	    magic;
+	uint32_t	    version;
+	int32_t		    cputype;
+	int32_t		    cpusubtype; /* capability bits masked */
+	uint8_t		    uuid[16];
+	uint64_t	    size; /* of the file */
+	uint64_t	    vmbase;
+	uint64_t	    text_start; /* function ranges are clipped to */
+	uint64_t	    text_end;
+	image_cache_table_t segments;	     /* image_cache_segment_t */
+	image_cache_table_t symbols;	     /* image_cache_symbol_t, by address */
+	image_cache_table_t symbol_hash;     /* uint32_t, symbol index + 1 */
+	image_cache_table_t function_starts; /* uint64_t, ascending */
+	image_cache_table_t exports;	     /* image_cache_export_t, by name */
+	image_cache_table_t strings;	     /* bytes, the first one is NUL */
+} image_cache_header_t;
+
+typedef struct image_cache_segment_s {
+	char	 name[16];
+	uint64_t vmaddr;
+	uint64_t vmsize;
+	uint64_t fileoff;
+	uint64_t filesize;
+	uint32_t maxprot;
+	uint32_t initprot;
+} image_cache_segment_t;
+
+typedef struct image_cache_symbol_s {
+	uint64_t addr; /* unslid */
+	uint32_t name; /* into the strings */
+	uint32_t type; /* n_type */
+} image_cache_symbol_t;
+
+typedef struct image_cache_export_s {
+	uint64_t addr;	 /* unslid, or the stub of a resolver */
+	uint64_t other;	 /* resolver, or the ordinal of a re-export */
+	uint32_t name;	 /* into the strings */
+	uint32_t import; /* name in the re-exported library, 0 when the same */
+	uint32_t flags;	 /* EXPORT_SYMBOL_FLAGS_* */
+	uint32_t reserved;
+} image_cache_export_t;
+
+typedef struct image_cache_s {
+	const image_cache_header_t  *header;
+	const image_cache_segment_t *segments;
+	const image_cache_symbol_t  *symbols;
+	const uint32_t		    *symbol_hash;
+	const uint64_t		    *function_starts;
+	const image_cache_export_t  *exports;
+	const char		    *strings;
+	void			    *map;
+	size_t			     map_size;
+} image_cache_t;
+
+/* Indices live in 'dir'/<UUID>/<cputype>.<cpusubtype>. image_cache_load()
+ * maps one and fails without logging when there is none, image_cache_store()
+ * writes the one of 'macho' (replacing it atomically) and image_cache_open()
+ * does the first and falls back to the second.
+ */
+bool image_cache_load(image_cache_t *ic, const char *dir,
+		      const uint8_t uuid[16], int32_t cputype,
+		      int32_t cpusubtype);
+bool image_cache_store(const char *dir, const macho_t *macho);
+bool image_cache_open(image_cache_t *ic, const char *dir,
+		      const macho_t *macho);
+void image_cache_close(image_cache_t *ic);
+
+/* String at 'offset', NULL when out of bounds. */
+const char *image_cache_string(const image_cache_t *ic, uint32_t offset);
+
+const image_cache_symbol_t *image_cache_symbol_find(const image_cache_t *ic,
+						    const char *name);
+/* Closest symbol at or before the unslid 'addr'. */
+const image_cache_symbol_t *image_cache_symbol_at(const image_cache_t *ic,
+						  uint64_t addr);
+const image_cache_export_t *image_cache_export_find(const image_cache_t *ic,
+						    const char *name);
+bool image_cache_function_at(const image_cache_t *ic, uint64_t addr,
+			     function_range_t *range);
+
+/* PROCESS TABLE
+ */
+#define PROCESS_NAME_MAX 33 /* 2 * MAXCOMLEN + 1 */
+
+typedef struct process_entry_s {
+	pid_t pid;
+	pid_t ppid;
+	char  name[PROCESS_NAME_MAX];
+	char *path; /* NULL when it could not be read */
+} process_entry_t;
+
+typedef struct process_table_s {
+	vec_t  *entries; /* process_entry_t, sorted by pid */
+	pid_t  *pids;	 /* listing buffer, grown to fit */
+	size_t	npids;
+	size_t	queried; /* processes looked up by the last refresh */
+} process_table_t;
+
+bool process_table_init(process_table_t *pt);
+void process_table_free(process_table_t *pt);
+
+/* Lists every pid and only looks up the ones that were not there at the
+ * previous refresh, dropping those that are gone. A pid reused between two
+ * refreshes keeps the entry of its previous owner.
+ */
+bool process_table_refresh(process_table_t *pt);
+
+const process_entry_t *process_table_get(const process_table_t *pt,
+					 pid_t			pid);
+
+/* Appends a pointer to every entry whose name, or path when 'pattern' holds
+ * a '/', matches the glob 'pattern' to 'matches' (a vec of
+ * const process_entry_t *, created when NULL). Pointers are valid until the
+ * next refresh. Returns how many matched.
+ */
+size_t process_table_find(const process_table_t *pt, const char *pattern,
+			  vec_t **matches);
+
+/* STRINGS
+ */
+#define STRINGS_ASCII	0x1
+#define STRINGS_UTF16LE 0x2
+
+typedef struct string_span_s {
+	uint64_t    addr; /* of the first character */
+	const char *str;  /* in the scanned buffer or the pool, else NULL */
+	uint32_t    len;  /* in bytes, terminator excluded */
+	uint8_t	    encoding; /* STRINGS_* */
+} string_span_t;
+
+typedef struct strings_s {
+	vec_t		 *spans;   /* string_span_t, in discovery order */
+	struct strpool_s *pool;	   /* optional, interns every span */
+	size_t		  min_len; /* in characters */
+	uint32_t	  flags;   /* STRINGS_* to look for */
+	uint64_t	  done;	   /* terminators below are already reported */
+} strings_t;
+
+/* Collects NUL-terminated runs of printable characters, classifying the
+ * input 64 bytes at a time. UTF-16LE strings are looked for at even offsets.
+ */
+bool strings_init(strings_t *st, size_t min_len, uint32_t flags,
+		  struct strpool_s *pool);
+void strings_free(strings_t *st);
+bool strings_scan(strings_t *st, const uint8_t *buf, size_t size,
+		  uint64_t addr);
+bool strings_scan_section(strings_t *st, const macho_t *macho,
+			  const struct section_64 *sect);
+
+/* Scans the readable regions of a task within the range, 'str' is only set
+ * when interning.
+ */
+bool strings_scan_task(strings_t *st, task_t task, mach_vm_address_t address,
+		       mach_vm_size_t size);
+
+/* SPAWN
+ */
+#define SPAWN_SUSPENDED (1U << 0) /* the process starts stopped */
+
+typedef struct spawn_opts_s {
+	char *const *argv; /* NULL for { path, NULL } */
+	char *const *envp; /* NULL for an empty environment */
+	int	     stdin_fd; /* -1 to inherit */
+	int	     stdout_fd;
+	int	     stderr_fd;
+	uint32_t     flags; /* SPAWN_* */
+} spawn_opts_t;
+
+/* A resident helper forked from the caller that launches programs on its
+ * behalf, so a launch does not pay for the caller's address space. The
+ * programs are children of the helper and are reaped through
+ * spawn_server_wait(), which polls the helper rather than block it, with
+ * a backoff from 50us to 10ms. spawn_server_poll() is a single poll that
+ * sets 'exited' once the program has been reaped.
+ * Requests from several threads are serialized.
+ */
+typedef struct spawn_server_s {
+	pid_t		pid;
+	int		sock;
+	pthread_mutex_t lock;
+} spawn_server_t;
+
+void spawn_opts_init(spawn_opts_t *opts);
+bool spawn(pid_t *pid, const char *path, const spawn_opts_t *opts);
+
+/* Launches 'binpath' stopped, without arguments or environment. */
+bool spawn_program(pid_t *pid, const char *binpath);
+
+/* Forks the helper, best done before the caller starts threads since the
+ * helper keeps running after fork().
+ */
+bool spawn_server_start(spawn_server_t *srv);
+void spawn_server_stop(spawn_server_t *srv);
+bool spawn_server_launch(spawn_server_t *srv, pid_t *pid, const char *path,
+			 const spawn_opts_t *opts);
+bool spawn_server_wait(spawn_server_t *srv, pid_t pid, int *status);
+bool spawn_server_poll(spawn_server_t *srv, pid_t pid, int *status,
+		       bool *exited);
+
 /* IMAGE
 */
-bool spawn_program(pid_t *pid, const char *binpath);
 bool get_image_address_by_cputype(task_t task, vm_address_t *baddr,
 				  int32_t cputype);
 
@@ -41,6 +1155,8 @@ bool memory_r(task_t task, vm_address_t addr, const uint8_t *buf,
 	      vm_size_t bufsize);
 bool memory_rchunk(task_t task, vm_address_t addr, const uint8_t *buf,
 		   vm_size_t bufsize);
+bool memory_rpartial(task_t task, vm_address_t addr, const uint8_t *buf,
+		     vm_size_t bufsize, vm_size_t *nread);
 bool memory_rderef_ptr_at(task_t task, vm_address_t addr, const uint8_t *buffer,
 			  vm_size_t bufsize);
 bool memory_flush_caches(task_t task, mach_vm_address_t address,
@@ -52,6 +1168,8 @@ bool memory_prot_set(vm_map_t task, mach_vm_address_t address,
 bool memory_region_info_get(task_t task, vm_address_t address,
 			    mach_vm_address_t *region,
 			    mach_vm_size_t    *region_size);
+bool memory_region_next(task_t task, mach_vm_address_t *address,
+			mach_vm_size_t *size, vm_prot_t *prot);
 bool memory_dump(task_t task, vm_address_t address, size_t size);
 
 /* TASK
@@ -62,5 +1180,85 @@ bool process_find_by_name(const char *name, pid_t *pid);
 bool process_get_task(pid_t pid, task_t *task);
 bool process_suspend(task_t task);
 bool process_resume(task_t task);
+bool process_threads(task_t task, thread_act_array_t *threads,
+		     mach_msg_type_number_t *count);
+void process_threads_free(thread_act_array_t threads,
+			  mach_msg_type_number_t count);
+
+/* Registers of a stopped thread, in the form unwind_stack() takes. With
+ * 'quiet', a thread that has exited fails without logging. Only arm64
+ * threads are supported.
+ */
+bool thread_regs_get(thread_act_t thread, unwind_regs_t *regs, bool quiet);
+
+typedef struct process_image_s {
+	uint64_t    address; /* of the Mach-O header */
+	const char *path;    /* in the pool, NULL when it could not be read */
+} process_image_t;
+
+/* Appends the images dyld has loaded in a task to 'images' (a vec of
+ * process_image_t, created when NULL), in load order.
+ */
+bool process_images(task_t task, struct strpool_s *paths, vec_t **images);
+
+/* SESSION
+ */
+typedef struct session_target_s {
+	pid_t		  pid;
+	task_t		  task;
+	vec_t		 *images; /* process_image_t, NULL until enumerated */
+	struct strpool_s *paths;  /* of the images */
+	symbolicator_t	  sym;
+	size_t		  failures; /* operations that failed on this target */
+} session_target_t;
+
+typedef struct session_s {
+	vec_t  *targets;  /* session_target_t */
+	size_t	nworkers; /* 0 for one per target */
+} session_t;
+
+/* Called once per target, 'index' is the target's position in the session.
+ * Calls for different targets run concurrently, so anything shared through
+ * 'ctx' must be indexed or synchronized.
+ */
+typedef bool (*session_fn_t)(session_target_t *target, size_t index,
+			     void *ctx);
+
+bool session_init(session_t *s, size_t nworkers);
+void session_free(session_t *s);
+
+/* Targets are only added between operations. session_attach_matching()
+ * skips the processes it cannot get a task for and returns how many it
+ * attached to.
+ */
+bool   session_attach(session_t *s, pid_t pid);
+size_t session_attach_matching(session_t *s, const process_table_t *pt,
+			       const char *pattern);
+size_t session_count(const session_t *s);
+session_target_t *session_target(const session_t *s, size_t index);
+
+/* Runs 'fn' against every target on its own worker, a failing target does
+ * not stop the others. 'ok', when set, gets one flag per target. Returns how
+ * many targets succeeded.
+ */
+size_t session_run(session_t *s, session_fn_t fn, void *ctx, bool *ok);
+
+/* Reads 'size' bytes at the same address in every target, into 'bufs' which
+ * holds one buffer of 'size' bytes per target. 'nread', when set, gets what
+ * each target could read.
+ */
+size_t session_read(session_t *s, mach_vm_address_t address, uint8_t *bufs,
+		    vm_size_t size, vm_size_t *nread, bool *ok);
+
+/* Enumerates the images of every target into target->images. Targets that
+ * already have them are skipped unless 'refresh' is set.
+ */
+size_t session_images(session_t *s, bool refresh, bool *ok);
+
+/* Scans a range of every target with its own strings_t, 'st' holds one per
+ * target, initialized by the caller with pools that are not shared.
+ */
+size_t session_strings(session_t *s, strings_t *st, mach_vm_address_t address,
+		       mach_vm_size_t size, bool *ok);
 
 #endif /* __IOS_MACOS_UTILS_H__ */
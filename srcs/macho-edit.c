@@ -0,0 +1,586 @@
+#include "common.h"
+#include "ios-macos-utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <mach-o/fat.h>
+#include <mach-o/loader.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* What is to be written to one slice, computed before anything is.
+ */
+typedef struct edit_plan_s {
+	uint64_t offset;   /* of the slice in the file */
+	uint64_t size;	   /* of the slice, after the edits */
+	uint8_t *cmds;	   /* header and load commands */
+	size_t	 len;	   /* of 'cmds' */
+	size_t	 old_len;  /* what the header and load commands covered */
+	bool	 changed;
+} edit_plan_t;
+
+typedef struct edit_bulk_s {
+	const char *const  *paths;
+	const macho_edit_t *edits;
+	size_t		    count;
+	atomic_size_t	    failed;
+} edit_bulk_t;
+
+static bool edit_pread(int fd, void *buf, size_t size, uint64_t offset)
+{
+	ssize_t n = pread(fd, buf, size, (off_t)offset);
+
+	if (n != (ssize_t)size) {
+		__logger(error, "pread: %s",
+			 n < 0 ? strerror(errno) : "short read");
+		return (false);
+	}
+
+	return (true);
+}
+
+static bool edit_pwrite(int fd, const void *buf, size_t size,
+			uint64_t offset)
+{
+	ssize_t n = pwrite(fd, buf, size, (off_t)offset);
+
+	if (n != (ssize_t)size) {
+		__logger(error, "pwrite: %s",
+			 n < 0 ? strerror(errno) : "short write");
+		return (false);
+	}
+
+	return (true);
+}
+
+static bool edit_is_dylib(uint32_t cmd)
+{
+	return (cmd == LC_LOAD_DYLIB || cmd == LC_LOAD_WEAK_DYLIB ||
+		cmd == LC_REEXPORT_DYLIB || cmd == LC_LAZY_LOAD_DYLIB ||
+		cmd == LC_LOAD_UPWARD_DYLIB);
+}
+
+/* Path carried by a dylib or rpath command, NULL for other commands or
+ * when it does not fit.
+ */
+static const char *edit_command_path(const struct load_command *lc)
+{
+	uint32_t offset;
+
+	if (edit_is_dylib(lc->cmd))
+		offset = ((const struct dylib_command *)lc)->dylib.name.offset;
+	else if (lc->cmd == LC_RPATH)
+		offset = ((const struct rpath_command *)lc)->path.offset;
+	else
+		return (NULL);
+
+	if (offset >= lc->cmdsize ||
+	    !memchr((const char *)lc + offset, '\0', lc->cmdsize - offset))
+		return (NULL);
+	return ((const char *)lc + offset);
+}
+
+static bool edit_matches(const struct load_command *lc, bool rpath,
+			 const char *path)
+{
+	const char *p = edit_command_path(lc);
+
+	return (p && (rpath ? lc->cmd == LC_RPATH : edit_is_dylib(lc->cmd)) &&
+		!strcmp(p, path));
+}
+
+/* Lowest file offset of section or segment data, the load commands can
+ * grow up to there.
+ */
+static uint64_t edit_limit(const uint8_t *cmds, uint32_t ncmds,
+			   uint64_t slice_size)
+{
+	uint64_t limit = slice_size;
+
+	for (uint32_t i = 0; i < ncmds; i++) {
+		const struct segment_command_64 *seg = (const void *)cmds;
+		const struct section_64		*sect;
+
+		cmds += seg->cmdsize;
+		if (seg->cmd != LC_SEGMENT_64)
+			continue;
+
+		if (seg->fileoff && seg->filesize)
+			limit = MIN(limit, seg->fileoff);
+
+		sect = (const struct section_64 *)(seg + 1);
+		for (uint32_t j = 0; j < seg->nsects; j++) {
+			uint32_t type = sect[j].flags & SECTION_TYPE;
+
+			if (sect[j].offset && type != S_ZEROFILL &&
+			    type != S_GB_ZEROFILL &&
+			    type != S_THREAD_LOCAL_ZEROFILL)
+				limit = MIN(limit, sect[j].offset);
+		}
+	}
+
+	return (limit);
+}
+
+static bool edit_validate(const uint8_t *cmds, uint32_t ncmds,
+			  uint32_t sizeofcmds)
+{
+	const uint8_t *end = cmds + sizeofcmds;
+
+	for (uint32_t i = 0; i < ncmds; i++) {
+		const struct load_command	*lc  = (const void *)cmds;
+		const struct segment_command_64 *seg = (const void *)cmds;
+		bool				 bad;
+
+		bad = end - cmds < (ptrdiff_t)sizeof(*lc) ||
+		      lc->cmdsize < sizeof(*lc) || lc->cmdsize > end - cmds;
+		if (!bad && lc->cmd == LC_SEGMENT_64)
+			bad = lc->cmdsize < sizeof(*seg) ||
+			      (lc->cmdsize - sizeof(*seg)) /
+					      sizeof(struct section_64) <
+				      seg->nsects;
+		if (bad) {
+			__logger(error, "macho_edit: malformed load command %u",
+				 i);
+			return (false);
+		}
+		cmds += lc->cmdsize;
+	}
+
+	return (true);
+}
+
+/* Appends a dylib or rpath command for 'path' at 'at', which has room.
+ */
+static size_t edit_new_command(uint8_t *at, uint32_t op, const char *path)
+{
+	size_t len = strlen(path) + 1;
+
+	if (op == MACHO_EDIT_ADD_RPATH) {
+		struct rpath_command *rc = (struct rpath_command *)at;
+
+		rc->cmd		= LC_RPATH;
+		rc->cmdsize	= (sizeof(*rc) + len + 7) & ~7u;
+		rc->path.offset = sizeof(*rc);
+		(void)memset(at + sizeof(*rc), 0, rc->cmdsize - sizeof(*rc));
+		(void)memcpy(at + sizeof(*rc), path, len);
+		return (rc->cmdsize);
+	}
+
+	struct dylib_command *dc = (struct dylib_command *)at;
+
+	dc->cmd	    = op == MACHO_EDIT_ADD_WEAK_DYLIB ? LC_LOAD_WEAK_DYLIB :
+							LC_LOAD_DYLIB;
+	dc->cmdsize = (sizeof(*dc) + len + 7) & ~7u;
+	dc->dylib.name.offset		= sizeof(*dc);
+	dc->dylib.timestamp		= 2;
+	dc->dylib.current_version	= 0x10000;
+	dc->dylib.compatibility_version = 0x10000;
+	(void)memset(at + sizeof(*dc), 0, dc->cmdsize - sizeof(*dc));
+	(void)memcpy(at + sizeof(*dc), path, len);
+	return (dc->cmdsize);
+}
+
+/* Drops LC_CODE_SIGNATURE, which the edits invalidate anyway, and cuts its
+ * blob off the end of __LINKEDIT when it is last.
+ */
+static bool edit_drop_signature(uint8_t *cmds, uint32_t *ncmds,
+				uint32_t *sizeofcmds, uint64_t *size)
+{
+	const struct linkedit_data_command *sig = NULL;
+	struct segment_command_64	   *linkedit = NULL;
+	uint8_t				   *p	     = cmds;
+	uint32_t			    dataoff;
+	uint32_t			    datasize;
+	uint32_t			    cmdsize;
+
+	for (uint32_t i = 0; i < *ncmds; i++) {
+		const struct load_command *lc = (const void *)p;
+
+		if (lc->cmd == LC_CODE_SIGNATURE)
+			sig = (const void *)p;
+		else if (lc->cmd == LC_SEGMENT_64 &&
+			 !strncmp(((struct segment_command_64 *)p)->segname,
+				  SEG_LINKEDIT, 16))
+			linkedit = (struct segment_command_64 *)p;
+		p += lc->cmdsize;
+	}
+
+	if (!sig)
+		return (false);
+
+	dataoff	 = sig->dataoff;
+	datasize = sig->datasize;
+	cmdsize	 = sig->cmdsize;
+
+	if (linkedit && dataoff >= linkedit->fileoff &&
+	    (uint64_t)dataoff + datasize ==
+		    linkedit->fileoff + linkedit->filesize &&
+	    (uint64_t)dataoff + datasize == *size) {
+		linkedit->filesize = dataoff - linkedit->fileoff;
+		*size		   = dataoff;
+	}
+
+	(void)memmove((uint8_t *)sig, (const uint8_t *)sig + cmdsize,
+		      cmds + *sizeofcmds - ((const uint8_t *)sig + cmdsize));
+	*sizeofcmds -= cmdsize;
+	(*ncmds)--;
+	return (true);
+}
+
+/* Copies the commands that no removal matches. Removing a dylib is only
+ * allowed when no other one follows, the ordinals binds refer to the
+ * libraries with would shift otherwise.
+ */
+static bool edit_remove(const uint8_t *old, uint32_t old_ncmds, uint8_t *cmds,
+			uint32_t *ncmds, uint32_t *sizeofcmds,
+			const macho_edit_t *edits, size_t count)
+{
+	bool removed_dylib = false;
+
+	for (uint32_t i = 0; i < old_ncmds; i++) {
+		const struct load_command *lc	= (const void *)old;
+		bool			   drop = false;
+
+		old += lc->cmdsize;
+		for (size_t e = 0; e < count && !drop; e++) {
+			if (edits[e].op == MACHO_EDIT_REMOVE_DYLIB)
+				drop = edit_matches(lc, false, edits[e].path);
+			else if (edits[e].op == MACHO_EDIT_REMOVE_RPATH)
+				drop = edit_matches(lc, true, edits[e].path);
+		}
+
+		if (drop) {
+			removed_dylib |= edit_is_dylib(lc->cmd);
+			continue;
+		}
+
+		if (removed_dylib && edit_is_dylib(lc->cmd)) {
+			__logger(error,
+				 "macho_edit: cannot remove a dylib loaded "
+				 "before %s",
+				 edit_command_path(lc));
+			return (false);
+		}
+
+		(void)memcpy(cmds + *sizeofcmds, lc, lc->cmdsize);
+		*sizeofcmds += lc->cmdsize;
+		(*ncmds)++;
+	}
+
+	return (true);
+}
+
+/* Appends the dylibs and rpaths that are not there yet, after the last
+ * command so that no library ordinal moves.
+ */
+static void edit_add(uint8_t *cmds, uint32_t *ncmds, uint32_t *sizeofcmds,
+		     const macho_edit_t *edits, size_t count)
+{
+	for (size_t e = 0; e < count; e++) {
+		const uint8_t *p      = cmds;
+		bool	       rpath  = edits[e].op == MACHO_EDIT_ADD_RPATH;
+		bool	       exists = false;
+
+		if (edits[e].op != MACHO_EDIT_ADD_DYLIB &&
+		    edits[e].op != MACHO_EDIT_ADD_WEAK_DYLIB &&
+		    edits[e].op != MACHO_EDIT_ADD_RPATH)
+			continue;
+
+		for (uint32_t i = 0; i < *ncmds && !exists; i++) {
+			const struct load_command *lc = (const void *)p;
+
+			exists = edit_matches(lc, rpath, edits[e].path);
+			p += lc->cmdsize;
+		}
+
+		if (!exists) {
+			*sizeofcmds += edit_new_command(cmds + *sizeofcmds,
+							edits[e].op,
+							edits[e].path);
+			(*ncmds)++;
+		}
+	}
+}
+
+/* Rebuilds the header and load commands of the slice at 'plan->offset'
+ * in memory, nothing is written.
+ */
+static bool edit_plan_slice(int fd, edit_plan_t *plan,
+			    const macho_edit_t *edits, size_t count)
+{
+	struct mach_header_64 mh;
+	uint8_t		     *old;
+	uint8_t		     *cmds;
+	uint32_t	      ncmds	 = 0;
+	uint32_t	      sizeofcmds = 0;
+	uint64_t	      limit;
+	size_t		      room = 0;
+
+	if (!edit_pread(fd, &mh, sizeof(mh), plan->offset))
+		return (false);
+
+	if (mh.magic != MH_MAGIC_64) {
+		__logger(error, "macho_edit: unsupported magic: %s",
+			 magic_to_cstr(mh.magic));
+		return (false);
+	}
+
+	if (sizeof(mh) + (uint64_t)mh.sizeofcmds > plan->size) {
+		__logger(error, "macho_edit: load commands out of bounds");
+		return (false);
+	}
+
+	for (size_t i = 0; i < count; i++)
+		room += sizeof(struct dylib_command) + strlen(edits[i].path) +
+			8;
+
+	plan->old_len = sizeof(mh) + mh.sizeofcmds;
+	plan->cmds    = malloc(plan->old_len + room);
+	old	      = malloc(plan->old_len);
+	if (!plan->cmds || !old) {
+		__logger(error, "malloc: out of memory");
+		free(old);
+		return (false);
+	}
+
+	if (!edit_pread(fd, old, plan->old_len, plan->offset) ||
+	    !edit_validate(old + sizeof(mh), mh.ncmds, mh.sizeofcmds)) {
+		free(old);
+		return (false);
+	}
+
+	limit = edit_limit(old + sizeof(mh), mh.ncmds, plan->size);
+	cmds  = plan->cmds + sizeof(mh);
+	if (!edit_remove(old + sizeof(mh), mh.ncmds, cmds, &ncmds, &sizeofcmds,
+			 edits, count)) {
+		free(old);
+		return (false);
+	}
+	edit_add(cmds, &ncmds, &sizeofcmds, edits, count);
+
+	plan->changed = ncmds != mh.ncmds || sizeofcmds != mh.sizeofcmds ||
+			memcmp(cmds, old + sizeof(mh), sizeofcmds);
+	free(old);
+	if (!plan->changed)
+		return (true);
+
+	if (sizeof(mh) + sizeofcmds > limit &&
+	    !(edit_drop_signature(cmds, &ncmds, &sizeofcmds, &plan->size) &&
+	      sizeof(mh) + sizeofcmds <= limit)) {
+		__logger(error,
+			 "macho_edit: %u bytes of load commands do not fit "
+			 "before the first section at %#llx",
+			 sizeofcmds, (unsigned long long)limit);
+		return (false);
+	}
+
+	mh.ncmds      = ncmds;
+	mh.sizeofcmds = sizeofcmds;
+	(void)memcpy(plan->cmds, &mh, sizeof(mh));
+	plan->len = sizeof(mh) + sizeofcmds;
+	return (true);
+}
+
+/* Slices of a FAT file, or the file itself, with their fat_arch entry.
+ */
+static bool edit_plan_file(int fd, uint64_t file_size, edit_plan_t **plans,
+			   size_t *nplans, uint8_t **fat, size_t *fat_len)
+{
+	const struct fat_arch_64 *fa64;
+	const struct fat_arch	 *fa;
+	struct fat_header	  fh;
+	uint32_t		  nfat_arch;
+	bool			  is64;
+
+	*fat	 = NULL;
+	*fat_len = 0;
+	if (!edit_pread(fd, &fh, sizeof(fh), 0))
+		return (false);
+
+	if (fh.magic != FAT_CIGAM && fh.magic != FAT_CIGAM_64) {
+		*plans = calloc(1, sizeof(**plans));
+		if (!*plans) {
+			__logger(error, "malloc: out of memory");
+			return (false);
+		}
+		(*plans)->size = file_size;
+		*nplans	       = 1;
+		return (true);
+	}
+
+	is64	  = fh.magic == FAT_CIGAM_64;
+	nfat_arch = __builtin_bswap32(fh.nfat_arch);
+	if (nfat_arch > MACHO_MAX_SLICES) {
+		__logger(error, "macho_edit: %u FAT slices", nfat_arch);
+		return (false);
+	}
+
+	*fat_len = sizeof(fh) + nfat_arch * (is64 ? sizeof(struct fat_arch_64) :
+						    sizeof(struct fat_arch));
+	*fat	 = malloc(*fat_len);
+	*plans	 = calloc(nfat_arch + 1, sizeof(**plans));
+	if (!*fat || !*plans) {
+		__logger(error, "malloc: out of memory");
+		return (false);
+	}
+	if (!edit_pread(fd, *fat, *fat_len, 0))
+		return (false);
+	fa64 = (const void *)(*fat + sizeof(fh));
+	fa   = (const void *)(*fat + sizeof(fh));
+
+	for (uint32_t i = 0; i < nfat_arch; i++) {
+		edit_plan_t *plan = &(*plans)[i];
+
+		if (is64) {
+			plan->offset = __builtin_bswap64(fa64[i].offset);
+			plan->size   = __builtin_bswap64(fa64[i].size);
+		} else {
+			plan->offset = __builtin_bswap32(fa[i].offset);
+			plan->size   = __builtin_bswap32(fa[i].size);
+		}
+
+		if (plan->offset > file_size ||
+		    plan->size > file_size - plan->offset) {
+			__logger(error, "macho_edit: slice %u out of bounds",
+				 i);
+			return (false);
+		}
+	}
+
+	*nplans = nfat_arch;
+	return (true);
+}
+
+/* Writes every planned slice, then the FAT header when a slice shrank.
+ */
+static bool edit_commit(int fd, edit_plan_t *plans, size_t nplans,
+			uint8_t *fat, size_t fat_len, uint64_t file_size)
+{
+	struct fat_arch_64 *fa64	= NULL;
+	struct fat_arch	   *fa		= NULL;
+	uint64_t	    new_size	= file_size;
+	bool		    fat_dirty	= false;
+	uint8_t		    zeros[256] = { 0 };
+
+	if (fat) {
+		fa64 = (void *)(fat + sizeof(struct fat_header));
+		fa   = (void *)(fat + sizeof(struct fat_header));
+	}
+
+	for (size_t i = 0; i < nplans; i++) {
+		edit_plan_t *plan = &plans[i];
+		uint64_t     old_size;
+
+		if (!plan->changed)
+			continue;
+
+		if (!edit_pwrite(fd, plan->cmds, plan->len, plan->offset))
+			return (false);
+
+		/* Clears what is left of longer load commands. */
+		for (size_t at = plan->len; at < plan->old_len;) {
+			size_t n = MIN(sizeof(zeros), plan->old_len - at);
+
+			if (!edit_pwrite(fd, zeros, n, plan->offset + at))
+				return (false);
+			at += n;
+		}
+
+		old_size = fat ? 0 : file_size;
+		if (fat && fat[3] == (FAT_MAGIC_64 & 0xff)) {
+			old_size      = __builtin_bswap64(fa64[i].size);
+			fa64[i].size = __builtin_bswap64(plan->size);
+		} else if (fat) {
+			old_size    = __builtin_bswap32(fa[i].size);
+			fa[i].size = __builtin_bswap32((uint32_t)plan->size);
+		}
+
+		if (plan->size != old_size) {
+			fat_dirty = fat != NULL;
+			if (plan->offset + old_size == file_size)
+				new_size = plan->offset + plan->size;
+		}
+	}
+
+	if (fat_dirty && !edit_pwrite(fd, fat, fat_len, 0))
+		return (false);
+
+	if (new_size != file_size && ftruncate(fd, (off_t)new_size)) {
+		__logger(error, "ftruncate: %s", strerror(errno));
+		return (false);
+	}
+
+	return (true);
+}
+
+bool macho_edit_file(const char *path, const macho_edit_t *edits,
+		     size_t count)
+{
+	edit_plan_t *plans  = NULL;
+	size_t	     nplans = 0;
+	uint8_t	    *fat    = NULL;
+	size_t	     fat_len;
+	struct stat  st;
+	bool	     ret = false;
+	int	     fd;
+
+	fd = open(path, O_RDWR);
+	if (fd == -1) {
+		__logger(error, "open: %s: %s", path, strerror(errno));
+		return (false);
+	}
+
+	if (fstat(fd, &st)) {
+		__logger(error, "fstat: %s: %s", path, strerror(errno));
+		goto out;
+	}
+
+	/* Every slice is planned before the first write, so that a file is
+	 * edited whole or left alone.
+	 */
+	if (!edit_plan_file(fd, st.st_size, &plans, &nplans, &fat, &fat_len))
+		goto out;
+
+	for (size_t i = 0; i < nplans; i++) {
+		if (!edit_plan_slice(fd, &plans[i], edits, count)) {
+			__logger(error, "macho_edit: %s: slice %zu not edited",
+				 path, i);
+			goto out;
+		}
+	}
+
+	ret = edit_commit(fd, plans, nplans, fat, fat_len, st.st_size);
+
+out:
+	for (size_t i = 0; plans && i < nplans; i++)
+		free(plans[i].cmds);
+	free(plans);
+	free(fat);
+	(void)close(fd);
+	return (ret);
+}
+
+static void edit_bulk_file(void *arg, size_t worker, size_t job)
+{
+	edit_bulk_t *bulk = arg;
+
+	(void)worker;
+
+	if (!macho_edit_file(bulk->paths[job], bulk->edits, bulk->count))
+		atomic_fetch_add(&bulk->failed, 1);
+}
+
+size_t macho_edit_files(const char *const *paths, size_t npaths,
+			const macho_edit_t *edits, size_t count)
+{
+	edit_bulk_t bulk = { paths, edits, count, 0 };
+
+	if (!parallel_for(npaths, 0, edit_bulk_file, &bulk))
+		return (npaths);
+	return (atomic_load(&bulk.failed));
+}
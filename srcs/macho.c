@@ -0,0 +1,463 @@
+#include "common.h"
+#include "ios-macos-utils.h"
+#include <mach-o/fat.h>
+#include <mach-o/loader.h>
+#include <mach-o/nlist.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+size_t macho_slices(const uint8_t *map, size_t map_size, macho_slice_t *slices,
+		    size_t max)
+{
+	const struct fat_header *fh = (const struct fat_header *)map;
+	uint32_t		 magic;
+	uint32_t		 nfat_arch;
+	size_t			 n = 0;
+
+	if (map_size < sizeof(*fh))
+		return (0);
+
+	magic = *(const uint32_t *)map;
+	if (magic == MH_MAGIC_64) {
+		const struct mach_header_64 *mh = (const void *)map;
+
+		if (!max || map_size < sizeof(*mh))
+			return (0);
+
+		slices[0].cputype    = mh->cputype;
+		slices[0].cpusubtype = mh->cpusubtype;
+		slices[0].offset     = 0;
+		slices[0].size	     = map_size;
+		return (1);
+	}
+
+	if (magic != FAT_CIGAM && magic != FAT_CIGAM_64)
+		return (0);
+
+	magic	  = __builtin_bswap32(fh->magic);
+	nfat_arch = __builtin_bswap32(fh->nfat_arch);
+
+	for (uint32_t i = 0; i < nfat_arch && n < max; i++) {
+		macho_slice_t *slice = &slices[n];
+
+		if (magic == FAT_MAGIC_64) {
+			const struct fat_arch_64 *fa =
+				(const struct fat_arch_64 *)(fh + 1) + i;
+
+			if ((const uint8_t *)(fa + 1) > map + map_size)
+				break;
+			slice->cputype	  = __builtin_bswap32(fa->cputype);
+			slice->cpusubtype = __builtin_bswap32(fa->cpusubtype);
+			slice->offset	  = __builtin_bswap64(fa->offset);
+			slice->size	  = __builtin_bswap64(fa->size);
+		} else {
+			const struct fat_arch *fa =
+				(const struct fat_arch *)(fh + 1) + i;
+
+			if ((const uint8_t *)(fa + 1) > map + map_size)
+				break;
+			slice->cputype	  = __builtin_bswap32(fa->cputype);
+			slice->cpusubtype = __builtin_bswap32(fa->cpusubtype);
+			slice->offset	  = __builtin_bswap32(fa->offset);
+			slice->size	  = __builtin_bswap32(fa->size);
+		}
+
+		if (slice->offset > map_size ||
+		    slice->size > map_size - slice->offset)
+			continue;
+		n++;
+	}
+
+	return (n);
+}
+
+static bool macho_fat_slice(const uint8_t *map, size_t map_size,
+			    int32_t cputype, size_t *offset, size_t *size)
+{
+	macho_slice_t slices[MACHO_MAX_SLICES];
+	size_t	      n;
+
+	n = macho_slices(map, map_size, slices, MACHO_MAX_SLICES);
+	for (size_t i = 0; i < n; i++) {
+		if (cputype != CPU_TYPE_ANY && slices[i].cputype != cputype)
+			continue;
+
+		*offset = slices[i].offset;
+		*size	= slices[i].size;
+		return (true);
+	}
+
+	__logger(error, "macho_fat_slice: no slice for cputype %s",
+		 cputype_to_cstr(cputype));
+	return (false);
+}
+
+bool macho_init(macho_t *macho, const uint8_t *base, size_t size,
+		size_t hdroff)
+{
+	const struct mach_header_64 *header;
+	const uint8_t		    *cmd;
+	const uint8_t		    *end;
+
+	(void)memset(macho, 0, sizeof(*macho));
+
+	if (hdroff > size || size - hdroff < sizeof(*header)) {
+		__logger(error, "macho_init: buffer too small");
+		return (false);
+	}
+
+	header = (const struct mach_header_64 *)(base + hdroff);
+	if (header->magic != MH_MAGIC_64) {
+		__logger(error, "macho_init: unsupported magic: %s",
+			 magic_to_cstr(header->magic));
+		return (false);
+	}
+
+	cmd = (const uint8_t *)(header + 1);
+	end = cmd + header->sizeofcmds;
+	if (end > base + size) {
+		__logger(error, "macho_init: load commands out of bounds");
+		return (false);
+	}
+
+	macho->base   = base;
+	macho->size   = size;
+	macho->header = header;
+	macho->vmbase = UINT64_MAX;
+
+	for (uint32_t i = 0; i < header->ncmds; i++) {
+		const struct load_command *lc = (const struct load_command *)cmd;
+
+		if (cmd + sizeof(*lc) > end || lc->cmdsize < sizeof(*lc) ||
+		    cmd + lc->cmdsize > end) {
+			__logger(error, "macho_init: malformed load command %u",
+				 i);
+			macho_close(macho);
+			return (false);
+		}
+
+		if (lc->cmd == LC_SEGMENT_64) {
+			const struct segment_command_64 *seg =
+				(const struct segment_command_64 *)lc;
+			const struct segment_command_64 **segs;
+
+			/* Sections are only ever looked at through segments */
+			if (lc->cmdsize < sizeof(*seg) ||
+			    (uint64_t)seg->nsects * sizeof(struct section_64) >
+				    lc->cmdsize - sizeof(*seg)) {
+				__logger(error,
+					 "macho_init: malformed segment %u", i);
+				macho_close(macho);
+				return (false);
+			}
+
+			segs = realloc(macho->segments,
+				       sizeof(*segs) * (macho->nsegments + 1));
+			if (!segs) {
+				__logger(error, "realloc: out of memory");
+				macho_close(macho);
+				return (false);
+			}
+
+			segs[macho->nsegments++] = seg;
+			macho->segments		 = segs;
+
+			if (seg->filesize && seg->fileoff == 0 &&
+			    macho->vmbase == UINT64_MAX)
+				macho->vmbase = seg->vmaddr;
+			if (!strncmp(seg->segname, SEG_LINKEDIT, 16))
+				macho->linkedit = seg;
+		}
+
+		cmd += lc->cmdsize;
+	}
+
+	if (macho->vmbase == UINT64_MAX) {
+		macho->vmbase = 0;
+		for (uint32_t i = 0; i < macho->nsegments; i++) {
+			if (!strncmp(macho->segments[i]->segname, SEG_TEXT, 16))
+				macho->vmbase = macho->segments[i]->vmaddr;
+		}
+	}
+
+	return (true);
+}
+
+bool macho_init_vm(macho_t *macho, const uint8_t *base, size_t size,
+		   uint64_t base_vmaddr, uint64_t vmaddr)
+{
+	if (vmaddr < base_vmaddr || vmaddr - base_vmaddr > size) {
+		__logger(error, "macho_init: %#llx is not mapped",
+			 (unsigned long long)vmaddr);
+		return (false);
+	}
+
+	if (!macho_init(macho, base, size, vmaddr - base_vmaddr))
+		return (false);
+
+	macho->base_vmaddr = base_vmaddr;
+	macho->in_memory   = true;
+	return (true);
+}
+
+bool macho_open(macho_t *macho, const char *path, int32_t cputype)
+{
+	uint8_t *map;
+	size_t	 map_size;
+	size_t	 offset = 0;
+	size_t	 size;
+	int	 fd;
+
+	if (!file_open_read(path, &fd))
+		return (false);
+
+	if (!file_get_size(path, &map_size)) {
+		(void)close(fd);
+		return (false);
+	}
+
+	if (map_size < sizeof(struct mach_header_64)) {
+		__logger(error, "macho_open: %s: file too small", path);
+		(void)close(fd);
+		return (false);
+	}
+
+	map = mmap(NULL, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	(void)close(fd);
+	if (map == MAP_FAILED) {
+		__logger(error, "mmap: %s", strerror(errno));
+		return (false);
+	}
+
+	size = map_size;
+	switch (*(const uint32_t *)map) {
+	case FAT_CIGAM:
+	case FAT_CIGAM_64:
+		if (!macho_fat_slice(map, map_size, cputype, &offset, &size)) {
+			(void)munmap(map, map_size);
+			return (false);
+		}
+		break;
+	default:
+		break;
+	}
+
+	if (!macho_init(macho, map + offset, size, 0)) {
+		(void)munmap(map, map_size);
+		return (false);
+	}
+
+	if (cputype != CPU_TYPE_ANY && macho->header->cputype != cputype) {
+		__logger(error, "macho_open: %s: no %s image", path,
+			 cputype_to_cstr(cputype));
+		macho_close(macho);
+		(void)munmap(map, map_size);
+		return (false);
+	}
+
+	macho->map	    = map;
+	macho->map_size	    = map_size;
+	macho->slice_offset = offset;
+	return (true);
+}
+
+void macho_close(macho_t *macho)
+{
+	free(macho->segments);
+
+	if (macho->map)
+		(void)munmap(macho->map, macho->map_size);
+
+	(void)memset(macho, 0, sizeof(*macho));
+}
+
+const void *macho_find_command(const macho_t *macho, uint32_t command,
+			       const void *after)
+{
+	const uint8_t *cmd   = (const uint8_t *)(macho->header + 1);
+	bool	       found = !after;
+
+	/* Only the 'ncmds' commands were validated by macho_init() */
+	for (uint32_t i = 0; i < macho->header->ncmds; i++) {
+		const struct load_command *lc = (const struct load_command *)cmd;
+
+		if (found && lc->cmd == command)
+			return (lc);
+		if ((const void *)lc == after)
+			found = true;
+		cmd += lc->cmdsize;
+	}
+
+	return (NULL);
+}
+
+const struct segment_command_64 *macho_find_segment(const macho_t *macho,
+						    const char	  *segname)
+{
+	for (uint32_t i = 0; i < macho->nsegments; i++) {
+		if (!strncmp(macho->segments[i]->segname, segname, 16))
+			return (macho->segments[i]);
+	}
+
+	return (NULL);
+}
+
+const struct section_64 *macho_find_section(const macho_t *macho,
+					    const char	  *segname,
+					    const char	  *sectname)
+{
+	const struct segment_command_64 *seg;
+	const struct section_64		*sect;
+
+	seg = macho_find_segment(macho, segname);
+	if (!seg)
+		return (NULL);
+
+	sect = (const struct section_64 *)(seg + 1);
+	for (uint32_t i = 0; i < seg->nsects; i++) {
+		if (!strncmp(sect[i].sectname, sectname, 16))
+			return (&sect[i]);
+	}
+
+	return (NULL);
+}
+
+const struct segment_command_64 *macho_segment_for_vmaddr(const macho_t *macho,
+							  uint64_t vmaddr)
+{
+	for (uint32_t i = 0; i < macho->nsegments; i++) {
+		const struct segment_command_64 *seg = macho->segments[i];
+
+		if (vmaddr >= seg->vmaddr && vmaddr - seg->vmaddr < seg->vmsize)
+			return (seg);
+	}
+
+	return (NULL);
+}
+
+static bool macho_segment_holds(const struct segment_command_64 *seg,
+				uint64_t fileoff, uint64_t size)
+{
+	return (fileoff >= seg->fileoff &&
+		fileoff - seg->fileoff < seg->filesize &&
+		size <= seg->filesize - (fileoff - seg->fileoff));
+}
+
+/* Address of the bytes at 'fileoff' in an image laid out by address. The
+ * segments of a cached image may come from different files and overlap in
+ * file offsets, the linkedit data is looked up in __LINKEDIT first.
+ */
+static const uint8_t *macho_vm_at_offset(const macho_t *macho,
+					 uint64_t fileoff, uint64_t size)
+{
+	const struct segment_command_64 *seg = macho->linkedit;
+
+	if (!seg || !macho_segment_holds(seg, fileoff, size)) {
+		seg = NULL;
+		for (uint32_t i = 0; i < macho->nsegments && !seg; i++) {
+			if (macho_segment_holds(macho->segments[i], fileoff,
+						size))
+				seg = macho->segments[i];
+		}
+	}
+
+	if (!seg)
+		return (NULL);
+
+	return (macho_at_vmaddr(macho, seg->vmaddr + (fileoff - seg->fileoff),
+				size));
+}
+
+const uint8_t *macho_at_offset(const macho_t *macho, uint64_t fileoff,
+			       uint64_t size)
+{
+	if (macho->in_memory)
+		return (macho_vm_at_offset(macho, fileoff, size));
+
+	if (fileoff > macho->size || size > macho->size - fileoff)
+		return (NULL);
+
+	return (macho->base + fileoff);
+}
+
+const uint8_t *macho_at_vmaddr(const macho_t *macho, uint64_t vmaddr,
+			       uint64_t size)
+{
+	const struct segment_command_64 *seg;
+	uint64_t			 delta;
+
+	seg = macho_segment_for_vmaddr(macho, vmaddr);
+	if (!seg)
+		return (NULL);
+
+	delta = vmaddr - seg->vmaddr;
+	if (delta > seg->filesize || size > seg->filesize - delta)
+		return (NULL);
+
+	if (macho->in_memory) {
+		delta = vmaddr - macho->base_vmaddr;
+		if (delta > macho->size || size > macho->size - delta)
+			return (NULL);
+		return (macho->base + delta);
+	}
+
+	return (macho_at_offset(macho, seg->fileoff + delta, size));
+}
+
+const uint8_t *macho_linkedit_data(const macho_t *macho, uint32_t command,
+				   uint32_t *size)
+{
+	const struct linkedit_data_command *ledc;
+	const uint8_t			   *data;
+
+	ledc = macho_find_command(macho, command, NULL);
+	if (!ledc)
+		return (NULL);
+
+	data = macho_at_offset(macho, ledc->dataoff, ledc->datasize);
+	if (!data) {
+		__logger(error, "%s: data out of bounds",
+			 load_command_to_cstr(command));
+		return (NULL);
+	}
+
+	*size = ledc->datasize;
+	return (data);
+}
+
+const char *macho_indirect_symbol(const macho_t *macho, uint32_t index)
+{
+	const struct symtab_command   *symtab;
+	const struct dysymtab_command *dysymtab;
+	const struct nlist_64	      *sym;
+	const uint32_t		      *indirect;
+	const char		      *strtab;
+
+	symtab	 = macho_find_command(macho, LC_SYMTAB, NULL);
+	dysymtab = macho_find_command(macho, LC_DYSYMTAB, NULL);
+	if (!symtab || !dysymtab || index >= dysymtab->nindirectsyms)
+		return (NULL);
+
+	indirect = (const uint32_t *)macho_at_offset(
+		macho, dysymtab->indirectsymoff + (uint64_t)index * 4, 4);
+	if (!indirect ||
+	    (*indirect & (INDIRECT_SYMBOL_LOCAL | INDIRECT_SYMBOL_ABS)) ||
+	    *indirect >= symtab->nsyms)
+		return (NULL);
+
+	sym = (const struct nlist_64 *)macho_at_offset(
+		macho, symtab->symoff + (uint64_t)*indirect * sizeof(*sym),
+		sizeof(*sym));
+	strtab = (const char *)macho_at_offset(macho, symtab->stroff,
+					       symtab->strsize);
+	if (!sym || !strtab || sym->n_un.n_strx >= symtab->strsize ||
+	    !memchr(strtab + sym->n_un.n_strx, '\0',
+		    symtab->strsize - sym->n_un.n_strx))
+		return (NULL);
+
+	return (strtab + sym->n_un.n_strx);
+}
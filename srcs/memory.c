@@ -86,6 +86,41 @@ bool memory_rchunk(task_t task, vm_address_t addr, const uint8_t *buf,
 	return (true);
 }
 
+/* Reads as much of 'bufsize' as is mapped from 'addr' on, at once when all
+ * of it is and page by page otherwise, storing the amount in '*nread'. Fails
+ * without logging when nothing could be read, such as past the end of a stack.
+ */
+bool memory_rpartial(task_t task, vm_address_t addr, const uint8_t *buf,
+		     vm_size_t bufsize, vm_size_t *nread)
+{
+	mach_vm_size_t ret = 0;
+	kern_return_t  kr;
+
+	*nread = 0;
+	kr     = mach_vm_read_overwrite(task, addr, bufsize, (vm_address_t)buf,
+					&ret);
+	if (kr == KERN_SUCCESS) {
+		*nread = ret;
+		return (ret != 0);
+	}
+
+	while (*nread < bufsize) {
+		vm_address_t at = addr + *nread;
+		vm_size_t    n	= vm_page_size - (at & (vm_page_size - 1));
+
+		if (n > bufsize - *nread)
+			n = bufsize - *nread;
+
+		kr = mach_vm_read_overwrite(task, at, n,
+					    (vm_address_t)buf + *nread, &ret);
+		if (kr != KERN_SUCCESS || ret != n)
+			break;
+		*nread += n;
+	}
+
+	return (*nread != 0);
+}
+
 /* Reads a pointer at 'addr', dereferences it and reads 'bufsize'
  * from there.
  */
@@ -184,6 +219,34 @@ bool memory_region_info_get(task_t task, vm_address_t address,
 	return (true);
 }
 
+/* Finds the first region at or above '*address', false once past the last
+ * one.
+ */
+bool memory_region_next(task_t task, mach_vm_address_t *address,
+			mach_vm_size_t *size, vm_prot_t *prot)
+{
+	vm_region_basic_info_data_64_t info;
+	mach_msg_type_number_t info_count = VM_REGION_BASIC_INFO_COUNT_64;
+	mach_port_t	       object_name;
+	kern_return_t	       kr;
+
+	kr = mach_vm_region(task, address, size, VM_REGION_BASIC_INFO_64,
+			    (vm_region_info_t)&info,
+			    (mach_msg_type_number_t *)&info_count,
+			    (mach_port_t *)&object_name);
+
+	if (kr == KERN_INVALID_ADDRESS)
+		return (false);
+
+	if (kr != KERN_SUCCESS) {
+		__logger(error, "mach_vm_region: %s", mach_error_string(kr));
+		return (false);
+	}
+
+	*prot = info.protection;
+	return (true);
+}
+
 bool memory_dump(task_t task, vm_address_t address, size_t size)
 {
 	uint8_t *buffer = NULL;
@@ -0,0 +1,606 @@
+#include "common.h"
+#include "ios-macos-utils.h"
+#include <mach-o/loader.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+/* Layouts of the 64-bit runtime structures, see objc4's objc-runtime-new.h.
+ */
+#define OBJC_CLASS_ISA	      0
+#define OBJC_CLASS_SUPERCLASS 8
+#define OBJC_CLASS_DATA	      32
+#define OBJC_RO_NAME	      24
+#define OBJC_RO_METHODS	      32
+#define OBJC_RW_RO	      8
+
+#define OBJC_RW_REALIZED	(1u << 31)
+#define OBJC_LIST_RELATIVE	(1u << 31)
+#define OBJC_LIST_DIRECT_SEL	(1u << 30) /* names off the selector base */
+#define OBJC_LIST_ENTSIZE_MASK	0xfffc
+#define OBJC_CLASS_PREFIX	"_OBJC_CLASS_$_"
+#define OBJC_PTR_MASK		0x00007fffffffffffULL /* strips PAC bits */
+#define OBJC_MAX_NAME		4096
+#define OBJC_MAX_METHODS	(1 << 20)
+
+enum { OBJC_CLASS_NEW, OBJC_CLASS_NAMED, OBJC_CLASS_LOADED };
+
+static bool objc_is_task(const objc_t *objc)
+{
+	return (objc->task != MACH_PORT_NULL);
+}
+
+static bool objc_read(const objc_t *objc, uint64_t vmaddr, void *buf,
+		      size_t size)
+{
+	const uint8_t *data;
+
+	if (objc_is_task(objc))
+		return (memory_r(objc->task, vmaddr + objc->slide, buf, size));
+
+	data = macho_at_vmaddr(objc->macho, vmaddr, size);
+	if (!data) {
+		__logger(error, "objc: %#llx is not mapped",
+			 (unsigned long long)vmaddr);
+		return (false);
+	}
+
+	(void)memcpy(buf, data, size);
+	return (true);
+}
+
+/* Turns the 'raw' pointer read at 'vmaddr' into an unslid address. In a
+ * file it goes through the chained fixups, a bind yields 0 and the name of
+ * the import.
+ */
+static bool objc_fix(const objc_t *objc, uint64_t vmaddr, uint64_t raw,
+		     uint64_t *value, const char **import)
+{
+	const chained_import_t *imp = NULL;
+
+	if (import)
+		*import = NULL;
+
+	if (objc_is_task(objc)) {
+		raw &= OBJC_PTR_MASK;
+		*value = raw ? raw - objc->slide : 0;
+		return (true);
+	}
+
+	if (!objc->fixups.fixups) {
+		*value = raw;
+		return (true);
+	}
+
+	if (!chained_fixups_resolve(&objc->fixups, vmaddr, value, &imp))
+		return (false);
+
+	if (imp) {
+		*value = 0;
+		if (import)
+			*import = imp->name;
+	}
+	return (true);
+}
+
+static bool objc_ptr(const objc_t *objc, uint64_t vmaddr, uint64_t *value,
+		     const char **import)
+{
+	uint64_t raw;
+
+	return (objc_read(objc, vmaddr, &raw, sizeof(raw)) &&
+		objc_fix(objc, vmaddr, raw, value, import));
+}
+
+/* C string at 'vmaddr', within the image for a file or interned for a
+ * task. NULL if it cannot be read.
+ */
+static const char *objc_string(objc_t *objc, uint64_t vmaddr)
+{
+	const struct segment_command_64 *seg;
+	const char			*s;
+	char				 buf[OBJC_MAX_NAME];
+	size_t				 len = 0;
+	size_t				 avail;
+
+	if (!vmaddr)
+		return (NULL);
+
+	if (!objc_is_task(objc)) {
+		seg = macho_segment_for_vmaddr(objc->macho, vmaddr);
+		if (!seg || vmaddr - seg->vmaddr >= seg->filesize)
+			return (NULL);
+
+		avail = MIN(seg->filesize - (vmaddr - seg->vmaddr),
+			    OBJC_MAX_NAME);
+		s     = (const char *)macho_at_vmaddr(objc->macho, vmaddr,
+						      avail);
+		return (s && memchr(s, '\0', avail) ? s : NULL);
+	}
+
+	/* Reads up to the end of the page at most, the next one may not be
+	 * mapped.
+	 */
+	while (len < sizeof(buf)) {
+		uint64_t at = vmaddr + len + objc->slide;
+		size_t	 n  = MIN(sizeof(buf) - len, 0x1000 - (at & 0xfff));
+
+		n = MIN(n, 256);
+		if (!memory_r(objc->task, at, (uint8_t *)buf + len, n))
+			return (NULL);
+
+		s = memchr(buf + len, '\0', n);
+		if (s)
+			return (strpool_intern(objc->pool, buf, s - buf));
+		len += n;
+	}
+
+	return (NULL);
+}
+
+/* First section named 'sectname' in any segment, the metadata moves
+ * between __DATA, __DATA_CONST and __AUTH_CONST.
+ */
+static const struct section_64 *objc_section(const macho_t *macho,
+					     const char	   *sectname)
+{
+	for (uint32_t i = 0; i < macho->nsegments; i++) {
+		const struct segment_command_64 *seg  = macho->segments[i];
+		const struct section_64		*sect = (const void *)(seg + 1);
+
+		for (uint32_t j = 0; j < seg->nsects; j++) {
+			if (!strncmp(sect[j].sectname, sectname, 16))
+				return (&sect[j]);
+		}
+	}
+
+	return (NULL);
+}
+
+/* Reads a section of pointers and resolves every entry.
+ */
+static uint64_t *objc_pointers(objc_t *objc, const char *sectname,
+			       size_t *count)
+{
+	const struct section_64 *sect = objc_section(objc->macho, sectname);
+	uint64_t		*ptrs;
+
+	*count = 0;
+	if (!sect || sect->size < sizeof(*ptrs))
+		return (NULL);
+
+	ptrs = arena_alloc(objc->arena, sect->size);
+	if (!ptrs || !objc_read(objc, sect->addr, ptrs, sect->size))
+		return (NULL);
+
+	*count = sect->size / sizeof(*ptrs);
+	for (size_t i = 0; i < *count; i++) {
+		if (!objc_fix(objc, sect->addr + i * sizeof(*ptrs), ptrs[i],
+			      &ptrs[i], NULL))
+			ptrs[i] = 0;
+	}
+
+	return (ptrs);
+}
+
+static bool objc_setup(objc_t *objc, const macho_t *macho)
+{
+	uint64_t *addrs;
+
+	objc->macho = macho;
+	objc->arena = arena_create(0);
+	objc->pool  = strpool_create();
+	if (!objc->arena || !objc->pool) {
+		objc_free(objc);
+		return (false);
+	}
+
+	addrs = objc_pointers(objc, "__objc_classlist", &objc->nclasses);
+	if (objc->nclasses && !addrs) {
+		__logger(error, "objc: cannot read __objc_classlist");
+		objc_free(objc);
+		return (false);
+	}
+
+	objc->classes = arena_calloc(objc->arena, objc->nclasses + 1,
+				     sizeof(*objc->classes));
+	if (!objc->classes) {
+		objc_free(objc);
+		return (false);
+	}
+
+	for (size_t i = 0; i < objc->nclasses; i++)
+		objc->classes[i].addr = addrs[i];
+
+	return (true);
+}
+
+bool objc_init(objc_t *objc, const macho_t *macho)
+{
+	(void)memset(objc, 0, sizeof(*objc));
+	objc->task = MACH_PORT_NULL;
+
+	if (macho_find_command(macho, LC_DYLD_CHAINED_FIXUPS, NULL) &&
+	    !chained_fixups_parse(macho, &objc->fixups))
+		return (false);
+
+	return (objc_setup(objc, macho));
+}
+
+bool objc_init_task(objc_t *objc, task_t task, vm_address_t address,
+		    const macho_t *macho)
+{
+	(void)memset(objc, 0, sizeof(*objc));
+	objc->task  = task;
+	objc->slide = address - macho->vmbase;
+
+	return (objc_setup(objc, macho));
+}
+
+void objc_free(objc_t *objc)
+{
+	if (objc->fixups.fixups)
+		chained_fixups_free(&objc->fixups);
+	if (objc->pool)
+		strpool_kill(objc->pool);
+	if (objc->arena)
+		arena_kill(objc->arena);
+	strmap_kill(objc->by_name);
+	strmap_kill(objc->by_selector);
+	(void)memset(objc, 0, sizeof(*objc));
+}
+
+/* class_ro_t of the class at 'cls'. A class realized in a live task points
+ * at its class_rw_t instead, which holds the class_ro_t directly or through
+ * a class_rw_ext_t.
+ */
+static bool objc_class_ro(const objc_t *objc, uint64_t cls, uint64_t *ro)
+{
+	uint64_t data;
+	uint32_t flags;
+
+	if (!objc_ptr(objc, cls + OBJC_CLASS_DATA, &data, NULL) || !data)
+		return (false);
+
+	*ro = data & ~(uint64_t)7;
+	if (!objc_is_task(objc))
+		return (true);
+
+	if (!objc_read(objc, *ro, &flags, sizeof(flags)))
+		return (false);
+	if (!(flags & OBJC_RW_REALIZED))
+		return (true);
+
+	if (!objc_ptr(objc, *ro + OBJC_RW_RO, &data, NULL))
+		return (false);
+	if (data & 1)
+		return (objc_ptr(objc, data & ~(uint64_t)1, ro, NULL));
+
+	*ro = data;
+	return (true);
+}
+
+static void objc_class_name(objc_t *objc, objc_class_t *cls)
+{
+	const char *import;
+	uint64_t    name;
+
+	cls->state = OBJC_CLASS_NAMED;
+
+	if (!cls->addr || !objc_class_ro(objc, cls->addr, &cls->ro) ||
+	    !objc_ptr(objc, cls->ro + OBJC_RO_NAME, &name, NULL))
+		return;
+	cls->name = objc_string(objc, name);
+
+	if (!objc_ptr(objc, cls->addr + OBJC_CLASS_SUPERCLASS,
+		      &cls->superclass, &import))
+		return;
+
+	if (import && !strncmp(import, OBJC_CLASS_PREFIX,
+			       sizeof(OBJC_CLASS_PREFIX) - 1))
+		cls->super_name = import + sizeof(OBJC_CLASS_PREFIX) - 1;
+}
+
+/* Decodes the method list at 'list', pointer based or relative (offsets
+ * to a selector reference, the types and the implementation). Lists of
+ * the shared cache whose names are offsets from the cache's selector base
+ * are skipped, that base is only known to the runtime.
+ */
+static bool objc_method_list(objc_t *objc, uint64_t list, uint32_t flags,
+			     vec_t *out)
+{
+	uint32_t hdr[2];
+	uint32_t entsize;
+	bool	 relative;
+	uint8_t *entries;
+
+	if (!list)
+		return (true);
+
+	if (!objc_read(objc, list, hdr, sizeof(hdr)))
+		return (false);
+
+	entsize	 = hdr[0] & OBJC_LIST_ENTSIZE_MASK;
+	relative = hdr[0] & OBJC_LIST_RELATIVE;
+	if (entsize < (relative ? 12 : 24) || hdr[1] > OBJC_MAX_METHODS) {
+		__logger(error, "objc: bad method list at %#llx",
+			 (unsigned long long)list);
+		return (false);
+	}
+
+	if (relative && (hdr[0] & OBJC_LIST_DIRECT_SEL)) {
+		__logger(warning,
+			 "objc: method list at %#llx uses direct selectors, "
+			 "skipped",
+			 (unsigned long long)list);
+		return (true);
+	}
+
+	entries = malloc((size_t)entsize * hdr[1] + 1);
+	if (!entries) {
+		__logger(error, "malloc: out of memory");
+		return (false);
+	}
+
+	if (!objc_read(objc, list + sizeof(hdr), entries,
+		       (size_t)entsize * hdr[1])) {
+		free(entries);
+		return (false);
+	}
+
+	for (uint32_t i = 0; i < hdr[1]; i++) {
+		uint64_t      at = list + sizeof(hdr) + (uint64_t)i * entsize;
+		uint8_t	     *e	 = entries + (size_t)i * entsize;
+		objc_method_t method = { .flags = flags };
+		uint64_t      name   = 0;
+		uint64_t      types  = 0;
+
+		if (relative) {
+			int32_t off[3];
+
+			(void)memcpy(off, e, sizeof(off));
+			if (!objc_ptr(objc, at + off[0], &name, NULL))
+				name = 0;
+			types	   = off[1] ? at + 4 + off[1] : 0;
+			method.imp = off[2] ? at + 8 + off[2] : 0;
+		} else {
+			uint64_t raw[3];
+
+			(void)memcpy(raw, e, sizeof(raw));
+			if (!objc_fix(objc, at, raw[0], &name, NULL) ||
+			    !objc_fix(objc, at + 8, raw[1], &types, NULL) ||
+			    !objc_fix(objc, at + 16, raw[2], &method.imp,
+				      NULL))
+				continue;
+		}
+
+		method.name  = objc_string(objc, name);
+		method.types = objc_string(objc, types);
+		if (method.name && !vec_push(out, &method)) {
+			__logger(error, "vec_push: out of memory");
+			free(entries);
+			return (false);
+		}
+	}
+
+	free(entries);
+	return (true);
+}
+
+static bool objc_class_load(objc_t *objc, objc_class_t *cls)
+{
+	objc_method_t *methods;
+	vec_t	      *out;
+	uint64_t       list;
+	uint64_t       meta;
+	uint64_t       meta_ro;
+	bool	       ret = true;
+
+	if (cls->state == OBJC_CLASS_NEW)
+		objc_class_name(objc, cls);
+	cls->state = OBJC_CLASS_LOADED;
+	if (!cls->ro)
+		return (true);
+
+	out = vec_create(sizeof(objc_method_t), 0, NULL);
+	if (!out) {
+		__logger(error, "vec_create: out of memory");
+		return (false);
+	}
+
+	/* Instance methods, then the class methods of the metaclass.
+	 */
+	if (objc_ptr(objc, cls->ro + OBJC_RO_METHODS, &list, NULL))
+		ret = objc_method_list(objc, list, 0, out);
+
+	if (ret && objc_ptr(objc, cls->addr + OBJC_CLASS_ISA, &meta, NULL) &&
+	    meta && objc_class_ro(objc, meta, &meta_ro) &&
+	    objc_ptr(objc, meta_ro + OBJC_RO_METHODS, &list, NULL))
+		ret = objc_method_list(objc, list, OBJC_METHOD_CLASS, out);
+
+	if (ret && vec_size(out)) {
+		methods = arena_alloc(objc->arena, vec_sizeof(out));
+		if (methods) {
+			(void)memcpy(methods, vec_data(out), vec_sizeof(out));
+			cls->methods  = methods;
+			cls->nmethods = (uint32_t)vec_size(out);
+		} else {
+			ret = false;
+		}
+	}
+
+	vec_kill(out);
+	return (ret);
+}
+
+const objc_class_t *objc_class_at(objc_t *objc, size_t index)
+{
+	objc_class_t *cls = &objc->classes[index];
+
+	if (cls->state == OBJC_CLASS_NEW)
+		objc_class_name(objc, cls);
+	return (cls);
+}
+
+const objc_method_t *objc_methods(objc_t *objc, const objc_class_t *cls,
+				  size_t *count)
+{
+	objc_class_t *c = &objc->classes[cls - objc->classes];
+
+	if (c->state != OBJC_CLASS_LOADED && !objc_class_load(objc, c)) {
+		*count = 0;
+		return (NULL);
+	}
+
+	*count = c->nmethods;
+	return (c->methods);
+}
+
+const objc_class_t *objc_class_find(objc_t *objc, const char *name)
+{
+	uint32_t index;
+
+	/* Only the names are read to build the index, not the methods.
+	 */
+	if (!objc->by_name) {
+		objc->by_name = strmap_create(objc->nclasses);
+		if (!objc->by_name)
+			return (NULL);
+
+		for (size_t i = 0; i < objc->nclasses; i++) {
+			const objc_class_t *cls = objc_class_at(objc, i);
+
+			if (cls->name &&
+			    !strmap_add(objc->by_name, cls->name, (uint32_t)i)) {
+				strmap_kill(objc->by_name);
+				objc->by_name = NULL;
+				return (NULL);
+			}
+		}
+	}
+
+	if (!strmap_get(objc->by_name, name, &index))
+		return (NULL);
+	return (&objc->classes[index]);
+}
+
+static int objc_impl_cmp(const void *a, const void *b)
+{
+	const objc_impl_t *x = a;
+	const objc_impl_t *y = b;
+
+	return (strcmp(x->method->name, y->method->name));
+}
+
+static bool objc_selector_index(objc_t *objc)
+{
+	strmap_t *map;
+	vec_t	 *impls;
+	size_t	  n;
+
+	impls = vec_create(sizeof(objc_impl_t), 0, NULL);
+	if (!impls) {
+		__logger(error, "vec_create: out of memory");
+		return (false);
+	}
+
+	for (size_t i = 0; i < objc->nclasses; i++) {
+		const objc_class_t  *cls = &objc->classes[i];
+		const objc_method_t *methods;
+		size_t		     count;
+
+		methods = objc_methods(objc, cls, &count);
+		for (size_t j = 0; j < count; j++) {
+			objc_impl_t impl = { cls, &methods[j] };
+
+			if (!vec_push(impls, &impl)) {
+				__logger(error, "vec_push: out of memory");
+				vec_kill(impls);
+				return (false);
+			}
+		}
+	}
+
+	n = vec_size(impls);
+	if (n >= UINT32_MAX)
+		n = 0;
+
+	map	    = strmap_create(n);
+	objc->impls = arena_alloc(objc->arena, sizeof(objc_impl_t) * (n + 1));
+	if (!map || !objc->impls) {
+		strmap_kill(map);
+		vec_kill(impls);
+		return (false);
+	}
+
+	/* Sorted by selector, the map points at the first of every run of
+	 * implementations.
+	 */
+	if (n)
+		(void)memcpy(objc->impls, vec_data(impls), vec_sizeof(impls));
+	qsort(objc->impls, n, sizeof(objc_impl_t), objc_impl_cmp);
+
+	for (size_t i = 0; i < n; i++) {
+		if (!strmap_add(map, objc->impls[i].method->name,
+				(uint32_t)i)) {
+			strmap_kill(map);
+			vec_kill(impls);
+			return (false);
+		}
+	}
+
+	vec_kill(impls);
+	objc->nimpls	  = n;
+	objc->by_selector = map;
+	return (true);
+}
+
+const objc_impl_t *objc_implementations(objc_t *objc, const char *selector,
+					size_t *count)
+{
+	uint32_t first;
+	size_t	 n;
+
+	*count = 0;
+	if (!objc->by_selector && !objc_selector_index(objc))
+		return (NULL);
+
+	if (!strmap_get(objc->by_selector, selector, &first))
+		return (NULL);
+
+	n = first + 1;
+	while (n < objc->nimpls &&
+	       !strcmp(objc->impls[n].method->name, selector))
+		n++;
+
+	*count = n - first;
+	return (&objc->impls[first]);
+}
+
+const objc_selref_t *objc_selrefs(objc_t *objc, size_t *count)
+{
+	const struct section_64 *sect;
+	uint64_t		*names;
+
+	if (!objc->selrefs) {
+		sect  = objc_section(objc->macho, "__objc_selrefs");
+		names = objc_pointers(objc, "__objc_selrefs", &objc->nselrefs);
+		objc->selrefs = arena_calloc(objc->arena, objc->nselrefs + 1,
+					     sizeof(*objc->selrefs));
+		if (!objc->selrefs || (objc->nselrefs && !names)) {
+			objc->selrefs  = NULL;
+			objc->nselrefs = 0;
+			*count	       = 0;
+			return (NULL);
+		}
+
+		for (size_t i = 0; i < objc->nselrefs; i++) {
+			objc->selrefs[i].ref  = sect->addr + i * 8;
+			objc->selrefs[i].name = objc_string(objc, names[i]);
+		}
+	}
+
+	*count = objc->nselrefs;
+	return (objc->selrefs);
+}
@@ -0,0 +1,476 @@
+#include "common.h"
+#include "ios-macos-utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <mach-o/loader.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/clonefile.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct patch_sorted_s {
+	uint64_t vmaddr;
+	size_t	 index; /* in the caller's array */
+} patch_sorted_t;
+
+static int patch_segment_cmp(const void *a, const void *b)
+{
+	const patch_segment_t *x = a;
+	const patch_segment_t *y = b;
+
+	return ((x->vmaddr > y->vmaddr) - (x->vmaddr < y->vmaddr));
+}
+
+static int patch_sorted_cmp(const void *a, const void *b)
+{
+	const patch_sorted_t *x = a;
+	const patch_sorted_t *y = b;
+
+	return ((x->vmaddr > y->vmaddr) - (x->vmaddr < y->vmaddr));
+}
+
+/* Keeps the segments with bytes in the file, sorted by address. Their
+ * ranges in the file must not overlap either.
+ */
+static bool patch_segments(patch_file_t *pf)
+{
+	const macho_t *macho = &pf->macho;
+
+	pf->segments = calloc(macho->nsegments + 1, sizeof(*pf->segments));
+	if (!pf->segments) {
+		__logger(error, "calloc: out of memory");
+		return (false);
+	}
+
+	for (uint32_t i = 0; i < macho->nsegments; i++) {
+		const struct segment_command_64 *seg = macho->segments[i];
+		patch_segment_t			*ps;
+
+		if (!seg->filesize)
+			continue;
+
+		if (seg->filesize > seg->vmsize ||
+		    !macho_at_offset(macho, seg->fileoff, seg->filesize)) {
+			__logger(error, "patch: %.16s out of bounds",
+				 seg->segname);
+			return (false);
+		}
+
+		ps	     = &pf->segments[pf->nsegments++];
+		ps->vmaddr   = seg->vmaddr;
+		ps->fileoff  = seg->fileoff;
+		ps->filesize = seg->filesize;
+		ps->seg	     = seg;
+	}
+
+	qsort(pf->segments, pf->nsegments, sizeof(*pf->segments),
+	      patch_segment_cmp);
+
+	/* Segments are laid out in the file in address order, which lets
+	 * the same table translate file offsets.
+	 */
+	for (size_t i = 0; i < pf->nsegments; i++) {
+		const patch_segment_t *ps = &pf->segments[i];
+
+		if (i && (ps->vmaddr < ps[-1].vmaddr + ps[-1].filesize ||
+			  ps->fileoff < ps[-1].fileoff + ps[-1].filesize)) {
+			__logger(error, "patch: %.16s overlaps %.16s",
+				 ps->seg->segname, ps[-1].seg->segname);
+			return (false);
+		}
+	}
+
+	return (true);
+}
+
+bool patch_file_open(patch_file_t *pf, const char *path, int32_t cputype,
+		     uint32_t flags)
+{
+	macho_slice_t slices[MACHO_MAX_SLICES];
+	size_t	      nslices;
+	size_t	      i;
+	int	      mode;
+	int	      fd;
+
+	(void)memset(pf, 0, sizeof(*pf));
+	pf->flags = flags;
+
+	fd = open(path, (flags & PATCH_FILE_SHARED) ? O_RDWR : O_RDONLY);
+	if (fd == -1) {
+		__logger(error, "open: %s: %s", path, strerror(errno));
+		return (false);
+	}
+
+	if (!file_get_size(path, &pf->map_size)) {
+		(void)close(fd);
+		return (false);
+	}
+
+	/* A private mapping is copy-on-write, the file is left alone.
+	 */
+	mode	= (flags & PATCH_FILE_SHARED) ? MAP_SHARED : MAP_PRIVATE;
+	pf->map = mmap(NULL, pf->map_size, PROT_READ | PROT_WRITE, mode, fd, 0);
+	(void)close(fd);
+	if (pf->map == MAP_FAILED) {
+		__logger(error, "mmap: %s", strerror(errno));
+		pf->map = NULL;
+		return (false);
+	}
+
+	nslices = macho_slices(pf->map, pf->map_size, slices,
+			       MACHO_MAX_SLICES);
+	for (i = 0; i < nslices; i++) {
+		if (cputype == CPU_TYPE_ANY || slices[i].cputype == cputype)
+			break;
+	}
+
+	if (i == nslices) {
+		__logger(error, "patch: %s: no %s image", path,
+			 cputype_to_cstr(cputype));
+		patch_file_close(pf);
+		return (false);
+	}
+
+	pf->slice_offset = slices[i].offset;
+	pf->page_size	 = (size_t)getpagesize();
+	pf->npages	 = (pf->map_size + pf->page_size - 1) / pf->page_size;
+	pf->dirty	 = calloc(pf->npages / 64 + 1, sizeof(*pf->dirty));
+	pf->path	 = strdup(path);
+	if (!pf->dirty || !pf->path) {
+		__logger(error, "patch: out of memory");
+		patch_file_close(pf);
+		return (false);
+	}
+
+	if (!macho_init(&pf->macho, pf->map + pf->slice_offset,
+			slices[i].size, 0) ||
+	    !patch_segments(pf)) {
+		patch_file_close(pf);
+		return (false);
+	}
+
+	return (true);
+}
+
+void patch_file_close(patch_file_t *pf)
+{
+	macho_close(&pf->macho);
+	if (pf->map)
+		(void)munmap(pf->map, pf->map_size);
+	free(pf->segments);
+	free(pf->dirty);
+	free(pf->path);
+	(void)memset(pf, 0, sizeof(*pf));
+}
+
+/* Segment holding 'vmaddr' in its file-backed part.
+ */
+static const patch_segment_t *patch_segment_at(const patch_file_t *pf,
+					       uint64_t		   vmaddr)
+{
+	size_t lo = 0;
+	size_t hi = pf->nsegments;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (pf->segments[mid].vmaddr <= vmaddr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (!lo || vmaddr - pf->segments[lo - 1].vmaddr >=
+			   pf->segments[lo - 1].filesize)
+		return (NULL);
+	return (&pf->segments[lo - 1]);
+}
+
+bool patch_file_to_offset(const patch_file_t *pf, uint64_t vmaddr,
+			  uint64_t *fileoff)
+{
+	const patch_segment_t *ps = patch_segment_at(pf, vmaddr);
+
+	if (!ps)
+		return (false);
+
+	*fileoff = ps->fileoff + (vmaddr - ps->vmaddr);
+	return (true);
+}
+
+bool patch_file_to_vmaddr(const patch_file_t *pf, uint64_t fileoff,
+			  uint64_t *vmaddr)
+{
+	size_t lo = 0;
+	size_t hi = pf->nsegments;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (pf->segments[mid].fileoff <= fileoff)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (!lo || fileoff - pf->segments[lo - 1].fileoff >=
+			   pf->segments[lo - 1].filesize)
+		return (false);
+
+	*vmaddr = pf->segments[lo - 1].vmaddr +
+		  (fileoff - pf->segments[lo - 1].fileoff);
+	return (true);
+}
+
+/* A patch stays within the file-backed part of a segment, and does not
+ * straddle the start or end of any of its sections.
+ */
+static bool patch_check(const patch_file_t *pf, uint64_t vmaddr,
+			uint64_t size)
+{
+	const patch_segment_t	*ps = patch_segment_at(pf, vmaddr);
+	const struct section_64 *sect;
+	uint64_t		 end = vmaddr + size;
+
+	if (!ps || end < vmaddr || end - ps->vmaddr > ps->filesize) {
+		__logger(error, "patch: %#llx+%#llx is not within a segment",
+			 (unsigned long long)vmaddr, (unsigned long long)size);
+		return (false);
+	}
+
+	sect = (const struct section_64 *)(ps->seg + 1);
+	for (uint32_t i = 0; i < ps->seg->nsects; i++) {
+		uint64_t lo = sect[i].addr;
+		uint64_t hi = sect[i].addr + sect[i].size;
+
+		if ((lo > vmaddr && lo < end) || (hi > vmaddr && hi < end)) {
+			__logger(error, "patch: %#llx+%#llx crosses %.16s",
+				 (unsigned long long)vmaddr,
+				 (unsigned long long)size, sect[i].sectname);
+			return (false);
+		}
+	}
+
+	return (true);
+}
+
+bool patch_file_apply(patch_file_t *pf, const patch_t *patches,
+		      size_t count)
+{
+	patch_sorted_t *sorted;
+	uint64_t	prev_end = 0;
+
+	sorted = malloc((count + 1) * sizeof(*sorted));
+	if (!sorted) {
+		__logger(error, "malloc: out of memory");
+		return (false);
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		sorted[i].vmaddr = pf->macho.vmbase + patches[i].offset;
+		sorted[i].index	 = i;
+	}
+	qsort(sorted, count, sizeof(*sorted), patch_sorted_cmp);
+
+	/* Everything is checked before the first byte is written, so that a
+	 * set is applied whole or not at all.
+	 */
+	for (size_t i = 0; i < count; i++) {
+		const patch_t *p = &patches[sorted[i].index];
+
+		if (!patch_check(pf, sorted[i].vmaddr, p->code_size))
+			goto fail;
+
+		if (i && sorted[i].vmaddr < prev_end) {
+			__logger(error, "patch: %#llx overlaps another patch",
+				 (unsigned long long)sorted[i].vmaddr);
+			goto fail;
+		}
+		prev_end = sorted[i].vmaddr + p->code_size;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		const patch_t *p = &patches[sorted[i].index];
+		uint64_t       off;
+
+		if (!p->code_size)
+			continue;
+
+		(void)patch_file_to_offset(pf, sorted[i].vmaddr, &off);
+		off += pf->slice_offset;
+		(void)memcpy(pf->map + off, p->code, p->code_size);
+
+		for (uint64_t pg = off / pf->page_size;
+		     pg <= (off + p->code_size - 1) / pf->page_size; pg++)
+			pf->dirty[pg / 64] |= 1ULL << (pg % 64);
+	}
+
+	free(sorted);
+	return (true);
+
+fail:
+	free(sorted);
+	return (false);
+}
+
+/* Runs of dirty pages, as [*first, *last) page indices from '*first' on.
+ */
+static bool patch_next_run(const patch_file_t *pf, size_t *first,
+			   size_t *last)
+{
+	size_t pg = *first;
+
+	while (pg < pf->npages && !(pf->dirty[pg / 64] & (1ULL << (pg % 64))))
+		pg++;
+	if (pg == pf->npages)
+		return (false);
+
+	*first = pg;
+	while (pg < pf->npages && (pf->dirty[pg / 64] & (1ULL << (pg % 64))))
+		pg++;
+	*last = pg;
+	return (true);
+}
+
+static bool patch_write_all(const patch_file_t *pf, int fd)
+{
+	for (size_t off = 0; off < pf->map_size;) {
+		ssize_t n = write(fd, pf->map + off, pf->map_size - off);
+
+		if (n <= 0) {
+			__logger(error, "write: %s", strerror(errno));
+			return (false);
+		}
+		off += n;
+	}
+
+	return (true);
+}
+
+static bool patch_write_dirty(const patch_file_t *pf, int fd)
+{
+	size_t first = 0;
+	size_t last;
+
+	while (patch_next_run(pf, &first, &last)) {
+		size_t off = first * pf->page_size;
+		size_t end = MIN(last * pf->page_size, pf->map_size);
+
+		while (off < end) {
+			ssize_t n = pwrite(fd, pf->map + off, end - off, off);
+
+			if (n <= 0) {
+				__logger(error, "pwrite: %s", strerror(errno));
+				return (false);
+			}
+			off += n;
+		}
+		first = last;
+	}
+
+	return (true);
+}
+
+/* Writes the private mapping to the unused name 'tmp'. A clone shares the
+ * unmodified blocks with the original, only the dirty pages are then
+ * written. Without one, everything is.
+ */
+static bool patch_write_new(const patch_file_t *pf, const char *tmp,
+			    mode_t mode)
+{
+	bool ret;
+	int  fd;
+
+	if (!clonefile(pf->path, tmp, 0)) {
+		fd = open(tmp, O_WRONLY);
+		if (fd == -1) {
+			__logger(error, "open: %s: %s", tmp, strerror(errno));
+			return (false);
+		}
+		ret = patch_write_dirty(pf, fd);
+	} else {
+		fd = open(tmp, O_CREAT | O_EXCL | O_WRONLY, mode);
+		if (fd == -1) {
+			__logger(error, "open: %s: %s", tmp, strerror(errno));
+			return (false);
+		}
+		ret = patch_write_all(pf, fd);
+	}
+
+	if (close(fd) == -1)
+		ret = false;
+	return (ret);
+}
+
+bool patch_file_save(patch_file_t *pf, const char *path)
+{
+	struct stat src;
+	struct stat dst;
+	char	    tmp[MAXPATHLEN];
+	size_t	    first = 0;
+	size_t	    last;
+	bool	    ret;
+	int	    fd;
+
+	/* A shared mapping only needs its dirty pages flushed.
+	 */
+	if (pf->flags & PATCH_FILE_SHARED) {
+		while (patch_next_run(pf, &first, &last)) {
+			size_t off = first * pf->page_size;
+			size_t end = MIN(last * pf->page_size, pf->map_size);
+
+			if (msync(pf->map + off, end - off, MS_SYNC)) {
+				__logger(error, "msync: %s", strerror(errno));
+				return (false);
+			}
+			first = last;
+		}
+		return (true);
+	}
+
+	/* Unmodified pages are read from the private mapping of the original,
+	 * which must not be truncated under it.
+	 */
+	if (stat(pf->path, &src) == -1) {
+		__logger(error, "stat: %s: %s", pf->path, strerror(errno));
+		return (false);
+	}
+	if (stat(path, &dst) == 0 && dst.st_dev == src.st_dev &&
+	    dst.st_ino == src.st_ino) {
+		__logger(error, "patch_file_save: %s: is the patched file",
+			 path);
+		return (false);
+	}
+
+	/* The file is written next to 'path' and renamed over it, so an
+	 * existing target is only replaced by a complete one.
+	 */
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path) >=
+	    (int)sizeof(tmp)) {
+		__logger(error, "patch_file_save: path too long: %s", path);
+		return (false);
+	}
+
+	fd = mkstemp(tmp);
+	if (fd == -1) {
+		__logger(error, "mkstemp: %s: %s", tmp, strerror(errno));
+		return (false);
+	}
+	(void)close(fd);
+	(void)unlink(tmp);
+
+	ret = patch_write_new(pf, tmp, src.st_mode & 07777);
+	if (ret && rename(tmp, path) == -1) {
+		__logger(error, "rename: %s: %s", path, strerror(errno));
+		ret = false;
+	}
+	if (!ret)
+		(void)unlink(tmp);
+
+	return (ret);
+}
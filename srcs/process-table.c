@@ -0,0 +1,209 @@
+#include "common.h"
+#include "ios-macos-utils.h"
+#include <libproc.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+static int process_pid_cmp(const void *a, const void *b)
+{
+	pid_t x = *(const pid_t *)a;
+	pid_t y = *(const pid_t *)b;
+
+	return ((x > y) - (x < y));
+}
+
+bool process_table_init(process_table_t *pt)
+{
+	(void)memset(pt, 0, sizeof(*pt));
+
+	pt->entries = vec_create(sizeof(process_entry_t), 1024, NULL);
+	if (!pt->entries) {
+		__logger(error, "vec_create: out of memory");
+		return (false);
+	}
+
+	return (true);
+}
+
+void process_table_free(process_table_t *pt)
+{
+	if (pt->entries) {
+		process_entry_t *e = vec_unsafe_access(pt->entries, 0);
+
+		for (size_t i = 0; i < vec_size(pt->entries); i++)
+			free(e[i].path);
+		vec_kill(pt->entries);
+	}
+
+	free(pt->pids);
+	(void)memset(pt, 0, sizeof(*pt));
+}
+
+/* Fills 'pt->pids' with every pid, sorted. The buffer grows until a listing
+ * leaves room to spare, so none is cut off.
+ */
+static bool process_list(process_table_t *pt, size_t *count)
+{
+	int bytes = proc_listpids(PROC_ALL_PIDS, 0, NULL, 0);
+
+	if (bytes <= 0) {
+		__logger(error, "proc_listpids: cannot size the pid list");
+		return (false);
+	}
+
+	for (;;) {
+		size_t want = (size_t)bytes / sizeof(pid_t) + 64;
+
+		if (want > pt->npids) {
+			pid_t *pids = realloc(pt->pids, want * sizeof(*pids));
+
+			if (!pids) {
+				__logger(error, "realloc: out of memory");
+				return (false);
+			}
+			pt->pids  = pids;
+			pt->npids = want;
+		}
+
+		bytes = proc_listpids(PROC_ALL_PIDS, 0, pt->pids,
+				      (int)(pt->npids * sizeof(pid_t)));
+		if (bytes <= 0) {
+			__logger(error, "proc_listpids: failed");
+			return (false);
+		}
+
+		if ((size_t)bytes < pt->npids * sizeof(pid_t))
+			break;
+		bytes *= 2;
+	}
+
+	*count = (size_t)bytes / sizeof(pid_t);
+	qsort(pt->pids, *count, sizeof(pid_t), process_pid_cmp);
+	return (true);
+}
+
+/* False when the process is gone or cannot be looked at. */
+static bool process_query(pid_t pid, process_entry_t *e)
+{
+	struct proc_bsdinfo info;
+	char		    path[PROC_PIDPATHINFO_MAXSIZE];
+
+	if (proc_pidinfo(pid, PROC_PIDTBSDINFO, 0, &info,
+			 PROC_PIDTBSDINFO_SIZE) != PROC_PIDTBSDINFO_SIZE)
+		return (false);
+
+	(void)memset(e, 0, sizeof(*e));
+	e->pid	= pid;
+	e->ppid = (pid_t)info.pbi_ppid;
+	(void)strncpy(e->name, info.pbi_name[0] ? info.pbi_name : info.pbi_comm,
+		      sizeof(e->name) - 1);
+
+	if (proc_pidpath(pid, path, sizeof(path)) > 0)
+		e->path = strdup(path);
+	return (true);
+}
+
+bool process_table_refresh(process_table_t *pt)
+{
+	const process_entry_t *old = vec_unsafe_access(pt->entries, 0);
+	size_t		       nold = vec_size(pt->entries);
+	vec_t		      *entries;
+	size_t		       count;
+	size_t		       j = 0;
+
+	pt->queried = 0;
+	if (!process_list(pt, &count))
+		return (false);
+
+	entries = vec_create(sizeof(process_entry_t), count + 1, NULL);
+	if (!entries) {
+		__logger(error, "vec_create: out of memory");
+		return (false);
+	}
+
+	/* Both lists are sorted by pid, entries that are in the old one are
+	 * moved over as they are.
+	 */
+	for (size_t i = 0; i < count; i++) {
+		process_entry_t e;
+
+		if (i && pt->pids[i] == pt->pids[i - 1])
+			continue;
+
+		while (j < nold && old[j].pid < pt->pids[i])
+			free(old[j++].path);
+
+		if (j < nold && old[j].pid == pt->pids[i]) {
+			e = old[j++];
+		} else {
+			pt->queried++;
+			if (!process_query(pt->pids[i], &e))
+				continue;
+		}
+
+		/* Room was reserved for every pid */
+		(void)vec_push(entries, &e);
+	}
+
+	while (j < nold)
+		free(old[j++].path);
+
+	vec_kill(pt->entries);
+	pt->entries = entries;
+	return (true);
+}
+
+const process_entry_t *process_table_get(const process_table_t *pt,
+					 pid_t			pid)
+{
+	const process_entry_t *e  = vec_unsafe_access(pt->entries, 0);
+	size_t		       lo = 0;
+	size_t		       hi = vec_size(pt->entries);
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (e[mid].pid == pid)
+			return (&e[mid]);
+		if (e[mid].pid < pid)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (NULL);
+}
+
+size_t process_table_find(const process_table_t *pt, const char *pattern,
+			  vec_t **matches)
+{
+	const process_entry_t *e	= vec_unsafe_access(pt->entries, 0);
+	bool		       by_path = strchr(pattern, '/') != NULL;
+	size_t		       n	= 0;
+
+	if (!*matches) {
+		*matches = vec_create(sizeof(const process_entry_t *), 16,
+				      NULL);
+		if (!*matches) {
+			__logger(error, "vec_create: out of memory");
+			return (0);
+		}
+	}
+
+	for (size_t i = 0; i < vec_size(pt->entries); i++) {
+		const process_entry_t *match = &e[i];
+		const char	      *s     = by_path ? e[i].path : e[i].name;
+
+		if (!s || !strpcmp(s, pattern))
+			continue;
+
+		if (!vec_push(*matches, &match)) {
+			__logger(error, "vec_push: out of memory");
+			break;
+		}
+		n++;
+	}
+
+	return (n);
+}
@@ -0,0 +1,442 @@
+#include "common.h"
+#include "ios-macos-utils.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define PROFILE_WRITE_BUF   0x10000
+#define PROFILE_NAME_MAX    512
+#define PROFILE_MAX_THREADS 256 /* walked per sample */
+
+struct profile_map_s {
+	uint32_t *slots; /* stack index + 1, 0 for an empty slot */
+	size_t	  nslots; /* power of two */
+};
+
+typedef struct profile_name_s {
+	uint64_t    pc;
+	const char *name;
+} profile_name_t;
+
+static uint64_t profile_now(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec);
+}
+
+bool profile_init(profile_t *prof)
+{
+	(void)memset(prof, 0, sizeof(*prof));
+	atomic_init(&prof->stop, false);
+
+	prof->arena	= arena_create(0);
+	prof->stacks	= vec_create(sizeof(profile_stack_t), 256, NULL);
+	prof->samples	= vec_create(sizeof(profile_sample_t), 1024, NULL);
+	prof->by_frames = calloc(1, sizeof(*prof->by_frames));
+	if (!prof->arena || !prof->stacks || !prof->samples ||
+	    !prof->by_frames) {
+		__logger(error, "profile: out of memory");
+		profile_free(prof);
+		return (false);
+	}
+
+	prof->by_frames->nslots = 512;
+	prof->by_frames->slots	= calloc(prof->by_frames->nslots,
+					 sizeof(*prof->by_frames->slots));
+	if (!prof->by_frames->slots) {
+		__logger(error, "calloc: out of memory");
+		profile_free(prof);
+		return (false);
+	}
+
+	return (true);
+}
+
+void profile_free(profile_t *prof)
+{
+	if (prof->arena)
+		arena_kill(prof->arena);
+	if (prof->stacks)
+		vec_kill(prof->stacks);
+	if (prof->samples)
+		vec_kill(prof->samples);
+	if (prof->by_frames)
+		free(prof->by_frames->slots);
+	free(prof->by_frames);
+	(void)memset(prof, 0, sizeof(*prof));
+}
+
+void profile_stop(profile_t *prof)
+{
+	atomic_store(&prof->stop, true);
+}
+
+static bool profile_grow(profile_t *prof)
+{
+	const profile_stack_t *stacks = vec_data(prof->stacks);
+	struct profile_map_s  *map    = prof->by_frames;
+	size_t		       nslots = map->nslots * 2;
+	uint32_t	      *slots;
+
+	slots = calloc(nslots, sizeof(*slots));
+	if (!slots) {
+		__logger(error, "calloc: out of memory");
+		return (false);
+	}
+
+	for (size_t i = 0; i < vec_size(prof->stacks); i++) {
+		size_t j = stacks[i].hash & (nslots - 1);
+
+		while (slots[j])
+			j = (j + 1) & (nslots - 1);
+		slots[j] = (uint32_t)i + 1;
+	}
+
+	free(map->slots);
+	map->slots  = slots;
+	map->nslots = nslots;
+	return (true);
+}
+
+/* Counts a sample of 'frames', which are copied into the arena the first
+ * time they are seen.
+ */
+static bool profile_intern(profile_t *prof, const uint64_t *frames,
+			   uint32_t n)
+{
+	struct profile_map_s *map = prof->by_frames;
+	uint64_t	      h	  = fnv1a(frames, n * sizeof(*frames));
+	size_t		      i	  = h & (map->nslots - 1);
+	profile_stack_t	      stack;
+	uint64_t	     *copy;
+
+	while (map->slots[i]) {
+		profile_stack_t *s = vec_unsafe_access(prof->stacks,
+						       map->slots[i] - 1);
+
+		if (s->hash == h && s->nframes == n &&
+		    !memcmp(s->frames, frames, n * sizeof(*frames))) {
+			s->count++;
+			return (true);
+		}
+		i = (i + 1) & (map->nslots - 1);
+	}
+
+	copy = arena_alloc(prof->arena, n * sizeof(*frames));
+	if (!copy) {
+		__logger(error, "arena_alloc: out of memory");
+		return (false);
+	}
+	(void)memcpy(copy, frames, n * sizeof(*frames));
+
+	stack.frames  = copy;
+	stack.nframes = n;
+	stack.count   = 1;
+	stack.hash    = h;
+	if (!vec_push(prof->stacks, &stack)) {
+		__logger(error, "vec_push: out of memory");
+		return (false);
+	}
+	map->slots[i] = (uint32_t)vec_size(prof->stacks);
+
+	if (vec_size(prof->stacks) * 2 > map->nslots)
+		return (profile_grow(prof));
+	return (true);
+}
+
+/* One sample: the task stays suspended while its threads are walked, until
+ * the budget runs out, and the walked stacks are interned afterwards.
+ */
+static bool profile_sample(profile_t *prof, task_t task,
+			   unwind_image_t *images, size_t nimages,
+			   const profile_config_t *config, uint64_t start,
+			   uint64_t *frames, uint32_t *nframes)
+{
+	thread_act_array_t     threads;
+	mach_msg_type_number_t count;
+	profile_sample_t       sample = { 0 };
+	uint64_t	       t0;
+	bool		       ok = true;
+
+	t0 = profile_now();
+	if (!process_suspend(task))
+		return (false);
+
+	if (!process_threads(task, &threads, &count)) {
+		(void)process_resume(task);
+		return (false);
+	}
+
+	for (mach_msg_type_number_t i = 0; i < count; i++) {
+		unwind_regs_t regs;
+		uint64_t     *pcs;
+
+		if (sample.nthreads == PROFILE_MAX_THREADS ||
+		    (config->budget && profile_now() - t0 >= config->budget)) {
+			sample.skipped = count - i;
+			break;
+		}
+
+		/* A thread that exited since the list was taken is not an
+		 * error.
+		 */
+		if (!thread_regs_get(threads[i], &regs, true))
+			continue;
+
+		pcs = frames + sample.nthreads * config->max_frames;
+		nframes[sample.nthreads++] =
+			(uint32_t)unwind_stack(task, &regs, images, nimages,
+					       pcs, config->max_frames);
+	}
+
+	ok = process_resume(task);
+	sample.pause = profile_now() - t0;
+	sample.time  = t0 - start;
+	process_threads_free(threads, count);
+
+	for (uint32_t i = 0; ok && i < sample.nthreads; i++) {
+		if (nframes[i])
+			ok = profile_intern(prof,
+					    frames + i * config->max_frames,
+					    nframes[i]);
+	}
+
+	if (ok && !vec_push(prof->samples, &sample)) {
+		__logger(error, "vec_push: out of memory");
+		ok = false;
+	}
+
+	return (ok);
+}
+
+bool profile_run(profile_t *prof, task_t task, unwind_image_t *images,
+		 size_t nimages, const profile_config_t *config)
+{
+	profile_config_t cfg = *config;
+	uint64_t	*frames;
+	uint32_t	*nframes;
+	uint64_t	 period;
+	uint64_t	 start;
+	uint64_t	 next;
+	bool		 ok = true;
+
+	/* Checked once here rather than by every thread of every sample */
+#if !defined(__arm64__)
+	__logger(error, "profile: only arm64 threads are supported");
+	return (false);
+#endif
+
+	if (!cfg.frequency || cfg.frequency > 1000000000) {
+		__logger(error, "profile: bad frequency %u", cfg.frequency);
+		return (false);
+	}
+	if (!cfg.max_frames || cfg.max_frames > PROFILE_MAX_FRAMES)
+		cfg.max_frames = PROFILE_MAX_FRAMES;
+
+	/* Stacks are walked into a scratch buffer while the task is stopped,
+	 * leaving the hashing for after it resumes.
+	 */
+	frames	= malloc((size_t)PROFILE_MAX_THREADS * cfg.max_frames *
+			 sizeof(*frames));
+	nframes = malloc(PROFILE_MAX_THREADS * sizeof(*nframes));
+	if (!frames || !nframes) {
+		__logger(error, "malloc: out of memory");
+		free(frames);
+		free(nframes);
+		return (false);
+	}
+
+	period = 1000000000ULL / cfg.frequency;
+	start  = profile_now();
+	next   = start;
+	while (ok && !atomic_load(&prof->stop)) {
+		uint64_t now = profile_now();
+
+		if (cfg.duration && now - start >= cfg.duration)
+			break;
+
+		if (now < next) {
+			struct timespec ts;
+
+			ts.tv_sec  = (time_t)((next - now) / 1000000000ULL);
+			ts.tv_nsec = (long)((next - now) % 1000000000ULL);
+			(void)nanosleep(&ts, NULL);
+			continue;
+		}
+
+		ok = profile_sample(prof, task, images, nimages, &cfg, start,
+				    frames, nframes);
+
+		/* Ticks missed by a slow sample are dropped rather than
+		 * taken back to back.
+		 */
+		next += period;
+		if (next < profile_now())
+			next = profile_now() + period;
+	}
+
+	free(frames);
+	free(nframes);
+	return (ok);
+}
+
+static int profile_u64_cmp(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return ((x > y) - (x < y));
+}
+
+static const char *profile_name(const profile_name_t *names, size_t n,
+				uint64_t pc)
+{
+	size_t lo = 0;
+	size_t hi = n;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (names[mid].pc < pc)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return (names[lo].name);
+}
+
+/* Every distinct pc is symbolized once, after sampling is over. */
+static profile_name_t *profile_names(const profile_t *prof, arena_t *arena,
+				     profile_symbolize_t symbolize, void *ctx,
+				     size_t *count)
+{
+	const profile_stack_t *stacks = vec_unsafe_access(prof->stacks, 0);
+	profile_name_t	      *names;
+	uint64_t	      *pcs;
+	size_t		       n = 0;
+	size_t		       u = 0;
+
+	for (size_t i = 0; i < vec_size(prof->stacks); i++)
+		n += stacks[i].nframes;
+
+	pcs   = malloc((n + 1) * sizeof(*pcs));
+	names = malloc((n + 1) * sizeof(*names));
+	if (!pcs || !names) {
+		__logger(error, "malloc: out of memory");
+		free(pcs);
+		free(names);
+		return (NULL);
+	}
+
+	n = 0;
+	for (size_t i = 0; i < vec_size(prof->stacks); i++) {
+		(void)memcpy(pcs + n, stacks[i].frames,
+			     stacks[i].nframes * sizeof(*pcs));
+		n += stacks[i].nframes;
+	}
+	qsort(pcs, n, sizeof(*pcs), profile_u64_cmp);
+
+	for (size_t i = 0; i < n; i++) {
+		char  buf[PROFILE_NAME_MAX];
+		char *p;
+
+		if (i && pcs[i] == pcs[i - 1])
+			continue;
+
+		if (!symbolize || !symbolize(ctx, pcs[i], buf, sizeof(buf)))
+			(void)snprintf(buf, sizeof(buf), "0x%llx",
+				       (unsigned long long)pcs[i]);
+
+		/* ';' separates frames in the folded format */
+		for (p = buf; (p = strchr(p, ';'));)
+			*p = ':';
+
+		names[u].pc   = pcs[i];
+		names[u].name = arena_strndup(arena, buf, sizeof(buf));
+		if (!names[u++].name) {
+			__logger(error, "arena_strndup: out of memory");
+			free(pcs);
+			free(names);
+			return (NULL);
+		}
+	}
+
+	free(pcs);
+	*count = u;
+	return (names);
+}
+
+bool profile_write_folded(const profile_t *prof, int fd,
+			  profile_symbolize_t symbolize, void *ctx)
+{
+	const profile_stack_t *stacks = vec_unsafe_access(prof->stacks, 0);
+	profile_name_t	      *names;
+	arena_t		      *arena;
+	bufwriter_t	       w;
+	size_t		       nnames = 0;
+	bool		       ok;
+
+	arena = arena_create(0);
+	if (!arena)
+		return (false);
+
+	names = profile_names(prof, arena, symbolize, ctx, &nnames);
+	if (!names || !bufwriter_init(&w, fd, PROFILE_WRITE_BUF, NULL)) {
+		free(names);
+		arena_kill(arena);
+		return (false);
+	}
+
+	for (size_t i = 0; i < vec_size(prof->stacks); i++) {
+		const profile_stack_t *s = &stacks[i];
+
+		for (uint32_t j = s->nframes; j > 0; j--) {
+			if (j != s->nframes)
+				bufwriter_write(&w, ";", 1);
+			bufwriter_puts(&w, profile_name(names, nnames,
+							s->frames[j - 1]));
+		}
+		bufwriter_printf(&w, " %llu\n", (unsigned long long)s->count);
+	}
+
+	ok = bufwriter_flush(&w);
+	bufwriter_destroy(&w);
+	free(names);
+	arena_kill(arena);
+	return (ok);
+}
+
+void profile_pauses(const profile_t *prof, uint64_t *median, uint64_t *p99,
+		    uint64_t *max)
+{
+	const profile_sample_t *samples = vec_unsafe_access(prof->samples, 0);
+	size_t			n	= vec_size(prof->samples);
+	uint64_t	       *pauses;
+
+	*median = 0;
+	*p99	= 0;
+	*max	= 0;
+
+	pauses = malloc((n + 1) * sizeof(*pauses));
+	if (!pauses) {
+		__logger(error, "malloc: out of memory");
+		return;
+	}
+
+	for (size_t i = 0; i < n; i++)
+		pauses[i] = samples[i].pause;
+	qsort(pauses, n, sizeof(*pauses), profile_u64_cmp);
+
+	if (n) {
+		*median = pauses[n / 2];
+		*p99	= pauses[n * 99 / 100];
+		*max	= pauses[n - 1];
+	}
+	free(pauses);
+}
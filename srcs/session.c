@@ -0,0 +1,234 @@
+#include "common.h"
+#include "ios-macos-utils.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct session_job_s {
+	session_t    *s;
+	session_fn_t  fn;
+	void	     *ctx;
+	bool	     *ok;
+	atomic_size_t nok;
+} session_job_t;
+
+typedef struct session_read_s {
+	mach_vm_address_t address;
+	uint8_t		 *bufs;
+	vm_size_t	  size;
+	vm_size_t	 *nread;
+} session_read_t;
+
+typedef struct session_strings_s {
+	strings_t	 *st;
+	mach_vm_address_t address;
+	mach_vm_size_t	  size;
+} session_strings_t;
+
+bool session_init(session_t *s, size_t nworkers)
+{
+	(void)memset(s, 0, sizeof(*s));
+
+	s->nworkers = nworkers;
+	s->targets  = vec_create(sizeof(session_target_t), 16, NULL);
+	if (!s->targets) {
+		__logger(error, "vec_create: out of memory");
+		return (false);
+	}
+
+	return (true);
+}
+
+static void session_target_free(session_target_t *t)
+{
+	if (t->images)
+		vec_kill(t->images);
+	if (t->paths)
+		strpool_kill(t->paths);
+	symbolicator_free(&t->sym);
+	(void)mach_port_deallocate(mach_task_self(), t->task);
+}
+
+void session_free(session_t *s)
+{
+	if (s->targets) {
+		for (size_t i = 0; i < vec_size(s->targets); i++)
+			session_target_free(vec_unsafe_access(s->targets, i));
+		vec_kill(s->targets);
+	}
+
+	(void)memset(s, 0, sizeof(*s));
+}
+
+bool session_attach(session_t *s, pid_t pid)
+{
+	session_target_t t;
+
+	(void)memset(&t, 0, sizeof(t));
+	t.pid = pid;
+	if (!process_get_task(pid, &t.task))
+		return (false);
+
+	t.paths = strpool_create();
+	if (!t.paths || !symbolicator_init(&t.sym)) {
+		__logger(error, "session: out of memory");
+		session_target_free(&t);
+		return (false);
+	}
+
+	if (!vec_push(s->targets, &t)) {
+		__logger(error, "vec_push: out of memory");
+		session_target_free(&t);
+		return (false);
+	}
+
+	return (true);
+}
+
+size_t session_attach_matching(session_t *s, const process_table_t *pt,
+			       const char *pattern)
+{
+	vec_t  *matches = NULL;
+	size_t	n	= 0;
+
+	if (!process_table_find(pt, pattern, &matches))
+		goto out;
+
+	for (size_t i = 0; i < vec_size(matches); i++) {
+		const process_entry_t *e;
+
+		e = *(const process_entry_t **)vec_unsafe_access(matches, i);
+		if (session_attach(s, e->pid))
+			n++;
+	}
+
+out:
+	if (matches)
+		vec_kill(matches);
+	return (n);
+}
+
+size_t session_count(const session_t *s)
+{
+	return (vec_size(s->targets));
+}
+
+session_target_t *session_target(const session_t *s, size_t index)
+{
+	return (vec_unsafe_access(s->targets, index));
+}
+
+static void session_worker(void *ctx, size_t worker, size_t job)
+{
+	session_job_t	 *j = ctx;
+	session_target_t *t = vec_unsafe_access(j->s->targets, job);
+	bool		  r;
+
+	(void)worker;
+	r = j->fn(t, job, j->ctx);
+	if (j->ok)
+		j->ok[job] = r;
+
+	/* Each target is only ever handled by one worker */
+	if (r)
+		atomic_fetch_add_explicit(&j->nok, 1, memory_order_relaxed);
+	else
+		t->failures++;
+}
+
+/* Work on a target mostly waits on the kernel, so by default every target
+ * gets a worker and the run takes as long as the slowest one.
+ */
+size_t session_run(session_t *s, session_fn_t fn, void *ctx, bool *ok)
+{
+	session_job_t j;
+	size_t	      n = vec_size(s->targets);
+
+	j.s   = s;
+	j.fn  = fn;
+	j.ctx = ctx;
+	j.ok  = ok;
+	atomic_init(&j.nok, 0);
+
+	if (ok)
+		(void)memset(ok, 0, n * sizeof(*ok));
+
+	if (!parallel_for(n, s->nworkers ? s->nworkers : n, session_worker,
+			  &j))
+		return (0);
+	return (atomic_load(&j.nok));
+}
+
+static bool session_read_one(session_target_t *t, size_t index, void *ctx)
+{
+	session_read_t *r     = ctx;
+	uint8_t	       *buf   = r->bufs + index * r->size;
+	vm_size_t	nread = 0;
+	bool		ok;
+
+	ok = memory_rpartial(t->task, (vm_address_t)r->address, buf, r->size,
+			     &nread);
+	if (r->nread)
+		r->nread[index] = ok ? nread : 0;
+	return (ok);
+}
+
+size_t session_read(session_t *s, mach_vm_address_t address, uint8_t *bufs,
+		    vm_size_t size, vm_size_t *nread, bool *ok)
+{
+	session_read_t r;
+
+	r.address = address;
+	r.bufs	  = bufs;
+	r.size	  = size;
+	r.nread	  = nread;
+	return (session_run(s, session_read_one, &r, ok));
+}
+
+static bool session_images_one(session_target_t *t, size_t index, void *ctx)
+{
+	bool refresh = *(bool *)ctx;
+
+	(void)index;
+	if (t->images) {
+		if (!refresh)
+			return (true);
+		vec_kill(t->images);
+		t->images = NULL;
+	}
+
+	/* A partial list is not kept, the next call tries again */
+	if (!process_images(t->task, t->paths, &t->images)) {
+		if (t->images)
+			vec_kill(t->images);
+		t->images = NULL;
+		return (false);
+	}
+
+	return (true);
+}
+
+size_t session_images(session_t *s, bool refresh, bool *ok)
+{
+	return (session_run(s, session_images_one, &refresh, ok));
+}
+
+static bool session_strings_one(session_target_t *t, size_t index, void *ctx)
+{
+	session_strings_t *r = ctx;
+
+	return (strings_scan_task(&r->st[index], t->task, r->address,
+				  r->size));
+}
+
+size_t session_strings(session_t *s, strings_t *st, mach_vm_address_t address,
+		       mach_vm_size_t size, bool *ok)
+{
+	session_strings_t r;
+
+	r.st	  = st;
+	r.address = address;
+	r.size	  = size;
+	return (session_run(s, session_strings_one, &r, ok));
+}
@@ -0,0 +1,354 @@
+#include "arm64.h"
+#include "common.h"
+#include "ios-macos-utils.h"
+#include <mach-o/loader.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#define SIGNATURE_WORDS_PER_JOB (1 << 20)
+#define SIGNATURE_READ_CHUNK	(4 << 20)
+#define SIGNATURE_LO12		(0xfffu << 10)
+
+/* Mask the n-grams are keyed with. It also drops the offsets of every ADD
+ * and LDR/STR immediate, so that it never keeps a bit a signature could
+ * have wildcarded.
+ */
+static inline uint32_t signature_coarse_mask(uint32_t insn)
+{
+	if (arm64_is_add_imm64(insn) || arm64_is_ldst_uimm(insn))
+		return (~SIGNATURE_LO12);
+	return (arm64_pcrel_mask(insn));
+}
+
+static inline uint32_t signature_word(const signature_index_t *si, size_t i)
+{
+	uint32_t insn;
+
+	(void)memcpy(&insn, si->text + i * 4, sizeof(insn));
+	return (insn);
+}
+
+/* FNV-1a over the masked words of the gram at word 'at'.
+ */
+static uint32_t signature_key(const signature_index_t *si, size_t at)
+{
+	uint32_t h = 0x811c9dc5;
+
+	for (size_t j = 0; j < SIGNATURE_GRAM; j++) {
+		uint32_t insn = signature_word(si, at + j);
+
+		h ^= insn & signature_coarse_mask(insn);
+		h *= 0x01000193;
+	}
+
+	return (h);
+}
+
+static void signature_keys(void *arg, size_t worker, size_t job)
+{
+	signature_index_t *si	 = arg;
+	size_t		   first = job * SIGNATURE_WORDS_PER_JOB;
+	size_t		   last	 = MIN(first + SIGNATURE_WORDS_PER_JOB,
+				       si->ngrams);
+
+	(void)worker;
+
+	for (size_t i = first; i < last; i++)
+		si->grams[i] = ((uint64_t)signature_key(si, i) << 32) | i;
+}
+
+/* Stable LSD radix sort on the key, the upper half of each gram, which
+ * keeps the positions of a key in ascending order.
+ */
+static bool signature_sort(signature_index_t *si)
+{
+	uint64_t *tmp = malloc(si->ngrams * sizeof(*tmp));
+	uint64_t *src = si->grams;
+	uint64_t *dst = tmp;
+
+	if (!tmp) {
+		__logger(error, "malloc: out of memory");
+		return (false);
+	}
+
+	for (unsigned shift = 32; shift < 64; shift += 8) {
+		size_t counts[256] = { 0 };
+		size_t sum	   = 0;
+
+		for (size_t i = 0; i < si->ngrams; i++)
+			counts[(src[i] >> shift) & 0xff]++;
+		for (size_t b = 0; b < 256; b++) {
+			size_t n = counts[b];
+
+			counts[b] = sum;
+			sum += n;
+		}
+		for (size_t i = 0; i < si->ngrams; i++)
+			dst[counts[(src[i] >> shift) & 0xff]++] = src[i];
+
+		tmp = src;
+		src = dst;
+		dst = tmp;
+	}
+
+	/* An even number of passes leaves the result in 'grams'. */
+	free(dst);
+	return (true);
+}
+
+static bool signature_index(signature_index_t *si)
+{
+	size_t njobs;
+
+	if (si->nwords < SIGNATURE_GRAM)
+		return (true);
+
+	si->ngrams = si->nwords - SIGNATURE_GRAM + 1;
+	si->grams  = malloc(si->ngrams * sizeof(*si->grams));
+	if (!si->grams) {
+		__logger(error, "malloc: out of memory");
+		return (false);
+	}
+
+	njobs = (si->ngrams + SIGNATURE_WORDS_PER_JOB - 1) /
+		SIGNATURE_WORDS_PER_JOB;
+	return (parallel_for(njobs, 0, signature_keys, si) &&
+		signature_sort(si));
+}
+
+bool signature_index_build(signature_index_t *si, const macho_t *macho)
+{
+	const struct segment_command_64 *seg;
+
+	(void)memset(si, 0, sizeof(*si));
+
+	seg = macho_find_segment(macho, SEG_TEXT);
+	if (!seg) {
+		__logger(error, "signature: no __TEXT segment");
+		return (false);
+	}
+
+	si->base   = seg->vmaddr;
+	si->nwords = seg->filesize / 4;
+	si->text   = macho_at_offset(macho, seg->fileoff, si->nwords * 4);
+	if (!si->text) {
+		__logger(error, "signature: __TEXT out of bounds");
+		return (false);
+	}
+
+	if (!signature_index(si)) {
+		signature_index_free(si);
+		return (false);
+	}
+
+	return (true);
+}
+
+bool signature_index_build_task(signature_index_t *si, task_t task,
+				vm_address_t address, const macho_t *macho)
+{
+	const struct segment_command_64 *seg;
+	uint64_t			 slide = address - macho->vmbase;
+	uint8_t				*copy;
+
+	(void)memset(si, 0, sizeof(*si));
+
+	seg = macho_find_segment(macho, SEG_TEXT);
+	if (!seg) {
+		__logger(error, "signature: no __TEXT segment");
+		return (false);
+	}
+
+	si->base   = seg->vmaddr;
+	si->nwords = seg->filesize / 4;
+	copy	   = malloc(si->nwords * 4 + 1);
+	if (!copy) {
+		__logger(error, "malloc: out of memory");
+		return (false);
+	}
+	si->text  = copy;
+	si->owned = copy;
+
+	for (uint64_t off = 0; off < si->nwords * 4;
+	     off += SIGNATURE_READ_CHUNK) {
+		size_t n = MIN(SIGNATURE_READ_CHUNK, si->nwords * 4 - off);
+
+		if (!memory_r(task, seg->vmaddr + slide + off, copy + off, n)) {
+			signature_index_free(si);
+			return (false);
+		}
+	}
+
+	if (!signature_index(si)) {
+		signature_index_free(si);
+		return (false);
+	}
+
+	return (true);
+}
+
+void signature_index_free(signature_index_t *si)
+{
+	free(si->grams);
+	free(si->owned);
+	(void)memset(si, 0, sizeof(*si));
+}
+
+/* Grams keyed like the one at word 'at', a range of 'grams'.
+ */
+static const uint64_t *signature_occurrences(const signature_index_t *si,
+					     size_t at, size_t *count)
+{
+	uint64_t key = (uint64_t)signature_key(si, at) << 32;
+	size_t	 lo  = 0;
+	size_t	 hi  = si->ngrams;
+	size_t	 first;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (si->grams[mid] < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	first = lo;
+	hi    = si->ngrams;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if ((si->grams[mid] >> 32) == (key >> 32))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	*count = lo - first;
+	return (si->grams + first);
+}
+
+static bool signature_matches(const signature_index_t *si,
+			      const insn_mask_t *sig, size_t count, size_t at)
+{
+	if (at + count > si->nwords)
+		return (false);
+
+	for (size_t j = 0; j < count; j++) {
+		if ((signature_word(si, at + j) & sig[j].mask) != sig[j].value)
+			return (false);
+	}
+
+	return (true);
+}
+
+/* Replaces the candidates by the positions whose gram at offset 'gram'
+ * matches the one of the signature, checked against its 'count' words.
+ */
+static size_t signature_restart(const signature_index_t *si,
+				const insn_mask_t *sig, size_t count,
+				size_t start, size_t gram, uint32_t *cands)
+{
+	const uint64_t *occ;
+	size_t		nocc;
+	size_t		n = 0;
+
+	occ = signature_occurrences(si, start + gram, &nocc);
+	for (size_t i = 0; i < nocc; i++) {
+		size_t at = (uint32_t)occ[i];
+
+		if (at >= gram && signature_matches(si, sig, count, at - gram))
+			cands[n++] = (uint32_t)(at - gram);
+	}
+
+	return (n);
+}
+
+bool signature_generate(const signature_index_t *si, uint64_t addr,
+			insn_mask_t *sig, size_t max, size_t *count)
+{
+	uint32_t *cands;
+	uint32_t  pages = 0;
+	size_t	  ncands;
+	size_t	  start;
+	size_t	  len;
+	size_t	  n;
+
+	*count = 0;
+
+	if ((addr & 3) || addr < si->base ||
+	    (addr - si->base) / 4 + SIGNATURE_GRAM > si->nwords ||
+	    max < SIGNATURE_GRAM) {
+		__logger(error, "signature: cannot start at %#llx",
+			 (unsigned long long)addr);
+		return (false);
+	}
+	start = (addr - si->base) / 4;
+
+	/* Branch, literal and ADRP immediates are wildcarded, as well as the
+	 * page offsets added to or loaded from an ADRP result.
+	 */
+	for (n = 0; n < max && start + n < si->nwords; n++) {
+		uint32_t insn = signature_word(si, start + n);
+		uint32_t mask = arm64_pcrel_mask(insn);
+
+		if (arm64_is_adrp(insn)) {
+			pages |= 1u << arm64_rd(insn);
+		} else if ((arm64_is_add_imm64(insn) ||
+			    arm64_is_ldst_uimm(insn)) &&
+			   (pages & (1u << arm64_rn(insn)))) {
+			mask &= ~SIGNATURE_LO12;
+			if (arm64_is_add_imm64(insn) || (insn & (3u << 22)))
+				pages &= ~(1u << arm64_rd(insn));
+		}
+
+		sig[n].value = insn & mask;
+		sig[n].mask  = mask;
+		sig[n].gap   = 0;
+	}
+
+	/* The rarest gram seen so far gives the candidates, which every new
+	 * word then filters.
+	 */
+	(void)signature_occurrences(si, start, &ncands);
+	cands = malloc((ncands + 1) * sizeof(*cands));
+	if (!cands) {
+		__logger(error, "malloc: out of memory");
+		return (false);
+	}
+	ncands = signature_restart(si, sig, SIGNATURE_GRAM, start, 0, cands);
+
+	for (len = SIGNATURE_GRAM; ncands > 1 && len < n; len++) {
+		size_t gram = len + 1 - SIGNATURE_GRAM;
+		size_t nocc;
+		size_t kept = 0;
+
+		(void)signature_occurrences(si, start + gram, &nocc);
+		if (nocc < ncands) {
+			ncands = signature_restart(si, sig, len + 1, start,
+						   gram, cands);
+			continue;
+		}
+
+		for (size_t i = 0; i < ncands; i++) {
+			if (cands[i] + len < si->nwords &&
+			    (signature_word(si, cands[i] + len) &
+			     sig[len].mask) == sig[len].value)
+				cands[kept++] = cands[i];
+		}
+		ncands = kept;
+	}
+
+	free(cands);
+	*count = len;
+	if (ncands != 1) {
+		__logger(error, "signature: %#llx is not unique within %zu "
+				"instructions",
+			 (unsigned long long)addr, n);
+		return (false);
+	}
+
+	return (true);
+}
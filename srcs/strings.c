@@ -0,0 +1,377 @@
+#include "common.h"
+#include "ios-macos-utils.h"
+#include <mach-o/loader.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
+
+#define STRINGS_BLOCK	     64
+#define STRINGS_NO_RUN	     SIZE_MAX
+#define STRINGS_EVEN	     0x5555555555555555ULL
+#define STRINGS_TASK_WINDOW (1 << 20)
+
+enum { STRINGS_ENC_ASCII, STRINGS_ENC_UTF16LE, STRINGS_ENC_MAX };
+
+typedef struct strings_ctx_s {
+	strings_t     *st;
+	const uint8_t *buf;
+	uint64_t       addr;
+	bool	       transient; /* 'buf' does not outlive the scan */
+	size_t	       run[STRINGS_ENC_MAX]; /* start of the open run */
+} strings_ctx_t;
+
+/* Sets one bit per byte of the 64 at 'p': printable ASCII (tab, newline and
+ * carriage return included) in 'print', NUL in 'nul'.
+ */
+static inline void strings_classify(const uint8_t *p, uint64_t *print,
+				    uint64_t *nul)
+{
+#if defined(__AVX2__)
+	const __m256i lo = _mm256_set1_epi8(0x1f);
+	const __m256i hi = _mm256_set1_epi8(0x7f);
+	const __m256i ht = _mm256_set1_epi8('\t');
+	const __m256i lf = _mm256_set1_epi8('\n');
+	const __m256i cr = _mm256_set1_epi8('\r');
+	uint64_t      pm = 0;
+	uint64_t      zm = 0;
+
+	for (int i = 0; i < 2; i++) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(p + 32 * i));
+		__m256i ws;
+		__m256i pr;
+
+		ws = _mm256_or_si256(_mm256_cmpeq_epi8(v, ht),
+				     _mm256_or_si256(_mm256_cmpeq_epi8(v, lf),
+						     _mm256_cmpeq_epi8(v, cr)));
+		pr = _mm256_and_si256(_mm256_cmpgt_epi8(v, lo),
+				      _mm256_cmpgt_epi8(hi, v));
+		pr = _mm256_or_si256(pr, ws);
+
+		pm |= (uint64_t)(uint32_t)_mm256_movemask_epi8(pr) << (32 * i);
+		zm |= (uint64_t)(uint32_t)_mm256_movemask_epi8(
+			      _mm256_cmpeq_epi8(v, _mm256_setzero_si256()))
+		      << (32 * i);
+	}
+
+	*print = pm;
+	*nul   = zm;
+#elif defined(__SSE2__)
+	const __m128i lo = _mm_set1_epi8(0x1f);
+	const __m128i hi = _mm_set1_epi8(0x7f);
+	const __m128i ht = _mm_set1_epi8('\t');
+	const __m128i lf = _mm_set1_epi8('\n');
+	const __m128i cr = _mm_set1_epi8('\r');
+	uint64_t      pm = 0;
+	uint64_t      zm = 0;
+
+	for (int i = 0; i < 4; i++) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + 16 * i));
+		__m128i ws;
+		__m128i pr;
+
+		ws = _mm_or_si128(_mm_cmpeq_epi8(v, ht),
+				  _mm_or_si128(_mm_cmpeq_epi8(v, lf),
+					       _mm_cmpeq_epi8(v, cr)));
+		pr = _mm_and_si128(_mm_cmpgt_epi8(v, lo),
+				   _mm_cmplt_epi8(v, hi));
+		pr = _mm_or_si128(pr, ws);
+
+		pm |= (uint64_t)(uint16_t)_mm_movemask_epi8(pr) << (16 * i);
+		zm |= (uint64_t)(uint16_t)_mm_movemask_epi8(
+			      _mm_cmpeq_epi8(v, _mm_setzero_si128()))
+		      << (16 * i);
+	}
+
+	*print = pm;
+	*nul   = zm;
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+	static const uint8_t weights[16] = { 1, 2, 4, 8, 16, 32, 64, 128,
+					     1, 2, 4, 8, 16, 32, 64, 128 };
+	const uint8x16_t     w		 = vld1q_u8(weights);
+	uint64_t	     pm		 = 0;
+	uint64_t	     zm		 = 0;
+
+	for (int i = 0; i < 4; i++) {
+		uint8x16_t v  = vld1q_u8(p + 16 * i);
+		uint8x16_t ws = vorrq_u8(
+			vceqq_u8(v, vdupq_n_u8('\t')),
+			vorrq_u8(vceqq_u8(v, vdupq_n_u8('\n')),
+				 vceqq_u8(v, vdupq_n_u8('\r'))));
+		uint8x16_t pr = vandq_u8(vcgtq_u8(v, vdupq_n_u8(0x1f)),
+					 vcltq_u8(v, vdupq_n_u8(0x7f)));
+		uint8x16_t z  = vandq_u8(vceqq_u8(v, vdupq_n_u8(0)), w);
+
+		pr = vandq_u8(vorrq_u8(pr, ws), w);
+		pm |= (uint64_t)(vaddv_u8(vget_low_u8(pr)) |
+				 (vaddv_u8(vget_high_u8(pr)) << 8))
+		      << (16 * i);
+		zm |= (uint64_t)(vaddv_u8(vget_low_u8(z)) |
+				 (vaddv_u8(vget_high_u8(z)) << 8))
+		      << (16 * i);
+	}
+
+	*print = pm;
+	*nul   = zm;
+#else
+	uint64_t pm = 0;
+	uint64_t zm = 0;
+
+	for (int i = 0; i < STRINGS_BLOCK; i++) {
+		if ((p[i] >= 0x20 && p[i] < 0x7f) || p[i] == '\t' ||
+		    p[i] == '\n' || p[i] == '\r')
+			pm |= 1ULL << i;
+		else if (!p[i])
+			zm |= 1ULL << i;
+	}
+
+	*print = pm;
+	*nul   = zm;
+#endif
+}
+
+static bool strings_emit(strings_ctx_t *ctx, int enc, size_t start,
+			 size_t end)
+{
+	strings_t    *st  = ctx->st;
+	size_t	      len = end - start;
+	string_span_t span;
+
+	/* Terminators before 'done' were reported by an earlier window.
+	 */
+	if (len < st->min_len * (enc + 1) || len > UINT32_MAX ||
+	    ctx->addr + end < st->done)
+		return (true);
+
+	span.addr     = ctx->addr + start;
+	span.len      = (uint32_t)len;
+	span.encoding = (enc == STRINGS_ENC_ASCII) ? STRINGS_ASCII :
+						     STRINGS_UTF16LE;
+	span.str      = ctx->transient ? NULL : (const char *)ctx->buf + start;
+
+	if (st->pool) {
+		span.str = strpool_intern(st->pool, ctx->buf + start, len);
+		if (!span.str)
+			return (false);
+	}
+
+	if (!vec_push(st->spans, &span)) {
+		__logger(error, "vec_push: out of memory");
+		return (false);
+	}
+
+	return (true);
+}
+
+/* Reports the runs closed by the terminators in 'ends'.
+ */
+static bool strings_ends(strings_ctx_t *ctx, int enc, size_t off,
+			 uint64_t starts, uint64_t ends)
+{
+	while (ends) {
+		unsigned e     = __builtin_ctzll(ends);
+		uint64_t below = starts & ((1ULL << e) - 1);
+		size_t	 start = below ? off + 63 - __builtin_clzll(below) :
+					 ctx->run[enc];
+
+		if (!strings_emit(ctx, enc, start, off + e))
+			return (false);
+		ends &= ends - 1;
+	}
+
+	return (true);
+}
+
+/* 'units' has a bit on the first byte of every printable character and
+ * 'nuls' on every terminator, characters being 'step' bytes wide. Only runs
+ * that end on a terminator are reported, so a block without one just
+ * carries the open run over.
+ */
+static inline bool strings_block(strings_ctx_t *ctx, int enc, size_t off,
+				 uint64_t units, uint64_t nuls, unsigned step)
+{
+	size_t	*run	= &ctx->run[enc];
+	uint64_t prev	= (units << step) | (*run != STRINGS_NO_RUN);
+	uint64_t starts = units & ~prev;
+	uint64_t ends	= nuls & prev;
+
+	if (ends && !strings_ends(ctx, enc, off, starts, ends))
+		return (false);
+
+	if (!((units >> (STRINGS_BLOCK - step)) & 1))
+		*run = STRINGS_NO_RUN;
+	else if (starts)
+		*run = off + 63 - __builtin_clzll(starts);
+
+	return (true);
+}
+
+/* Scans 'size' bytes mapped at 'addr'. '*resume' receives the offset of the
+ * earliest run still open at the end, or 'size' when there is none.
+ */
+static bool strings_buffer(strings_t *st, const uint8_t *buf, size_t size,
+			   uint64_t addr, bool transient, size_t *resume)
+{
+	strings_ctx_t ctx = {
+		.st	   = st,
+		.buf	   = buf,
+		.addr	   = addr,
+		.transient = transient,
+		.run	   = { STRINGS_NO_RUN, STRINGS_NO_RUN },
+	};
+	bool ascii = st->flags & STRINGS_ASCII;
+	bool utf16 = st->flags & STRINGS_UTF16LE;
+
+	for (size_t off = 0; off < size; off += STRINGS_BLOCK) {
+		uint64_t print;
+		uint64_t nul;
+
+		if (size - off >= STRINGS_BLOCK) {
+			strings_classify(buf + off, &print, &nul);
+		} else {
+			uint8_t tail[STRINGS_BLOCK];
+
+			/* Pads with a byte that neither extends nor ends a run.
+			 */
+			(void)memset(tail, 0x01, sizeof(tail));
+			(void)memcpy(tail, buf + off, size - off);
+			strings_classify(tail, &print, &nul);
+		}
+
+		if (ascii && !strings_block(&ctx, STRINGS_ENC_ASCII, off, print,
+					    nul, 1))
+			return (false);
+
+		/* UTF-16LE characters are an even-aligned printable byte
+		 * followed by NUL, terminated by two even-aligned NULs.
+		 */
+		if (utf16 &&
+		    !strings_block(&ctx, STRINGS_ENC_UTF16LE, off,
+				   print & (nul >> 1) & STRINGS_EVEN,
+				   nul & (nul >> 1) & STRINGS_EVEN, 2))
+			return (false);
+	}
+
+	*resume = MIN(ctx.run[STRINGS_ENC_ASCII], ctx.run[STRINGS_ENC_UTF16LE]);
+	*resume = MIN(*resume & ~(size_t)1, size);
+	return (true);
+}
+
+bool strings_init(strings_t *st, size_t min_len, uint32_t flags,
+		  struct strpool_s *pool)
+{
+	(void)memset(st, 0, sizeof(*st));
+
+	st->spans = vec_create(sizeof(string_span_t), 0, NULL);
+	if (!st->spans) {
+		__logger(error, "vec_create: out of memory");
+		return (false);
+	}
+
+	st->pool    = pool;
+	st->min_len = min_len ? min_len : 1;
+	st->flags   = flags ? flags : STRINGS_ASCII;
+	return (true);
+}
+
+void strings_free(strings_t *st)
+{
+	if (st->spans)
+		vec_kill(st->spans);
+	(void)memset(st, 0, sizeof(*st));
+}
+
+bool strings_scan(strings_t *st, const uint8_t *buf, size_t size,
+		  uint64_t addr)
+{
+	size_t resume;
+
+	return (strings_buffer(st, buf, size, addr, false, &resume));
+}
+
+bool strings_scan_section(strings_t *st, const macho_t *macho,
+			  const struct section_64 *sect)
+{
+	const uint8_t *data;
+	uint8_t	       type = sect->flags & SECTION_TYPE;
+
+	if (type == S_ZEROFILL || type == S_GB_ZEROFILL ||
+	    type == S_THREAD_LOCAL_ZEROFILL)
+		return (true);
+
+	data = macho_at_offset(macho, sect->offset, sect->size);
+	if (!data) {
+		__logger(error, "strings: %.16s,%.16s out of bounds",
+			 sect->segname, sect->sectname);
+		return (false);
+	}
+
+	return (strings_scan(st, data, sect->size, sect->addr));
+}
+
+/* Runs over the readable regions of [address, address + size) a window at a
+ * time. A run still open at the end of a window is read again at the start
+ * of the next one, so the spans can be interned from the window.
+ */
+bool strings_scan_task(strings_t *st, task_t task, mach_vm_address_t address,
+		       mach_vm_size_t size)
+{
+	mach_vm_address_t end = address + size;
+	uint8_t		 *window;
+	bool		  ret = true;
+
+	window = malloc(STRINGS_TASK_WINDOW);
+	if (!window) {
+		__logger(error, "malloc: out of memory");
+		return (false);
+	}
+
+	while (ret && address < end) {
+		mach_vm_address_t region = address;
+		mach_vm_size_t	  region_size;
+		mach_vm_address_t region_end;
+		vm_prot_t	  prot;
+
+		if (!memory_region_next(task, &region, &region_size, &prot) ||
+		    region >= end)
+			break;
+
+		region_end = MIN(region + region_size, end);
+		address	   = MAX(region, address);
+
+		while ((prot & VM_PROT_READ) && address < region_end) {
+			size_t n = region_end - address;
+			size_t resume;
+
+			n = MIN(n, STRINGS_TASK_WINDOW);
+
+			if (!memory_r(task, address, window, n))
+				break;
+
+			if (!strings_buffer(st, window, n, address, true,
+					    &resume)) {
+				ret = false;
+				break;
+			}
+
+			st->done = address + n;
+			if (!resume || st->done == region_end)
+				resume = n;
+			address += resume;
+		}
+
+		address = region_end;
+	}
+
+	st->done = 0;
+	free(window);
+	return (ret);
+}
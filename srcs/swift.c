@@ -0,0 +1,555 @@
+#include "common.h"
+#include "ios-macos-utils.h"
+#include <mach-o/loader.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+/* Layouts of the context and field descriptors, see the Swift ABI's
+ * Metadata.h and Records.h. Every reference is a 32-bit offset from the
+ * field holding it.
+ */
+#define SWIFT_DESC_FLAGS      0
+#define SWIFT_DESC_PARENT     4
+#define SWIFT_DESC_NAME	      8
+#define SWIFT_DESC_FIELDS     16
+#define SWIFT_DESC_SUPERCLASS 20
+#define SWIFT_DESC_SIZE	      24
+
+#define SWIFT_FD_SUPERCLASS  4
+#define SWIFT_FD_RECORD_SIZE 10
+#define SWIFT_FD_NFIELDS     12
+#define SWIFT_FD_SIZE	     16
+#define SWIFT_FIELD_SIZE     12
+
+#define SWIFT_KIND_MODULE    0
+#define SWIFT_KIND_EXTENSION 1
+#define SWIFT_KIND_ANONYMOUS 2
+
+#define SWIFT_MAX_NAME	 1024
+#define SWIFT_MAX_DEPTH	 32
+#define SWIFT_MAX_FIELDS (1 << 16)
+#define SWIFT_PTR_MASK	 0x00007fffffffffffULL /* strips PAC bits */
+#define SWIFT_READ_CHUNK (4 << 20)
+
+/* Shorthands of the standard library the mangled names commonly are.
+ */
+static const struct {
+	const char *mangled;
+	const char *name;
+} swift_std[] = {
+	{ "Sb", "Swift.Bool" },
+	{ "SS", "Swift.String" },
+	{ "Si", "Swift.Int" },
+	{ "Su", "Swift.UInt" },
+	{ "Sd", "Swift.Double" },
+	{ "Sf", "Swift.Float" },
+	{ "s4Int8V", "Swift.Int8" },
+	{ "s5UInt8V", "Swift.UInt8" },
+	{ "s5Int16V", "Swift.Int16" },
+	{ "s6UInt16V", "Swift.UInt16" },
+	{ "s5Int32V", "Swift.Int32" },
+	{ "s6UInt32V", "Swift.UInt32" },
+	{ "s5Int64V", "Swift.Int64" },
+	{ "s6UInt64V", "Swift.UInt64" },
+	{ "yXl", "AnyObject" },
+	{ "yp", "Any" },
+};
+
+/* Bytes at 'vmaddr', from the image of a file or from the copy of __TEXT
+ * read from the task.
+ */
+static const uint8_t *swift_at(const swift_t *sw, uint64_t vmaddr,
+			       uint64_t size)
+{
+	if (sw->task == MACH_PORT_NULL)
+		return (macho_at_vmaddr(sw->macho, vmaddr, size));
+
+	if (vmaddr < sw->text_addr || vmaddr - sw->text_addr > sw->text_size ||
+	    size > sw->text_size - (vmaddr - sw->text_addr))
+		return (NULL);
+	return (sw->text + (vmaddr - sw->text_addr));
+}
+
+static bool swift_u32(const swift_t *sw, uint64_t vmaddr, uint32_t *value)
+{
+	const uint8_t *p = swift_at(sw, vmaddr, sizeof(*value));
+
+	if (!p)
+		return (false);
+
+	(void)memcpy(value, p, sizeof(*value));
+	return (true);
+}
+
+/* Target of the relative pointer at 'vmaddr', 0 for a null one.
+ */
+static bool swift_rel(const swift_t *sw, uint64_t vmaddr, uint64_t *target)
+{
+	uint32_t off;
+
+	if (!swift_u32(sw, vmaddr, &off))
+		return (false);
+
+	*target = off ? vmaddr + (int64_t)(int32_t)off : 0;
+	return (true);
+}
+
+/* Reads the pointer at 'vmaddr', which lives outside of __TEXT (a GOT
+ * entry), unslid.
+ */
+static bool swift_ptr(const swift_t *sw, uint64_t vmaddr, uint64_t *value)
+{
+	const chained_import_t *import;
+	const uint8_t	       *p;
+
+	if (sw->task != MACH_PORT_NULL) {
+		if (!memory_r(sw->task, vmaddr + sw->slide, (uint8_t *)value,
+			      sizeof(*value)))
+			return (false);
+		*value &= SWIFT_PTR_MASK;
+		*value = *value ? *value - sw->slide : 0;
+		return (true);
+	}
+
+	if (sw->fixups.fixups)
+		return (chained_fixups_resolve(&sw->fixups, vmaddr, value,
+					       &import) &&
+			!import);
+
+	p = macho_at_vmaddr(sw->macho, vmaddr, sizeof(*value));
+	if (!p)
+		return (false);
+	(void)memcpy(value, p, sizeof(*value));
+	return (true);
+}
+
+/* Relative pointer whose low bit asks for one more indirection.
+ */
+static bool swift_rel_indirect(const swift_t *sw, uint64_t vmaddr,
+			       uint64_t *target)
+{
+	uint32_t off;
+
+	if (!swift_u32(sw, vmaddr, &off))
+		return (false);
+
+	*target = off ? vmaddr + (int64_t)(int32_t)(off & ~1u) : 0;
+	if (*target && (off & 1))
+		return (swift_ptr(sw, *target, target));
+	return (true);
+}
+
+static const char *swift_cstr(const swift_t *sw, uint64_t vmaddr)
+{
+	const struct segment_command_64 *seg;
+	const char			*s;
+	uint64_t			 avail;
+
+	if (!vmaddr)
+		return (NULL);
+
+	if (sw->task != MACH_PORT_NULL) {
+		if (vmaddr < sw->text_addr ||
+		    vmaddr - sw->text_addr >= sw->text_size)
+			return (NULL);
+		avail = sw->text_size - (vmaddr - sw->text_addr);
+	} else {
+		seg = macho_segment_for_vmaddr(sw->macho, vmaddr);
+		if (!seg || vmaddr - seg->vmaddr >= seg->filesize)
+			return (NULL);
+		avail = seg->filesize - (vmaddr - seg->vmaddr);
+	}
+
+	avail = MIN(avail, SWIFT_MAX_NAME);
+	s     = (const char *)swift_at(sw, vmaddr, avail);
+	return (s && memchr(s, '\0', avail) ? s : NULL);
+}
+
+/* Measures the mangled name at 'vmaddr'. Symbolic references embed a
+ * 4-byte relative offset (0x01-0x17) or a pointer (0x18-0x1f) which may
+ * contain NULs.
+ */
+static bool swift_mangled(const swift_t *sw, uint64_t vmaddr,
+			  swift_span_t *span)
+{
+	const uint8_t *p;
+	uint32_t       len = 0;
+
+	span->addr = vmaddr;
+	span->len  = 0;
+	if (!vmaddr)
+		return (true);
+
+	while ((p = swift_at(sw, vmaddr + len, 1)) && *p) {
+		len += (*p <= 0x17) ? 5 : (*p <= 0x1f) ? 9 : 1;
+		if (len > SWIFT_MAX_NAME)
+			return (false);
+	}
+
+	if (!p)
+		return (false);
+
+	span->len = len;
+	return (swift_at(sw, vmaddr, len) != NULL);
+}
+
+/* Dotted name of the context descriptor at 'desc', from the module down.
+ * Extensions and anonymous contexts do not add a component.
+ */
+static const char *swift_context_name(swift_t *sw, uint64_t desc)
+{
+	const char *parts[SWIFT_MAX_DEPTH];
+	char	    buf[SWIFT_MAX_NAME];
+	size_t	    nparts = 0;
+	size_t	    len	   = 0;
+
+	while (desc && nparts < SWIFT_MAX_DEPTH) {
+		uint32_t    flags;
+		uint64_t    name;
+		uint64_t    parent;
+		const char *part;
+
+		if (!swift_u32(sw, desc + SWIFT_DESC_FLAGS, &flags) ||
+		    !swift_rel_indirect(sw, desc + SWIFT_DESC_PARENT, &parent))
+			return (NULL);
+
+		if ((flags & 0x1f) != SWIFT_KIND_EXTENSION &&
+		    (flags & 0x1f) != SWIFT_KIND_ANONYMOUS) {
+			if (!swift_rel(sw, desc + SWIFT_DESC_NAME, &name))
+				return (NULL);
+			part = swift_cstr(sw, name);
+			if (!part)
+				return (NULL);
+			parts[nparts++] = part;
+		}
+
+		if ((flags & 0x1f) == SWIFT_KIND_MODULE)
+			break;
+		desc = parent;
+	}
+
+	while (nparts--) {
+		int n = snprintf(buf + len, sizeof(buf) - len, "%s%s",
+				 len ? "." : "", parts[nparts]);
+
+		if (n < 0 || (size_t)n >= sizeof(buf) - len)
+			return (NULL);
+		len += n;
+	}
+
+	return (strpool_intern(sw->pool, buf, len));
+}
+
+static bool swift_fields(swift_t *sw, swift_type_t *type)
+{
+	swift_field_t *fields;
+	uint16_t       record_size;
+	uint32_t       count;
+	const uint8_t *fd;
+	uint64_t       super;
+
+	fd = swift_at(sw, type->field_descriptor, SWIFT_FD_SIZE);
+	if (!fd)
+		return (false);
+
+	(void)memcpy(&record_size, fd + SWIFT_FD_RECORD_SIZE,
+		     sizeof(record_size));
+	(void)memcpy(&count, fd + SWIFT_FD_NFIELDS, sizeof(count));
+	if (record_size < SWIFT_FIELD_SIZE || count > SWIFT_MAX_FIELDS)
+		return (false);
+
+	if (!type->superclass.len &&
+	    swift_rel(sw, type->field_descriptor + SWIFT_FD_SUPERCLASS,
+		      &super) &&
+	    !swift_mangled(sw, super, &type->superclass))
+		return (false);
+
+	fields = arena_calloc(sw->arena, count + 1, sizeof(*fields));
+	if (!fields)
+		return (false);
+
+	for (uint32_t i = 0; i < count; i++) {
+		uint64_t rec = type->field_descriptor + SWIFT_FD_SIZE +
+			       (uint64_t)i * record_size;
+		uint64_t mangled;
+		uint64_t name;
+
+		if (!swift_u32(sw, rec, &fields[i].flags) ||
+		    !swift_rel(sw, rec + 4, &mangled) ||
+		    !swift_rel(sw, rec + 8, &name) ||
+		    !swift_mangled(sw, mangled, &fields[i].type))
+			return (false);
+		fields[i].name = swift_cstr(sw, name);
+	}
+
+	type->fields  = fields;
+	type->nfields = count;
+	return (true);
+}
+
+/* Adds the nominal type described at 'desc', ignoring what cannot be read.
+ */
+static bool swift_add_type(swift_t *sw, uint64_t desc)
+{
+	swift_type_t type = { .descriptor = desc };
+	uint32_t     flags;
+	uint64_t     super;
+
+	if (!swift_u32(sw, desc + SWIFT_DESC_FLAGS, &flags))
+		return (true);
+
+	type.kind = flags & 0x1f;
+	type.name = swift_context_name(sw, desc);
+	if (!type.name)
+		return (true);
+
+	if (type.kind == SWIFT_TYPE_CLASS &&
+	    swift_rel(sw, desc + SWIFT_DESC_SUPERCLASS, &super))
+		(void)swift_mangled(sw, super, &type.superclass);
+
+	if (swift_rel(sw, desc + SWIFT_DESC_FIELDS, &type.field_descriptor) &&
+	    type.field_descriptor && !swift_fields(sw, &type)) {
+		type.fields  = NULL;
+		type.nfields = 0;
+	}
+
+	if (!vec_push(sw->types, &type)) {
+		__logger(error, "vec_push: out of memory");
+		return (false);
+	}
+
+	return (true);
+}
+
+static bool swift_index(swift_t *sw)
+{
+	const swift_type_t *types = vec_unsafe_access(sw->types, 0);
+	size_t		    n	  = vec_size(sw->types);
+
+	sw->by_name = strmap_create(n);
+	if (!sw->by_name)
+		return (false);
+
+	for (size_t i = 0; i < n; i++) {
+		if (!strmap_add(sw->by_name, types[i].name, (uint32_t)i))
+			return (false);
+	}
+
+	return (true);
+}
+
+/* Reads the non-code sections of __TEXT from the task in large chunks,
+ * every descriptor, name and field record lives there.
+ */
+static bool swift_read_text(swift_t *sw)
+{
+	const struct segment_command_64 *seg;
+	const struct section_64		*sect;
+	uint64_t			 lo = UINT64_MAX;
+	uint64_t			 hi = 0;
+
+	seg = macho_find_segment(sw->macho, SEG_TEXT);
+	if (!seg)
+		return (false);
+
+	sect = (const struct section_64 *)(seg + 1);
+	for (uint32_t i = 0; i < seg->nsects; i++) {
+		if (sect[i].flags &
+		    (S_ATTR_PURE_INSTRUCTIONS | S_ATTR_SOME_INSTRUCTIONS))
+			continue;
+		lo = MIN(lo, sect[i].addr);
+		hi = MAX(hi, sect[i].addr + sect[i].size);
+	}
+
+	if (lo >= hi)
+		return (true);
+
+	sw->text_addr = lo;
+	sw->text_size = hi - lo;
+	sw->text      = malloc(sw->text_size);
+	if (!sw->text) {
+		__logger(error, "malloc: out of memory");
+		return (false);
+	}
+
+	for (uint64_t off = 0; off < sw->text_size; off += SWIFT_READ_CHUNK) {
+		if (!memory_r(sw->task, lo + sw->slide + off, sw->text + off,
+			      MIN(SWIFT_READ_CHUNK, sw->text_size - off)))
+			return (false);
+	}
+
+	return (true);
+}
+
+static bool swift_scan(swift_t *sw)
+{
+	const struct section_64 *types;
+	uint64_t		 desc;
+
+	sw->arena = arena_create(0);
+	sw->pool  = strpool_create();
+	sw->types = vec_create(sizeof(swift_type_t), 0, NULL);
+	if (!sw->arena || !sw->pool || !sw->types)
+		return (false);
+
+	if (sw->task != MACH_PORT_NULL && !swift_read_text(sw))
+		return (false);
+
+	/* Every entry is a relative pointer whose low two bits tell a direct
+	 * descriptor (0) from an indirect one (1), ObjC classes are skipped.
+	 */
+	types = macho_find_section(sw->macho, SEG_TEXT, "__swift5_types");
+	for (uint64_t i = 0; types && i + 4 <= types->size; i += 4) {
+		uint32_t off;
+
+		if (!swift_u32(sw, types->addr + i, &off) || (off & 3) > 1)
+			continue;
+
+		desc = types->addr + i + (int64_t)(int32_t)(off & ~3u);
+		if ((off & 3) == 1 && !swift_ptr(sw, desc, &desc))
+			continue;
+
+		if (!swift_add_type(sw, desc))
+			return (false);
+	}
+
+	return (swift_index(sw));
+}
+
+bool swift_init(swift_t *sw, const macho_t *macho)
+{
+	(void)memset(sw, 0, sizeof(*sw));
+	sw->macho = macho;
+	sw->task  = MACH_PORT_NULL;
+
+	if (macho_find_command(macho, LC_DYLD_CHAINED_FIXUPS, NULL) &&
+	    !chained_fixups_parse(macho, &sw->fixups))
+		return (false);
+
+	if (!swift_scan(sw)) {
+		swift_free(sw);
+		return (false);
+	}
+
+	return (true);
+}
+
+bool swift_init_task(swift_t *sw, task_t task, vm_address_t address,
+		     const macho_t *macho)
+{
+	(void)memset(sw, 0, sizeof(*sw));
+	sw->macho = macho;
+	sw->task  = task;
+	sw->slide = address - macho->vmbase;
+
+	if (!swift_scan(sw)) {
+		swift_free(sw);
+		return (false);
+	}
+
+	return (true);
+}
+
+void swift_free(swift_t *sw)
+{
+	if (sw->fixups.fixups)
+		chained_fixups_free(&sw->fixups);
+	if (sw->types)
+		vec_kill(sw->types);
+	if (sw->pool)
+		strpool_kill(sw->pool);
+	if (sw->arena)
+		arena_kill(sw->arena);
+	strmap_kill(sw->by_name);
+	free(sw->text);
+	(void)memset(sw, 0, sizeof(*sw));
+}
+
+const swift_type_t *swift_type_find(const swift_t *sw, const char *name)
+{
+	uint32_t type;
+
+	if (strmap_get(sw->by_name, name, &type))
+		return (vec_at(sw->types, type));
+	return (NULL);
+}
+
+static bool swift_append(char *buf, size_t size, size_t *len, const char *s,
+			 size_t n)
+{
+	if (n >= size - *len)
+		return (false);
+
+	(void)memcpy(buf + *len, s, n);
+	*len += n;
+	buf[*len] = '\0';
+	return (true);
+}
+
+/* Renders a mangled name for display: symbolic references to context
+ * descriptors become their dotted name and a few standard library types
+ * are spelled out, '?' standing for a trailing Optional. Anything else is
+ * left mangled, this is not a demangler.
+ */
+bool swift_demangle(swift_t *sw, const swift_span_t *span, char *buf,
+		    size_t size)
+{
+	const uint8_t *p = swift_at(sw, span->addr, span->len);
+	size_t	       len = 0;
+	size_t	       n   = span->len;
+	bool	       optional;
+
+	if (!size)
+		return (false);
+	buf[0] = '\0';
+	if (!p)
+		return (!span->len);
+
+	optional = n > 2 && p[n - 2] == 'S' && p[n - 1] == 'g';
+	if (optional)
+		n -= 2;
+
+	for (size_t i = 0; i < sizeof(swift_std) / sizeof(*swift_std); i++) {
+		if (strlen(swift_std[i].mangled) == n &&
+		    !memcmp(p, swift_std[i].mangled, n))
+			return (swift_append(buf, size, &len, swift_std[i].name,
+					     strlen(swift_std[i].name)) &&
+				(!optional || swift_append(buf, size, &len, "?",
+							   1)));
+	}
+
+	for (size_t i = 0; i < n;) {
+		const char *name = NULL;
+		uint64_t    ref;
+
+		/* 0x01 is a direct reference to a context descriptor, 0x02
+		 * an indirect one.
+		 */
+		ref = span->addr + i + 1;
+		if (p[i] == 0x01 && swift_rel(sw, ref, &ref) && ref)
+			name = swift_context_name(sw, ref);
+		else if (p[i] == 0x02 && swift_rel(sw, ref, &ref) && ref &&
+			 swift_ptr(sw, ref, &ref) && ref)
+			name = swift_context_name(sw, ref);
+
+		if (name) {
+			if (!swift_append(buf, size, &len, name, strlen(name)))
+				return (false);
+			i += 5;
+		} else if (p[i] <= 0x1f) {
+			if (!swift_append(buf, size, &len, "<symbolic>", 10))
+				return (false);
+			i += (p[i] <= 0x17) ? 5 : 9;
+		} else {
+			if (!swift_append(buf, size, &len, (const char *)p + i,
+					  1))
+				return (false);
+			i++;
+		}
+	}
+
+	return (!optional || swift_append(buf, size, &len, "?", 1));
+}
@@ -0,0 +1,386 @@
+#include "common.h"
+#include "ios-macos-utils.h"
+#include <mach-o/loader.h>
+#include <mach-o/nlist.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct symbolicator_syms_s {
+	uint64_t    *addrs; /* unslid, ascending */
+	const char **names; /* in the pool */
+	size_t	     count;
+} symbolicator_syms_t;
+
+typedef struct symbolicator_slot_s {
+	const uint8_t	    *key; /* NULL for an empty slot */
+	size_t		     keylen;
+	symbolicator_syms_t *syms;
+} symbolicator_slot_t;
+
+struct symbolicator_map_s {
+	symbolicator_slot_t *slots;
+	size_t		     nslots; /* power of two */
+	size_t		     count;
+};
+
+typedef struct symbolicate_addr_s {
+	uint64_t addr;
+	size_t	 index; /* in the caller's array */
+} symbolicate_addr_t;
+
+typedef struct symbolicate_range_s {
+	uint64_t		   start;
+	uint64_t		   end;
+	const symbolicate_image_t *image;
+} symbolicate_range_t;
+
+typedef struct symbolicate_sym_s {
+	uint64_t    addr;
+	const char *name;
+	uint32_t    len;
+	bool	    ext;
+} symbolicate_sym_t;
+
+bool symbolicator_init(symbolicator_t *sym)
+{
+	(void)memset(sym, 0, sizeof(*sym));
+
+	sym->arena  = arena_create(0);
+	sym->names  = strpool_create();
+	sym->by_key = calloc(1, sizeof(*sym->by_key));
+	if (!sym->arena || !sym->names || !sym->by_key) {
+		__logger(error, "symbolicator: out of memory");
+		symbolicator_free(sym);
+		return (false);
+	}
+
+	sym->by_key->nslots = 64;
+	sym->by_key->slots  = calloc(sym->by_key->nslots,
+				     sizeof(*sym->by_key->slots));
+	if (!sym->by_key->slots) {
+		__logger(error, "calloc: out of memory");
+		symbolicator_free(sym);
+		return (false);
+	}
+
+	return (true);
+}
+
+void symbolicator_free(symbolicator_t *sym)
+{
+	if (sym->arena)
+		arena_kill(sym->arena);
+	if (sym->names)
+		strpool_kill(sym->names);
+	if (sym->by_key)
+		free(sym->by_key->slots);
+	free(sym->by_key);
+	(void)memset(sym, 0, sizeof(*sym));
+}
+
+static bool symbolicator_grow(struct symbolicator_map_s *map)
+{
+	size_t		     nslots = map->nslots * 2;
+	symbolicator_slot_t *slots;
+
+	slots = calloc(nslots, sizeof(*slots));
+	if (!slots) {
+		__logger(error, "calloc: out of memory");
+		return (false);
+	}
+
+	for (size_t i = 0; i < map->nslots; i++) {
+		size_t j;
+
+		if (!map->slots[i].key)
+			continue;
+
+		j = fnv1a(map->slots[i].key, map->slots[i].keylen) &
+		    (nslots - 1);
+		while (slots[j].key)
+			j = (j + 1) & (nslots - 1);
+		slots[j] = map->slots[i];
+	}
+
+	free(map->slots);
+	map->slots  = slots;
+	map->nslots = nslots;
+	return (true);
+}
+
+static int symbolicate_sym_cmp(const void *a, const void *b)
+{
+	const symbolicate_sym_t *x = a;
+	const symbolicate_sym_t *y = b;
+
+	if (x->addr != y->addr)
+		return ((x->addr > y->addr) - (x->addr < y->addr));
+	/* Of the names sharing an address, external ones are kept */
+	return ((int)y->ext - (int)x->ext);
+}
+
+/* Sorted copy of the defined symbols of an image, one per address. */
+static symbolicator_syms_t *symbolicator_parse(symbolicator_t *sym,
+					       const macho_t  *macho)
+{
+	const struct symtab_command *symtab;
+	const struct nlist_64	    *nl;
+	const char		    *strtab;
+	symbolicate_sym_t	    *tmp;
+	symbolicator_syms_t	    *syms;
+	size_t			     n = 0;
+
+	syms = arena_calloc(sym->arena, 1, sizeof(*syms));
+	if (!syms) {
+		__logger(error, "arena_calloc: out of memory");
+		return (NULL);
+	}
+
+	symtab = macho_find_command(macho, LC_SYMTAB, NULL);
+	if (!symtab)
+		return (syms);
+
+	nl     = (const struct nlist_64 *)macho_at_offset(
+		  macho, symtab->symoff, (uint64_t)symtab->nsyms * sizeof(*nl));
+	strtab = (const char *)macho_at_offset(macho, symtab->stroff,
+					       symtab->strsize);
+	if (!nl || !strtab) {
+		__logger(error, "symbolicate: symbol table out of bounds");
+		return (NULL);
+	}
+
+	tmp = malloc((symtab->nsyms + 1) * sizeof(*tmp));
+	if (!tmp) {
+		__logger(error, "malloc: out of memory");
+		return (NULL);
+	}
+
+	for (uint32_t i = 0; i < symtab->nsyms; i++) {
+		uint32_t    strx = nl[i].n_un.n_strx;
+		const char *end;
+
+		if ((nl[i].n_type & N_STAB) ||
+		    (nl[i].n_type & N_TYPE) != N_SECT || !strx ||
+		    strx >= symtab->strsize)
+			continue;
+
+		end = memchr(strtab + strx, '\0', symtab->strsize - strx);
+		if (!end)
+			continue;
+
+		tmp[n].addr  = nl[i].n_value;
+		tmp[n].name  = strtab + strx;
+		tmp[n].len   = (uint32_t)(end - (strtab + strx));
+		tmp[n++].ext = (nl[i].n_type & N_EXT) != 0;
+	}
+
+	qsort(tmp, n, sizeof(*tmp), symbolicate_sym_cmp);
+
+	syms->addrs = arena_alloc(sym->arena, (n + 1) * sizeof(*syms->addrs));
+	syms->names = arena_alloc(sym->arena, (n + 1) * sizeof(*syms->names));
+	if (!syms->addrs || !syms->names) {
+		__logger(error, "arena_alloc: out of memory");
+		free(tmp);
+		return (NULL);
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		const char *name;
+
+		if (i && tmp[i].addr == tmp[i - 1].addr)
+			continue;
+
+		name = strpool_intern(sym->names, tmp[i].name, tmp[i].len);
+		if (!name) {
+			free(tmp);
+			return (NULL);
+		}
+		syms->addrs[syms->count]   = tmp[i].addr;
+		syms->names[syms->count++] = name;
+	}
+
+	free(tmp);
+	return (syms);
+}
+
+/* Symbols of an image, parsed the first time it is seen. */
+static symbolicator_syms_t *symbolicator_get(symbolicator_t	       *sym,
+					     const symbolicate_image_t *image)
+{
+	struct symbolicator_map_s *map = sym->by_key;
+	const struct uuid_command *uc;
+	symbolicator_syms_t	  *syms;
+	const uint8_t		  *key;
+	size_t			   keylen;
+	size_t			   i;
+	uint8_t			  *copy;
+
+	uc = macho_find_command(image->macho, LC_UUID, NULL);
+	if (uc && uc->cmdsize >= sizeof(*uc)) {
+		key    = uc->uuid;
+		keylen = sizeof(uc->uuid);
+	} else {
+		key    = (const uint8_t *)(image->name ? image->name : "");
+		keylen = strlen((const char *)key);
+	}
+
+	i = fnv1a(key, keylen) & (map->nslots - 1);
+	while (map->slots[i].key) {
+		if (map->slots[i].keylen == keylen &&
+		    !memcmp(map->slots[i].key, key, keylen))
+			return (map->slots[i].syms);
+		i = (i + 1) & (map->nslots - 1);
+	}
+
+	copy = arena_alloc(sym->arena, keylen + 1);
+	if (!copy) {
+		__logger(error, "arena_alloc: out of memory");
+		return (NULL);
+	}
+	(void)memcpy(copy, key, keylen);
+
+	syms = symbolicator_parse(sym, image->macho);
+	if (!syms)
+		return (NULL);
+	map->slots[i].key    = copy;
+	map->slots[i].keylen = keylen;
+	map->slots[i].syms   = syms;
+
+	if (++map->count * 2 > map->nslots && !symbolicator_grow(map))
+		return (NULL);
+	return (syms);
+}
+
+static int symbolicate_addr_cmp(const void *a, const void *b)
+{
+	const symbolicate_addr_t *x = a;
+	const symbolicate_addr_t *y = b;
+
+	return ((x->addr > y->addr) - (x->addr < y->addr));
+}
+
+static int symbolicate_range_cmp(const void *a, const void *b)
+{
+	const symbolicate_range_t *x = a;
+	const symbolicate_range_t *y = b;
+
+	return ((x->start > y->start) - (x->start < y->start));
+}
+
+static const symbolicate_range_t *
+symbolicate_range_for(const symbolicate_range_t *ranges, size_t n,
+		      uint64_t addr)
+{
+	size_t lo = 0;
+	size_t hi = n;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (ranges[mid].start <= addr)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (!lo || addr >= ranges[lo - 1].end)
+		return (NULL);
+	return (&ranges[lo - 1]);
+}
+
+/* The addresses of a group and the symbols of its image are both sorted, so
+ * a single pass over each resolves the whole group.
+ */
+static void symbolicate_group(const symbolicate_range_t	*range,
+			      const symbolicator_syms_t	*syms,
+			      const symbolicate_addr_t	*addrs, size_t n,
+			      symbolication_t		*out)
+{
+	uint64_t slide = range->image->address - range->image->macho->vmbase;
+	size_t	 s     = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		symbolication_t *o	= &out[addrs[i].index];
+		uint64_t	 unslid = addrs[i].addr - slide;
+
+		while (s < syms->count && syms->addrs[s] <= unslid)
+			s++;
+
+		o->image = range->image;
+		if (s) {
+			o->symbol = syms->names[s - 1];
+			o->offset = unslid - syms->addrs[s - 1];
+		} else {
+			o->symbol = NULL;
+			o->offset = addrs[i].addr - range->image->address;
+		}
+	}
+}
+
+bool symbolicate(symbolicator_t *sym, const symbolicate_image_t *images,
+		 size_t nimages, const uint64_t *addrs, size_t count,
+		 symbolication_t *out)
+{
+	symbolicate_range_t *ranges;
+	symbolicate_addr_t  *sorted;
+	size_t		     nranges = 0;
+	bool		     ok	     = true;
+
+	ranges = malloc((nimages + 1) * sizeof(*ranges));
+	sorted = malloc((count + 1) * sizeof(*sorted));
+	if (!ranges || !sorted) {
+		__logger(error, "malloc: out of memory");
+		free(ranges);
+		free(sorted);
+		return (false);
+	}
+
+	for (size_t i = 0; i < nimages; i++) {
+		const struct segment_command_64 *text;
+
+		text = macho_find_segment(images[i].macho, SEG_TEXT);
+		if (!text)
+			continue;
+
+		ranges[nranges].start	= images[i].address + text->vmaddr -
+					  images[i].macho->vmbase;
+		ranges[nranges].end	= ranges[nranges].start + text->vmsize;
+		ranges[nranges++].image = &images[i];
+	}
+	qsort(ranges, nranges, sizeof(*ranges), symbolicate_range_cmp);
+
+	for (size_t i = 0; i < count; i++) {
+		sorted[i].addr	= addrs[i];
+		sorted[i].index = i;
+		(void)memset(&out[i], 0, sizeof(out[i]));
+	}
+	qsort(sorted, count, sizeof(*sorted), symbolicate_addr_cmp);
+
+	for (size_t i = 0; ok && i < count;) {
+		const symbolicate_range_t *range;
+		const symbolicator_syms_t *syms;
+		size_t			   j = i + 1;
+
+		range = symbolicate_range_for(ranges, nranges, sorted[i].addr);
+		if (!range) {
+			out[sorted[i].index].offset = sorted[i].addr;
+			i++;
+			continue;
+		}
+
+		while (j < count && sorted[j].addr < range->end)
+			j++;
+
+		syms = symbolicator_get(sym, range->image);
+		if (syms)
+			symbolicate_group(range, syms, sorted + i, j - i, out);
+		else
+			ok = false;
+		i = j;
+	}
+
+	free(ranges);
+	free(sorted);
+	return (ok);
+}
@@ -1,36 +1,40 @@
 #include "common.h"
 #include <mach/mach_error.h>
-#include "common.h"
+#include "ios-macos-utils.h"
 #include <libproc.h>
+#include <limits.h>
+#include <mach-o/dyld_images.h>
 #include <stdio.h>
 #include <string.h>
 #include <mach/mach.h>
 #include <mach/task.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <sys/types.h>
 
 bool process_find_by_name(const char *name, pid_t *pid)
 {
-	pid_t pids[2048];
-	int   bytes = proc_listpids(PROC_ALL_PIDS, 0, pids, sizeof(pids));
-
-	int n_proc = bytes / sizeof(pids[0]);
+	process_table_t	       pt;
+	const process_entry_t *e;
+	bool		       found = false;
 
-	for (int i = 0; i < n_proc; i++) {
-		struct proc_bsdinfo proc;
-		int st = proc_pidinfo(pids[i], PROC_PIDTBSDINFO, 0, &proc,
-				      PROC_PIDTBSDINFO_SIZE);
+	if (!process_table_init(&pt) || !process_table_refresh(&pt)) {
+		process_table_free(&pt);
+		return (false);
+	}
 
-		if (st == PROC_PIDTBSDINFO_SIZE) {
-			if (strcmp(name, proc.pbi_name) == 0) {
-				*pid = pids[i];
-				return (true);
-			}
+	e = vec_unsafe_access(pt.entries, 0);
+	for (size_t i = 0; i < vec_size(pt.entries) && !found; i++) {
+		if (strcmp(name, e[i].name) == 0) {
+			*pid  = e[i].pid;
+			found = true;
 		}
 	}
 
-	__logger(error, "Could not find the process '%s'", name);
-	return (false);
+	process_table_free(&pt);
+	if (!found)
+		__logger(error, "Could not find the process '%s'", name);
+	return (found);
 }
 
 bool process_get_task(pid_t pid, task_t *task)
@@ -70,3 +74,132 @@ bool process_resume(task_t task)
 	}
 	return (true);
 }
+
+/* The thread ports and the array are released by process_threads_free(). */
+bool process_threads(task_t task, thread_act_array_t *threads,
+		     mach_msg_type_number_t *count)
+{
+	kern_return_t kr;
+
+	kr = task_threads(task, threads, count);
+	if (kr != KERN_SUCCESS) {
+		__logger(error, "task_threads: %s", mach_error_string(kr));
+		return (false);
+	}
+	return (true);
+}
+
+void process_threads_free(thread_act_array_t threads,
+			  mach_msg_type_number_t count)
+{
+	for (mach_msg_type_number_t i = 0; i < count; i++)
+		(void)mach_port_deallocate(mach_task_self(), threads[i]);
+	(void)vm_deallocate(mach_task_self(), (vm_address_t)threads,
+			    count * sizeof(*threads));
+}
+
+bool thread_regs_get(thread_act_t thread, unwind_regs_t *regs, bool quiet)
+{
+#if defined(__arm64__)
+	arm_thread_state64_t   state;
+	mach_msg_type_number_t count = ARM_THREAD_STATE64_COUNT;
+	kern_return_t	       kr;
+
+	kr = thread_get_state(thread, ARM_THREAD_STATE64,
+			      (thread_state_t)&state, &count);
+	if (kr != KERN_SUCCESS) {
+		if (!quiet ||
+		    (kr != MACH_SEND_INVALID_DEST && kr != KERN_TERMINATED))
+			__logger(error, "thread_get_state: %s",
+				 mach_error_string(kr));
+		return (false);
+	}
+
+	regs->pc = (uint64_t)arm_thread_state64_get_pc(state);
+	regs->lr = (uint64_t)arm_thread_state64_get_lr(state);
+	regs->sp = (uint64_t)arm_thread_state64_get_sp(state);
+	regs->fp = (uint64_t)arm_thread_state64_get_fp(state);
+	return (true);
+#else
+	(void)thread;
+	(void)regs;
+	(void)quiet;
+	__logger(error, "thread_regs_get: only arm64 threads are supported");
+	return (false);
+#endif
+}
+
+bool process_images(task_t task, struct strpool_s *paths, vec_t **images)
+{
+	struct task_dyld_info	    dyld_info;
+	struct dyld_all_image_infos infos;
+	struct dyld_image_info	   *array;
+	mach_msg_type_number_t	    count = TASK_DYLD_INFO_COUNT;
+	kern_return_t		    kr;
+	char			    path[PATH_MAX];
+
+	kr = task_info(task, TASK_DYLD_INFO, (task_info_t)&dyld_info, &count);
+	if (kr != KERN_SUCCESS) {
+		__logger(error, "task_info: %s", mach_error_string(kr));
+		return (false);
+	}
+
+	(void)memset(&infos, 0, sizeof(infos));
+	if (!memory_r(task, (vm_address_t)dyld_info.all_image_info_addr,
+		      (const uint8_t *)&infos,
+		      dyld_info.all_image_info_size < sizeof(infos) ?
+			      (vm_size_t)dyld_info.all_image_info_size :
+			      sizeof(infos)))
+		return (false);
+
+	/* dyld clears the array while it updates it */
+	if (!infos.infoArray) {
+		__logger(error, "process_images: dyld is updating the list");
+		return (false);
+	}
+
+	if (!*images) {
+		*images = vec_create(sizeof(process_image_t),
+				     infos.infoArrayCount + 1, NULL);
+		if (!*images) {
+			__logger(error, "vec_create: out of memory");
+			return (false);
+		}
+	}
+
+	array = malloc((infos.infoArrayCount + 1) * sizeof(*array));
+	if (!array) {
+		__logger(error, "malloc: out of memory");
+		return (false);
+	}
+
+	if (!memory_r(task, (vm_address_t)infos.infoArray,
+		      (const uint8_t *)array,
+		      infos.infoArrayCount * sizeof(*array))) {
+		free(array);
+		return (false);
+	}
+
+	for (uint32_t i = 0; i < infos.infoArrayCount; i++) {
+		process_image_t image;
+		vm_size_t	nread = 0;
+
+		image.address = (uint64_t)array[i].imageLoadAddress;
+		image.path    = NULL;
+		if (array[i].imageFilePath &&
+		    memory_rpartial(task, (vm_address_t)array[i].imageFilePath,
+				    (const uint8_t *)path, sizeof(path),
+				    &nread))
+			image.path = strpool_intern(paths, path,
+						    strnlen(path, nread));
+
+		if (!vec_push(*images, &image)) {
+			__logger(error, "vec_push: out of memory");
+			free(array);
+			return (false);
+		}
+	}
+
+	free(array);
+	return (true);
+}
@@ -0,0 +1,174 @@
+#include "common.h"
+#include "ios-macos-utils.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A cache of three one-page mappings, each slid with a different slide
+ * info version, checked against the pointers dyld would have unslid.
+ */
+
+#define SLIDE_BASE	0x180000000ULL
+#define SLIDE_PAGE	0x1000
+#define SLIDE_NMAPPINGS 3
+#define SLIDE_V2_INFO	0x10
+#define SLIDE_V3_INFO	0x100
+#define SLIDE_V5_INFO	0x200
+#define SLIDE_INFO_SIZE 0x300
+
+typedef struct slide_expect_s {
+	uint64_t vmaddr;
+	uint64_t value;
+} slide_expect_t;
+
+static uint8_t slide_data[SLIDE_NMAPPINGS * SLIDE_PAGE];
+static uint8_t slide_info[SLIDE_INFO_SIZE];
+
+static const slide_expect_t slide_expect[] = {
+	/* v2, a chain of three through a NULL pointer */
+	{ SLIDE_BASE + 0x10, SLIDE_BASE + 0x100 },
+	{ SLIDE_BASE + 0x18, 0 },
+	{ SLIDE_BASE + 0x40, SLIDE_BASE + 0x200 },
+	{ SLIDE_BASE + 0x20, 0x1122334455667788ULL }, /* not in the chain */
+	/* v3, a plain pointer with a high byte then an authenticated one */
+	{ SLIDE_BASE + SLIDE_PAGE + 0x08, 0x1200000180001234ULL },
+	{ SLIDE_BASE + SLIDE_PAGE + 0x18, SLIDE_BASE + 0x500 },
+	/* v5, the same with offsets from the cache base */
+	{ SLIDE_BASE + 2 * SLIDE_PAGE + 0x00, 0x3400000180000600ULL },
+	{ SLIDE_BASE + 2 * SLIDE_PAGE + 0x08, SLIDE_BASE + 0x700 },
+};
+
+static void slide_put32(uint8_t *p, uint32_t value)
+{
+	(void)memcpy(p, &value, sizeof(value));
+}
+
+static void slide_put64(uint8_t *p, uint64_t value)
+{
+	(void)memcpy(p, &value, sizeof(value));
+}
+
+/* dyld_cache_slide_info2 with one page start and no extras */
+static void slide_build_v2(uint8_t *info, uint8_t *page)
+{
+	const uint64_t delta_mask = 0x00ffff0000000000ULL;
+	const unsigned shift	  = 38; /* ctz(delta_mask) - 2 */
+
+	slide_put32(info + 0, 2);
+	slide_put32(info + 4, SLIDE_PAGE);
+	slide_put32(info + 8, 40); /* page_starts_offset */
+	slide_put32(info + 12, 1);
+	slide_put32(info + 16, 42); /* page_extras_offset */
+	slide_put32(info + 20, 0);
+	slide_put64(info + 24, delta_mask);
+	slide_put64(info + 32, 0);
+	info[40] = 0x10 / 4;
+
+	slide_put64(page + 0x10, (SLIDE_BASE + 0x100) | (8ULL << shift));
+	slide_put64(page + 0x18, 0x28ULL << shift);
+	slide_put64(page + 0x40, SLIDE_BASE + 0x200);
+	slide_put64(page + 0x20, 0x1122334455667788ULL);
+}
+
+/* dyld_cache_slide_info3: 11 bits of delta in 8 byte steps at bit 51 */
+static void slide_build_v3(uint8_t *info, uint8_t *page)
+{
+	slide_put32(info + 0, 3);
+	slide_put32(info + 4, SLIDE_PAGE);
+	slide_put32(info + 8, 1);
+	slide_put64(info + 16, SLIDE_BASE);
+	info[24] = 0x08;
+
+	slide_put64(page + 0x08,
+		    (2ULL << 51) | (0x12ULL << 43) | 0x180001234ULL);
+	slide_put64(page + 0x18, (1ULL << 63) | (0xbeefULL << 32) | 0x500);
+}
+
+/* dyld_cache_slide_info5: 34 bits of offset, delta at bit 52 */
+static void slide_build_v5(uint8_t *info, uint8_t *page)
+{
+	slide_put32(info + 0, 5);
+	slide_put32(info + 4, SLIDE_PAGE);
+	slide_put32(info + 8, 1);
+	slide_put64(info + 16, SLIDE_BASE);
+	info[24] = 0x00;
+
+	slide_put64(page + 0x00, (1ULL << 52) | (0x34ULL << 34) | 0x600);
+	slide_put64(page + 0x08, (1ULL << 63) | (0x1234ULL << 34) | 0x700);
+}
+
+static void slide_build(dyld_cache_t *cache, dyld_cache_mapping_t *mappings)
+{
+	static const uint64_t infos[SLIDE_NMAPPINGS] = {
+		SLIDE_V2_INFO,
+		SLIDE_V3_INFO,
+		SLIDE_V5_INFO,
+	};
+
+	slide_build_v2(slide_info + SLIDE_V2_INFO, slide_data);
+	slide_build_v3(slide_info + SLIDE_V3_INFO, slide_data + SLIDE_PAGE);
+	slide_build_v5(slide_info + SLIDE_V5_INFO,
+		       slide_data + 2 * SLIDE_PAGE);
+
+	(void)memset(cache, 0, sizeof(*cache));
+	cache->base	     = slide_data;
+	cache->size	     = sizeof(slide_data);
+	cache->vmbase	     = SLIDE_BASE;
+	cache->files[0].map  = slide_info;
+	cache->files[0].size = sizeof(slide_info);
+	cache->nfiles	     = 1;
+	cache->mappings	     = mappings;
+	cache->nmappings     = SLIDE_NMAPPINGS;
+
+	for (size_t i = 0; i < SLIDE_NMAPPINGS; i++) {
+		(void)memset(&mappings[i], 0, sizeof(mappings[i]));
+		mappings[i].address	      = SLIDE_BASE + i * SLIDE_PAGE;
+		mappings[i].size	      = SLIDE_PAGE;
+		mappings[i].file_offset	      = i * SLIDE_PAGE;
+		mappings[i].slide_info_offset = infos[i];
+		mappings[i].slide_info_size   = 0x100 - (infos[i] & 0xff);
+	}
+}
+
+int main(void)
+{
+	dyld_cache_mapping_t mappings[SLIDE_NMAPPINGS];
+	dyld_cache_t	     cache;
+	uint8_t		    *buf;
+	size_t		     failed = 0;
+
+	slide_build(&cache, mappings);
+
+	buf = malloc(sizeof(slide_data));
+	if (!buf) {
+		__logger(error, "malloc: out of memory");
+		return (EXIT_FAILURE);
+	}
+	(void)memcpy(buf, slide_data, sizeof(slide_data));
+
+	if (!dyld_cache_unslide(&cache, SLIDE_BASE, buf, sizeof(slide_data))) {
+		free(buf);
+		return (EXIT_FAILURE);
+	}
+
+	for (size_t i = 0; i < sizeof(slide_expect) / sizeof(*slide_expect);
+	     i++) {
+		const slide_expect_t *e = &slide_expect[i];
+		uint64_t	      value;
+
+		(void)memcpy(&value, buf + (e->vmaddr - SLIDE_BASE),
+			     sizeof(value));
+		if (value != e->value) {
+			(void)fprintf(stderr, "%#llx: %#llx, expected %#llx\n",
+				      (unsigned long long)e->vmaddr,
+				      (unsigned long long)value,
+				      (unsigned long long)e->value);
+			failed++;
+		}
+	}
+
+	free(buf);
+	(void)printf("dyld-cache-slide: %s\n", failed ? "FAIL" : "ok");
+	return (failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
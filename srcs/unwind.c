@@ -0,0 +1,421 @@
+#include "common.h"
+#include "ios-macos-utils.h"
+#include <mach-o/compact_unwind_encoding.h>
+#include <mach-o/loader.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Return addresses may carry a pointer authentication code above the
+ * user address bits.
+ */
+#define UNWIND_PTR_MASK 0x00007fffffffffffULL
+
+typedef struct unwind_page_s {
+	uint32_t  count;
+	uint32_t *funcs; /* offsets from the image base, ascending */
+	uint32_t *encodings;
+} unwind_page_t;
+
+typedef struct unwind_stack_s {
+	task_t	 task;
+	uint64_t start; /* of the words in 'buf' */
+	size_t	 size;
+	uint8_t	 buf[UNWIND_STACK_WINDOW];
+} unwind_stack_t;
+
+bool unwind_info_init(unwind_info_t *ui, const macho_t *macho)
+{
+	const struct unwind_info_section_header *hdr;
+	const struct section_64			*sect;
+	uint64_t				 end;
+
+	(void)memset(ui, 0, sizeof(*ui));
+	ui->base = macho->vmbase;
+
+	sect = macho_find_section(macho, SEG_TEXT, "__unwind_info");
+	if (!sect)
+		return (true);
+
+	ui->section = macho_at_vmaddr(macho, sect->addr, sect->size);
+	ui->size    = sect->size;
+	if (!ui->section || ui->size < sizeof(*hdr)) {
+		__logger(error, "unwind: __unwind_info out of bounds");
+		return (false);
+	}
+
+	hdr = (const struct unwind_info_section_header *)ui->section;
+	if (hdr->version != UNWIND_SECTION_VERSION) {
+		__logger(error, "unwind: unsupported version %u", hdr->version);
+		return (false);
+	}
+
+	end = (uint64_t)hdr->commonEncodingsArraySectionOffset +
+	      (uint64_t)hdr->commonEncodingsArrayCount * sizeof(uint32_t);
+	if (end > ui->size || (hdr->commonEncodingsArraySectionOffset & 3)) {
+		__logger(error, "unwind: common encodings out of bounds");
+		return (false);
+	}
+
+	end = (uint64_t)hdr->indexSectionOffset +
+	      (uint64_t)hdr->indexCount *
+		      sizeof(struct unwind_info_section_header_index_entry);
+	if (end > ui->size || (hdr->indexSectionOffset & 3)) {
+		__logger(error, "unwind: first level index out of bounds");
+		return (false);
+	}
+
+	/* The last entry only marks where the last page ends */
+	if (hdr->indexCount < 2)
+		return (true);
+
+	ui->pages = calloc(hdr->indexCount, sizeof(*ui->pages));
+	if (!ui->pages) {
+		__logger(error, "calloc: out of memory");
+		return (false);
+	}
+
+	ui->common  = (const void *)(ui->section +
+				     hdr->commonEncodingsArraySectionOffset);
+	ui->ncommon = hdr->commonEncodingsArrayCount;
+	ui->index   = ui->section + hdr->indexSectionOffset;
+	ui->nindex  = hdr->indexCount;
+	return (true);
+}
+
+void unwind_info_free(unwind_info_t *ui)
+{
+	for (uint32_t i = 0; ui->pages && i < ui->nindex; i++)
+		free(ui->pages[i]);
+	free(ui->pages);
+	(void)memset(ui, 0, sizeof(*ui));
+}
+
+static unwind_page_t *unwind_page_alloc(uint32_t count)
+{
+	unwind_page_t *page;
+
+	page = malloc(sizeof(*page) + (size_t)count * 2 * sizeof(uint32_t));
+	if (!page) {
+		__logger(error, "malloc: out of memory");
+		return (NULL);
+	}
+
+	page->count	= count;
+	page->funcs	= (uint32_t *)(page + 1);
+	page->encodings = page->funcs + count;
+	return (page);
+}
+
+static unwind_page_t *unwind_page_regular(const unwind_info_t *ui,
+					  uint32_t	       off)
+{
+	const struct unwind_info_regular_second_level_page_header *hdr;
+	const struct unwind_info_regular_second_level_entry	     *ent;
+	unwind_page_t						     *page;
+
+	hdr = (const void *)(ui->section + off);
+	if (off + sizeof(*hdr) > ui->size ||
+	    off + hdr->entryPageOffset + (uint64_t)hdr->entryCount *
+						     sizeof(*ent) > ui->size ||
+	    (hdr->entryPageOffset & 3)) {
+		__logger(error, "unwind: regular page out of bounds");
+		return (NULL);
+	}
+
+	page = unwind_page_alloc(hdr->entryCount);
+	if (!page)
+		return (NULL);
+
+	ent = (const void *)(ui->section + off + hdr->entryPageOffset);
+	for (uint32_t i = 0; i < hdr->entryCount; i++) {
+		page->funcs[i]	   = ent[i].functionOffset;
+		page->encodings[i] = ent[i].encoding;
+	}
+
+	return (page);
+}
+
+static unwind_page_t *unwind_page_compressed(const unwind_info_t *ui,
+					     uint32_t off, uint32_t base)
+{
+	const struct unwind_info_compressed_second_level_page_header *hdr;
+	const uint32_t						     *ent;
+	const uint32_t						     *local;
+	unwind_page_t						     *page;
+
+	hdr = (const void *)(ui->section + off);
+	if (off + sizeof(*hdr) > ui->size ||
+	    off + hdr->entryPageOffset + (uint64_t)hdr->entryCount *
+						     sizeof(*ent) > ui->size ||
+	    off + hdr->encodingsPageOffset +
+			    (uint64_t)hdr->encodingsCount * sizeof(*local) >
+		    ui->size ||
+	    ((hdr->entryPageOffset | hdr->encodingsPageOffset) & 3)) {
+		__logger(error, "unwind: compressed page out of bounds");
+		return (NULL);
+	}
+
+	page = unwind_page_alloc(hdr->entryCount);
+	if (!page)
+		return (NULL);
+
+	ent   = (const void *)(ui->section + off + hdr->entryPageOffset);
+	local = (const void *)(ui->section + off + hdr->encodingsPageOffset);
+
+	/* Entries are 24 bits of offset from the first function of the page
+	 * and 8 bits of index, into the common encodings and then the ones
+	 * of the page.
+	 */
+	for (uint32_t i = 0; i < hdr->entryCount; i++) {
+		uint32_t e   = ent[i];
+		uint32_t idx = UNWIND_INFO_COMPRESSED_ENTRY_ENCODING_INDEX(e);
+
+		page->funcs[i] =
+			base + UNWIND_INFO_COMPRESSED_ENTRY_FUNC_OFFSET(e);
+		if (idx < ui->ncommon)
+			page->encodings[i] = ui->common[idx];
+		else if (idx - ui->ncommon < hdr->encodingsCount)
+			page->encodings[i] = local[idx - ui->ncommon];
+		else
+			page->encodings[i] = 0;
+	}
+
+	return (page);
+}
+
+static const unwind_page_t *unwind_page(unwind_info_t *ui, uint32_t i)
+{
+	const struct unwind_info_section_header_index_entry *ix	 = ui->index;
+	uint32_t					     off = 0;
+
+	if (ui->pages[i])
+		return (ui->pages[i]);
+
+	off = ix[i].secondLevelPagesSectionOffset;
+	if (!off || (off & 3) || (uint64_t)off + sizeof(uint32_t) > ui->size) {
+		__logger(error, "unwind: page %u out of bounds", i);
+		return (NULL);
+	}
+
+	switch (*(const uint32_t *)(ui->section + off)) {
+	case UNWIND_SECOND_LEVEL_REGULAR:
+		ui->pages[i] = unwind_page_regular(ui, off);
+		break;
+	case UNWIND_SECOND_LEVEL_COMPRESSED:
+		ui->pages[i] =
+			unwind_page_compressed(ui, off, ix[i].functionOffset);
+		break;
+	default:
+		__logger(error, "unwind: page %u of unknown kind", i);
+		break;
+	}
+
+	return (ui->pages[i]);
+}
+
+bool unwind_info_lookup(unwind_info_t *ui, uint64_t vmaddr,
+			uint32_t *encoding, uint64_t *start)
+{
+	const struct unwind_info_section_header_index_entry *ix = ui->index;
+	const unwind_page_t				    *page;
+	uint64_t					     off;
+	size_t						     lo = 0;
+	size_t						     hi;
+
+	if (!ui->nindex || vmaddr < ui->base)
+		return (false);
+
+	off = vmaddr - ui->base;
+	if (off < ix[0].functionOffset ||
+	    off >= ix[ui->nindex - 1].functionOffset)
+		return (false);
+
+	hi = ui->nindex - 1;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (ix[mid].functionOffset <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	page = unwind_page(ui, (uint32_t)(lo - 1));
+	if (!page)
+		return (false);
+
+	lo = 0;
+	hi = page->count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (page->funcs[mid] <= off)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (!lo || !page->encodings[lo - 1])
+		return (false);
+
+	*encoding = page->encodings[lo - 1];
+	*start	  = ui->base + page->funcs[lo - 1];
+	return (true);
+}
+
+bool unwind_image_init(unwind_image_t *image, const macho_t *macho,
+		       uint64_t address)
+{
+	const struct segment_command_64 *text;
+
+	(void)memset(image, 0, sizeof(*image));
+
+	text = macho_find_segment(macho, SEG_TEXT);
+	if (!text) {
+		__logger(error, "unwind: image without %s", SEG_TEXT);
+		return (false);
+	}
+
+	image->slide   = address - macho->vmbase;
+	image->start   = text->vmaddr + image->slide;
+	image->end     = image->start + text->vmsize;
+	image->cputype = macho->header->cputype;
+	return (unwind_info_init(&image->info, macho));
+}
+
+void unwind_image_free(unwind_image_t *image)
+{
+	unwind_info_free(&image->info);
+}
+
+static unwind_image_t *unwind_image_for(unwind_image_t *images, size_t n,
+					uint64_t pc)
+{
+	size_t lo = 0;
+	size_t hi = n;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (images[mid].start <= pc)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (!lo || pc >= images[lo - 1].end)
+		return (NULL);
+	return (&images[lo - 1]);
+}
+
+/* Frameless functions only move the stack pointer, by a multiple of 16. */
+static uint64_t unwind_frameless_size(uint32_t enc)
+{
+	if ((enc & UNWIND_ARM64_MODE_MASK) != UNWIND_ARM64_MODE_FRAMELESS)
+		return (0);
+	return (16 * ((enc & UNWIND_ARM64_FRAMELESS_STACK_SIZE_MASK) >> 12));
+}
+
+/* Stack words are served from a window read forward from the first word
+ * missing, as callers' frames sit above their callees'.
+ */
+static bool unwind_read(unwind_stack_t *st, uint64_t addr, uint64_t *word)
+{
+	vm_size_t n;
+
+	if (addr & 7)
+		return (false);
+
+	if (addr < st->start || addr - st->start + 8 > st->size) {
+		if (!memory_rpartial(st->task, addr, st->buf, sizeof(st->buf),
+				     &n) ||
+		    n < 8)
+			return (false);
+		st->start = addr;
+		st->size  = n & ~(vm_size_t)7;
+	}
+
+	(void)memcpy(word, st->buf + (addr - st->start), sizeof(*word));
+	return (true);
+}
+
+/* Steps out of the frame of 'regs->pc'. Only a leaf can be frameless or
+ * interrupted before its prologue, any other frame has stored the link
+ * register on the stack, and that is found through the frame pointer.
+ */
+static bool unwind_step(unwind_stack_t *st, unwind_image_t *images,
+			size_t nimages, unwind_regs_t *regs, bool leaf)
+{
+	unwind_image_t *image;
+	uint64_t	lookup = leaf ? regs->pc : regs->pc - 1;
+	uint64_t	next_fp;
+	uint64_t	next_pc;
+	uint32_t	enc;
+	uint64_t	start;
+
+	/* Encodings are read with the arm64 rules, the modes of other
+	 * architectures reuse the same values.
+	 */
+	image = unwind_image_for(images, nimages, lookup);
+	if (leaf && image && image->cputype == CPU_TYPE_ARM64 &&
+	    unwind_info_lookup(&image->info, lookup - image->slide, &enc,
+			       &start)) {
+		bool entry = lookup - image->slide == start;
+
+		if ((enc & UNWIND_ARM64_MODE_MASK) ==
+			    UNWIND_ARM64_MODE_FRAMELESS ||
+		    entry) {
+			if (!entry)
+				regs->sp += unwind_frameless_size(enc);
+			regs->pc = regs->lr & UNWIND_PTR_MASK;
+			regs->lr = 0;
+			return (regs->pc != 0);
+		}
+	}
+
+	/* Frame based and DWARF described functions alike keep the frame
+	 * record of their caller at the frame pointer.
+	 */
+	if (!regs->fp || regs->fp < regs->sp ||
+	    !unwind_read(st, regs->fp, &next_fp) ||
+	    !unwind_read(st, regs->fp + 8, &next_pc))
+		return (false);
+
+	if (next_fp && next_fp <= regs->fp)
+		return (false);
+
+	regs->sp = regs->fp + 16;
+	regs->fp = next_fp;
+	regs->pc = next_pc & UNWIND_PTR_MASK;
+	regs->lr = 0;
+	return (regs->pc != 0);
+}
+
+size_t unwind_stack(task_t task, const unwind_regs_t *regs,
+		    unwind_image_t *images, size_t nimages, uint64_t *pcs,
+		    size_t max)
+{
+	unwind_stack_t *st;
+	unwind_regs_t	cur = *regs;
+	size_t		n   = 0;
+
+	st = malloc(sizeof(*st));
+	if (!st) {
+		__logger(error, "malloc: out of memory");
+		return (0);
+	}
+	st->task  = task;
+	st->start = 0;
+	st->size  = 0;
+
+	cur.pc &= UNWIND_PTR_MASK;
+	while (n < max && cur.pc) {
+		pcs[n++] = cur.pc;
+		if (!unwind_step(st, images, nimages, &cur, n == 1))
+			break;
+	}
+
+	free(st);
+	return (n);
+}
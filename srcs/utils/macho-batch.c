@@ -0,0 +1,557 @@
+#include "common.h"
+#include "ios-macos-utils.h"
+#include <mach-o/loader.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BATCH_OUTBUF_SIZE (1024 * 1024)
+#define BATCH_FLUSH_AT	  (768 * 1024)
+#define BATCH_MAX_JOBS	  1024
+
+typedef enum e_batch_format {
+	format_ndjson,
+	format_csv
+} t_batch_format;
+
+typedef struct batch_segment_s {
+	const char *name;
+	uint64_t    vmaddr;
+	uint64_t    vmsize;
+	uint64_t    fileoff;
+	uint64_t    filesize;
+} batch_segment_t;
+
+typedef struct batch_record_s {
+	const char	*path;
+	uint64_t	 offset;
+	uint32_t	 magic;
+	int32_t		 cputype;
+	int32_t		 cpusubtype;
+	uint32_t	 filetype;
+	uint32_t	 ncmds;
+	const char     **commands;
+	batch_segment_t *segments;
+	uint32_t	 nsegments;
+	const char     **dylibs;
+	uint32_t	 ndylibs;
+	const uint8_t	*uuid;
+} batch_record_t;
+
+typedef struct batch_worker_s {
+	arena_t	   *arena;
+	bufwriter_t out;
+	size_t	    nfiles;
+	size_t	    nslices;
+	size_t	    nskipped;
+} batch_worker_t;
+
+typedef struct batch_s {
+	vec_t	       *paths;
+	batch_worker_t *workers;
+	t_batch_format	format;
+} batch_t;
+
+static void emit_json_str(bufwriter_t *w, const char *s)
+{
+	const char *run = s;
+
+	bufwriter_write(w, "\"", 1);
+	for (; *s; s++) {
+		unsigned char c = *s;
+
+		if (c >= 0x20 && c != '"' && c != '\\')
+			continue;
+
+		bufwriter_write(w, run, s - run);
+		if (c == '"' || c == '\\')
+			bufwriter_printf(w, "\\%c", c);
+		else
+			bufwriter_printf(w, "\\u%04x", c);
+		run = s + 1;
+	}
+	bufwriter_write(w, run, s - run);
+	bufwriter_write(w, "\"", 1);
+}
+
+static void emit_csv_str(bufwriter_t *w, const char *s)
+{
+	if (!strpbrk(s, ",\"\n\r")) {
+		bufwriter_puts(w, s);
+		return;
+	}
+
+	bufwriter_write(w, "\"", 1);
+	for (; *s; s++) {
+		if (*s == '"')
+			bufwriter_write(w, "\"", 1);
+		bufwriter_write(w, s, 1);
+	}
+	bufwriter_write(w, "\"", 1);
+}
+
+static void emit_uuid(bufwriter_t *w, const uint8_t *u)
+{
+	bufwriter_printf(w,
+			 "%02X%02X%02X%02X-%02X%02X-%02X%02X-%02X%02X-"
+			 "%02X%02X%02X%02X%02X%02X",
+			 u[0], u[1], u[2], u[3], u[4], u[5], u[6], u[7], u[8],
+			 u[9], u[10], u[11], u[12], u[13], u[14], u[15]);
+}
+
+static void emit_ndjson(bufwriter_t *w, const batch_record_t *r)
+{
+	bufwriter_puts(w, "{\"path\":");
+	emit_json_str(w, r->path);
+	bufwriter_printf(w, ",\"offset\":%llu,\"magic\":",
+			 (unsigned long long)r->offset);
+	emit_json_str(w, magic_to_cstr(r->magic));
+	bufwriter_puts(w, ",\"cputype\":");
+	emit_json_str(w, cputype_to_cstr(r->cputype));
+	bufwriter_puts(w, ",\"cpusubtype\":");
+	emit_json_str(w, cpusubtype_to_cstr(r->cputype, r->cpusubtype));
+	bufwriter_puts(w, ",\"filetype\":");
+	emit_json_str(w, filetype_to_cstr(r->filetype));
+
+	bufwriter_puts(w, ",\"load_commands\":[");
+	for (uint32_t i = 0; i < r->ncmds; i++) {
+		if (i)
+			bufwriter_write(w, ",", 1);
+		emit_json_str(w, r->commands[i]);
+	}
+
+	bufwriter_puts(w, "],\"segments\":[");
+	for (uint32_t i = 0; i < r->nsegments; i++) {
+		const batch_segment_t *s = &r->segments[i];
+
+		bufwriter_puts(w, i ? ",{\"name\":" : "{\"name\":");
+		emit_json_str(w, s->name);
+		bufwriter_printf(w,
+				 ",\"vmaddr\":%llu,\"vmsize\":%llu"
+				 ",\"fileoff\":%llu,\"filesize\":%llu}",
+				 (unsigned long long)s->vmaddr,
+				 (unsigned long long)s->vmsize,
+				 (unsigned long long)s->fileoff,
+				 (unsigned long long)s->filesize);
+	}
+
+	bufwriter_puts(w, "],\"uuid\":");
+	if (r->uuid) {
+		bufwriter_write(w, "\"", 1);
+		emit_uuid(w, r->uuid);
+		bufwriter_write(w, "\"", 1);
+	} else {
+		bufwriter_puts(w, "null");
+	}
+
+	bufwriter_puts(w, ",\"dylibs\":[");
+	for (uint32_t i = 0; i < r->ndylibs; i++) {
+		if (i)
+			bufwriter_write(w, ",", 1);
+		emit_json_str(w, r->dylibs[i]);
+	}
+	bufwriter_puts(w, "]}\n");
+}
+
+/* Lists are joined with ';' inside a single field so that every slice
+ * stays one row.
+ */
+static void emit_csv(bufwriter_t *w, arena_t *arena, const batch_record_t *r)
+{
+	char   *field;
+	size_t	len = 0;
+
+	emit_csv_str(w, r->path);
+	bufwriter_printf(w, ",%llu,", (unsigned long long)r->offset);
+	emit_csv_str(w, magic_to_cstr(r->magic));
+	bufwriter_write(w, ",", 1);
+	emit_csv_str(w, cputype_to_cstr(r->cputype));
+	bufwriter_write(w, ",", 1);
+	emit_csv_str(w, cpusubtype_to_cstr(r->cputype, r->cpusubtype));
+	bufwriter_write(w, ",", 1);
+	emit_csv_str(w, filetype_to_cstr(r->filetype));
+	bufwriter_printf(w, ",%u,", r->ncmds);
+
+	for (uint32_t i = 0; i < r->nsegments; i++) {
+		if (i)
+			bufwriter_write(w, ";", 1);
+		emit_csv_str(w, r->segments[i].name);
+		bufwriter_printf(w, "@%#llx+%#llx",
+				 (unsigned long long)r->segments[i].vmaddr,
+				 (unsigned long long)r->segments[i].vmsize);
+	}
+	bufwriter_write(w, ",", 1);
+
+	if (r->uuid)
+		emit_uuid(w, r->uuid);
+	bufwriter_write(w, ",", 1);
+
+	for (uint32_t i = 0; i < r->ndylibs; i++)
+		len += strlen(r->dylibs[i]) + 1;
+
+	field = arena_alloc(arena, len + 1);
+	if (field) {
+		char *p = field;
+
+		for (uint32_t i = 0; i < r->ndylibs; i++) {
+			size_t n = strlen(r->dylibs[i]);
+
+			if (i)
+				*p++ = ';';
+			(void)memcpy(p, r->dylibs[i], n);
+			p += n;
+		}
+		*p = '\0';
+		emit_csv_str(w, field);
+	}
+	bufwriter_write(w, "\n", 1);
+}
+
+static bool batch_collect(arena_t *arena, const macho_t *macho,
+			  batch_record_t *r)
+{
+	const struct mach_header_64 *mh	 = macho->header;
+	const uint8_t		    *cmd = (const uint8_t *)(mh + 1);
+
+	r->magic      = mh->magic;
+	r->cputype    = mh->cputype;
+	r->cpusubtype = mh->cpusubtype;
+	r->filetype   = mh->filetype;
+	r->ncmds      = mh->ncmds;
+	r->nsegments  = 0;
+	r->ndylibs    = 0;
+	r->uuid	      = NULL;
+
+	r->commands = arena_calloc(arena, mh->ncmds, sizeof(*r->commands));
+	r->dylibs   = arena_calloc(arena, mh->ncmds, sizeof(*r->dylibs));
+	r->segments = arena_calloc(arena, macho->nsegments, sizeof(*r->segments));
+	if ((mh->ncmds && (!r->commands || !r->dylibs)) ||
+	    (macho->nsegments && !r->segments))
+		return (false);
+
+	/* macho_init() already validated the command sizes.
+	 */
+	for (uint32_t i = 0; i < mh->ncmds; i++) {
+		const struct load_command *lc = (const void *)cmd;
+
+		r->commands[i] = load_command_to_cstr(lc->cmd);
+
+		switch (lc->cmd) {
+		case LC_SEGMENT_64: {
+			const struct segment_command_64 *seg = (const void *)lc;
+			batch_segment_t *s = &r->segments[r->nsegments++];
+
+			s->name	    = arena_strndup(arena, seg->segname, 16);
+			s->vmaddr   = seg->vmaddr;
+			s->vmsize   = seg->vmsize;
+			s->fileoff  = seg->fileoff;
+			s->filesize = seg->filesize;
+			if (!s->name)
+				return (false);
+			break;
+		}
+		case LC_UUID:
+			if (lc->cmdsize >= sizeof(struct uuid_command))
+				r->uuid = ((const struct uuid_command *)lc)->uuid;
+			break;
+		case LC_LOAD_DYLIB:
+		case LC_LOAD_WEAK_DYLIB:
+		case LC_REEXPORT_DYLIB:
+		case LC_LAZY_LOAD_DYLIB:
+		case LC_LOAD_UPWARD_DYLIB: {
+			const struct dylib_command *dc = (const void *)lc;
+			uint32_t		    off = dc->dylib.name.offset;
+
+			if (lc->cmdsize < sizeof(*dc) || off >= lc->cmdsize)
+				break;
+
+			r->dylibs[r->ndylibs] = arena_strndup(
+				arena, (const char *)lc + off, lc->cmdsize - off);
+			if (!r->dylibs[r->ndylibs++])
+				return (false);
+			break;
+		}
+		default:
+			break;
+		}
+
+		cmd += lc->cmdsize;
+	}
+
+	return (true);
+}
+
+static void batch_file(void *ctx, size_t worker, size_t job)
+{
+	batch_t	       *batch = ctx;
+	batch_worker_t *w     = &batch->workers[worker];
+	const char     *path  = *(char **)vec_at(batch->paths, job);
+	macho_slice_t	slices[MACHO_MAX_SLICES];
+	batch_record_t	record;
+	struct stat	sb;
+	uint8_t	       *map;
+	size_t		n;
+	int		fd;
+
+	w->nfiles++;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1 || fstat(fd, &sb) == -1 || sb.st_size == 0) {
+		if (fd != -1)
+			(void)close(fd);
+		w->nskipped++;
+		return;
+	}
+
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	(void)close(fd);
+	if (map == MAP_FAILED) {
+		__logger(warning, "mmap: %s: %s", path, strerror(errno));
+		w->nskipped++;
+		return;
+	}
+
+	n = macho_slices(map, sb.st_size, slices, MACHO_MAX_SLICES);
+	if (!n)
+		w->nskipped++;
+
+	for (size_t i = 0; i < n; i++) {
+		macho_t macho;
+
+		if (!macho_init(&macho, map + slices[i].offset, slices[i].size,
+				0))
+			continue;
+
+		record.path   = path;
+		record.offset = slices[i].offset;
+		if (batch_collect(w->arena, &macho, &record)) {
+			if (batch->format == format_ndjson)
+				emit_ndjson(&w->out, &record);
+			else
+				emit_csv(&w->out, w->arena, &record);
+			w->nslices++;
+		}
+
+		macho_close(&macho);
+		arena_reset(w->arena);
+	}
+
+	(void)munmap(map, sb.st_size);
+	(void)bufwriter_commit(&w->out, BATCH_FLUSH_AT);
+}
+
+static void path_free(void *p)
+{
+	free(*(char **)p);
+}
+
+static bool batch_walk(vec_t *paths, const char *path)
+{
+	struct dirent *ent;
+	DIR	      *dir;
+	char	      *dup;
+
+	if (!is_file_directory(path)) {
+		dup = strdup(path);
+		if (!dup || !vec_push(paths, &dup)) {
+			free(dup);
+			__logger(error, "batch_walk: out of memory");
+			return (false);
+		}
+		return (true);
+	}
+
+	dir = opendir(path);
+	if (!dir) {
+		__logger(warning, "opendir: %s: %s", path, strerror(errno));
+		return (true);
+	}
+
+	while ((ent = readdir(dir))) {
+		bool descend;
+
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+
+		dup = path_attach(path, ent->d_name);
+		if (!dup) {
+			(void)closedir(dir);
+			__logger(error, "batch_walk: out of memory");
+			return (false);
+		}
+
+		/* Symbolic links to directories are not followed, so cycles
+		 * cannot make the walk loop forever.
+		 */
+		if (ent->d_type == DT_UNKNOWN) {
+			struct stat sb;
+
+			if (lstat(dup, &sb) == -1 ||
+			    !(S_ISDIR(sb.st_mode) || S_ISREG(sb.st_mode))) {
+				free(dup);
+				continue;
+			}
+			descend = S_ISDIR(sb.st_mode);
+		} else if (ent->d_type == DT_DIR || ent->d_type == DT_REG) {
+			descend = ent->d_type == DT_DIR;
+		} else {
+			free(dup);
+			continue;
+		}
+
+		if (descend) {
+			bool ok = batch_walk(paths, dup);
+
+			free(dup);
+			if (!ok) {
+				(void)closedir(dir);
+				return (false);
+			}
+		} else if (!vec_push(paths, &dup)) {
+			free(dup);
+			(void)closedir(dir);
+			__logger(error, "batch_walk: out of memory");
+			return (false);
+		}
+	}
+
+	(void)closedir(dir);
+	return (true);
+}
+
+static void usage(const char *name)
+{
+	(void)fprintf(stderr,
+		      "usage: %s [-f ndjson|csv] [-j jobs] [-o output] [-v] "
+		      "path...\n",
+		      name);
+}
+
+int main(int ac, char **av)
+{
+	pthread_mutex_t lock   = PTHREAD_MUTEX_INITIALIZER;
+	batch_t		batch  = { 0 };
+	size_t		njobs  = 0;
+	size_t		nfiles = 0, nslices = 0, nskipped = 0;
+	struct timespec t0, t1;
+	bool		ok = true;
+	int		out    = STDOUT_FILENO;
+	char	       *end;
+	int		opt;
+
+	log_set_level(fatal);
+	batch.format = format_ndjson;
+
+	while ((opt = getopt(ac, av, "f:j:o:v")) != -1) {
+		switch (opt) {
+		case 'f':
+			if (!strcmp(optarg, "csv")) {
+				batch.format = format_csv;
+			} else if (strcmp(optarg, "ndjson")) {
+				usage(av[0]);
+				return (EXIT_FAILURE);
+			}
+			break;
+		case 'j':
+			errno = 0;
+			njobs = strtoul(optarg, &end, 10);
+			if (errno || end == optarg || *end ||
+			    njobs > BATCH_MAX_JOBS) {
+				usage(av[0]);
+				return (EXIT_FAILURE);
+			}
+			break;
+		case 'o':
+			if (!file_open_write(optarg, &out))
+				return (EXIT_FAILURE);
+			break;
+		case 'v':
+			log_set_level(info);
+			break;
+		default:
+			usage(av[0]);
+			return (EXIT_FAILURE);
+		}
+	}
+
+	if (optind == ac) {
+		usage(av[0]);
+		return (EXIT_FAILURE);
+	}
+
+	if (!njobs)
+		njobs = parallel_ncpus();
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &t0);
+
+	batch.paths = vec_create(sizeof(char *), 0, path_free);
+	if (!batch.paths)
+		return (EXIT_FAILURE);
+
+	for (int i = optind; ok && i < ac; i++)
+		ok = batch_walk(batch.paths, av[i]);
+
+	batch.workers = calloc(njobs, sizeof(*batch.workers));
+	if (!batch.workers) {
+		__logger(error, "calloc: out of memory");
+		ok = false;
+	}
+	for (size_t i = 0; ok && batch.workers && i < njobs; i++) {
+		batch.workers[i].arena = arena_create(0);
+		ok = batch.workers[i].arena &&
+		     bufwriter_init(&batch.workers[i].out, out,
+				    BATCH_OUTBUF_SIZE, &lock);
+	}
+
+	if (ok && batch.workers) {
+		/* Out before any worker can flush a row */
+		if (batch.format == format_csv) {
+			bufwriter_puts(&batch.workers[0].out,
+				       "path,offset,magic,cputype,cpusubtype,"
+				       "filetype,ncmds,segments,uuid,dylibs\n");
+			ok = bufwriter_flush(&batch.workers[0].out);
+		}
+		ok = ok && parallel_for(vec_size(batch.paths), njobs,
+					batch_file, &batch);
+	}
+
+	for (size_t i = 0; batch.workers && i < njobs; i++) {
+		batch_worker_t *w = &batch.workers[i];
+
+		if (w->out.buf)
+			bufwriter_destroy(&w->out);
+		if (w->arena)
+			arena_kill(w->arena);
+		nfiles += w->nfiles;
+		nslices += w->nslices;
+		nskipped += w->nskipped;
+	}
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &t1);
+
+	double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+	log_set_level(info);
+	if (!ok)
+		__logger(error, "batch: failed, -v for details");
+	__logger(info,
+		 "%zu files (%zu skipped), %zu slices in %.3fs (%.0f files/s)",
+		 nfiles, nskipped, nslices, secs,
+		 secs > 0 ? nfiles / secs : 0.0);
+
+	free(batch.workers);
+	vec_kill(batch.paths);
+	if (out != STDOUT_FILENO)
+		(void)close(out);
+
+	return (ok ? EXIT_SUCCESS : EXIT_FAILURE);
+}
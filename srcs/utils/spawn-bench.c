@@ -0,0 +1,173 @@
+#include "common.h"
+#include "ios-macos-utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_DEFAULT_COUNT 1000
+#define BENCH_DEFAULT_BATCH 32
+
+typedef struct bench_s {
+	spawn_server_t *srv; /* NULL to call spawn() directly */
+	const char     *path;
+	spawn_opts_t	opts;
+	size_t		count;
+	size_t		batch; /* launches in flight before they are reaped */
+} bench_t;
+
+/* The helper is polled back to back rather than through the backoff of
+ * spawn_server_wait(), which would add its sleeps to the launch times.
+ * 'polls' counts the round-trips so their overhead is reported apart.
+ */
+static bool bench_wait(const bench_t *b, pid_t pid, size_t *polls)
+{
+	bool exited = false;
+
+	if (b->srv) {
+		while (!exited) {
+			if (!spawn_server_poll(b->srv, pid, NULL, &exited))
+				return (false);
+			(*polls)++;
+			if (!exited)
+				(void)sched_yield();
+		}
+		return (true);
+	}
+
+	while (waitpid(pid, NULL, 0) < 0) {
+		if (errno != EINTR) {
+			__logger(error, "waitpid: %s", strerror(errno));
+			return (false);
+		}
+	}
+	return (true);
+}
+
+/* Returns the launch rate, or a negative value when a launch failed. */
+static double bench_run(const bench_t *b, size_t *polls)
+{
+	struct timespec t0, t1;
+	pid_t	       *pids;
+	double		secs;
+	size_t		done = 0;
+	bool		ok   = true;
+
+	pids = malloc(b->batch * sizeof(*pids));
+	if (!pids) {
+		__logger(error, "malloc: out of memory");
+		return (-1);
+	}
+
+	*polls = 0;
+	(void)clock_gettime(CLOCK_MONOTONIC, &t0);
+	while (ok && done < b->count) {
+		size_t n = 0;
+
+		while (ok && n < b->batch && done + n < b->count) {
+			ok = b->srv ? spawn_server_launch(b->srv, &pids[n],
+							  b->path, &b->opts) :
+				      spawn(&pids[n], b->path, &b->opts);
+			n += ok;
+		}
+
+		for (size_t i = 0; i < n; i++)
+			ok &= bench_wait(b, pids[i], polls);
+		done += n;
+	}
+	(void)clock_gettime(CLOCK_MONOTONIC, &t1);
+	free(pids);
+
+	secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+	if (!ok)
+		return (-1);
+	return (secs > 0 ? done / secs : 0.0);
+}
+
+static void usage(const char *name)
+{
+	(void)fprintf(stderr,
+		      "usage: %s [-n count] [-b batch] [-v] path [arg...]\n",
+		      name);
+}
+
+int main(int ac, char **av)
+{
+	spawn_server_t srv;
+	bench_t	       b;
+	double	       direct, served;
+	int	       devnull;
+	int	       opt;
+	size_t	       polls;
+
+	log_set_level(fatal);
+	(void)memset(&b, 0, sizeof(b));
+	b.count = BENCH_DEFAULT_COUNT;
+	b.batch = BENCH_DEFAULT_BATCH;
+
+	while ((opt = getopt(ac, av, "n:b:v")) != -1) {
+		switch (opt) {
+		case 'n':
+			b.count = strtoul(optarg, NULL, 10);
+			break;
+		case 'b':
+			b.batch = strtoul(optarg, NULL, 10);
+			break;
+		case 'v':
+			log_set_level(info);
+			break;
+		default:
+			usage(av[0]);
+			return (EXIT_FAILURE);
+		}
+	}
+
+	if (optind == ac || !b.batch) {
+		usage(av[0]);
+		return (EXIT_FAILURE);
+	}
+
+	/* The helper is forked first, while this process is single-threaded */
+	if (!spawn_server_start(&srv))
+		return (EXIT_FAILURE);
+
+	devnull = open("/dev/null", O_RDWR | O_CLOEXEC);
+	if (devnull < 0) {
+		__logger(error, "/dev/null: %s", strerror(errno));
+		spawn_server_stop(&srv);
+		return (EXIT_FAILURE);
+	}
+
+	spawn_opts_init(&b.opts);
+	b.path		 = av[optind];
+	b.opts.argv	 = av + optind;
+	b.opts.stdin_fd	 = devnull;
+	b.opts.stdout_fd = devnull;
+	b.opts.stderr_fd = devnull;
+
+	direct = bench_run(&b, &polls);
+	b.srv  = &srv;
+	served = direct < 0 ? -1 : bench_run(&b, &polls);
+
+	spawn_server_stop(&srv);
+	(void)close(devnull);
+
+	log_set_level(info);
+	if (direct < 0 || served < 0) {
+		__logger(error, "%s: a launch failed", b.path);
+		return (EXIT_FAILURE);
+	}
+
+	__logger(info, "%zu launches of %s, %zu in flight", b.count, b.path,
+		 b.batch);
+	__logger(info, "spawn:        %.0f launches/s", direct);
+	__logger(info, "spawn server: %.0f launches/s, %.1f polls/launch",
+		 served, (double)polls / b.count);
+	return (EXIT_SUCCESS);
+}
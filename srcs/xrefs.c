@@ -0,0 +1,476 @@
+#include "arm64.h"
+#include "common.h"
+#include "ios-macos-utils.h"
+#include <mach-o/loader.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+
+#define XREFS_CHUNK	 (64 * 1024)
+#define XREFS_RADIX_BITS 11
+#define XREFS_EMPTY	 UINT32_MAX
+
+typedef struct xref_pair_s {
+	uint64_t target;
+	uint64_t pc;
+} xref_pair_t;
+
+typedef struct xrefs_job_s {
+	uint64_t start;
+	uint64_t end;
+	size_t	 iter; /* function_starts_next cursor, or SIZE_MAX */
+	vec_t	*pairs;
+} xrefs_job_t;
+
+typedef struct xrefs_ctx_s {
+	const function_starts_t *fs;
+	const uint8_t		*text; /* bytes of __TEXT,__text */
+	uint64_t		 text_addr;
+	xrefs_job_t		*jobs;
+	atomic_bool		 failed;
+} xrefs_ctx_t;
+
+typedef struct xrefs_regs_s {
+	uint32_t known; /* registers holding an ADRP page */
+	uint64_t page[32];
+} xrefs_regs_t;
+
+static inline bool xrefs_add(vec_t *pairs, uint64_t target, uint64_t pc)
+{
+	xref_pair_t pair = { target, pc };
+
+	return (vec_push(pairs, &pair));
+}
+
+/* Forgets the registers an instruction that is not otherwise decoded may
+ * write, so that a stale ADRP page is never paired.
+ */
+static inline void xrefs_clobber(xrefs_regs_t *regs, uint32_t insn)
+{
+	if (arm64_is_bl(insn) || arm64_is_blr(insn)) {
+		regs->known &= ~0x7ffffu; /* x0-x18 are caller-saved */
+		return;
+	}
+
+	if (arm64_is_b(insn) || arm64_is_bcond(insn) || arm64_is_cbz(insn) ||
+	    arm64_is_tbz(insn) || arm64_is_branch_reg(insn))
+		return;
+
+	if (arm64_is_ldst_excl(insn)) {
+		bool	 load = insn & (1u << 22);
+		bool	 o1   = insn & (1u << 21);
+		bool	 o2   = insn & (1u << 23);
+		uint32_t rs   = arm64_rs(insn);
+		uint32_t rt2  = (insn >> 10) & 0x1f;
+
+		/* CAS writes the old value to Rs, CASP to Rs and Rs+1. A
+		 * store-exclusive writes its status to Ws, loads write Rt and
+		 * the pairs Rt2.
+		 */
+		if (o1 && (o2 || !(insn & (1u << 31)))) {
+			regs->known &= ~(1u << rs);
+			if (!o2)
+				regs->known &= ~(1u << ((rs + 1) & 0x1f));
+		} else if (load) {
+			regs->known &= ~(1u << arm64_rd(insn));
+			if (o1)
+				regs->known &= ~(1u << rt2);
+		} else if (!o2) {
+			regs->known &= ~(1u << rs);
+		}
+		return;
+	}
+
+	/* LDADD and co and SWP return the old value in Rt */
+	if (arm64_is_atomic(insn)) {
+		regs->known &= ~(1u << arm64_rd(insn));
+		return;
+	}
+
+	if (arm64_is_ldst(insn)) {
+		bool pair = (insn & 0x3a000000) == 0x28000000;
+		bool simd = insn & (1u << 26);
+
+		/* Pre and post-indexed forms write the base back.
+		 */
+		if ((pair && (insn & (1u << 23))) ||
+		    (!pair && (insn & 0x3b200400) == 0x38000400))
+			regs->known &= ~(1u << arm64_rn(insn));
+
+		if (simd)
+			return;
+		if (pair && (insn & (1u << 22)))
+			regs->known &= ~((1u << arm64_rd(insn)) |
+					 (1u << ((insn >> 10) & 0x1f)));
+		else if (!pair && (insn & (3u << 22)))
+			regs->known &= ~(1u << arm64_rd(insn));
+		return;
+	}
+
+	regs->known &= ~(1u << arm64_rd(insn));
+}
+
+/* Decodes [start, end) with no register known on entry.
+ */
+static bool xrefs_scan(const xrefs_ctx_t *ctx, vec_t *pairs, uint64_t start,
+		       uint64_t end)
+{
+	const uint8_t *code = ctx->text + (start - ctx->text_addr);
+	xrefs_regs_t   regs = { 0 };
+
+	for (uint64_t pc = start; pc + 4 <= end; pc += 4, code += 4) {
+		uint64_t target;
+		uint32_t insn;
+		uint32_t rn;
+
+		(void)memcpy(&insn, code, sizeof(insn));
+
+		if (arm64_is_adrp(insn)) {
+			if (arm64_rd(insn) == 31)
+				continue;
+			regs.page[arm64_rd(insn)] = arm64_adr_target(insn, pc);
+			regs.known |= 1u << arm64_rd(insn);
+			continue;
+		}
+
+		if (arm64_is_adr(insn)) {
+			if (!xrefs_add(pairs, arm64_adr_target(insn, pc), pc))
+				return (false);
+			regs.known &= ~(1u << arm64_rd(insn));
+			continue;
+		}
+
+		if (arm64_is_ldr_literal(insn)) {
+			target = arm64_ldr_literal_target(insn, pc);
+			if (!xrefs_add(pairs, target, pc))
+				return (false);
+			if (!(insn & (1u << 26)))
+				regs.known &= ~(1u << arm64_rd(insn));
+			continue;
+		}
+
+		rn = arm64_rn(insn);
+		if (regs.known & (1u << rn)) {
+			if (arm64_is_add_imm64(insn))
+				target = regs.page[rn] + arm64_add_imm(insn);
+			else if (arm64_is_ldst_uimm(insn))
+				target = regs.page[rn] +
+					 arm64_ldst_uimm_offset(insn);
+			else
+				target = 0;
+
+			if (target && !xrefs_add(pairs, target, pc))
+				return (false);
+		}
+
+		xrefs_clobber(&regs, insn);
+	}
+
+	return (true);
+}
+
+static void xrefs_job(void *arg, size_t worker, size_t index)
+{
+	xrefs_ctx_t	*ctx = arg;
+	xrefs_job_t	*job = &ctx->jobs[index];
+	function_range_t range;
+	size_t		 iter = job->iter;
+
+	(void)worker;
+
+	job->pairs = vec_create(sizeof(xref_pair_t), 0, NULL);
+	if (!job->pairs) {
+		atomic_store(&ctx->failed, true);
+		return;
+	}
+
+	/* Register state does not flow across function boundaries.
+	 */
+	if (iter == SIZE_MAX) {
+		if (!xrefs_scan(ctx, job->pairs, job->start, job->end))
+			atomic_store(&ctx->failed, true);
+		return;
+	}
+
+	while (function_starts_next(ctx->fs, &iter, &range) &&
+	       range.start < job->end) {
+		if (!xrefs_scan(ctx, job->pairs, range.start, range.end)) {
+			atomic_store(&ctx->failed, true);
+			return;
+		}
+	}
+}
+
+/* Cuts __TEXT,__text into jobs of about XREFS_CHUNK bytes, on function
+ * boundaries when they are known.
+ */
+static bool xrefs_split(const function_starts_t *fs, uint64_t start,
+			uint64_t end, vec_t *jobs)
+{
+	xrefs_job_t	 job  = { 0 };
+	function_range_t range;
+	size_t		 iter = 0;
+	size_t		 prev = 0;
+
+	if (!fs || !vec_size(fs->starts)) {
+		for (uint64_t at = start; at < end; at += XREFS_CHUNK) {
+			job.start = at;
+			job.end	  = MIN(at + XREFS_CHUNK, end);
+			job.iter  = SIZE_MAX;
+			if (!vec_push(jobs, &job))
+				return (false);
+		}
+		return (true);
+	}
+
+	job.iter = SIZE_MAX;
+	while (function_starts_next(fs, &iter, &range)) {
+		if (job.iter == SIZE_MAX) {
+			job.start = range.start;
+			job.iter  = prev;
+		}
+
+		job.end = range.end;
+		prev	= iter;
+		if (job.end - job.start >= XREFS_CHUNK) {
+			if (!vec_push(jobs, &job))
+				return (false);
+			job.iter = SIZE_MAX;
+		}
+	}
+
+	return (job.iter == SIZE_MAX || vec_push(jobs, &job));
+}
+
+/* Stable LSD radix sort on the target, the pairs come in pc order so the
+ * pcs of every target end up sorted too. Returns whichever of the two
+ * arrays holds the result.
+ */
+static xref_pair_t *xrefs_sort(xref_pair_t *pairs, xref_pair_t *tmp, size_t n,
+			       uint64_t base, uint64_t span)
+{
+	size_t count[1 << XREFS_RADIX_BITS];
+
+	for (unsigned shift = 0; shift < 64 && (span >> shift);
+	     shift += XREFS_RADIX_BITS) {
+		xref_pair_t *swap;
+		size_t	     sum = 0;
+
+		(void)memset(count, 0, sizeof(count));
+		for (size_t i = 0; i < n; i++)
+			count[((pairs[i].target - base) >> shift) &
+			      ((1 << XREFS_RADIX_BITS) - 1)]++;
+
+		for (size_t i = 0; i < (1 << XREFS_RADIX_BITS); i++) {
+			size_t c = count[i];
+
+			count[i] = sum;
+			sum += c;
+		}
+
+		for (size_t i = 0; i < n; i++)
+			tmp[count[((pairs[i].target - base) >> shift) &
+				  ((1 << XREFS_RADIX_BITS) - 1)]++] = pairs[i];
+
+		swap  = pairs;
+		pairs = tmp;
+		tmp   = swap;
+	}
+
+	return (pairs);
+}
+
+static inline size_t xrefs_slot(const xref_index_t *xi, uint64_t target)
+{
+	return ((target * 0x9e3779b97f4a7c15ULL) >> 32) & (xi->nbuckets - 1);
+}
+
+/* Builds the CSR arrays and the target hash from the sorted pairs.
+ */
+static bool xrefs_compact(xref_index_t *xi, const xref_pair_t *pairs,
+			  size_t n)
+{
+	size_t ntargets = 0;
+
+	for (size_t i = 0; i < n; i++)
+		ntargets += (i == 0 || pairs[i].target != pairs[i - 1].target);
+
+	xi->nbuckets = 16;
+	while (xi->nbuckets < ntargets * 2)
+		xi->nbuckets <<= 1;
+
+	xi->targets = malloc(sizeof(*xi->targets) * (ntargets + 1));
+	xi->offsets = malloc(sizeof(*xi->offsets) * (ntargets + 1));
+	xi->pcs	    = malloc(sizeof(*xi->pcs) * (n + 1));
+	xi->buckets = malloc(sizeof(*xi->buckets) * xi->nbuckets);
+	if (!xi->targets || !xi->offsets || !xi->pcs || !xi->buckets) {
+		__logger(error, "malloc: out of memory");
+		return (false);
+	}
+
+	(void)memset(xi->buckets, 0xff, sizeof(*xi->buckets) * xi->nbuckets);
+
+	for (size_t i = 0; i < n; i++) {
+		if (i == 0 || pairs[i].target != pairs[i - 1].target) {
+			size_t slot = xrefs_slot(xi, pairs[i].target);
+
+			while (xi->buckets[slot] != XREFS_EMPTY)
+				slot = (slot + 1) & (xi->nbuckets - 1);
+			xi->buckets[slot] = (uint32_t)xi->ntargets;
+
+			xi->targets[xi->ntargets]   = pairs[i].target;
+			xi->offsets[xi->ntargets++] = (uint32_t)i;
+		}
+		xi->pcs[i] = pairs[i].pc;
+	}
+
+	xi->offsets[xi->ntargets] = (uint32_t)n;
+	xi->npcs		  = n;
+	return (true);
+}
+
+static bool xrefs_merge(xref_index_t *xi, const xrefs_job_t *jobs,
+			size_t njobs)
+{
+	xref_pair_t *pairs;
+	xref_pair_t *tmp;
+	uint64_t     lo = UINT64_MAX;
+	uint64_t     hi = 0;
+	size_t	     n	= 0;
+	bool	     ret;
+
+	for (size_t i = 0; i < njobs; i++)
+		n += vec_size(jobs[i].pairs);
+
+	if (n >= UINT32_MAX) {
+		__logger(error, "xrefs: too many references");
+		return (false);
+	}
+
+	pairs = malloc(sizeof(*pairs) * (n + 1));
+	tmp   = malloc(sizeof(*tmp) * (n + 1));
+	if (!pairs || !tmp) {
+		__logger(error, "malloc: out of memory");
+		free(pairs);
+		free(tmp);
+		return (false);
+	}
+
+	n = 0;
+	for (size_t i = 0; i < njobs; i++) {
+		size_t count = vec_size(jobs[i].pairs);
+
+		if (count)
+			(void)memcpy(pairs + n,
+				     vec_unsafe_access(jobs[i].pairs, 0),
+				     count * sizeof(*pairs));
+		n += count;
+	}
+
+	for (size_t i = 0; i < n; i++) {
+		lo = MIN(lo, pairs[i].target);
+		hi = MAX(hi, pairs[i].target);
+	}
+
+	ret = xrefs_compact(xi, xrefs_sort(pairs, tmp, n, lo, n ? hi - lo : 0),
+			    n);
+
+	free(pairs);
+	free(tmp);
+	return (ret);
+}
+
+bool xrefs_build(const macho_t *macho, const function_starts_t *fs,
+		 xref_index_t *xi)
+{
+	const struct section_64 *text;
+	xrefs_ctx_t		 ctx;
+	vec_t			*jobs;
+	size_t			 njobs;
+	bool			 ret = false;
+
+	(void)memset(xi, 0, sizeof(*xi));
+
+	if (macho->header->cputype != CPU_TYPE_ARM64) {
+		__logger(error, "xrefs: %s is not supported",
+			 cputype_to_cstr(macho->header->cputype));
+		return (false);
+	}
+
+	text = macho_find_section(macho, SEG_TEXT, SECT_TEXT);
+	if (!text) {
+		__logger(error, "xrefs: no __TEXT,__text");
+		return (false);
+	}
+
+	ctx.fs	      = fs;
+	ctx.text_addr = text->addr;
+	ctx.text      = macho_at_offset(macho, text->offset, text->size);
+	if (!ctx.text) {
+		__logger(error, "xrefs: __TEXT,__text out of bounds");
+		return (false);
+	}
+	atomic_init(&ctx.failed, false);
+
+	jobs = vec_create(sizeof(xrefs_job_t), 0, NULL);
+	if (!jobs || !xrefs_split(fs, text->addr, text->addr + text->size,
+				  jobs)) {
+		__logger(error, "vec_push: out of memory");
+		if (jobs)
+			vec_kill(jobs);
+		return (false);
+	}
+
+	ctx.jobs = vec_unsafe_access(jobs, 0);
+	njobs	 = vec_size(jobs);
+
+	if (parallel_for(njobs, 0, xrefs_job, &ctx) &&
+	    !atomic_load(&ctx.failed))
+		ret = xrefs_merge(xi, ctx.jobs, njobs);
+	else
+		__logger(error, "xrefs: out of memory");
+
+	for (size_t i = 0; i < njobs; i++) {
+		if (ctx.jobs[i].pairs)
+			vec_kill(ctx.jobs[i].pairs);
+	}
+	vec_kill(jobs);
+
+	if (!ret)
+		xrefs_free(xi);
+	return (ret);
+}
+
+void xrefs_free(xref_index_t *xi)
+{
+	free(xi->targets);
+	free(xi->offsets);
+	free(xi->pcs);
+	free(xi->buckets);
+	(void)memset(xi, 0, sizeof(*xi));
+}
+
+const uint64_t *xrefs_to(const xref_index_t *xi, uint64_t target,
+			 size_t *count)
+{
+	size_t slot;
+
+	*count = 0;
+	if (!xi->ntargets)
+		return (NULL);
+
+	slot = xrefs_slot(xi, target);
+	while (xi->buckets[slot] != XREFS_EMPTY) {
+		uint32_t t = xi->buckets[slot];
+
+		if (xi->targets[t] == target) {
+			*count = xi->offsets[t + 1] - xi->offsets[t];
+			return (&xi->pcs[xi->offsets[t]]);
+		}
+		slot = (slot + 1) & (xi->nbuckets - 1);
+	}
+
+	return (NULL);
+}